@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <span>
+
+/// @brief Appends bit fields MSB first, as FLAC stores them
+class FlacBitWriter
+{
+public:
+  constexpr explicit FlacBitWriter(const std::span<uint8_t> output)
+    : m_output(output)
+  {
+  }
+
+  /// @brief Writes the lowest `bits` of `value`, up to 32 bits
+  constexpr void Write(const uint32_t value, const unsigned bits)
+  {
+    for (unsigned remaining = bits; remaining != 0;) {
+      const unsigned free_bits = 8 - m_bit_position;
+      const unsigned to_write = std::min(remaining, free_bits);
+      remaining -= to_write;
+
+      const uint32_t chunk = (value >> remaining) & ((1U << to_write) - 1);
+      if (m_bit_position == 0) {
+        m_output[m_size] = 0;
+      }
+      m_output[m_size] |= static_cast<uint8_t>(chunk << (free_bits - to_write));
+
+      m_bit_position += to_write;
+      if (m_bit_position == 8) {
+        m_bit_position = 0;
+        ++m_size;
+      }
+    }
+  }
+
+  /// @brief Writes `zeros` zero bits followed by a one
+  constexpr void WriteUnary(uint32_t zeros)
+  {
+    for (; zeros >= 16; zeros -= 16) {
+      Write(0, 16);
+    }
+    Write(1, zeros + 1);
+  }
+
+  /// @brief Pads the last byte with zeros
+  constexpr void AlignToByte()
+  {
+    if (m_bit_position != 0) {
+      Write(0, 8 - m_bit_position);
+    }
+  }
+
+  /// @brief Returns the amount of complete bytes written
+  constexpr std::size_t GetSize() const { return m_size; }
+
+private:
+  std::span<uint8_t> m_output;
+  std::size_t m_size = 0;
+  unsigned m_bit_position = 0;
+};
+
+/// @brief Lossless encoder of mono 16-bit samples into FLAC frames (a subset of the format).
+/// Every block is predicted by the best of FLAC's fixed polynomial predictors of order 0-4,
+/// and the residual is Rice coded in 2^p partitions, each with its own Rice parameter.
+/// Silent blocks become CONSTANT subframes, & blocks which don't compress are stored verbatim.
+/// All memory is preallocated; frames never exceed `MAX_FRAME_BYTES`
+template<std::size_t BlockSize>
+class FlacEncoder
+{
+public:
+  static constexpr std::size_t BLOCK_SIZE = BlockSize;
+  static constexpr unsigned MAX_FIXED_ORDER = 4;
+  static constexpr unsigned MAX_PARTITION_ORDER = 6;
+  static constexpr unsigned MAX_RICE_PARAMETER = 14;
+  static constexpr unsigned BITS_PER_SAMPLE = 16;
+  // frame header, subframe header, verbatim samples, padding & CRC-16
+  static constexpr std::size_t MAX_FRAME_BYTES = 16 + 1 + BLOCK_SIZE * 2 + 3;
+
+  static_assert(BLOCK_SIZE >= 16 && BLOCK_SIZE <= 65'535, "FLAC block size is 16-65535");
+
+  /// @brief Encodes up to `BLOCK_SIZE` samples into a frame. Only the last frame of a stream
+  /// may be shorter
+  /// @param sample_rate_hz stored in the frame header
+  /// @param frame_number index of the frame in the stream
+  /// @return size of the frame
+  constexpr std::size_t EncodeFrame(const uint32_t sample_rate_hz,
+                                    const uint64_t frame_number,
+                                    const std::span<const int16_t> samples,
+                                    const std::span<uint8_t, MAX_FRAME_BYTES> frame)
+  {
+    FlacBitWriter writer(frame);
+
+    WriteFrameHeader(writer, sample_rate_hz, frame_number, samples.size());
+    WriteSubframe(writer, samples);
+
+    writer.AlignToByte();
+    const uint16_t crc = Crc16(frame.first(writer.GetSize()));
+    writer.Write(crc, 16);
+
+    return writer.GetSize();
+  }
+
+  /// @brief CRC-8 of the frame header, polynomial x^8 + x^2 + x + 1
+  static constexpr uint8_t Crc8(const std::span<const uint8_t> data)
+  {
+    uint8_t crc = 0;
+    for (const uint8_t byte : data) {
+      crc = CRC8_TABLE[crc ^ byte];
+    }
+    return crc;
+  }
+
+  /// @brief CRC-16 of the whole frame, polynomial x^16 + x^15 + x^2 + 1
+  static constexpr uint16_t Crc16(const std::span<const uint8_t> data)
+  {
+    uint16_t crc = 0;
+    for (const uint8_t byte : data) {
+      crc = static_cast<uint16_t>((crc << 8) ^ CRC16_TABLE[(crc >> 8) ^ byte]);
+    }
+    return crc;
+  }
+
+  /// @brief Residual of the fixed predictor of `order` at `samples[i]`, `i >= order`
+  static constexpr int32_t FixedResidual(const std::span<const int16_t> samples,
+                                         const std::size_t i,
+                                         const unsigned order)
+  {
+    const int32_t x0 = samples[i];
+    switch (order) {
+      case 0:
+        return x0;
+      case 1:
+        return x0 - samples[i - 1];
+      case 2:
+        return x0 - 2 * samples[i - 1] + samples[i - 2];
+      case 3:
+        return x0 - 3 * samples[i - 1] + 3 * samples[i - 2] - samples[i - 3];
+      default:
+        return x0 - 4 * samples[i - 1] + 6 * samples[i - 2] - 4 * samples[i - 3] + samples[i - 4];
+    }
+  }
+
+  /// @brief Maps signed residuals to unsigned: 0, -1, 1, -2, 2... become 0, 1, 2, 3, 4...
+  static constexpr uint32_t FoldResidual(const int32_t residual)
+  {
+    return (static_cast<uint32_t>(residual) << 1) ^ static_cast<uint32_t>(residual >> 31);
+  }
+
+private:
+  static constexpr void WriteFrameHeader(FlacBitWriter& writer,
+                                         const uint32_t sample_rate_hz,
+                                         const uint64_t frame_number,
+                                         const std::size_t block_size)
+  {
+    std::array<uint8_t, 16> header = {};
+    FlacBitWriter header_writer(header);
+
+    // sync code, reserved bit, fixed block size
+    header_writer.Write(0b11111111'11111000, 16);
+
+    const uint8_t block_size_code = GetBlockSizeCode(block_size);
+    const uint8_t sample_rate_code = GetSampleRateCode(sample_rate_hz);
+    header_writer.Write(block_size_code, 4);
+    header_writer.Write(sample_rate_code, 4);
+    // mono, 16 bits per sample, reserved bit
+    header_writer.Write(0b0000, 4);
+    header_writer.Write(0b100, 3);
+    header_writer.Write(0, 1);
+
+    WriteUtf8Number(header_writer, frame_number);
+
+    if (block_size_code == 0b0111) {
+      header_writer.Write(block_size - 1, 16);
+    }
+    if (sample_rate_code == 0b1100) {
+      header_writer.Write(sample_rate_hz / 1'000, 8);
+    } else if (sample_rate_code == 0b1101) {
+      header_writer.Write(sample_rate_hz, 16);
+    } else if (sample_rate_code == 0b1110) {
+      header_writer.Write(sample_rate_hz / 10, 16);
+    }
+
+    header_writer.Write(Crc8(std::span(header).first(header_writer.GetSize())), 8);
+
+    for (std::size_t i = 0; i < header_writer.GetSize(); ++i) {
+      writer.Write(header[i], 8);
+    }
+  }
+
+  static constexpr uint8_t GetBlockSizeCode(const std::size_t block_size)
+  {
+    // 256 * 2^(n - 8) for powers of two from 256 to 32768
+    if (std::has_single_bit(block_size) && block_size >= 256 && block_size <= 32'768) {
+      return static_cast<uint8_t>(std::bit_width(block_size) - 1);
+    }
+    // 16-bit block size - 1 at the end of the header
+    return 0b0111;
+  }
+
+  static constexpr uint8_t GetSampleRateCode(const uint32_t sample_rate_hz)
+  {
+    switch (sample_rate_hz) {
+      case 88'200:
+        return 0b0001;
+      case 176'400:
+        return 0b0010;
+      case 192'000:
+        return 0b0011;
+      case 8'000:
+        return 0b0100;
+      case 16'000:
+        return 0b0101;
+      case 22'050:
+        return 0b0110;
+      case 24'000:
+        return 0b0111;
+      case 32'000:
+        return 0b1000;
+      case 44'100:
+        return 0b1001;
+      case 48'000:
+        return 0b1010;
+      case 96'000:
+        return 0b1011;
+      default:
+        break;
+    }
+
+    // 8-bit kHz, 16-bit Hz or 16-bit tens of Hz at the end of the header
+    if (sample_rate_hz % 1'000 == 0 && sample_rate_hz <= 255'000) {
+      return 0b1100;
+    }
+    if (sample_rate_hz <= 65'535) {
+      return 0b1101;
+    }
+    if (sample_rate_hz % 10 == 0 && sample_rate_hz <= 655'350) {
+      return 0b1110;
+    }
+    // not representable in the frame header, decoders take the rate from STREAMINFO
+    return 0b0000;
+  }
+
+  /// @brief Writes `value` coded like UTF-8, extended to 36 bits
+  static constexpr void WriteUtf8Number(FlacBitWriter& writer, const uint64_t value)
+  {
+    if (value < 0x80) {
+      writer.Write(static_cast<uint32_t>(value), 8);
+      return;
+    }
+
+    // amount of continuation bytes, each holds 6 bits
+    unsigned continuation_bytes = 1;
+    while (continuation_bytes < 6 && value >= (uint64_t{ 1 } << (5 * continuation_bytes + 6))) {
+      ++continuation_bytes;
+    }
+
+    const unsigned first_byte_bits = 6 - continuation_bytes;
+    const uint32_t prefix = (0xFF00U >> (continuation_bytes + 1)) & 0xFF;
+    const uint32_t first_bits =
+      static_cast<uint32_t>(value >> (6 * continuation_bytes)) & ((1U << first_byte_bits) - 1);
+    writer.Write(prefix | first_bits, 8);
+    for (unsigned i = continuation_bytes; i != 0; --i) {
+      writer.Write(0x80 | (static_cast<uint32_t>(value >> (6 * (i - 1))) & 0x3F), 8);
+    }
+  }
+
+  constexpr void WriteSubframe(FlacBitWriter& writer, const std::span<const int16_t> samples)
+  {
+    const std::size_t size = samples.size();
+
+    if (std::all_of(samples.begin(), samples.end(), [&](int16_t s) { return s == samples[0]; })) {
+      // CONSTANT
+      writer.Write(0b0'000000'0, 8);
+      writer.Write(static_cast<uint16_t>(samples[0]), BITS_PER_SAMPLE);
+      return;
+    }
+
+    const unsigned order = size > MAX_FIXED_ORDER ? PickFixedOrder(samples) : 0;
+    for (std::size_t i = order; i < size; ++i) {
+      m_folded_residual[i] = FoldResidual(FixedResidual(samples, i, order));
+    }
+
+    std::array<uint8_t, 1 << MAX_PARTITION_ORDER> rice_parameters = {};
+    unsigned partition_order = 0;
+    const uint64_t residual_bits =
+      PickPartitioning(size, order, partition_order, rice_parameters);
+
+    const uint64_t fixed_bits = 8 + order * BITS_PER_SAMPLE + residual_bits;
+    const uint64_t verbatim_bits = 8 + size * BITS_PER_SAMPLE;
+    if (size <= MAX_FIXED_ORDER || fixed_bits >= verbatim_bits) {
+      // VERBATIM
+      writer.Write(0b0'000001'0, 8);
+      for (const int16_t sample : samples) {
+        writer.Write(static_cast<uint16_t>(sample), BITS_PER_SAMPLE);
+      }
+      return;
+    }
+
+    // FIXED, the warm-up samples are stored as they are
+    writer.Write((0b001000 | order) << 1, 8);
+    for (std::size_t i = 0; i < order; ++i) {
+      writer.Write(static_cast<uint16_t>(samples[i]), BITS_PER_SAMPLE);
+    }
+
+    // Rice coding with 4-bit parameters
+    writer.Write(0b00, 2);
+    writer.Write(partition_order, 4);
+    const std::size_t partition_size = size >> partition_order;
+    for (std::size_t partition = 0; partition < (1U << partition_order); ++partition) {
+      const unsigned parameter = rice_parameters[partition];
+      writer.Write(parameter, 4);
+
+      const std::size_t start = partition == 0 ? order : partition * partition_size;
+      const std::size_t end = (partition + 1) * partition_size;
+      for (std::size_t i = start; i < end; ++i) {
+        const uint32_t value = m_folded_residual[i];
+        writer.WriteUnary(value >> parameter);
+        if (parameter != 0) {
+          writer.Write(value, parameter);
+        }
+      }
+    }
+  }
+
+  /// @brief Picks the order whose residual has the smallest sum of magnitudes
+  static constexpr unsigned PickFixedOrder(const std::span<const int16_t> samples)
+  {
+    std::array<uint64_t, MAX_FIXED_ORDER + 1> sums = {};
+    // each order's residual is the difference of the previous order's residuals
+    std::array<int32_t, MAX_FIXED_ORDER + 1> previous = {};
+    for (std::size_t i = 0; i < samples.size(); ++i) {
+      int32_t residual = samples[i];
+      for (unsigned order = 0; order <= MAX_FIXED_ORDER; ++order) {
+        const int32_t next_residual = residual - previous[order];
+        previous[order] = residual;
+        // the warm-up samples have no residual of this order
+        if (i >= MAX_FIXED_ORDER) {
+          sums[order] += static_cast<uint32_t>(residual < 0 ? -residual : residual);
+        }
+        residual = next_residual;
+      }
+    }
+
+    return static_cast<unsigned>(std::min_element(sums.begin(), sums.end()) - sums.begin());
+  }
+
+  /// @brief Picks the partition order & the Rice parameters which give the smallest residual
+  /// @return size of the coded residual in bits, an upper bound of the real size
+  constexpr uint64_t PickPartitioning(const std::size_t size,
+                                      const unsigned order,
+                                      unsigned& best_partition_order,
+                                      std::array<uint8_t, 1 << MAX_PARTITION_ORDER>& parameters)
+  {
+    // the block must split evenly, & the first partition must be longer than the warm-up
+    unsigned max_partition_order = 0;
+    while (max_partition_order < MAX_PARTITION_ORDER && size % (2U << max_partition_order) == 0 &&
+           (size >> (max_partition_order + 1)) > order) {
+      ++max_partition_order;
+    }
+
+    // sums of the finest partitions, coarser ones are merged from them
+    std::array<uint64_t, 1 << MAX_PARTITION_ORDER> sums = {};
+    const std::size_t finest_size = size >> max_partition_order;
+    for (std::size_t partition = 0; partition < (1U << max_partition_order); ++partition) {
+      const std::size_t start = partition == 0 ? order : partition * finest_size;
+      for (std::size_t i = start; i < (partition + 1) * finest_size; ++i) {
+        sums[partition] += m_folded_residual[i];
+      }
+    }
+
+    uint64_t best_bits = UINT64_MAX;
+    for (unsigned partition_order = max_partition_order + 1; partition_order-- != 0;) {
+      const std::size_t partitions = 1U << partition_order;
+      const std::size_t partition_size = size >> partition_order;
+
+      uint64_t bits = 2 + 4;
+      std::array<uint8_t, 1 << MAX_PARTITION_ORDER> candidate = {};
+      for (std::size_t partition = 0; partition < partitions; ++partition) {
+        const std::size_t count = partition == 0 ? partition_size - order : partition_size;
+        const unsigned parameter = GetRiceParameter(sums[partition], count);
+        candidate[partition] = static_cast<uint8_t>(parameter);
+        // unary quotients can not sum up to more than sum >> parameter
+        bits += 4 + count * (parameter + 1) + (sums[partition] >> parameter);
+      }
+
+      if (bits < best_bits) {
+        best_bits = bits;
+        best_partition_order = partition_order;
+        parameters = candidate;
+      }
+
+      // merge pairs of partitions for the next, coarser order
+      for (std::size_t partition = 0; partition < partitions / 2; ++partition) {
+        sums[partition] = sums[2 * partition] + sums[2 * partition + 1];
+      }
+    }
+
+    return best_bits;
+  }
+
+  /// @brief Rice parameter close to log2 of the mean folded residual
+  static constexpr unsigned GetRiceParameter(const uint64_t sum, const std::size_t count)
+  {
+    if (count == 0 || sum < count) {
+      return 0;
+    }
+    const unsigned parameter = std::bit_width(sum / count) - 1;
+    return std::min(parameter, MAX_RICE_PARAMETER);
+  }
+
+  static constexpr std::array<uint8_t, 256> MakeCrc8Table()
+  {
+    std::array<uint8_t, 256> table = {};
+    for (unsigned i = 0; i < 256; ++i) {
+      uint8_t crc = static_cast<uint8_t>(i);
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = static_cast<uint8_t>((crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1);
+      }
+      table[i] = crc;
+    }
+    return table;
+  }
+
+  static constexpr std::array<uint16_t, 256> MakeCrc16Table()
+  {
+    std::array<uint16_t, 256> table = {};
+    for (unsigned i = 0; i < 256; ++i) {
+      uint16_t crc = static_cast<uint16_t>(i << 8);
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = static_cast<uint16_t>((crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1);
+      }
+      table[i] = crc;
+    }
+    return table;
+  }
+
+  static constexpr std::array<uint8_t, 256> CRC8_TABLE = MakeCrc8Table();
+  static constexpr std::array<uint16_t, 256> CRC16_TABLE = MakeCrc16Table();
+
+private:
+  std::array<uint32_t, BLOCK_SIZE> m_folded_residual = {};
+};
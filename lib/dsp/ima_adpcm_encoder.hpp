@@ -0,0 +1,131 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+
+/// @brief Streaming IMA-ADPCM (WAVE format 0x11) encoder of mono 16-bit samples.
+/// Every block starts with a 4-byte header holding the first sample & the step index, followed
+/// by 4-bit codes of the remaining samples, two per byte, the earlier sample in the low nibble.
+/// The step index is carried over from block to block. No allocations, no divisions
+class ImaAdpcmEncoder
+{
+public:
+  struct State
+  {
+    // last reconstructed sample, as the decoder sees it
+    int32_t predictor = 0;
+    int32_t step_index = 0;
+  };
+
+  static constexpr std::size_t BLOCK_HEADER_BYTES = 4;
+
+  /// @brief Returns how many samples fit into a block of `block_bytes`
+  static constexpr std::size_t SamplesPerBlock(const std::size_t block_bytes)
+  {
+    return (block_bytes - BLOCK_HEADER_BYTES) * 2 + 1;
+  }
+
+  void Reset() { m_state = State{}; }
+
+  /// @brief Encodes `SamplesPerBlock(block.size())` samples into `block`
+  void EncodeBlock(const std::span<const int16_t> samples, const std::span<uint8_t> block)
+  {
+    EncodeBlock(m_state, samples, block);
+  }
+
+  static constexpr void EncodeBlock(State& state,
+                                    const std::span<const int16_t> samples,
+                                    const std::span<uint8_t> block)
+  {
+    // the first sample is stored verbatim, & the decoder starts predicting from it
+    state.predictor = samples[0];
+    block[0] = static_cast<uint8_t>(samples[0] & 0xFF);
+    block[1] = static_cast<uint8_t>((samples[0] >> 8) & 0xFF);
+    block[2] = static_cast<uint8_t>(state.step_index);
+    block[3] = 0;
+
+    std::size_t sample_index = 1;
+    for (std::size_t i = BLOCK_HEADER_BYTES; i < block.size(); ++i) {
+      const uint8_t low = EncodeSample(state, samples[sample_index]);
+      const uint8_t high = EncodeSample(state, samples[sample_index + 1]);
+      block[i] = static_cast<uint8_t>(low | (high << 4));
+      sample_index += 2;
+    }
+  }
+
+  /// @brief Quantizes the difference between `sample` & the prediction into a 4-bit code,
+  /// and advances the state exactly like the decoder will
+  static constexpr uint8_t EncodeSample(State& state, const int16_t sample)
+  {
+    int32_t diff = sample - state.predictor;
+    uint8_t code = 0;
+    if (diff < 0) {
+      code = 8;
+      diff = -diff;
+    }
+
+    // successive approximation of diff / step, 3 magnitude bits
+    int32_t step = STEP_TABLE[state.step_index];
+    if (diff >= step) {
+      code |= 4;
+      diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+      code |= 2;
+      diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+      code |= 1;
+    }
+
+    DecodeSample(state, code);
+
+    return code;
+  }
+
+  /// @brief Reconstructs a sample from a 4-bit code
+  static constexpr int16_t DecodeSample(State& state, const uint8_t code)
+  {
+    const int32_t step = STEP_TABLE[state.step_index];
+
+    int32_t diff = step >> 3;
+    if (code & 4) {
+      diff += step;
+    }
+    if (code & 2) {
+      diff += step >> 1;
+    }
+    if (code & 1) {
+      diff += step >> 2;
+    }
+
+    const int32_t predictor = state.predictor + ((code & 8) ? -diff : diff);
+    state.predictor =
+      predictor < INT16_MIN ? INT16_MIN : (predictor > INT16_MAX ? INT16_MAX : predictor);
+
+    const int32_t step_index = state.step_index + INDEX_TABLE[code];
+    state.step_index = step_index < 0 ? 0 : (step_index > 88 ? 88 : step_index);
+
+    return static_cast<int16_t>(state.predictor);
+  }
+
+private:
+  static constexpr std::array<int8_t, 16> INDEX_TABLE = { -1, -1, -1, -1, 2, 4, 6, 8,
+                                                          -1, -1, -1, -1, 2, 4, 6, 8 };
+
+  static constexpr std::array<int16_t, 89> STEP_TABLE = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+  };
+
+private:
+  State m_state;
+};
@@ -0,0 +1,123 @@
+#include "sample_conditioner.hpp"
+
+#include <cstring>
+
+void
+SampleConditioner::Reset(const int32_t dc_level)
+{
+  m_state.prev_input = dc_level;
+  m_state.prev_output = 0;
+  m_agc = AgcState();
+}
+
+std::span<int16_t>
+SampleConditioner::Process(std::span<int32_t> buffer)
+{
+  // Output sample `i` is stored at byte `2 * i`, while the input word `i` is read from byte
+  // `4 * i`, so a forward pass never overwrites a word which has not been read yet.
+  // memcpy keeps the aliasing of int32/int16 accesses to the same memory well-defined.
+  uint8_t* const bytes = reinterpret_cast<uint8_t*>(buffer.data());
+
+  if (m_is_agc_enabled) {
+    ProcessAdaptiveGain(bytes, buffer.size());
+  } else {
+    ProcessFixedGain(bytes, buffer.size());
+  }
+
+  return std::span<int16_t>(reinterpret_cast<int16_t*>(buffer.data()), buffer.size());
+}
+
+void
+SampleConditioner::ProcessFixedGain(uint8_t* bytes, const std::size_t size)
+{
+  const uint8_t gain_shift = m_agc.gain_shift;
+  State state = m_state;
+
+  std::size_t i = 0;
+
+  // unrolled by 4, the filter is recursive so samples are still processed in order
+  for (; i + 4 <= size; i += 4) {
+    int32_t raw[4];
+    std::memcpy(raw, bytes + i * sizeof(int32_t), sizeof(raw));
+
+    const int16_t conditioned[4] = {
+      ConditionSample(state, raw[0], gain_shift),
+      ConditionSample(state, raw[1], gain_shift),
+      ConditionSample(state, raw[2], gain_shift),
+      ConditionSample(state, raw[3], gain_shift),
+    };
+    std::memcpy(bytes + i * sizeof(int16_t), conditioned, sizeof(conditioned));
+  }
+
+  for (; i < size; ++i) {
+    int32_t raw;
+    std::memcpy(&raw, bytes + i * sizeof(int32_t), sizeof(raw));
+
+    const int16_t conditioned = ConditionSample(state, raw, gain_shift);
+    std::memcpy(bytes + i * sizeof(int16_t), &conditioned, sizeof(conditioned));
+  }
+
+  m_state = state;
+}
+
+void
+SampleConditioner::ProcessAdaptiveGain(uint8_t* bytes, const std::size_t size)
+{
+  State state = m_state;
+  // OR of all magnitudes has the same highest bit as the peak
+  uint32_t peak_bits = 0;
+
+  // first pass: filter in place, keeping 32-bit words, and measure the peak
+  std::size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    int32_t words[4];
+    std::memcpy(words, bytes + i * sizeof(int32_t), sizeof(words));
+
+    words[0] = FilterSample(state, words[0]);
+    words[1] = FilterSample(state, words[1]);
+    words[2] = FilterSample(state, words[2]);
+    words[3] = FilterSample(state, words[3]);
+
+    // branch-free magnitude, one less than the exact one for negative values
+    peak_bits |= (words[0] ^ (words[0] >> 31)) | (words[1] ^ (words[1] >> 31)) |
+                 (words[2] ^ (words[2] >> 31)) | (words[3] ^ (words[3] >> 31));
+
+    std::memcpy(bytes + i * sizeof(int32_t), words, sizeof(words));
+  }
+
+  for (; i < size; ++i) {
+    int32_t word;
+    std::memcpy(&word, bytes + i * sizeof(int32_t), sizeof(word));
+
+    word = FilterSample(state, word);
+    peak_bits |= word ^ (word >> 31);
+
+    std::memcpy(bytes + i * sizeof(int32_t), &word, sizeof(word));
+  }
+
+  m_state = state;
+  UpdateAgc(m_agc, peak_bits);
+  const uint8_t gain_shift = m_agc.gain_shift;
+
+  // second pass: apply the block's gain, saturate, and compact to 16 bits
+  for (i = 0; i + 4 <= size; i += 4) {
+    int32_t words[4];
+    std::memcpy(words, bytes + i * sizeof(int32_t), sizeof(words));
+
+    const int16_t conditioned[4] = {
+      ShiftSample(words[0], gain_shift),
+      ShiftSample(words[1], gain_shift),
+      ShiftSample(words[2], gain_shift),
+      ShiftSample(words[3], gain_shift),
+    };
+    std::memcpy(bytes + i * sizeof(int16_t), conditioned, sizeof(conditioned));
+  }
+
+  for (; i < size; ++i) {
+    int32_t word;
+    std::memcpy(&word, bytes + i * sizeof(int32_t), sizeof(word));
+
+    const int16_t conditioned = ShiftSample(word, gain_shift);
+    std::memcpy(bytes + i * sizeof(int16_t), &conditioned, sizeof(conditioned));
+  }
+}
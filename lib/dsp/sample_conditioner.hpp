@@ -0,0 +1,130 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <span>
+
+#include "settings.hpp"
+
+/// @brief Converts raw 24-in-32-bit I2S words into 16-bit samples:
+/// DC-blocking high-pass filter, gain shift with rounding, and saturation to int16.
+/// All of it is fixed-point and branch-free.
+///
+/// With the automatic gain enabled, the gain shift is picked per block from the block's filtered
+/// peak (block floating point). Gain is lowered immediately if the block would clip, and raised
+/// by one step only after `AGC_RELEASE_BLOCKS` quiet blocks in a row.
+class SampleConditioner
+{
+public:
+  struct State
+  {
+    // previous filter input, 24-bit
+    int32_t prev_input = 0;
+    // previous filter output, 24-bit
+    int32_t prev_output = 0;
+  };
+
+  struct AgcState
+  {
+    uint8_t gain_shift = CONDITIONER_GAIN_SHIFT;
+    // consecutive blocks which could have used more gain
+    std::size_t quiet_blocks = 0;
+  };
+
+  /// @brief Resets the filter
+  /// @param dc_level current DC level of the 24-bit input, to avoid a step at the start
+  void Reset(const int32_t dc_level = 0);
+
+  /// @brief Sets how many of the 24 data bits are dropped, 8 keeps the 16 most significant bits.
+  /// Less bits dropped means more gain
+  void SetGainShift(const uint8_t gain_shift) { m_agc.gain_shift = gain_shift; }
+  /// @brief Returns the gain shift applied to the last processed block
+  uint8_t GetGainShift() const { return m_agc.gain_shift; }
+
+  /// @brief Enables or disables (freezes) the automatic gain
+  void SetAgcEnabled(const bool is_enabled) { m_is_agc_enabled = is_enabled; }
+  bool IsAgcEnabled() const { return m_is_agc_enabled; }
+
+  /// @brief Conditions `buffer` in place. 16-bit samples are compacted at the front of the buffer
+  /// @return conditioned samples, pointing into `buffer`
+  std::span<int16_t> Process(std::span<int32_t> buffer);
+
+  /// @brief Clamps `value` to the int16 range without branches
+  static constexpr int16_t Saturate16(const int32_t value)
+  {
+    // -32768 for negative values, 32767 otherwise
+    const int32_t limit = (value >> 31) ^ 0x7FFF;
+    // all ones if `value` does not fit into int16
+    const int32_t is_outside =
+      -static_cast<int32_t>(static_cast<uint32_t>(value) + 0x8000U > 0xFFFFU);
+
+    return static_cast<int16_t>((value & ~is_outside) | (limit & is_outside));
+  }
+
+  /// @brief DC-blocking filter of a single raw I2S word
+  /// @return filtered 24-bit sample
+  static constexpr int32_t FilterSample(State& state, const int32_t raw_sample)
+  {
+    // data occupies upper 24 of 32 bits
+    const int32_t input = raw_sample >> 8;
+
+    // y[n] = x[n] - x[n-1] + (1 - 2^-k) * y[n-1]
+    const int32_t output = input - state.prev_input + state.prev_output -
+                           (state.prev_output >> CONDITIONER_DC_POLE_SHIFT);
+    state.prev_input = input;
+    state.prev_output = output;
+
+    return output;
+  }
+
+  /// @brief Applies the gain shift with rounding to nearest, and saturates to int16
+  static constexpr int16_t ShiftSample(const int32_t filtered_sample, const uint8_t gain_shift)
+  {
+    const int32_t rounding = (1 << gain_shift) >> 1;
+    return Saturate16((filtered_sample + rounding) >> gain_shift);
+  }
+
+  /// @brief Conditions a single raw I2S word
+  static constexpr int16_t ConditionSample(State& state,
+                                           const int32_t raw_sample,
+                                           const uint8_t gain_shift)
+  {
+    return ShiftSample(FilterSample(state, raw_sample), gain_shift);
+  }
+
+  /// @brief Picks the gain shift for a block
+  /// @param agc gain state after the previous block, updated in place
+  /// @param peak_bits bitwise OR of the block's filtered sample magnitudes
+  static constexpr void UpdateAgc(AgcState& agc, const uint32_t peak_bits)
+  {
+    // smallest shift which keeps the peak `AGC_HEADROOM_BITS` below the int16 full scale
+    const int needed_bits = std::bit_width(peak_bits) - (15 - AGC_HEADROOM_BITS);
+    const uint8_t needed_shift = static_cast<uint8_t>(
+      needed_bits < AGC_MIN_GAIN_SHIFT
+        ? AGC_MIN_GAIN_SHIFT
+        : (needed_bits > CONDITIONER_GAIN_SHIFT ? CONDITIONER_GAIN_SHIFT : needed_bits));
+
+    if (needed_shift > agc.gain_shift) {
+      // attack: lower the gain at once, so the block does not clip
+      agc.gain_shift = needed_shift;
+      agc.quiet_blocks = 0;
+    } else if (needed_shift < agc.gain_shift) {
+      // release: raise the gain by one step after a while
+      if (++agc.quiet_blocks >= AGC_RELEASE_BLOCKS) {
+        --agc.gain_shift;
+        agc.quiet_blocks = 0;
+      }
+    } else {
+      agc.quiet_blocks = 0;
+    }
+  }
+
+private:
+  void ProcessFixedGain(uint8_t* bytes, const std::size_t size);
+  void ProcessAdaptiveGain(uint8_t* bytes, const std::size_t size);
+
+private:
+  State m_state;
+  AgcState m_agc;
+  bool m_is_agc_enabled = AGC_ENABLED;
+};
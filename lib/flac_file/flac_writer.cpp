@@ -0,0 +1,263 @@
+#include "flac_writer.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <sys/stat.h>
+
+#include <Arduino.h>
+
+#include "esp_cpu.h"
+
+#include "flac_encoder.hpp"
+#include "settings.hpp"
+
+#if DEBUG_WAV
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+using Encoder = FlacEncoder<FLAC_BLOCK_SAMPLES>;
+
+// Encoder state & buffers shared by all writers, only one file is open at a time
+static Encoder s_encoder;
+static std::array<int16_t, FLAC_BLOCK_SAMPLES> s_block;
+static std::array<uint8_t, Encoder::MAX_FRAME_BYTES> s_frame;
+
+static constexpr std::array<char, 4> k_flac_marker = { 'f', 'L', 'a', 'C' };
+static constexpr std::size_t k_block_header_size = 4;
+static constexpr std::size_t k_stream_info_size = 34;
+
+enum class MetadataBlockType : uint8_t
+{
+  StreamInfo = 0,
+  Padding = 1,
+  VorbisComment = 4,
+};
+
+static void
+WriteBlockHeader(FlacBitWriter& writer,
+                 const MetadataBlockType type,
+                 const bool is_last,
+                 const std::size_t size)
+{
+  writer.Write(is_last, 1);
+  writer.Write(static_cast<uint8_t>(type), 7);
+  writer.Write(size, 24);
+}
+
+/// @brief VORBIS_COMMENT lengths are the only little-endian fields of FLAC
+static void
+WriteLittleEndian(FlacBitWriter& writer, const uint32_t value)
+{
+  for (int i = 0; i < 4; ++i) {
+    writer.Write((value >> (8 * i)) & 0xFF, 8);
+  }
+}
+
+bool
+FlacWriter::Open(const std::string_view file_path,
+                 const std::size_t write_buffer_size,
+                 const std::size_t header_commit_interval)
+{
+  m_sample_count = 0;
+  m_frame_count = 0;
+  m_min_frame_size = 0;
+  m_max_frame_size = 0;
+  m_block_size = 0;
+  m_encoding_cycles = 0;
+  m_encoded_bytes = 0;
+  m_comment_length = 0;
+
+  UpdateHeader();
+  // the frames have varying sizes, so clusters can't be reserved ahead: the file size is the only
+  // thing which tells where the committed frames end after a power loss
+  if (!m_file.Open(file_path, m_header, write_buffer_size, 0, header_commit_interval)) {
+    LOG("%s:%d | Error opening the FLAC file.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+FlacWriter::Close()
+{
+  if (!m_file.IsOpen()) {
+    return true;
+  }
+
+  if (m_block_size != 0) {
+    WriteFrame();
+  }
+
+  if (m_sample_count != 0) {
+    LOG("FLAC encoding: %llu cycles per 100 samples, %u%% of the PCM size\n",
+        m_encoding_cycles * 100 / m_sample_count,
+        static_cast<std::size_t>(m_encoded_bytes * 100 / (m_sample_count * sizeof(int16_t))));
+  }
+
+  UpdateHeader();
+
+  return m_file.Close(m_header);
+}
+
+FlacWriter::~FlacWriter()
+{
+  Close();
+}
+
+void
+FlacWriter::WriteSamples(const std::span<const int16_t> samples)
+{
+  std::span<const int16_t> remaining = samples;
+  while (!remaining.empty()) {
+    const std::size_t to_copy = std::min(remaining.size(), s_block.size() - m_block_size);
+    std::copy_n(remaining.begin(), to_copy, s_block.begin() + m_block_size);
+    m_block_size += to_copy;
+    remaining = remaining.subspan(to_copy);
+
+    if (m_block_size == s_block.size()) {
+      WriteFrame();
+      CommitHeaderIfDue();
+    }
+  }
+}
+
+void
+FlacWriter::WriteFrame()
+{
+  const uint32_t encoding_start = esp_cpu_get_cycle_count();
+  const std::size_t frame_size = s_encoder.EncodeFrame(
+    MIC_SAMPLE_RATE, m_frame_count, std::span(s_block).first(m_block_size), s_frame);
+  m_encoding_cycles += esp_cpu_get_cycle_count() - encoding_start;
+
+  m_min_frame_size = m_frame_count == 0 ? frame_size : std::min(m_min_frame_size, frame_size);
+  m_max_frame_size = std::max(m_max_frame_size, frame_size);
+  m_encoded_bytes += frame_size;
+  m_sample_count += m_block_size;
+  ++m_frame_count;
+  m_block_size = 0;
+
+  m_file.Write(std::span(s_frame).first(frame_size));
+}
+
+void
+FlacWriter::CommitHeaderIfDue()
+{
+  if (!m_file.IsHeaderCommitDue()) {
+    return;
+  }
+
+  // the committed file must end with a whole frame, so the buffered part of the last one is
+  // flushed as well
+  m_file.Flush();
+  UpdateHeader();
+  m_file.CommitHeader(m_header);
+}
+
+void
+FlacWriter::UpdateHeader()
+{
+  m_header.fill(0);
+  FlacBitWriter writer(m_header);
+
+  for (const char c : k_flac_marker) {
+    writer.Write(c, 8);
+  }
+
+  WriteBlockHeader(writer, MetadataBlockType::StreamInfo, false, k_stream_info_size);
+  writer.Write(FLAC_BLOCK_SAMPLES, 16);
+  writer.Write(FLAC_BLOCK_SAMPLES, 16);
+  writer.Write(m_min_frame_size, 24);
+  writer.Write(m_max_frame_size, 24);
+  writer.Write(MIC_SAMPLE_RATE, 20);
+  // mono, 16 bits per sample
+  writer.Write(0, 3);
+  writer.Write(Encoder::BITS_PER_SAMPLE - 1, 5);
+  writer.Write(static_cast<uint32_t>(m_sample_count >> 32), 4);
+  writer.Write(static_cast<uint32_t>(m_sample_count), 32);
+  // the MD5 of the audio is left unset, which tells decoders not to check it
+  for (int i = 0; i < 4; ++i) {
+    writer.Write(0, 32);
+  }
+
+  if (m_comment_length != 0) {
+    constexpr std::string_view k_field_name = "COMMENT=";
+    const std::size_t comment_size = 4 + DEVICE_NAME.size() + 4 + 4 + k_field_name.size() +
+                                     m_comment_length;
+    WriteBlockHeader(writer, MetadataBlockType::VorbisComment, false, comment_size);
+    WriteLittleEndian(writer, DEVICE_NAME.size());
+    for (const char c : DEVICE_NAME) {
+      writer.Write(c, 8);
+    }
+    WriteLittleEndian(writer, 1);
+    WriteLittleEndian(writer, k_field_name.size() + m_comment_length);
+    for (const char c : k_field_name) {
+      writer.Write(c, 8);
+    }
+    for (std::size_t i = 0; i < m_comment_length; ++i) {
+      writer.Write(m_comment[i], 8);
+    }
+  }
+
+  // the padding fills the rest of the sector, so the frames start at a sector boundary
+  const std::size_t padding_size = m_header.size() - writer.GetSize() - k_block_header_size;
+  WriteBlockHeader(writer, MetadataBlockType::Padding, true, padding_size);
+}
+
+FlacWriterStats
+FlacWriter::GetStats() const
+{
+  return FlacWriterStats{ .file = m_file.GetStats(),
+                          .encoding_cycles = m_encoding_cycles,
+                          .encoded_samples = static_cast<std::size_t>(m_sample_count),
+                          .encoded_bytes = m_encoded_bytes };
+}
+
+bool
+FlacWriter::Recover(const std::string_view file_path)
+{
+  LOG("Recovering file '%.*s'...\n", file_path.size(), file_path.data());
+
+  FILE* fp = fopen(file_path.data(), "rb");
+  if (fp == nullptr) {
+    perror("");
+    return false;
+  }
+
+  std::array<uint8_t, k_flac_marker.size() + k_block_header_size + k_stream_info_size> header;
+  struct stat file_stats;
+  const bool is_read =
+    std::fread(header.data(), header.size(), 1, fp) == 1 && fstat(fileno(fp), &file_stats) == 0;
+  fclose(fp);
+  if (!is_read) {
+    LOG("%s:%d | Unable to read the FLAC metadata.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  if (std::memcmp(header.data(), k_flac_marker.data(), k_flac_marker.size()) != 0 ||
+      header[k_flac_marker.size()] != static_cast<uint8_t>(MetadataBlockType::StreamInfo)) {
+    LOG("%s:%d | Not a FLAC file.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  // the total samples are the lowest 36 bits of STREAMINFO's bytes 13-17
+  const uint8_t* total_samples_bytes =
+    header.data() + k_flac_marker.size() + k_block_header_size + 13;
+  uint64_t total_samples = total_samples_bytes[0] & 0x0F;
+  for (int i = 1; i < 5; ++i) {
+    total_samples = (total_samples << 8) | total_samples_bytes[i];
+  }
+
+  LOG("Recovered %llu samples in %ld bytes.\n", total_samples, file_stats.st_size);
+
+  return total_samples > 0;
+}
+
+void
+FlacWriter::SetComment(const std::string_view comment)
+{
+  m_comment_length = std::min(comment.size(), m_comment.size());
+  std::copy_n(comment.begin(), m_comment_length, m_comment.begin());
+}
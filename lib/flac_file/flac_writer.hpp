@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "audio_writer.hpp"
+#include "cluster_writer.hpp"
+#include "settings.hpp"
+
+struct FlacWriterStats
+{
+  ClusterWriterStats file;
+  // CPU cycles spent encoding the frames
+  uint64_t encoding_cycles;
+  std::size_t encoded_samples;
+  // size of the encoded frames
+  std::size_t encoded_bytes;
+};
+
+/// @brief Writes mono 16-bit .flac files, losslessly compressed on the fly.
+/// The metadata fills the first sector of the file, so the frames start at a sector boundary.
+/// The encoder's buffers are statically allocated & shared, like the `ClusterWriter`'s, so only
+/// one file can be open at a time
+class FlacWriter : public AudioWriter
+{
+public:
+  /// @brief Creates the file at `file_path` & writes placeholder metadata
+  /// @param write_buffer_size size of the write buffer, rounded down to whole clusters
+  /// and limited by the static buffer
+  /// @param header_commit_interval the metadata is updated & the file synced whenever this many
+  /// bytes of frames have been written since the last commit, 0 disables it
+  /// @return `true` if successful, `false` otherwise
+  bool Open(const std::string_view file_path,
+            const std::size_t write_buffer_size,
+            const std::size_t header_commit_interval = 0);
+  bool Close() override;
+
+  ~FlacWriter() override;
+
+  void WriteSamples(const std::span<const int16_t> samples) override;
+
+  /// @brief Sets a comment which is stored in a VORBIS_COMMENT block when the file is closed.
+  /// Longer comments are truncated
+  void SetComment(const std::string_view comment) override;
+
+  /// @brief FLAC metadata must precede the frames, and the gain log is only known at the end,
+  /// so it's not stored
+  void SetGainLog(const std::span<const wav_gain_entry_t>) override {}
+
+  /// @brief Returns the size of the file written so far, without the samples waiting to fill
+  /// a frame
+  std::size_t GetFileSize() const override { return m_file.GetFileSize(); }
+
+  FlacWriterStats GetStats() const;
+
+  /// @brief Checks a file which has not been closed, e.g. due to a power loss. Clusters are not
+  /// reserved ahead, so the file ends where it was last committed, & its STREAMINFO describes
+  /// the frames up to there
+  /// @return `true` if the file holds a valid recording, `false` if it's empty or not a FLAC file
+  static bool Recover(const std::string_view file_path);
+
+private:
+  /// @brief Encodes the collected samples into a frame & writes it
+  void WriteFrame();
+  /// @brief Flushes the frames written so far & commits the metadata, if it's due
+  void CommitHeaderIfDue();
+  /// @brief Writes the "fLaC" marker, STREAMINFO, the comment & padding into `m_header`
+  void UpdateHeader();
+
+private:
+  ClusterWriter m_file;
+
+  std::array<uint8_t, SD_SECTOR_SIZE> m_header;
+  // samples in the frames written so far
+  uint64_t m_sample_count = 0;
+  uint64_t m_frame_count = 0;
+  std::size_t m_min_frame_size = 0;
+  std::size_t m_max_frame_size = 0;
+  // samples waiting to fill a frame
+  std::size_t m_block_size = 0;
+
+  uint64_t m_encoding_cycles = 0;
+  std::size_t m_encoded_bytes = 0;
+
+  std::array<char, 128> m_comment;
+  std::size_t m_comment_length = 0;
+};
@@ -1,9 +1,18 @@
 #include "i2s_sampler.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+
 #include <Arduino.h>
 
+#include "esp_cpu.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "settings.hpp"
 
@@ -15,7 +24,7 @@
 
 constexpr i2s_std_config_t I2S_MIC_CONFIG = { 
   .clk_cfg = {
-    .sample_rate_hz = MIC_SAMPLE_RATE,
+    .sample_rate_hz = CAPTURE_PROFILE.sample_rate_hz, // overridden by the profile passed to Init
     .clk_src = I2S_CLK_SRC_DEFAULT,
     // .ext_clk_freq_hz = 0,
     .mclk_multiple = I2S_MCLK_MULTIPLE_256,
@@ -47,8 +56,11 @@ constexpr i2s_std_config_t I2S_MIC_CONFIG = {
   }
 };
 
+// Small buffer reused to read samples which are thrown away
+static std::array<int32_t, WARMUP_BLOCK_SAMPLES> s_discard_buffer;
+
 bool
-I2sSampler::Init()
+I2sSampler::Init(const CaptureProfile& profile)
 {
   if (m_is_init) {
     LOG("I2S sampler is already initialized.\n");
@@ -64,8 +76,16 @@ I2sSampler::Init()
 
   LOG("Initializing I2S sampler...\n");
 
+  LOG("DMA: %lu x %lu frames = %u bytes, holds %u ms\n",
+      profile.dma_desc_num,
+      profile.dma_frame_num,
+      DmaRingBytes(profile),
+      DmaRingDurationMs(profile));
+
   // Create a new I2S channel
   i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_AUTO, I2S_ROLE_MASTER);
+  chan_cfg.dma_desc_num = profile.dma_desc_num;
+  chan_cfg.dma_frame_num = profile.dma_frame_num;
   esp_err_t esp_result = i2s_new_channel(&chan_cfg, nullptr, &m_rx_handle);
   if (esp_result != ESP_OK) {
     LOG("%s:%d | Unable to create a new I2S channel: %s\n",
@@ -76,15 +96,37 @@ I2sSampler::Init()
   }
 
   // Initialize this new channel in standard mode
-  esp_result = i2s_channel_init_std_mode(m_rx_handle, &I2S_MIC_CONFIG);
+  i2s_std_config_t std_cfg = I2S_MIC_CONFIG;
+  std_cfg.clk_cfg.sample_rate_hz = profile.sample_rate_hz;
+  esp_result = i2s_channel_init_std_mode(m_rx_handle, &std_cfg);
   if (esp_result != ESP_OK) {
     LOG("%s:%d | Unable to initialize I2S rx channel: %s\n",
         __FILE__,
         __LINE__,
         esp_err_to_name(esp_result));
+    DeleteChannel();
+    return false;
+  }
+
+  // Count DMA buffers dropped by the driver. Callbacks can be registered only before the channel
+  // is enabled
+  const i2s_event_callbacks_t callbacks = { .on_recv = nullptr,
+                                            .on_recv_q_ovf = ReceiveOverflowCallback,
+                                            .on_sent = nullptr,
+                                            .on_send_q_ovf = nullptr };
+  esp_result = i2s_channel_register_event_callback(m_rx_handle, &callbacks, this);
+  if (esp_result != ESP_OK) {
+    LOG("%s:%d | Unable to register I2S RX callbacks: %s\n",
+        __FILE__,
+        __LINE__,
+        esp_err_to_name(esp_result));
+    DeleteChannel();
     return false;
   }
 
+  ResetStats();
+  m_conditioner.Reset();
+
   // Enable the channel
   esp_result = i2s_channel_enable(m_rx_handle);
   if (esp_result != ESP_OK) {
@@ -92,6 +134,7 @@ I2sSampler::Init()
         __FILE__,
         __LINE__,
         esp_err_to_name(esp_result));
+    DeleteChannel();
     return false;
   }
 
@@ -100,6 +143,49 @@ I2sSampler::Init()
   return true;
 }
 
+void
+I2sSampler::DeleteChannel()
+{
+  // the channel is not enabled, so it can be deleted right away
+  const esp_err_t esp_result = i2s_del_channel(m_rx_handle);
+  if (esp_result != ESP_OK) {
+    LOG("%s:%d | Unable to delete I2S RX channel: %s\n",
+        __FILE__,
+        __LINE__,
+        esp_err_to_name(esp_result));
+  }
+  m_rx_handle = nullptr;
+}
+
+bool
+I2sSampler::InitSynthetic(const CaptureProfile& profile)
+{
+  if (m_is_init) {
+    LOG("I2S sampler is already initialized.\n");
+    return true;
+  }
+
+  LOG("Initializing the simulated I2S source at %lu Hz...\n", profile.sample_rate_hz);
+
+  if (!IsCaptureProfileValid(profile, SD_CLUSTER_SIZE)) {
+    LOG("%s:%d | Invalid capture profile.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  ResetStats();
+  m_conditioner.Reset();
+
+  m_synthetic_profile = profile;
+  m_synthetic_start_us = esp_timer_get_time();
+  m_synthetic_frames = 0;
+  m_synthetic_noise = 1;
+
+  m_is_synthetic = true;
+  m_is_init = true;
+
+  return true;
+}
+
 bool
 I2sSampler::DeInit()
 {
@@ -108,6 +194,12 @@ I2sSampler::DeInit()
     return true;
   }
 
+  if (m_is_synthetic) {
+    m_is_synthetic = false;
+    m_is_init = false;
+    return true;
+  }
+
   esp_err_t esp_result = i2s_channel_disable(m_rx_handle);
   if (esp_result != ESP_OK) {
     LOG("%s:%d | Unable to disable I2S RX channel: %s\n",
@@ -139,96 +231,200 @@ I2sSampler::~I2sSampler()
 void
 I2sSampler::DiscardSamples(const std::size_t samples_ammount)
 {
-  std::vector<uint32_t> buffer;
-  buffer.resize(samples_ammount);
-
-  const esp_err_t esp_result =
-    i2s_channel_read(m_rx_handle, buffer.data(), samples_ammount * sizeof(buffer[0]), nullptr, 100);
+  std::size_t remaining = samples_ammount;
+
+  while (remaining > 0) {
+    const std::size_t to_read = std::min(remaining, s_discard_buffer.size());
+    std::size_t bytes_read = 0;
+
+    const esp_err_t esp_result = i2s_channel_read(
+      m_rx_handle, s_discard_buffer.data(), to_read * sizeof(int32_t), &bytes_read, 100);
+    if (esp_result != ESP_OK) {
+      LOG("%s:%d | Unable to discard RX buffer: %s\n",
+          __FILE__,
+          __LINE__,
+          esp_err_to_name(esp_result));
+      return;
+    }
+
+    remaining -= bytes_read / sizeof(int32_t);
+  }
+}
 
-  if (esp_result != ESP_OK) {
-    LOG(
-      "%s:%d | Unable to discard RX buffer: %s\n", __FILE__, __LINE__, esp_err_to_name(esp_result));
+std::size_t
+I2sSampler::WarmUp(const std::size_t max_samples)
+{
+  // tolerances are set in 16-bit sample units, while statistics are computed on 24-bit data
+  constexpr int64_t k_dc_tolerance = WARMUP_DC_TOLERANCE << 8;
+  constexpr int64_t k_variance_floor = WARMUP_VARIANCE_FLOOR << 16;
+
+  std::size_t discarded = 0;
+  int64_t prev_mean = 0;
+  int64_t prev_variance = 0;
+  bool has_prev_block = false;
+
+  while (discarded < max_samples) {
+    const std::size_t to_read = std::min(max_samples - discarded, s_discard_buffer.size());
+    std::size_t bytes_read = 0;
+
+    const esp_err_t esp_result = i2s_channel_read(
+      m_rx_handle, s_discard_buffer.data(), to_read * sizeof(int32_t), &bytes_read, 100);
+    if (esp_result != ESP_OK) {
+      LOG("%s:%d | Unable to read I2S RX channel during warm-up: %s\n",
+          __FILE__,
+          __LINE__,
+          esp_err_to_name(esp_result));
+      break;
+    }
+
+    const std::size_t samples_read = bytes_read / sizeof(int32_t);
+    discarded += samples_read;
+    if (samples_read == 0) {
+      continue;
+    }
+
+    int64_t sum = 0;
+    int64_t square_sum = 0;
+    for (std::size_t i = 0; i < samples_read; ++i) {
+      // data occupies upper 24 of 32 bits
+      const int64_t sample = s_discard_buffer[i] >> 8;
+      sum += sample;
+      square_sum += sample * sample;
+    }
+
+    const int64_t mean = sum / static_cast<int64_t>(samples_read);
+    const int64_t variance = square_sum / static_cast<int64_t>(samples_read) - mean * mean;
+
+    if (has_prev_block) {
+      // the stream has settled when both the DC level & the noise power stop drifting
+      const int64_t variance_tolerance = std::max(
+        k_variance_floor,
+        std::max(variance, prev_variance) * WARMUP_VARIANCE_TOLERANCE_PERCENT / 100);
+
+      if (std::abs(mean - prev_mean) <= k_dc_tolerance &&
+          std::abs(variance - prev_variance) <= variance_tolerance) {
+        break;
+      }
+    }
+
+    prev_mean = mean;
+    prev_variance = variance;
+    has_prev_block = true;
   }
+
+  LOG("Warm-up discarded %u samples.\n", discarded);
+
+  // start the DC-blocking filter from the settled DC level, so it does not produce a step
+  m_conditioner.Reset(static_cast<int32_t>(prev_mean));
+
+  return discarded;
 }
 
 std::vector<int16_t>
 I2sSampler::ReadSamples(const std::size_t max_samples)
 {
-  // a buffer which will store read data
   std::vector<int32_t> raw_samples_vector;
   raw_samples_vector.resize(max_samples);
 
+  const std::span<int16_t> samples = ReadSamples(raw_samples_vector);
+
+  return std::vector<int16_t>(samples.begin(), samples.end());
+}
+
+std::span<int16_t>
+I2sSampler::ReadSamples(std::span<int32_t> raw_buffer)
+{
   // how many bytes have to be read
-  const std::size_t bytes_to_read = max_samples * sizeof(raw_samples_vector[0]);
+  const std::size_t bytes_to_read = raw_buffer.size_bytes();
   // will store how many bytes were actually read
   std::size_t bytes_read = 0;
 
   // read the data
+  const int64_t read_start_us = esp_timer_get_time();
   const esp_err_t esp_result =
-    i2s_channel_read(m_rx_handle, raw_samples_vector.data(), bytes_to_read, &bytes_read, 100);
+    m_is_synthetic
+      ? ReadSyntheticFrames(raw_buffer, bytes_read)
+      : i2s_channel_read(m_rx_handle, raw_buffer.data(), bytes_to_read, &bytes_read, 100);
+  const uint32_t read_latency_us = static_cast<uint32_t>(esp_timer_get_time() - read_start_us);
 
-  LOG("%u bytes have been read.\n", bytes_read);
+  if (read_latency_us > m_worst_read_latency_us) {
+    m_worst_read_latency_us = read_latency_us;
+  }
+  if (bytes_read < bytes_to_read) {
+    ++m_short_reads;
+  }
 
   // check for errors
   if (esp_result != ESP_OK) {
     LOG(
       "%s:%d | Unable to read I2S RX channel: %s\n", __FILE__, __LINE__, esp_err_to_name(esp_result));
-    return {}; // return empty array
+    return {}; // return empty span
   }
 
   // number of samples that have been read
-  const std::size_t samples_read = bytes_read / sizeof(raw_samples_vector[0]);
+  const std::size_t samples_read = bytes_read / sizeof(raw_buffer[0]);
+  m_frames_captured += samples_read;
+
+  const uint32_t conditioning_start = esp_cpu_get_cycle_count();
+  const std::span<int16_t> samples = m_conditioner.Process(raw_buffer.first(samples_read));
+  m_conditioning_cycles += esp_cpu_get_cycle_count() - conditioning_start;
 
-  std::vector<int16_t> result_samples;
-  result_samples.reserve(samples_read);
+  return samples;
+}
+
+esp_err_t
+I2sSampler::ReadSyntheticFrames(std::span<int32_t> raw_buffer, std::size_t& bytes_read)
+{
+  const uint64_t sample_rate_hz = m_synthetic_profile.sample_rate_hz;
+  const auto get_produced_frames = [this, sample_rate_hz]() {
+    return static_cast<uint64_t>(esp_timer_get_time() - m_synthetic_start_us) * sample_rate_hz /
+           1'000'000;
+  };
+
+  // the DMA ring holds all but the buffer which is being filled, older frames are overwritten
+  const uint64_t ring_frames =
+    (m_synthetic_profile.dma_desc_num - 1) * m_synthetic_profile.dma_frame_num;
+  uint64_t produced_frames = get_produced_frames();
+  if (produced_frames > m_synthetic_frames + ring_frames) {
+    const uint64_t lost_frames = produced_frames - m_synthetic_frames - ring_frames;
+    m_frames_lost.fetch_add(static_cast<uint32_t>(lost_frames), std::memory_order_relaxed);
+    m_synthetic_frames += lost_frames;
+  }
 
-  for (std::size_t i = 0; i < samples_read; ++i) {
-    // data occupies 24 of 32 bits
-    // shifting discards 8 zero and 8 least significant bits
-    result_samples.push_back(raw_samples_vector[i] >> 16);
+  // wait for the rest of the chunk, like a blocking read of the DMA buffers
+  while (produced_frames < m_synthetic_frames + raw_buffer.size()) {
+    const uint64_t missing_frames = m_synthetic_frames + raw_buffer.size() - produced_frames;
+    vTaskDelay(std::max<TickType_t>(pdMS_TO_TICKS(missing_frames * 1'000 / sample_rate_hz), 1));
+    produced_frames = get_produced_frames();
   }
 
-  return result_samples;
+  // noise 24 dB below the full scale, in the upper 24 bits like the microphone's data
+  for (int32_t& frame : raw_buffer) {
+    m_synthetic_noise = m_synthetic_noise * 1'664'525 + 1'013'904'223;
+    frame = static_cast<int32_t>(m_synthetic_noise & 0xFFFFFF00) >> 4 & ~0xFF;
+  }
+  m_synthetic_frames += raw_buffer.size();
+  bytes_read = raw_buffer.size_bytes();
+
+  return ESP_OK;
+}
+
+void
+I2sSampler::ResetStats()
+{
+  m_frames_lost = 0;
+  m_frames_captured = 0;
+  m_short_reads = 0;
+  m_worst_read_latency_us = 0;
+  m_conditioning_cycles = 0;
 }
 
-// esp_err_t
-// I2sSampler::ReadSamples(std::span<int16_t> output_buf)
-// {
-//   const std::size_t bytes_to_read = output_buf.size() * sizeof(int16_t);
-
-//   const esp_err_t esp_result =
-//     i2s_channel_read(m_rx_handle, output_buf.data(), bytes_to_read, &bytes_to_read, 1'000);
-
-//   if (esp_result != ESP_OK) {
-//     LOG(
-//       "%s:%d | Unable to read I2S RX channel: %s", __FILE__, __LINE__,
-//       esp_err_to_name(esp_result));
-//   }
-
-//   return esp_result;
-// }
-
-// template<std::size_t N>
-// std::expected<std::array<int16_t, N>, esp_err_t>
-// I2sSampler::ReadSamples()
-// {
-//   // read from i2s
-//   // int32_t* raw_samples = (int32_t*)malloc(sizeof(int32_t) * count);
-//   // size_t bytes_read = 0;
-//   // i2s_read(m_i2sPort, raw_samples, sizeof(int32_t) * count, &bytes_read, 100);
-//   // int samples_read = bytes_read / sizeof(int32_t);
-
-//   constexpr std::size_t bytes_to_read = N * 2;
-//   std::array<int16_t, N> samples;
-
-//   const esp_err_t esp_result =
-//     i2s_channel_read(m_rx_handle, &samples.data(), bytes_to_read, bytes_to_read, 1'000);
-//   if (esp_result != ESP_OK) {
-//     LOG(
-//       "%s:%d | Unable to read I2S RX channel: %s", __FILE__, __LINE__,
-//       esp_err_to_name(esp_result));
-//     return std::unexpected(esp_result);
-//   }
-
-//   return samples;
-// }
+I2sSamplerStats
+I2sSampler::GetStats() const
+{
+  return I2sSamplerStats{ .frames_captured = m_frames_captured,
+                          .frames_lost = m_frames_lost.load(std::memory_order_relaxed),
+                          .short_reads = m_short_reads,
+                          .worst_read_latency_us = m_worst_read_latency_us,
+                          .conditioning_cycles = m_conditioning_cycles };
+}
@@ -1,25 +1,113 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <span>
 #include <vector>
 
 #include "driver/i2s_std.h"
+#include "esp_attr.h"
+
+#include "capture_profile.hpp"
+#include "sample_conditioner.hpp"
+
+struct I2sSamplerStats
+{
+  // frames which have been read from the DMA buffers
+  uint32_t frames_captured;
+  // frames which have been overwritten in the DMA buffers before being read
+  uint32_t frames_lost;
+  // reads which have returned less frames than requested
+  uint32_t short_reads;
+  // the longest `i2s_channel_read()` call
+  uint32_t worst_read_latency_us;
+  // CPU cycles spent conditioning the captured frames
+  uint64_t conditioning_cycles;
+};
 
 class I2sSampler
 {
 public:
-  bool Init();
+  /// @brief Creates & enables the I2S RX channel
+  /// @param profile sample rate & DMA buffering to use
+  /// @return `true` if successful, `false` otherwise
+  bool Init(const CaptureProfile& profile);
   bool DeInit();
 
+  /// @brief Starts a simulated I2S source instead of the microphone, for the capture stress test.
+  /// It generates noise at the profile's sample rate, paced by the system timer, and drops frames
+  /// which aren't read before the profile's DMA ring would overflow, like the driver does
+  /// @return `true` if successful, `false` otherwise
+  bool InitSynthetic(const CaptureProfile& profile);
+
   ~I2sSampler();
 
   void DiscardSamples(const std::size_t samples_ammount);
 
+  /// @brief Discards samples until the microphone's DC level & noise variance settle
+  /// between two consecutive blocks, but no more than `max_samples`
+  /// @return amount of discarded samples
+  std::size_t WarmUp(const std::size_t max_samples);
+
   std::vector<int16_t> ReadSamples(const std::size_t max_samples);
 
+  /// @brief Reads up to `raw_buffer.size()` samples into a caller-owned buffer without any
+  /// heap allocations. DMA reads 24-in-32-bit words into `raw_buffer`, which are then conditioned
+  /// into 16-bit samples in place, at the front of the same buffer.
+  /// @param raw_buffer buffer for the raw I2S words, its memory is reused for the output
+  /// @return 16-bit samples which have been read, an empty span in case of an error.
+  /// Points into `raw_buffer`, so it is valid until the buffer is reused
+  std::span<int16_t> ReadSamples(std::span<int32_t> raw_buffer);
+
+  /// @brief Returns the gain shift applied to the last read block
+  uint8_t GetGainShift() const { return m_conditioner.GetGainShift(); }
+  /// @brief Enables or freezes the automatic gain
+  void SetAgcEnabled(const bool is_enabled) { m_conditioner.SetAgcEnabled(is_enabled); }
+
+  /// @brief Clears the capture counters, should be called at the start of every recording
+  void ResetStats();
+  I2sSamplerStats GetStats() const;
+
+private:
+  /// @brief Deletes the channel after a failed initialization, so a retry doesn't leak it
+  void DeleteChannel();
+
+  /// @brief Blocks until the simulated source has produced `raw_buffer.size()` frames, like a
+  /// DMA read, and fills the buffer with them
+  esp_err_t ReadSyntheticFrames(std::span<int32_t> raw_buffer, std::size_t& bytes_read);
+
+  static bool IRAM_ATTR ReceiveOverflowCallback(i2s_chan_handle_t handle,
+                                                i2s_event_data_t* event,
+                                                void* user_data)
+  {
+    // the driver has dropped the oldest DMA buffer, because the receive queue was full
+    I2sSampler* sampler = reinterpret_cast<I2sSampler*>(user_data);
+    sampler->m_frames_lost.fetch_add(event->size / sizeof(int32_t), std::memory_order_relaxed);
+
+    // no task has been woken
+    return false;
+  }
+
 private:
   bool m_is_init = false;
-  i2s_chan_handle_t m_rx_handle;
+  i2s_chan_handle_t m_rx_handle = nullptr;
+
+  // set while the simulated source is used instead of the I2S channel
+  bool m_is_synthetic = false;
+  CaptureProfile m_synthetic_profile;
+  int64_t m_synthetic_start_us = 0;
+  // frames produced by the simulated source which have been read or dropped
+  uint64_t m_synthetic_frames = 0;
+  uint32_t m_synthetic_noise = 0;
+
+  // updated from the I2S ISR
+  std::atomic<uint32_t> m_frames_lost = 0;
+  uint32_t m_frames_captured = 0;
+  uint32_t m_short_reads = 0;
+  uint32_t m_worst_read_latency_us = 0;
+  uint64_t m_conditioning_cycles = 0;
+
+  SampleConditioner m_conditioner;
 
   // I have no idea what is this used for
   int16_t constval = 0;
@@ -0,0 +1,203 @@
+#include "block_device.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <SD.h>
+
+#include "settings.hpp"
+
+#if DEBUG_SD
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+namespace {
+
+// layout of the master boot record in the card's first sector
+constexpr std::size_t k_partition_table_offset = 0x1BE;
+constexpr std::size_t k_partition_entry_size = 16;
+constexpr std::size_t k_partition_count = 4;
+constexpr std::size_t k_partition_type_offset = 4;
+constexpr std::size_t k_partition_start_offset = 8;
+constexpr std::size_t k_partition_size_offset = 12;
+
+uint32_t
+ReadLittleEndian32(const uint8_t* data)
+{
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+} // namespace
+
+bool
+SdPartition::Open(const uint8_t partition_type)
+{
+  m_first_sector = 0;
+  m_sector_count = 0;
+
+  std::array<uint8_t, SD_SECTOR_SIZE> mbr;
+  if (!SD.readRAW(mbr.data(), 0)) {
+    LOG("%s:%d | Unable to read the MBR.\n", __FILE__, __LINE__);
+    return false;
+  }
+  if (mbr[SD_SECTOR_SIZE - 2] != 0x55 || mbr[SD_SECTOR_SIZE - 1] != 0xAA) {
+    LOG("The card has no MBR.\n");
+    return false;
+  }
+
+  for (std::size_t i = 0; i < k_partition_count; ++i) {
+    const uint8_t* entry = mbr.data() + k_partition_table_offset + i * k_partition_entry_size;
+    if (entry[k_partition_type_offset] != partition_type) {
+      continue;
+    }
+
+    m_first_sector = ReadLittleEndian32(entry + k_partition_start_offset);
+    m_sector_count = ReadLittleEndian32(entry + k_partition_size_offset);
+    if (m_first_sector == 0 || m_sector_count == 0 ||
+        static_cast<uint64_t>(m_first_sector) + m_sector_count > SD.cardSize() / SD_SECTOR_SIZE) {
+      LOG("%s:%d | Partition %u of type 0x%02X lies outside of the card.\n",
+          __FILE__,
+          __LINE__,
+          i + 1,
+          partition_type);
+      m_first_sector = 0;
+      m_sector_count = 0;
+      return false;
+    }
+
+    LOG("Raw partition %u: %lu sectors at sector %lu.\n", i + 1, m_sector_count, m_first_sector);
+    return true;
+  }
+
+  LOG("The card has no partition of type 0x%02X.\n", partition_type);
+  return false;
+}
+
+bool
+SdPartition::Read(const uint64_t sector, const std::span<uint8_t> data)
+{
+  const std::size_t sector_count = data.size() / SD_SECTOR_SIZE;
+  if (sector + sector_count > m_sector_count) {
+    LOG("%s:%d | Read beyond the partition.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  // the raw access of the SD library transfers a single sector at a time
+  for (std::size_t i = 0; i < sector_count; ++i) {
+    if (!SD.readRAW(data.data() + i * SD_SECTOR_SIZE, m_first_sector + sector + i)) {
+      LOG("%s:%d | Unable to read sector %llu.\n", __FILE__, __LINE__, sector + i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+SdPartition::Write(const uint64_t sector, const std::span<const uint8_t> data)
+{
+  const std::size_t sector_count = data.size() / SD_SECTOR_SIZE;
+  if (sector + sector_count > m_sector_count) {
+    LOG("%s:%d | Write beyond the partition.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  for (std::size_t i = 0; i < sector_count; ++i) {
+    // the library doesn't modify the buffer, it's just not declared const
+    if (!SD.writeRAW(const_cast<uint8_t*>(data.data() + i * SD_SECTOR_SIZE),
+                     m_first_sector + sector + i)) {
+      LOG("%s:%d | Unable to write sector %llu.\n", __FILE__, __LINE__, sector + i);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+FileBlockDevice::Open(const std::string_view file_path, const uint64_t sector_count)
+{
+  Close();
+
+  m_fp = fopen(file_path.data(), "r+b");
+  if (m_fp == nullptr) {
+    m_fp = fopen(file_path.data(), "w+b");
+  }
+  if (m_fp == nullptr) {
+    LOG("%s:%d | Unable to open '%.*s'. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        file_path.length(),
+        file_path.data(),
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  // sectors are written whole, stdio buffering would only copy them
+  setvbuf(m_fp, nullptr, _IONBF, 0);
+
+  struct stat file_stats;
+  const uint64_t size = sector_count * SD_SECTOR_SIZE;
+  if (fstat(fileno(m_fp), &file_stats) != 0 || static_cast<uint64_t>(file_stats.st_size) < size) {
+    LOG("Allocating %llu KB for the log file...\n", size / 1024);
+
+    // seeking beyond the end & writing extends the cluster chain in one go, the sync stores the
+    // new size
+    const uint8_t last_byte = 0;
+    if (fseek(m_fp, size - 1, SEEK_SET) != 0 || std::fwrite(&last_byte, 1, 1, m_fp) != 1 ||
+        fsync(fileno(m_fp)) != 0) {
+      LOG("%s:%d | Unable to extend the log file. errno: %d = %s\n",
+          __FILE__,
+          __LINE__,
+          errno,
+          std::strerror(errno));
+      Close();
+      return false;
+    }
+  }
+
+  m_sector_count = sector_count;
+
+  return true;
+}
+
+void
+FileBlockDevice::Close()
+{
+  if (m_fp != nullptr) {
+    fclose(m_fp);
+    m_fp = nullptr;
+  }
+  m_sector_count = 0;
+}
+
+bool
+FileBlockDevice::Read(const uint64_t sector, const std::span<uint8_t> data)
+{
+  if (m_fp == nullptr || sector + data.size() / SD_SECTOR_SIZE > m_sector_count) {
+    return false;
+  }
+
+  return fseek(m_fp, sector * SD_SECTOR_SIZE, SEEK_SET) == 0 &&
+         std::fread(data.data(), data.size(), 1, m_fp) == 1;
+}
+
+bool
+FileBlockDevice::Write(const uint64_t sector, const std::span<const uint8_t> data)
+{
+  if (m_fp == nullptr || sector + data.size() / SD_SECTOR_SIZE > m_sector_count) {
+    return false;
+  }
+
+  // whole, aligned sectors within the allocated file go straight to the card, & the file's size
+  // doesn't change, so there is no metadata to sync
+  return fseek(m_fp, sector * SD_SECTOR_SIZE, SEEK_SET) == 0 &&
+         std::fwrite(data.data(), data.size(), 1, m_fp) == 1;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string_view>
+
+/// @brief Storage which is read & written in whole sectors of `SD_SECTOR_SIZE`, addressed from 0
+class BlockDevice
+{
+public:
+  virtual ~BlockDevice() = default;
+
+  /// @brief Reads `data.size() / SD_SECTOR_SIZE` sectors starting at `sector`
+  virtual bool Read(const uint64_t sector, const std::span<uint8_t> data) = 0;
+  /// @brief Writes `data.size() / SD_SECTOR_SIZE` sectors starting at `sector`
+  virtual bool Write(const uint64_t sector, const std::span<const uint8_t> data) = 0;
+
+  virtual uint64_t GetSectorCount() const = 0;
+};
+
+/// @brief Primary MBR partition of the mounted SD card, accessed sector by sector below the
+/// file system
+class SdPartition final : public BlockDevice
+{
+public:
+  /// @brief Looks up the first primary partition of `partition_type` in the card's MBR
+  /// @return `true` if the partition exists, `false` otherwise
+  bool Open(const uint8_t partition_type);
+
+  bool Read(const uint64_t sector, const std::span<uint8_t> data) override;
+  bool Write(const uint64_t sector, const std::span<const uint8_t> data) override;
+
+  uint64_t GetSectorCount() const override { return m_sector_count; }
+
+private:
+  uint32_t m_first_sector = 0;
+  uint32_t m_sector_count = 0;
+};
+
+/// @brief Device backed by a container file of a fixed size, for cards without a raw partition,
+/// and for running the log store on a host
+class FileBlockDevice final : public BlockDevice
+{
+public:
+  ~FileBlockDevice() override { Close(); }
+
+  /// @brief Opens the file at `file_path`, & extends it to `sector_count` sectors if it's smaller.
+  /// The extension is allocated at once, so the file system metadata isn't touched by writes
+  /// @return `true` if successful, `false` otherwise
+  bool Open(const std::string_view file_path, const uint64_t sector_count);
+  void Close();
+
+  bool Read(const uint64_t sector, const std::span<uint8_t> data) override;
+  bool Write(const uint64_t sector, const std::span<const uint8_t> data) override;
+
+  uint64_t GetSectorCount() const override { return m_sector_count; }
+
+private:
+  FILE* m_fp = nullptr;
+  uint64_t m_sector_count = 0;
+};
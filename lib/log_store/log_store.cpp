@@ -0,0 +1,495 @@
+#include "log_store.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+#include <Arduino.h>
+
+#include "checksum.hpp"
+#include "wav_header.hpp"
+
+#if DEBUG_SD
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+// the superblocks occupy the device's first sectors, the log wraps around the ones after them
+constexpr uint64_t k_superblock_count = 2;
+// smallest device which holds a record of a useful length
+constexpr uint64_t k_min_data_sectors = 64;
+
+bool
+LogStore::Mount(BlockDevice& device)
+{
+  if (m_mutex == nullptr) {
+    m_mutex = xSemaphoreCreateMutex();
+    if (m_mutex == nullptr) {
+      LOG("%s:%d | Unable to create the log store mutex.\n", __FILE__, __LINE__);
+      return false;
+    }
+  }
+
+  if (device.GetSectorCount() < k_superblock_count + k_min_data_sectors) {
+    LOG("%s:%d | The device is too small for the log.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  m_device = &device;
+  m_data_sectors = device.GetSectorCount() - k_superblock_count;
+  m_open_record.reset();
+
+  // only a device which holds no log at all is formatted, a read error or a damaged superblock
+  // would otherwise drop all recordings of the log
+  const SuperblockState superblock_state = LoadSuperblock();
+  bool is_mounted = superblock_state == SuperblockState::Loaded ||
+                    (superblock_state == SuperblockState::Missing && Format());
+  if (is_mounted && !RecoverOpenRecord()) {
+    LOG("%s:%d | Unable to recover the open record.\n", __FILE__, __LINE__);
+  }
+
+  if (is_mounted) {
+    LOG("Log store mounted, %llu of %llu sectors used.\n",
+        m_superblock.head - m_superblock.tail,
+        m_data_sectors);
+  } else {
+    m_device = nullptr;
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return is_mounted;
+}
+
+void
+LogStore::Unmount()
+{
+  if (m_mutex == nullptr) {
+    return;
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  if (m_open_record) {
+    LOG("%s:%d | Unmounting with an open record.\n", __FILE__, __LINE__);
+    m_open_record.reset();
+  }
+  m_device = nullptr;
+  xSemaphoreGive(m_mutex);
+}
+
+std::optional<uint64_t>
+LogStore::BeginRecord()
+{
+  if (m_device == nullptr) {
+    return std::nullopt;
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  std::optional<uint64_t> position;
+  if (m_open_record) {
+    LOG("%s:%d | Another record is already open.\n", __FILE__, __LINE__);
+  } else if (Reserve(m_superblock.head + 1)) {
+    // written with the data once the first commit is due, there is nothing to recover before
+    const uint64_t head = m_superblock.head;
+    LogRecordHeader header;
+    header.position = head;
+    header.timestamp = std::time(nullptr);
+    m_open_record = header;
+    m_write_position = head + 1;
+    position = head;
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return position;
+}
+
+bool
+LogStore::Append(const std::span<const uint8_t> sectors)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  const uint64_t end = m_write_position + sectors.size() / SD_SECTOR_SIZE;
+  const bool is_written = m_open_record && Reserve(end) && WriteSectors(m_write_position, sectors);
+  if (is_written) {
+    m_write_position = end;
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return is_written;
+}
+
+bool
+LogStore::CommitRecord(const uint32_t data_bytes)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  bool is_committed = false;
+  if (m_open_record) {
+    m_open_record->data_bytes = data_bytes;
+    is_committed = WriteHeader(*m_open_record);
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return is_committed;
+}
+
+bool
+LogStore::FinishRecord(const uint32_t data_bytes)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  if (!m_open_record) {
+    xSemaphoreGive(m_mutex);
+    return false;
+  }
+
+  LogRecordHeader& header = *m_open_record;
+  header.data_bytes = data_bytes;
+  header.state = LogRecordState::Finished;
+
+  // a record is part of the log once the head has moved past it
+  bool is_finished = true;
+  if (data_bytes != 0) {
+    const uint64_t head = header.position + GetRecordSectors(header);
+    is_finished = WriteHeader(header);
+    if (is_finished) {
+      m_superblock.head = head;
+      is_finished = StoreSuperblock();
+    }
+  }
+
+  m_open_record.reset();
+
+  xSemaphoreGive(m_mutex);
+
+  return is_finished;
+}
+
+bool
+LogStore::NameRecord(const uint64_t position, const uint32_t timestamp, const uint16_t segment)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  std::optional<LogRecordHeader> header = ReadHeader(position);
+  bool is_named = false;
+  if (header && header->state != LogRecordState::Open) {
+    header->timestamp = timestamp;
+    header->segment = segment;
+    is_named = WriteHeader(*header);
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  if (!is_named) {
+    LOG("%s:%d | Unable to name the record at %llu.\n", __FILE__, __LINE__, position);
+  }
+
+  return is_named;
+}
+
+bool
+LogStore::MarkUploaded(const uint64_t position)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  std::optional<LogRecordHeader> header = ReadHeader(position);
+  bool is_marked = false;
+  if (header && header->state != LogRecordState::Open) {
+    header->state = LogRecordState::Uploaded;
+    is_marked = WriteHeader(*header);
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return is_marked;
+}
+
+std::optional<LogRecordHeader>
+LogStore::GetNextRecord(LogCursor& cursor)
+{
+  if (m_device == nullptr) {
+    return std::nullopt;
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  std::optional<LogRecordHeader> record;
+  cursor.position = std::max(cursor.position, m_superblock.tail);
+  while (!record && cursor.position < m_superblock.head) {
+    const std::optional<LogRecordHeader> header = ReadHeader(cursor.position);
+    if (!header) {
+      LOG("%s:%d | No record at %llu.\n", __FILE__, __LINE__, cursor.position);
+      cursor.position = m_superblock.head;
+      break;
+    }
+
+    cursor.position += GetRecordSectors(*header);
+    if (header->state == LogRecordState::Finished) {
+      record = header;
+    }
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return record;
+}
+
+std::size_t
+LogStore::ReadWav(const LogRecordHeader& record,
+                  const std::size_t offset,
+                  const std::span<uint8_t> data)
+{
+  const std::size_t wav_size = sizeof(wav_header_t) + record.data_bytes;
+  if (m_device == nullptr || offset >= wav_size) {
+    return 0;
+  }
+
+  const std::size_t length = std::min(data.size(), wav_size - offset);
+  // the header of the record & the one of the stream both take the first sector, so sector `i`
+  // of the stream is sector `i` of the record
+  uint64_t sector = offset / SD_SECTOR_SIZE;
+  std::span<uint8_t> sectors =
+    data.first((length + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE * SD_SECTOR_SIZE);
+  if (sector == 0) {
+    wav_header_t header;
+    header.wav_size = wav_size - 8;
+    header.data_bytes = record.data_bytes;
+    std::memcpy(sectors.data(), &header, sizeof(header));
+    sectors = sectors.subspan(sizeof(header));
+    ++sector;
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+
+  // the data of a reclaimed record may have been overwritten already
+  bool is_read = record.position >= m_superblock.tail;
+  if (is_read && !sectors.empty()) {
+    is_read = ReadSectors(record.position + sector, sectors);
+  }
+
+  xSemaphoreGive(m_mutex);
+
+  return is_read ? length : 0;
+}
+
+sd::RecordingName
+LogStore::GetFileName(const LogRecordHeader& record)
+{
+  const sd::RecordingEntry entry = { .timestamp = record.timestamp,
+                                     .size = static_cast<uint32_t>(sizeof(wav_header_t) +
+                                                                   record.data_bytes),
+                                     .segment = record.segment,
+                                     .format = RecordingFormat::Wav,
+                                     .upload_state = sd::UploadState::Pending,
+                                     .checksum = 0 };
+  return entry.GetFileName();
+}
+
+LogStore::SuperblockState
+LogStore::LoadSuperblock()
+{
+  const LogSuperblock k_reference;
+  std::optional<LogSuperblock> current;
+  bool has_magic = false;
+
+  for (uint64_t i = 0; i < k_superblock_count; ++i) {
+    if (!m_device->Read(i, m_sector)) {
+      LOG("%s:%d | Unable to read the log superblock %llu.\n", __FILE__, __LINE__, i);
+      return SuperblockState::Unusable;
+    }
+
+    LogSuperblock superblock;
+    std::memcpy(&superblock, m_sector.data(), sizeof(superblock));
+    if (std::memcmp(superblock.magic, k_reference.magic, sizeof(superblock.magic)) != 0) {
+      continue;
+    }
+    has_magic = true;
+
+    const bool is_valid =
+      superblock.version == k_reference.version &&
+      superblock.checksum == sd::CalculateChecksum(superblock) &&
+      superblock.tail <= superblock.head && superblock.head - superblock.tail <= m_data_sectors;
+    if (is_valid && (!current || superblock.sequence > current->sequence)) {
+      current = superblock;
+    }
+  }
+
+  if (!current) {
+    if (has_magic) {
+      LOG("%s:%d | The log superblocks are damaged.\n", __FILE__, __LINE__);
+      return SuperblockState::Unusable;
+    }
+    LOG("No log superblock.\n");
+    return SuperblockState::Missing;
+  }
+
+  m_superblock = *current;
+
+  return SuperblockState::Loaded;
+}
+
+bool
+LogStore::StoreSuperblock()
+{
+  ++m_superblock.sequence;
+  m_superblock.checksum = sd::CalculateChecksum(m_superblock);
+
+  m_sector.fill(0);
+  std::memcpy(m_sector.data(), &m_superblock, sizeof(m_superblock));
+  if (!m_device->Write(m_superblock.sequence % k_superblock_count, m_sector)) {
+    LOG("%s:%d | Unable to store the log superblock.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+LogStore::Format()
+{
+  LOG("Formatting the log store...\n");
+
+  m_superblock = LogSuperblock{};
+
+  // both copies are written, so no superblock of an earlier log is left behind
+  for (uint64_t i = 0; i < k_superblock_count; ++i) {
+    if (!StoreSuperblock()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+LogStore::RecoverOpenRecord()
+{
+  if (m_superblock.head - m_superblock.tail >= m_data_sectors) {
+    return true;
+  }
+
+  std::optional<LogRecordHeader> header = ReadHeader(m_superblock.head);
+  if (!header || header->data_bytes == 0) {
+    return true;
+  }
+
+  LOG("Recovering the record at %llu with %lu bytes.\n",
+      m_superblock.head,
+      header->data_bytes);
+
+  // the record may have been finished, but the superblock not updated yet
+  if (header->state == LogRecordState::Open) {
+    header->state = LogRecordState::Finished;
+    if (!WriteHeader(*header)) {
+      return false;
+    }
+  }
+
+  m_superblock.head += GetRecordSectors(*header);
+  return StoreSuperblock();
+}
+
+bool
+LogStore::ReclaimOldest()
+{
+  const std::optional<LogRecordHeader> header = ReadHeader(m_superblock.tail);
+  if (header) {
+    LOG("Reclaiming the record at %llu.\n", m_superblock.tail);
+    m_superblock.tail += GetRecordSectors(*header);
+  } else {
+    // the log is damaged, it's dropped up to the head
+    LOG("%s:%d | No record at the tail %llu, dropping the log.\n",
+        __FILE__,
+        __LINE__,
+        m_superblock.tail);
+    m_superblock.tail = m_superblock.head;
+  }
+
+  // the record's sectors must not be written before the tail has moved past them
+  return StoreSuperblock();
+}
+
+bool
+LogStore::Reserve(const uint64_t end)
+{
+  while (end - m_superblock.tail > m_data_sectors) {
+    // the open record is never reclaimed
+    if (m_superblock.tail == m_superblock.head) {
+      LOG("%s:%d | The record doesn't fit into the log.\n", __FILE__, __LINE__);
+      return false;
+    }
+    if (!ReclaimOldest()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+LogStore::ReadSectors(const uint64_t position, const std::span<uint8_t> data)
+{
+  // the range is split where it wraps around the end of the device
+  const uint64_t start = position % m_data_sectors;
+  const std::size_t first_size =
+    std::min<uint64_t>(data.size(), (m_data_sectors - start) * SD_SECTOR_SIZE);
+
+  return m_device->Read(k_superblock_count + start, data.first(first_size)) &&
+         (first_size == data.size() ||
+          m_device->Read(k_superblock_count, data.subspan(first_size)));
+}
+
+bool
+LogStore::WriteSectors(const uint64_t position, const std::span<const uint8_t> data)
+{
+  const uint64_t start = position % m_data_sectors;
+  const std::size_t first_size =
+    std::min<uint64_t>(data.size(), (m_data_sectors - start) * SD_SECTOR_SIZE);
+
+  return m_device->Write(k_superblock_count + start, data.first(first_size)) &&
+         (first_size == data.size() ||
+          m_device->Write(k_superblock_count, data.subspan(first_size)));
+}
+
+std::optional<LogRecordHeader>
+LogStore::ReadHeader(const uint64_t position)
+{
+  if (!ReadSectors(position, m_sector)) {
+    return std::nullopt;
+  }
+
+  const LogRecordHeader k_reference;
+  LogRecordHeader header;
+  std::memcpy(&header, m_sector.data(), sizeof(header));
+  const bool is_valid =
+    std::memcmp(header.magic, k_reference.magic, sizeof(header.magic)) == 0 &&
+    header.checksum == sd::CalculateChecksum(header) && header.position == position &&
+    GetRecordSectors(header) <= m_data_sectors;
+
+  return is_valid ? std::optional(header) : std::nullopt;
+}
+
+bool
+LogStore::WriteHeader(LogRecordHeader& header)
+{
+  header.checksum = sd::CalculateChecksum(header);
+
+  m_sector.fill(0);
+  std::memcpy(m_sector.data(), &header, sizeof(header));
+  if (!WriteSectors(header.position, m_sector)) {
+    LOG("%s:%d | Unable to write the header of the record at %llu.\n",
+        __FILE__,
+        __LINE__,
+        header.position);
+    return false;
+  }
+
+  return true;
+}
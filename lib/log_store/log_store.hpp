@@ -0,0 +1,161 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "block_device.hpp"
+#include "recording_index.hpp"
+#include "settings.hpp"
+
+/// @brief Bounds of the log, stored in turns into the device's first two sectors, so a torn
+/// write leaves the other copy intact
+struct LogSuperblock
+{
+  char magic[4] = { 'L', 'O', 'G', 'S' };
+  uint32_t version = 1;
+  // incremented with every store, the valid copy with the higher sequence is the current one
+  uint32_t sequence = 0;
+  // header of the oldest record. Log positions are counted in sectors since the log was
+  // formatted, they only grow, & wrap around the device's data sectors
+  uint64_t tail = 0;
+  // where the next record starts
+  uint64_t head = 0;
+  // CRC-32 of the fields above
+  uint32_t checksum = 0;
+} __attribute__((packed));
+
+enum class LogRecordState : uint8_t
+{
+  // being written, its `data_bytes` hold the committed data
+  Open,
+  // waiting to be uploaded
+  Finished,
+  Uploaded,
+};
+
+/// @brief First sector of a record, followed by the record's 16-bit PCM data in whole sectors
+struct LogRecordHeader
+{
+  char magic[4] = { 'L', 'R', 'E', 'C' };
+  // log position of the header, which tells a record from a stale one of an earlier lap
+  uint64_t position = 0;
+  // named like the files of the FAT store, by the time & the segment number
+  uint32_t timestamp = 0;
+  uint32_t data_bytes = 0;
+  uint16_t segment = 0;
+  LogRecordState state = LogRecordState::Open;
+  uint8_t reserved = 0;
+  // CRC-32 of the fields above
+  uint32_t checksum = 0;
+} __attribute__((packed));
+
+/// @brief Position of an enumeration of the log's records
+struct LogCursor
+{
+  uint64_t position = 0;
+};
+
+/// @brief Stores recordings as records of an append-only log, which wraps around a block device.
+/// Records are appended at the head & reclaimed at the tail, oldest first, by reading a single
+/// header. Besides the data, a recording costs a header write per commit, & a superblock write
+/// when it's finished, so there is no file system metadata to update while recording.
+/// Records are read back as .wav streams for the upload. Only one record can be open at a time
+class LogStore
+{
+public:
+  /// @brief Loads the superblock of `device`, or formats the device if it holds no log, and
+  /// adopts the record which was open when the device was last used, if it holds committed data.
+  /// A device whose superblocks can't be read, or are damaged, is not formatted
+  /// @return `true` if successful, `false` otherwise
+  bool Mount(BlockDevice& device);
+  void Unmount();
+
+  bool IsMounted() const { return m_device != nullptr; }
+
+  /// @brief Starts a record at the head, reclaiming the oldest records as needed
+  /// @return the record's position, or nothing if it can't be started
+  std::optional<uint64_t> BeginRecord();
+  /// @brief Appends whole sectors of data to the open record, reclaiming the oldest records
+  /// as needed
+  bool Append(const std::span<const uint8_t> sectors);
+  /// @brief Stores in the open record's header that its first `data_bytes` have been written,
+  /// so they survive a power loss
+  bool CommitRecord(const uint32_t data_bytes);
+  /// @brief Closes the open record with `data_bytes` of data & moves the head past it.
+  /// A record without data is dropped
+  bool FinishRecord(const uint32_t data_bytes);
+
+  /// @brief Names the finished record at `position` after `timestamp` & `segment`
+  bool NameRecord(const uint64_t position, const uint32_t timestamp, const uint16_t segment);
+  bool MarkUploaded(const uint64_t position);
+
+  /// @brief Returns the next record waiting to be uploaded, and advances `cursor` past it
+  std::optional<LogRecordHeader> GetNextRecord(LogCursor& cursor);
+
+  /// @brief Reads the .wav stream of `record`, a generated header sector followed by the data,
+  /// from `offset`, which must be a multiple of `SD_SECTOR_SIZE`
+  /// @param data buffer of whole sectors
+  /// @return amount of bytes read, 0 at the end of the stream or if the record has been reclaimed
+  std::size_t ReadWav(const LogRecordHeader& record,
+                      const std::size_t offset,
+                      const std::span<uint8_t> data);
+
+  /// @brief Returns the name which the .wav stream of `record` is uploaded under
+  static sd::RecordingName GetFileName(const LogRecordHeader& record);
+
+  static uint64_t GetRecordSectors(const LogRecordHeader& record)
+  {
+    return 1 + (record.data_bytes + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+  }
+
+private:
+  enum class SuperblockState
+  {
+    // the current superblock has been loaded
+    Loaded,
+    // both sectors have been read, & neither holds a superblock
+    Missing,
+    // a sector can't be read, or the superblocks are damaged
+    Unusable,
+  };
+
+  SuperblockState LoadSuperblock();
+  bool StoreSuperblock();
+  /// @brief Starts an empty log
+  bool Format();
+  /// @brief Adopts the record at the head, which has been left open by a power loss or a reset
+  bool RecoverOpenRecord();
+
+  /// @brief Moves the tail past the oldest record
+  bool ReclaimOldest();
+  /// @brief Reclaims the oldest records until the log can grow up to `end`
+  bool Reserve(const uint64_t end);
+
+  bool ReadSectors(const uint64_t position, const std::span<uint8_t> data);
+  bool WriteSectors(const uint64_t position, const std::span<const uint8_t> data);
+  /// @brief Reads the header of the record at `position`
+  /// @return the header, or nothing if there is no valid record at `position`
+  std::optional<LogRecordHeader> ReadHeader(const uint64_t position);
+  bool WriteHeader(LogRecordHeader& header);
+
+private:
+  BlockDevice* m_device = nullptr;
+  // sectors of the device after the superblocks
+  uint64_t m_data_sectors = 0;
+  LogSuperblock m_superblock;
+
+  std::optional<LogRecordHeader> m_open_record;
+  // end of the open record's data
+  uint64_t m_write_position = 0;
+
+  // the recorder's storage task appends while the upload reads
+  SemaphoreHandle_t m_mutex = nullptr;
+  // superblocks & headers are read & written through this sector
+  std::array<uint8_t, SD_SECTOR_SIZE> m_sector;
+};
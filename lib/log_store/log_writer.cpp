@@ -0,0 +1,146 @@
+#include "log_writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#include <Arduino.h>
+
+#include "esp_timer.h"
+
+#include "settings.hpp"
+
+#if DEBUG_WAV
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+static_assert(LOG_STORE_WRITE_BUFFER_BYTES % SD_SECTOR_SIZE == 0,
+              "The log is appended in whole sectors");
+
+// Write buffer of the open record
+static std::array<uint8_t, LOG_STORE_WRITE_BUFFER_BYTES> s_log_write_buffer;
+static bool s_is_log_write_buffer_used = false;
+
+bool
+LogWriter::Open(LogStore& store, const std::size_t header_commit_interval)
+{
+  if (s_is_log_write_buffer_used) {
+    LOG("%s:%d | Another record is already open.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  const std::optional<uint64_t> position = store.BeginRecord();
+  if (!position) {
+    LOG("%s:%d | Unable to begin a record.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  s_is_log_write_buffer_used = true;
+  m_store = &store;
+  m_record_position = *position;
+  m_buffer = s_log_write_buffer.data();
+  m_buffer_size = 0;
+  m_flushed_size = 0;
+  m_header_commit_interval = header_commit_interval;
+  m_committed_size = 0;
+  m_stats = ClusterWriterStats{};
+
+  return true;
+}
+
+void
+LogWriter::WriteSamples(const std::span<const int16_t> samples)
+{
+  if (m_store == nullptr) {
+    return;
+  }
+
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(samples.data());
+  std::size_t size = samples.size_bytes();
+
+  while (size != 0) {
+    const std::size_t to_copy = std::min(size, s_log_write_buffer.size() - m_buffer_size);
+    std::copy_n(bytes, to_copy, m_buffer + m_buffer_size);
+    m_buffer_size += to_copy;
+    bytes += to_copy;
+    size -= to_copy;
+
+    if (m_buffer_size == s_log_write_buffer.size()) {
+      Flush();
+    }
+  }
+
+  if (m_header_commit_interval != 0 &&
+      m_flushed_size - m_committed_size >= m_header_commit_interval) {
+    if (m_store->CommitRecord(m_flushed_size)) {
+      ++m_stats.header_commits;
+    } else {
+      ++m_stats.write_errors;
+    }
+    m_committed_size = m_flushed_size;
+  }
+}
+
+bool
+LogWriter::Close()
+{
+  if (m_store == nullptr) {
+    return true;
+  }
+
+  // the last sector is padded with silence, which the record's size leaves out
+  const std::size_t data_size = m_flushed_size + m_buffer_size;
+  const std::size_t padded_size =
+    (m_buffer_size + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE * SD_SECTOR_SIZE;
+  std::fill(m_buffer + m_buffer_size, m_buffer + padded_size, 0);
+  m_buffer_size = padded_size;
+  const bool is_flushed = Flush();
+
+  LOG("Finished record size: %u, appends: %u, worst append: %lu us, header commits: %u, "
+      "write errors: %u\n",
+      data_size,
+      m_stats.flush_count,
+      m_stats.worst_flush_latency_us,
+      m_stats.header_commits,
+      m_stats.write_errors);
+
+  // a failed append has dropped its data, so the record ends with the data which has been written
+  const bool is_finished = m_store->FinishRecord(is_flushed ? data_size : m_flushed_size);
+
+  m_store = nullptr;
+  m_buffer = nullptr;
+  s_is_log_write_buffer_used = false;
+
+  return is_flushed && is_finished;
+}
+
+bool
+LogWriter::Flush()
+{
+  if (m_buffer_size == 0) {
+    return true;
+  }
+
+  const int64_t flush_start_us = esp_timer_get_time();
+  const bool is_written = m_store->Append(std::span(m_buffer, m_buffer_size));
+  const uint32_t flush_latency_us = static_cast<uint32_t>(esp_timer_get_time() - flush_start_us);
+
+  ++m_stats.flush_count;
+  m_stats.flush_time_us += flush_latency_us;
+  m_stats.worst_flush_latency_us = std::max(m_stats.worst_flush_latency_us, flush_latency_us);
+  const std::size_t bucket = std::min<std::size_t>(std::bit_width(flush_latency_us / 1'000),
+                                                   m_stats.flush_latency_histogram.size() - 1);
+  ++m_stats.flush_latency_histogram[bucket];
+
+  if (is_written) {
+    m_flushed_size += m_buffer_size;
+  } else {
+    LOG("%s:%d | Error appending %u bytes to the record.\n", __FILE__, __LINE__, m_buffer_size);
+    ++m_stats.write_errors;
+  }
+  m_buffer_size = 0;
+
+  return is_written;
+}
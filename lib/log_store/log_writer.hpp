@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "audio_writer.hpp"
+#include "log_store.hpp"
+#include "wav_header.hpp"
+#include "wav_writer.hpp"
+
+/// @brief Writes a recording as 16-bit PCM into a record of a `LogStore`, which is read back as
+/// a .wav stream. Samples are collected in a statically allocated buffer of whole sectors.
+/// The log keeps audio only, so the comment & the gain log are ignored.
+/// Only one record can be open at a time
+class LogWriter final : public AudioWriter
+{
+public:
+  ~LogWriter() override { Close(); }
+
+  /// @brief Begins a record in `store`
+  /// @param header_commit_interval the record's header is updated whenever this many bytes of
+  /// audio have been written since the last commit, 0 disables it
+  /// @return `true` if successful, `false` otherwise
+  bool Open(LogStore& store, const std::size_t header_commit_interval);
+
+  void WriteSamples(const std::span<const int16_t> samples) override;
+
+  void SetComment(const std::string_view) override {}
+  void SetGainLog(const std::span<const wav_gain_entry_t>) override {}
+
+  /// @brief Appends the buffered samples, padded to a whole sector, & finishes the record
+  bool Close() override;
+
+  /// @brief Returns the size of the record's .wav stream, including buffered data
+  std::size_t GetFileSize() const override
+  {
+    return sizeof(wav_header_t) + m_flushed_size + m_buffer_size;
+  }
+
+  /// @brief Returns the position of the record in the log, which names it once it's finished
+  uint64_t GetRecordPosition() const { return m_record_position; }
+
+  /// @brief Returns the stats of the appends, in the form of a .wav writer's
+  WavWriterStats GetStats() const
+  {
+    return WavWriterStats{ .file = m_stats, .encoding_cycles = 0, .encoded_samples = 0 };
+  }
+
+private:
+  /// @brief Appends the buffered whole sectors to the record
+  bool Flush();
+
+private:
+  LogStore* m_store = nullptr;
+  uint64_t m_record_position = 0;
+
+  // points to the static write buffer while the record is open
+  uint8_t* m_buffer = nullptr;
+  std::size_t m_buffer_size = 0;
+  // bytes of audio appended to the record so far
+  std::size_t m_flushed_size = 0;
+
+  std::size_t m_header_commit_interval = 0;
+  // audio bytes at the last header commit
+  std::size_t m_committed_size = 0;
+
+  ClusterWriterStats m_stats;
+};
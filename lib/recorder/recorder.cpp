@@ -0,0 +1,433 @@
+#include "recorder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+#include <Arduino.h>
+
+#include "esp_timer.h"
+
+#include "settings.hpp"
+
+#if DEBUG_REC
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+// how long the storage task sleeps if it was not signalled about new samples
+constexpr TickType_t k_storage_wait_ticks = pdMS_TO_TICKS(100);
+// how long the tasks are waited for to start or finish
+constexpr TickType_t k_task_wait_ticks = pdMS_TO_TICKS(SLEEP_TIMEOUT_MS);
+
+/// @brief Creates a binary semaphore once
+static bool
+EnsureSemaphore(SemaphoreHandle_t& semaphore)
+{
+  if (semaphore == nullptr) {
+    semaphore = xSemaphoreCreateBinary();
+  }
+
+  return semaphore != nullptr;
+}
+
+bool
+Recorder::StartCapture(I2sSampler& sampler, const std::size_t preroll_samples)
+{
+  if (m_is_capturing) {
+    LOG("Capture is already started.\n");
+    return true;
+  }
+
+  if (!EnsureSemaphore(m_capture_finished_semaphore) ||
+      !EnsureSemaphore(m_storage_finished_semaphore) ||
+      !EnsureSemaphore(m_storage_attached_semaphore) ||
+      !EnsureSemaphore(m_new_samples_semaphore)) {
+    LOG("%s:%d | Unable to create the recorder semaphores.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  m_sampler = &sampler;
+  m_preroll_samples = std::min(preroll_samples, m_ring_buffer.Capacity() - m_read_buffer.size());
+  m_ring_buffer.Reset();
+  m_gain_log_size = 0;
+  m_is_attach_requested = false;
+  m_is_storage_attached = false;
+  m_is_capturing = true;
+
+  const BaseType_t rtos_result =
+    xTaskCreate(CaptureTaskExecutor, "Rec_Capture", 4096, this, CAPTURE_TASK_PRIORITY, nullptr);
+  if (rtos_result != pdPASS) {
+    LOG("%s:%d | Unable to create the capture task.\n", __FILE__, __LINE__);
+    m_is_capturing = false;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+Recorder::StopCapture()
+{
+  if (!m_is_capturing) {
+    LOG("Capture is not started. Skipping stopping...\n");
+    return true;
+  }
+
+  if (m_is_recording) {
+    LOG("%s:%d | Recording has to be stopped before the capture.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  m_is_capturing = false;
+
+  if (xSemaphoreTake(m_capture_finished_semaphore, k_task_wait_ticks) != pdTRUE) {
+    LOG("%s:%d | Timed out waiting for the capture task.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  return true;
+}
+
+bool
+Recorder::StartRecording(AudioWriter& writer, const RecordingSegmentation& segmentation)
+{
+  if (!m_is_capturing) {
+    LOG("%s:%d | Capture has to be started before recording.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  if (m_is_recording) {
+    LOG("Recording is already started.\n");
+    return true;
+  }
+
+  if ((segmentation.max_samples != 0 || segmentation.max_bytes != 0) &&
+      segmentation.handler == nullptr) {
+    LOG("%s:%d | Segmented recording requires a segment handler.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  m_writer = &writer;
+  m_segmentation = segmentation;
+  m_segment_samples = 0;
+  m_finished_segments = 0;
+  m_written_samples = 0;
+  m_first_write_time_us = 0;
+  m_is_recording = true;
+
+  // segment handlers close, rename & open files on the storage task's stack
+  const BaseType_t rtos_result =
+    xTaskCreate(StorageTaskExecutor, "Rec_Storage", 6144, this, STORAGE_TASK_PRIORITY, nullptr);
+  if (rtos_result != pdPASS) {
+    LOG("%s:%d | Unable to create the storage task.\n", __FILE__, __LINE__);
+    m_is_recording = false;
+    return false;
+  }
+
+  // hand the consumer side of the buffer over from the capture task to the storage task
+  m_is_attach_requested = true;
+
+  return true;
+}
+
+bool
+Recorder::StopRecording()
+{
+  if (!m_is_recording) {
+    LOG("Recording is not started. Skipping stopping...\n");
+    return true;
+  }
+
+  // everything captured up to this point belongs to the recording
+  m_end_position = m_ring_buffer.GetWritePosition();
+  m_is_recording = false;
+  xSemaphoreGive(m_new_samples_semaphore);
+
+  // a stalled card keeps the storage task in the writer, which must not be closed before it
+  // has returned, so it's waited for as long as it takes
+  if (xSemaphoreTake(m_storage_finished_semaphore, k_task_wait_ticks) != pdTRUE) {
+    LOG("%s:%d | The storage task is still writing, waiting for it...\n", __FILE__, __LINE__);
+    xSemaphoreTake(m_storage_finished_semaphore, portMAX_DELAY);
+  }
+
+  // the capture task only appends to the gain log until the buffer is handed back
+  StoreSegmentMetadata(m_end_position);
+
+  // the storage task has finished, so the capture task can consume the buffer again
+  m_is_storage_attached = false;
+
+  const RecorderStats stats = GetStats();
+  LOG("Recording stopped. Written samples: %u | high-water mark: %u/%u | overrun: %u\n",
+      stats.written_samples,
+      stats.high_water_mark,
+      m_ring_buffer.Capacity(),
+      stats.overrun_samples);
+  if (stats.finished_segments != 0) {
+    LOG("Segments: %u\n", stats.finished_segments + 1);
+  }
+  LOG("I2S frames captured: %lu | lost: %lu | short reads: %lu | worst read: %lu us\n",
+      stats.sampler.frames_captured,
+      stats.sampler.frames_lost,
+      stats.sampler.short_reads,
+      stats.sampler.worst_read_latency_us);
+  LOG("Gain changes: %u\n", stats.gain_changes);
+  LOG("Conditioning: %llu cycles per 100 samples\n",
+      stats.sampler.conditioning_cycles * 100 /
+        std::max<uint32_t>(stats.sampler.frames_captured, 1));
+
+  return true;
+}
+
+void
+Recorder::StoreSegmentMetadata(const std::size_t end_position)
+{
+  if (m_writer == nullptr) {
+    return;
+  }
+
+  CopyRecordedGainLog(m_segment_start_position, end_position);
+  m_writer->SetGainLog(
+    std::span<const wav_gain_entry_t>(m_recorded_gain_log.data(), m_recorded_gain_log_size));
+
+  // keep the statistics in the file, so bad recordings can be found without listening to them.
+  // Segments get the statistics of the recording so far
+  const RecorderStats stats = GetStats();
+  std::array<char, 128> comment;
+  const int comment_length =
+    std::snprintf(comment.data(),
+                  comment.size(),
+                  "frames_captured=%lu;frames_lost=%lu;short_reads=%lu;worst_read_us=%lu;"
+                  "buffer_overrun=%u;buffer_hwm=%u",
+                  stats.sampler.frames_captured,
+                  stats.sampler.frames_lost,
+                  stats.sampler.short_reads,
+                  stats.sampler.worst_read_latency_us,
+                  stats.overrun_samples,
+                  stats.high_water_mark);
+  if (comment_length > 0) {
+    m_writer->SetComment(std::string_view(
+      comment.data(), std::min(static_cast<std::size_t>(comment_length), comment.size() - 1)));
+  }
+}
+
+RecorderStats
+Recorder::GetStats() const
+{
+  return RecorderStats{ .high_water_mark = m_ring_buffer.GetHighWaterMark(),
+                        .overrun_samples = m_ring_buffer.GetOverrunCount(),
+                        .written_samples = m_written_samples,
+                        .finished_segments = m_finished_segments,
+                        .gain_changes = m_recorded_gain_log_size,
+                        .first_write_time_us = m_first_write_time_us,
+                        .sampler = m_sampler->GetStats() };
+}
+
+void
+Recorder::CaptureTaskExecutor(void* args)
+{
+  reinterpret_cast<Recorder*>(args)->CaptureLoop();
+  vTaskDelete(nullptr);
+}
+
+void
+Recorder::StorageTaskExecutor(void* args)
+{
+  reinterpret_cast<Recorder*>(args)->StorageLoop();
+  vTaskDelete(nullptr);
+}
+
+void
+Recorder::CaptureLoop()
+{
+  while (m_is_capturing) {
+    const std::span<int16_t> samples = m_sampler->ReadSamples(m_read_buffer);
+    const std::size_t block_position = m_ring_buffer.GetWritePosition();
+    m_ring_buffer.Push(samples);
+
+    if (!samples.empty()) {
+      LogGainShift(block_position, m_sampler->GetGainShift());
+    }
+
+    if (m_is_attach_requested) {
+      // a new recording starts, its statistics are counted from here
+      m_is_attach_requested = false;
+      m_ring_buffer.ResetStats();
+      m_sampler->ResetStats();
+      m_start_position = m_ring_buffer.GetReadPosition();
+
+      m_is_storage_attached = true;
+      xSemaphoreGive(m_storage_attached_semaphore);
+    }
+
+    if (m_is_storage_attached) {
+      xSemaphoreGive(m_new_samples_semaphore);
+    } else {
+      // nothing is recorded, keep only the pre-roll
+      const std::size_t buffered = m_ring_buffer.Size();
+      if (buffered > m_preroll_samples) {
+        m_ring_buffer.Consume(buffered - m_preroll_samples);
+      }
+      TrimGainLog();
+    }
+  }
+
+  xSemaphoreGive(m_capture_finished_semaphore);
+}
+
+void
+Recorder::StorageLoop()
+{
+  // wait until the capture task stops consuming the buffer
+  if (xSemaphoreTake(m_storage_attached_semaphore, k_task_wait_ticks) != pdTRUE) {
+    LOG("%s:%d | Capture task has not handed the buffer over.\n", __FILE__, __LINE__);
+    xSemaphoreGive(m_storage_finished_semaphore);
+    return;
+  }
+  m_segment_start_position = m_start_position;
+
+  while (m_is_recording) {
+    DrainBuffer(SIZE_MAX);
+    xSemaphoreTake(m_new_samples_semaphore, k_storage_wait_ticks);
+  }
+
+  DrainBuffer(m_end_position);
+
+  xSemaphoreGive(m_storage_finished_semaphore);
+}
+
+void
+Recorder::DrainBuffer(const std::size_t end_position)
+{
+  while (true) {
+    const std::size_t to_end = end_position - m_ring_buffer.GetReadPosition();
+    const std::span<const int16_t> samples = m_ring_buffer.Peek();
+    std::size_t to_write = std::min(samples.size(), to_end);
+    if (to_write == 0) {
+      break;
+    }
+
+    // a new segment is started only once there's a sample for it, so none of them is empty
+    if (IsSegmentComplete()) {
+      StartNextSegment();
+    }
+    if (m_segmentation.max_samples != 0 && m_writer != nullptr) {
+      to_write = std::min(to_write, m_segmentation.max_samples - m_segment_samples);
+    }
+
+    if (m_writer != nullptr) {
+      m_writer->WriteSamples(samples.first(to_write));
+    }
+    if (m_written_samples == 0) {
+      m_first_write_time_us = esp_timer_get_time();
+    }
+    m_ring_buffer.Consume(to_write);
+    m_written_samples += to_write;
+    m_segment_samples += to_write;
+  }
+}
+
+bool
+Recorder::IsSegmentComplete() const
+{
+  if (m_writer == nullptr) {
+    return false;
+  }
+
+  return (m_segmentation.max_samples != 0 && m_segment_samples >= m_segmentation.max_samples) ||
+         (m_segmentation.max_bytes != 0 && m_writer->GetFileSize() >= m_segmentation.max_bytes);
+}
+
+void
+Recorder::StartNextSegment()
+{
+  const std::size_t segment_end = m_ring_buffer.GetReadPosition();
+  StoreSegmentMetadata(segment_end);
+
+  if (!m_segmentation.handler(*m_writer, m_segmentation.arg)) {
+    LOG("%s:%d | Unable to start segment %u, the rest of the recording is dropped.\n",
+        __FILE__,
+        __LINE__,
+        m_finished_segments + 2);
+    m_writer = nullptr;
+  }
+
+  ++m_finished_segments;
+  m_segment_start_position = segment_end;
+  m_segment_samples = 0;
+}
+
+void
+Recorder::LogGainShift(const std::size_t block_position, const uint8_t gain_shift)
+{
+  const std::size_t size = m_gain_log_size.load(std::memory_order_relaxed);
+  if (size != 0 && m_gain_log[size - 1].gain_shift == gain_shift) {
+    return;
+  }
+
+  if (size == m_gain_log.size()) {
+    // can not happen, the gain is frozen while the log is full
+    return;
+  }
+
+  m_gain_log[size] = wav_gain_entry_t{ .sample_offset = static_cast<uint32_t>(block_position),
+                                       .gain_shift = gain_shift,
+                                       .reserved = {} };
+  m_gain_log_size.store(size + 1, std::memory_order_release);
+
+  // every further change would be lost, so the gain must not change anymore
+  if (size + 1 == m_gain_log.size()) {
+    m_sampler->SetAgcEnabled(false);
+  }
+}
+
+void
+Recorder::TrimGainLog()
+{
+  const std::size_t read_position = m_ring_buffer.GetReadPosition();
+  const std::size_t size = m_gain_log_size.load(std::memory_order_relaxed);
+
+  // keep the entry which applies to the oldest buffered sample, and all after it
+  std::size_t to_remove = 0;
+  while (to_remove + 1 < size && m_gain_log[to_remove + 1].sample_offset <= read_position) {
+    ++to_remove;
+  }
+
+  if (to_remove == 0) {
+    return;
+  }
+
+  std::copy(m_gain_log.begin() + to_remove, m_gain_log.begin() + size, m_gain_log.begin());
+  m_gain_log_size.store(size - to_remove, std::memory_order_release);
+
+  m_sampler->SetAgcEnabled(AGC_ENABLED);
+}
+
+void
+Recorder::CopyRecordedGainLog(const std::size_t start_position, const std::size_t end_position)
+{
+  const std::size_t size = m_gain_log_size.load(std::memory_order_acquire);
+  m_recorded_gain_log_size = 0;
+
+  for (std::size_t i = 0; i < size; ++i) {
+    const wav_gain_entry_t& entry = m_gain_log[i];
+    if (entry.sample_offset >= end_position) {
+      break;
+    }
+
+    // the entry in effect at the first sample may be older than the recording itself
+    const uint32_t sample_offset = entry.sample_offset > start_position
+                                     ? static_cast<uint32_t>(entry.sample_offset - start_position)
+                                     : 0;
+
+    // only the last entry before the first sample applies to it
+    if (sample_offset == 0 && m_recorded_gain_log_size != 0 &&
+        m_recorded_gain_log[m_recorded_gain_log_size - 1].sample_offset == 0) {
+      --m_recorded_gain_log_size;
+    }
+
+    m_recorded_gain_log[m_recorded_gain_log_size++] = wav_gain_entry_t{
+      .sample_offset = sample_offset, .gain_shift = entry.gain_shift, .reserved = {}
+    };
+  }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "audio_writer.hpp"
+#include "i2s_sampler.hpp"
+#include "ring_buffer.hpp"
+#include "settings.hpp"
+
+struct RecorderStats
+{
+  // maximum amount of samples waiting in the capture buffer at once
+  std::size_t high_water_mark;
+  // amount of samples dropped because the capture buffer was full
+  std::size_t overrun_samples;
+  std::size_t written_samples;
+  // amount of finished segments, the last segment is not counted
+  std::size_t finished_segments;
+  // amount of entries in the gain log of the recording, or of its last segment
+  std::size_t gain_changes;
+  // system time when the storage task has handed the first samples to the writer, 0 if not yet
+  int64_t first_write_time_us;
+  I2sSamplerStats sampler;
+};
+
+/// @brief Called by the storage task when a segment of a recording is complete. Must close the
+/// file of `writer`, & open it again for the next segment
+/// @return `true` if the next segment can be written, `false` otherwise
+typedef bool (*RecordingSegmentHandler_t)(AudioWriter& writer, void* arg);
+
+/// @brief Splits a recording into segments. A segment ends once it holds `max_samples`,
+/// or once its file has reached `max_bytes`, whichever comes first. 0 disables either limit
+struct RecordingSegmentation
+{
+  std::size_t max_samples = 0;
+  std::size_t max_bytes = 0;
+  RecordingSegmentHandler_t handler = nullptr;
+  void* arg = nullptr;
+};
+
+/// @brief Records audio with two tasks joined by a lock-free ring buffer:
+/// a high-priority capture task which only reads the I2S sampler, and a storage task which drains
+/// the buffer into a recording file, so SD card stalls do not block the I2S reads.
+///
+/// The capture can run without a recording. In this case the capture task itself keeps only the
+/// last `preroll_samples` in the buffer, which are then written at the start of the next recording.
+class Recorder
+{
+public:
+  /// @brief Starts the capture task. `sampler` must be initialized & stay valid until
+  /// `StopCapture()` returns
+  /// @param preroll_samples amount of samples kept in the buffer while nothing is recorded
+  /// @return `true` if the capture task has been started, `false` otherwise
+  bool StartCapture(I2sSampler& sampler, const std::size_t preroll_samples);
+
+  /// @brief Stops the capture task. A started recording must be stopped beforehand
+  /// @return `true` if the capture task has finished, `false` otherwise
+  bool StopCapture();
+
+  bool IsCapturing() const { return m_is_capturing; }
+
+  /// @brief Starts the storage task, which writes the pre-roll & all newly captured samples
+  /// into `writer`. The capture must be started, and `writer` must stay valid until
+  /// `StopRecording()` returns
+  /// @param segmentation optionally splits the recording into segments. Segments follow each
+  /// other without a gap, the last sample of one segment directly precedes the first of the next
+  /// @return `true` if the storage task has been started, `false` otherwise
+  bool StartRecording(AudioWriter& writer, const RecordingSegmentation& segmentation = {});
+
+  /// @brief Ends the recording at the last captured sample, and waits for the storage task to
+  /// write all samples up to it. Samples captured after it are kept as the next pre-roll.
+  /// Capture statistics are stored as a comment in the recording file, or in its last segment.
+  /// The storage task is waited for without a deadline, as it uses the writer until it has
+  /// finished, so the writer can be closed & destroyed once this returns
+  /// @return `true` once the storage task has finished
+  bool StopRecording();
+
+  RecorderStats GetStats() const;
+
+private:
+  static void CaptureTaskExecutor(void* args);
+  static void StorageTaskExecutor(void* args);
+
+  void CaptureLoop();
+  void StorageLoop();
+
+  /// @brief Writes buffered samples into the file, but not past `end_position`
+  void DrainBuffer(const std::size_t end_position);
+  /// @brief Returns `true` if the current segment has reached one of its limits
+  bool IsSegmentComplete() const;
+  /// @brief Hands the finished segment over to the segment handler, which starts the next one
+  void StartNextSegment();
+  /// @brief Stores the gain log & the capture statistics of the current segment in the file
+  void StoreSegmentMetadata(const std::size_t end_position);
+
+  /// @brief Logs the gain shift of a block starting at the buffer position `block_position`,
+  /// if it differs from the previous one. Freezes the automatic gain once the log is full
+  void LogGainShift(const std::size_t block_position, const uint8_t gain_shift);
+  /// @brief Drops log entries which are no longer needed for the samples kept in the buffer
+  void TrimGainLog();
+  /// @brief Copies gain log entries which belong to the samples between the buffer positions
+  /// `start_position` & `end_position`, with offsets relative to the first of them
+  void CopyRecordedGainLog(const std::size_t start_position, const std::size_t end_position);
+
+private:
+  SpscRingBuffer<int16_t, CAPTURE_BUFFER_SAMPLES> m_ring_buffer;
+  std::array<int32_t, MIC_READ_CHUNK_SAMPLES> m_read_buffer;
+
+  I2sSampler* m_sampler = nullptr;
+  // set to `nullptr` if the next segment's file could not be opened, the rest is dropped
+  AudioWriter* m_writer = nullptr;
+  RecordingSegmentation m_segmentation;
+  // buffer position of the current segment's first sample, & the samples written into it
+  std::size_t m_segment_start_position = 0;
+  std::size_t m_segment_samples = 0;
+  std::size_t m_finished_segments = 0;
+  std::size_t m_preroll_samples = 0;
+
+  SemaphoreHandle_t m_capture_finished_semaphore = nullptr;
+  SemaphoreHandle_t m_storage_finished_semaphore = nullptr;
+  SemaphoreHandle_t m_storage_attached_semaphore = nullptr;
+  // given by the capture task whenever new samples are pushed into the buffer
+  SemaphoreHandle_t m_new_samples_semaphore = nullptr;
+
+  std::atomic<bool> m_is_capturing = false;
+  std::atomic<bool> m_is_recording = false;
+  // set by the storage task to request ownership of the buffer's consumer side
+  std::atomic<bool> m_is_attach_requested = false;
+  // while set, the storage task is the consumer of the buffer, otherwise the capture task is
+  std::atomic<bool> m_is_storage_attached = false;
+  // write position of the last recorded sample, valid once `m_is_recording` is cleared
+  std::atomic<std::size_t> m_end_position = 0;
+  std::size_t m_written_samples = 0;
+  std::atomic<int64_t> m_first_write_time_us = 0;
+  // buffer position of the recording's first sample
+  std::size_t m_start_position = 0;
+
+  // gain changes with absolute buffer positions, written only by the capture task
+  std::array<wav_gain_entry_t, AGC_GAIN_LOG_SIZE> m_gain_log;
+  std::atomic<std::size_t> m_gain_log_size = 0;
+  // gain changes of the last recording or segment, with offsets relative to its first sample
+  std::array<wav_gain_entry_t, AGC_GAIN_LOG_SIZE> m_recorded_gain_log;
+  std::size_t m_recorded_gain_log_size = 0;
+};
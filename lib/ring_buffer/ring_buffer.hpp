@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <span>
+
+/// @brief Lock-free single-producer/single-consumer ring buffer.
+/// `Push()` must only be called from one task and `Peek()`/`Consume()` from another one.
+/// Indices are free-running, and wrapped with a mask, so `N` has to be a power of two.
+template<class T, std::size_t N>
+class SpscRingBuffer
+{
+  static_assert(std::has_single_bit(N), "Ring buffer capacity must be a power of two");
+
+public:
+  /// @brief Copies as many `items` as there is free space for.
+  /// Items which do not fit are dropped and counted as overrun.
+  /// @return amount of items which have been pushed
+  std::size_t Push(const std::span<const T> items)
+  {
+    const std::size_t head = m_head.load(std::memory_order_relaxed);
+    const std::size_t tail = m_tail.load(std::memory_order_acquire);
+
+    const std::size_t to_push = std::min(items.size(), N - (head - tail));
+    const std::size_t head_index = head & k_mask;
+    const std::size_t first_part = std::min(to_push, N - head_index);
+
+    std::copy_n(items.begin(), first_part, m_buffer.begin() + head_index);
+    std::copy_n(items.begin() + first_part, to_push - first_part, m_buffer.begin());
+
+    m_head.store(head + to_push, std::memory_order_release);
+
+    const std::size_t new_size = head + to_push - tail;
+    if (new_size > m_high_water_mark.load(std::memory_order_relaxed)) {
+      m_high_water_mark.store(new_size, std::memory_order_relaxed);
+    }
+
+    if (to_push != items.size()) {
+      m_overrun_count.fetch_add(items.size() - to_push, std::memory_order_relaxed);
+    }
+
+    return to_push;
+  }
+
+  /// @brief Returns the longest contiguous run of stored items, starting from the oldest one.
+  /// Remaining items (if the stored data wraps around) are returned after a `Consume()`
+  std::span<const T> Peek() const
+  {
+    const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+    const std::size_t head = m_head.load(std::memory_order_acquire);
+
+    const std::size_t tail_index = tail & k_mask;
+    const std::size_t count = std::min(head - tail, N - tail_index);
+
+    return std::span<const T>(m_buffer.data() + tail_index, count);
+  }
+
+  /// @brief Frees `count` oldest items, previously obtained with `Peek()`
+  void Consume(const std::size_t count)
+  {
+    m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  }
+
+  std::size_t Size() const
+  {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+  }
+
+  bool IsEmpty() const { return Size() == 0; }
+
+  /// @brief Total amount of items pushed since the last `Reset()`
+  std::size_t GetWritePosition() const { return m_head.load(std::memory_order_acquire); }
+  /// @brief Total amount of items consumed since the last `Reset()`
+  std::size_t GetReadPosition() const { return m_tail.load(std::memory_order_acquire); }
+
+  static constexpr std::size_t Capacity() { return N; }
+
+  /// @brief Maximum amount of items which have been stored at once since the last `Reset()`
+  std::size_t GetHighWaterMark() const { return m_high_water_mark.load(std::memory_order_relaxed); }
+
+  /// @brief Amount of items which have been dropped because the buffer was full
+  std::size_t GetOverrunCount() const { return m_overrun_count.load(std::memory_order_relaxed); }
+
+  /// @brief Empties the buffer and clears the counters.
+  /// Must not be called while the producer or the consumer is active
+  void Reset()
+  {
+    m_head.store(0, std::memory_order_relaxed);
+    m_tail.store(0, std::memory_order_relaxed);
+    ResetStats();
+  }
+
+  /// @brief Clears the counters, keeping the stored items. Must be called by the producer
+  void ResetStats()
+  {
+    m_high_water_mark.store(Size(), std::memory_order_relaxed);
+    m_overrun_count.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr std::size_t k_mask = N - 1;
+
+  std::array<T, N> m_buffer;
+
+  // written only by the producer
+  std::atomic<std::size_t> m_head = 0;
+  // written only by the consumer
+  std::atomic<std::size_t> m_tail = 0;
+
+  std::atomic<std::size_t> m_high_water_mark = 0;
+  std::atomic<std::size_t> m_overrun_count = 0;
+};
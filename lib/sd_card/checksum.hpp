@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_rom_crc.h"
+
+namespace sd {
+
+/// @brief Returns the CRC-32 of a struct which is stored as raw bytes, and whose last field is
+/// its `checksum`
+template<typename T>
+uint32_t
+CalculateChecksum(const T& value)
+{
+  static_assert(offsetof(T, checksum) + sizeof(value.checksum) == sizeof(T),
+                "The checksum must be the last field");
+  return esp_rom_crc32_le(
+    0, reinterpret_cast<const uint8_t*>(&value), sizeof(value) - sizeof(value.checksum));
+}
+
+} // namespace sd
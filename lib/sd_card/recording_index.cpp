@@ -0,0 +1,472 @@
+#include "recording_index.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "checksum.hpp"
+#include "sd_card.hpp"
+
+#if DEBUG_SD
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+namespace sd {
+
+namespace {
+
+struct RecordingIndexHeader
+{
+  char magic[4] = { 'R', 'I', 'D', 'X' };
+  // 3: the recordings are stored in day directories, older indexes are rebuilt, which moves
+  // the recordings there
+  uint16_t version = 3;
+  // set while the card is unmounted, so the entries & the free space match the card
+  uint8_t is_clean = 0;
+  // mounts since the free space was last synced with the file system
+  uint8_t unsynced_mount_count = 0;
+  uint32_t entry_count = 0;
+  // free space of the card when the index was closed, in KiB
+  uint32_t free_space_kib = 0;
+  // CRC-32 of the fields above
+  uint32_t checksum = 0;
+};
+static_assert(sizeof(RecordingIndexHeader) == 20, "The header is stored as raw bytes");
+
+std::string_view
+GetExtension(const RecordingFormat format)
+{
+  return format == RecordingFormat::Wav ? ".wav" : ".flac";
+}
+
+/// @brief Returns `true` if `name` is a directory of the layout, which has `length` digits
+bool
+IsDateDirectory(const std::string_view name, const std::size_t length)
+{
+  return name.size() == length &&
+         std::all_of(name.begin(), name.end(), [](const char c) { return c >= '0' && c <= '9'; });
+}
+
+/// @brief Parses a decimal number which makes up all of `text`
+template<typename T>
+bool
+ParseNumber(const std::string_view text, T& value)
+{
+  const std::from_chars_result result =
+    std::from_chars(text.data(), text.data() + text.size(), value);
+  return !text.empty() && result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+} // namespace
+
+std::optional<RecordingEntry>
+RecordingEntry::FromFileName(const std::string_view file_name)
+{
+  // "<device name>_<timestamp>[_<segment>].<extension>"
+  if (file_name.size() <= DEVICE_NAME.size() || !file_name.starts_with(DEVICE_NAME) ||
+      file_name[DEVICE_NAME.size()] != '_') {
+    return std::nullopt;
+  }
+
+  const std::size_t dot_index = file_name.find_last_of('.');
+  if (dot_index == std::string_view::npos) {
+    return std::nullopt;
+  }
+
+  RecordingEntry entry = {};
+  const std::string_view extension = file_name.substr(dot_index);
+  if (extension == GetExtension(RecordingFormat::Wav)) {
+    entry.format = RecordingFormat::Wav;
+  } else if (extension == GetExtension(RecordingFormat::Flac)) {
+    entry.format = RecordingFormat::Flac;
+  } else {
+    return std::nullopt;
+  }
+
+  std::string_view numbers =
+    file_name.substr(DEVICE_NAME.size() + 1, dot_index - DEVICE_NAME.size() - 1);
+  const std::size_t separator_index = numbers.find('_');
+  if (separator_index != std::string_view::npos) {
+    if (!ParseNumber(numbers.substr(separator_index + 1), entry.segment) || entry.segment == 0) {
+      return std::nullopt;
+    }
+    numbers = numbers.substr(0, separator_index);
+  }
+
+  if (!ParseNumber(numbers, entry.timestamp) || entry.timestamp == 0) {
+    return std::nullopt;
+  }
+
+  entry.upload_state = UploadState::Pending;
+
+  return entry;
+}
+
+RecordingName
+RecordingEntry::GetFileName() const
+{
+  RecordingName name;
+  char* const end = name.data.data() + name.data.size() - 1;
+
+  char* position = std::copy(DEVICE_NAME.begin(), DEVICE_NAME.end(), name.data.data());
+  *position++ = '_';
+  position = std::to_chars(position, end, timestamp).ptr;
+  if (segment != 0) {
+    *position++ = '_';
+    position = std::to_chars(position, end, segment).ptr;
+  }
+  const std::string_view extension = GetExtension(format);
+  position = std::copy(extension.begin(), extension.end(), position);
+  *position = '\0';
+
+  name.length = position - name.data.data();
+  return name;
+}
+
+std::string
+RecordingEntry::GetDirectory() const
+{
+  const std::time_t time = timestamp;
+  std::tm date;
+  gmtime_r(&time, &date);
+
+  char directory[sizeof("YYYY/MM/DD")];
+  return std::string(directory, std::strftime(directory, sizeof(directory), "%Y/%m/%d", &date));
+}
+
+bool
+RecordingIndex::Load()
+{
+  m_entries.clear();
+  m_stored_free_space = std::nullopt;
+  m_unsynced_mount_count = 0;
+  ++m_generation;
+
+  const std::string index_path = SDCard::GetFilePath(RECORDING_INDEX_NAME);
+  FILE* fp = fopen(index_path.c_str(), "rb");
+
+  bool is_valid = false;
+  if (fp != nullptr) {
+    RecordingIndexHeader header;
+    const RecordingIndexHeader k_reference;
+    is_valid = std::fread(&header, sizeof(header), 1, fp) == 1 &&
+               std::memcmp(header.magic, k_reference.magic, sizeof(header.magic)) == 0 &&
+               header.version == k_reference.version &&
+               header.checksum == CalculateChecksum(header) && header.is_clean != 0;
+
+    if (is_valid) {
+      m_stored_free_space = uint64_t{ header.free_space_kib } * 1024;
+      m_unsynced_mount_count = header.unsynced_mount_count;
+      m_entries.resize(header.entry_count);
+      is_valid =
+        std::fread(m_entries.data(), sizeof(RecordingEntry), m_entries.size(), fp) ==
+          m_entries.size() &&
+        std::all_of(m_entries.begin(), m_entries.end(), [](const RecordingEntry& entry) {
+          return entry.checksum == CalculateChecksum(entry);
+        });
+    }
+
+    fclose(fp);
+  }
+
+  if (!is_valid) {
+    LOG("The recording index is missing or stale, rebuilding it...\n");
+    m_stored_free_space = std::nullopt;
+    return Rebuild();
+  }
+
+  // drop the deleted entries & restore the order of the ones added out of order
+  const std::size_t loaded_count = m_entries.size();
+  std::erase_if(m_entries, [](const RecordingEntry& entry) {
+    return entry.upload_state == UploadState::Deleted;
+  });
+  const bool is_sorted =
+    std::is_sorted(m_entries.begin(), m_entries.end(), RecordingEntry::SortTimestamp);
+  if (!is_sorted) {
+    std::sort(m_entries.begin(), m_entries.end(), RecordingEntry::SortTimestamp);
+  }
+
+  LOG("Loaded %u recordings from the index.\n", m_entries.size());
+
+  // a reset before `Close()` leaves the index marked as in use, so it's rebuilt at the next mount
+  m_is_clean = false;
+  return m_entries.size() == loaded_count && is_sorted ? Store(m_entries.size(), 0)
+                                                       : Store(0, m_entries.size());
+}
+
+bool
+RecordingIndex::Close(const uint64_t free_space, const uint8_t unsynced_mount_count)
+{
+  m_is_clean = true;
+  m_free_space = free_space;
+  m_unsynced_mount_count = unsynced_mount_count;
+  return Store(m_entries.size(), 0);
+}
+
+bool
+RecordingIndex::Rebuild()
+{
+  m_entries.clear();
+  ++m_generation;
+
+  std::string directory_path(SDCard::GetMountPoint());
+  std::vector<std::string> misplaced_paths;
+  if (!ScanDirectory(directory_path, 0, misplaced_paths)) {
+    LOG("%s:%d | Failed to open the mount directory.\n", __FILE__, __LINE__);
+    return false;
+  }
+  MoveToDayDirectories(misplaced_paths);
+
+  std::sort(m_entries.begin(), m_entries.end(), RecordingEntry::SortTimestamp);
+
+  LOG("Indexed %u recordings.\n", m_entries.size());
+
+  m_is_clean = false;
+  return Store(0, m_entries.size());
+}
+
+bool
+RecordingIndex::Add(const std::string_view file_name, const std::size_t size)
+{
+  std::optional<RecordingEntry> entry = RecordingEntry::FromFileName(file_name);
+  if (!entry.has_value()) {
+    LOG("%s:%d | '%.*s' is not a recording.\n",
+        __FILE__,
+        __LINE__,
+        file_name.length(),
+        file_name.data());
+    return false;
+  }
+
+  entry->size = size;
+  entry->checksum = CalculateChecksum(*entry);
+  m_entries.push_back(*entry);
+
+  return Store(m_entries.size() - 1, 1);
+}
+
+std::optional<RecordingEntry>
+RecordingIndex::Remove(const std::string_view file_name)
+{
+  const std::size_t index = Find(file_name);
+  if (index == m_entries.size()) {
+    return std::nullopt;
+  }
+
+  RecordingEntry& entry = m_entries[index];
+  entry.upload_state = UploadState::Deleted;
+  entry.checksum = CalculateChecksum(entry);
+  Store(index, 1);
+
+  return entry;
+}
+
+bool
+RecordingIndex::SetUploadState(const std::string_view file_name, const UploadState upload_state)
+{
+  const std::size_t index = Find(file_name);
+  if (index == m_entries.size()) {
+    return false;
+  }
+
+  RecordingEntry& entry = m_entries[index];
+  entry.upload_state = upload_state;
+  entry.checksum = CalculateChecksum(entry);
+
+  return Store(index, 1);
+}
+
+std::size_t
+RecordingIndex::GetPending(RecordingCursor& cursor, const std::span<RecordingName> names) const
+{
+  if (cursor.generation != m_generation) {
+    cursor = RecordingCursor{ .position = 0, .generation = m_generation };
+  }
+
+  std::size_t count = 0;
+  while (cursor.position < m_entries.size() && count < names.size()) {
+    const RecordingEntry& entry = m_entries[cursor.position];
+    ++cursor.position;
+
+    if (entry.upload_state == UploadState::Pending) {
+      names[count] = entry.GetFileName();
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+std::optional<RecordingEntry>
+RecordingIndex::GetNext(RecordingCursor& cursor) const
+{
+  if (cursor.generation != m_generation) {
+    cursor = RecordingCursor{ .position = 0, .generation = m_generation };
+  }
+
+  while (cursor.position < m_entries.size()) {
+    const RecordingEntry& entry = m_entries[cursor.position];
+    ++cursor.position;
+
+    if (entry.upload_state != UploadState::Deleted) {
+      return entry;
+    }
+  }
+
+  return std::nullopt;
+}
+
+bool
+RecordingIndex::ScanDirectory(std::string& directory_path,
+                              const std::size_t depth,
+                              std::vector<std::string>& misplaced_paths)
+{
+  DIR* dir = opendir(directory_path.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+
+  const std::size_t directory_path_length = directory_path.size();
+
+  dirent* dir_entity;
+  while ((dir_entity = readdir(dir)) != nullptr) {
+    const std::string_view name(dir_entity->d_name);
+    directory_path.append(1, '/').append(name);
+
+    // "YYYY/MM/DD" below the mount directory
+    if (dir_entity->d_type == DT_DIR && depth < 3 && IsDateDirectory(name, depth == 0 ? 4 : 2)) {
+      ScanDirectory(directory_path, depth + 1, misplaced_paths);
+      directory_path.resize(directory_path_length);
+      continue;
+    }
+
+    // skip the directory entity if it's not a file, and the file if it's not a recording, or
+    // was named differently
+    std::optional<RecordingEntry> entry =
+      dir_entity->d_type == DT_REG ? RecordingEntry::FromFileName(name) : std::nullopt;
+    if (!entry.has_value() || entry->GetFileName().View() != name) {
+      directory_path.resize(directory_path_length);
+      continue;
+    }
+
+    // a recording outside of its day directory is moved there, then it's found by `GetFilePath()`
+    if (directory_path != SDCard::GetFilePath(name)) {
+      misplaced_paths.push_back(directory_path);
+      directory_path.resize(directory_path_length);
+      continue;
+    }
+
+    struct stat file_stats;
+    const bool is_stated = stat(directory_path.c_str(), &file_stats) == 0;
+    directory_path.resize(directory_path_length);
+    if (!is_stated) {
+      continue;
+    }
+
+    entry->size = file_stats.st_size;
+    entry->checksum = CalculateChecksum(*entry);
+    m_entries.push_back(*entry);
+  }
+
+  closedir(dir);
+
+  return true;
+}
+
+void
+RecordingIndex::MoveToDayDirectories(const std::span<const std::string> misplaced_paths)
+{
+  std::size_t moved_count = 0;
+  for (const std::string& misplaced_path : misplaced_paths) {
+    const std::string_view name =
+      std::string_view(misplaced_path).substr(misplaced_path.rfind('/') + 1);
+    const std::string file_path = SDCard::GetFilePath(name);
+    if (!SDCard::CreateParentDirectories(file_path) ||
+        rename(misplaced_path.c_str(), file_path.c_str()) != 0) {
+      LOG("%s:%d | Unable to move '%s'. errno: %d = %s\n",
+          __FILE__,
+          __LINE__,
+          misplaced_path.c_str(),
+          errno,
+          std::strerror(errno));
+      continue;
+    }
+    ++moved_count;
+
+    struct stat file_stats;
+    if (stat(file_path.c_str(), &file_stats) != 0) {
+      continue;
+    }
+
+    RecordingEntry entry = *RecordingEntry::FromFileName(name);
+    entry.size = file_stats.st_size;
+    entry.checksum = CalculateChecksum(entry);
+    m_entries.push_back(entry);
+  }
+
+  if (moved_count != 0) {
+    LOG("Moved %u recordings into day directories.\n", moved_count);
+  }
+}
+
+std::size_t
+RecordingIndex::Find(const std::string_view file_name) const
+{
+  const std::optional<RecordingEntry> entry = RecordingEntry::FromFileName(file_name);
+  if (!entry.has_value()) {
+    return m_entries.size();
+  }
+
+  const auto it =
+    std::find_if(m_entries.begin(), m_entries.end(), [&entry](const RecordingEntry& other) {
+      return other.upload_state != UploadState::Deleted && other.IsSameFile(*entry);
+    });
+  return it - m_entries.begin();
+}
+
+bool
+RecordingIndex::Store(const std::size_t first_entry, const std::size_t count)
+{
+  const std::string index_path = SDCard::GetFilePath(RECORDING_INDEX_NAME);
+  FILE* fp = fopen(index_path.c_str(), count == m_entries.size() ? "wb" : "r+b");
+  if (fp == nullptr) {
+    LOG("%s:%d | Unable to open the recording index. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  RecordingIndexHeader header;
+  header.is_clean = m_is_clean ? 1 : 0;
+  header.entry_count = m_entries.size();
+  header.free_space_kib = m_is_clean ? std::min<uint64_t>(m_free_space / 1024, UINT32_MAX) : 0;
+  header.unsynced_mount_count = m_is_clean ? m_unsynced_mount_count : 0;
+  header.checksum = CalculateChecksum(header);
+
+  const bool is_stored =
+    std::fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fseek(fp, sizeof(header) + first_entry * sizeof(RecordingEntry), SEEK_SET) == 0 &&
+    std::fwrite(m_entries.data() + first_entry, sizeof(RecordingEntry), count, fp) == count;
+
+  if (fclose(fp) != 0 || !is_stored) {
+    LOG("%s:%d | Unable to write the recording index.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  return true;
+}
+
+} // namespace sd
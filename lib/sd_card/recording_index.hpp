@@ -0,0 +1,173 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "settings.hpp"
+
+namespace sd {
+
+enum class UploadState : uint8_t
+{
+  // waiting to be sent to the server
+  Pending,
+  // sent to the server, but the file could not be deleted afterwards
+  Uploaded,
+  // the file has been deleted, the entry is dropped when the index is loaded again
+  Deleted,
+};
+
+/// @brief File name of a recording, stored without allocations & null-terminated
+struct RecordingName
+{
+  // "<device name>_<timestamp>_<segment>.flac"
+  static constexpr std::size_t CAPACITY = DEVICE_NAME.size() + 24;
+
+  std::array<char, CAPACITY> data;
+  std::size_t length;
+
+  std::string_view View() const { return std::string_view(data.data(), length); }
+};
+
+/// @brief Entry of a recording in the index, as it's stored on the card.
+/// The file name is not stored, it's made of the timestamp, the segment number & the format
+struct RecordingEntry
+{
+  uint32_t timestamp;
+  uint32_t size;
+  // number of the segment, starting with 1, 0 if the recording is not split into segments
+  uint16_t segment;
+  RecordingFormat format;
+  UploadState upload_state;
+  // CRC-32 of the fields above
+  uint32_t checksum;
+
+  /// @brief Parses a name made by `GetFileName()`
+  /// @return the entry with a zero size & no checksum, or nothing if `file_name` is not the name
+  /// of a recording
+  static std::optional<RecordingEntry> FromFileName(const std::string_view file_name);
+
+  RecordingName GetFileName() const;
+
+  /// @brief Returns the directory of the recording relative to the mount point, "YYYY/MM/DD"
+  /// after the UTC date of its timestamp
+  std::string GetDirectory() const;
+
+  /// @brief Returns `true` if both entries belong to the same file
+  bool IsSameFile(const RecordingEntry& other) const
+  {
+    return timestamp == other.timestamp && segment == other.segment && format == other.format;
+  }
+
+  static bool SortTimestamp(const RecordingEntry& a, const RecordingEntry& b)
+  {
+    return a.timestamp != b.timestamp ? a.timestamp < b.timestamp : a.segment < b.segment;
+  }
+};
+static_assert(sizeof(RecordingEntry) == 16, "Index entries are stored as raw bytes");
+
+/// @brief Position of an enumeration of the index. Entries are only marked as deleted, & new ones
+/// are appended, so the position stays valid until the index is loaded or rebuilt again, after
+/// which the enumeration starts over
+struct RecordingCursor
+{
+  std::size_t position = 0;
+  uint32_t generation = 0;
+};
+
+/// @brief Index of the recordings on the card, so they can be listed without scanning the
+/// directories & stat-ing every file.
+///
+/// The index is kept in RAM, and stored in a binary file of fixed-size entries, each of which is
+/// rewritten in place when it changes. It's marked as clean only while the card is unmounted,
+/// so an index left by a reset or a power loss is rebuilt from the directory at the next mount,
+/// as is a missing or damaged one. Recordings deleted or added outside of the index are not
+/// noticed until then
+class RecordingIndex
+{
+public:
+  /// @brief Loads the index from the card, or rebuilds it if it's missing or stale, and marks it
+  /// as in use
+  /// @return `true` if successful, `false` otherwise
+  bool Load();
+
+  /// @brief Marks the index on the card as clean, before the card is unmounted
+  /// @param free_space free space of the card, which is valid as long as the index is
+  /// @param unsynced_mount_count mounts since the free space was synced with the file system
+  bool Close(const uint64_t free_space, const uint8_t unsynced_mount_count);
+
+  /// @brief Returns the free space stored by `Close()`, if the index has been loaded clean
+  std::optional<uint64_t> GetStoredFreeSpace() const { return m_stored_free_space; }
+  /// @brief Returns the mount count stored along with the free space
+  uint8_t GetUnsyncedMountCount() const { return m_unsynced_mount_count; }
+
+  /// @brief Scans the day directories for recordings & replaces the index with them.
+  /// Recordings found directly in the mount directory, as stored by older firmware, are moved
+  /// into their day directories
+  /// @return `true` if successful, `false` otherwise
+  bool Rebuild();
+
+  /// @brief Adds the recording `file_name` of `size` bytes
+  /// @return `true` if successful, `false` if it's not a recording or the index can't be written
+  bool Add(const std::string_view file_name, const std::size_t size);
+
+  /// @brief Marks the recording `file_name` as deleted
+  /// @return the removed entry, or nothing if there is none
+  std::optional<RecordingEntry> Remove(const std::string_view file_name);
+
+  bool SetUploadState(const std::string_view file_name, const UploadState upload_state);
+
+  /// @brief Returns all entries, the oldest first, except the ones added since the index has been
+  /// loaded, which follow in the order they were added. Deleted entries are included
+  std::span<const RecordingEntry> GetEntries() const { return m_entries; }
+
+  /// @brief Copies the names of the next recordings waiting to be uploaded into `names`, and
+  /// advances `cursor` past them
+  /// @return amount of names copied, 0 once all recordings have been enumerated
+  std::size_t GetPending(RecordingCursor& cursor, const std::span<RecordingName> names) const;
+
+  /// @brief Returns the next recording which has not been deleted, regardless of its upload
+  /// state, and advances `cursor` past it
+  /// @return the entry, or nothing once all recordings have been enumerated
+  std::optional<RecordingEntry> GetNext(RecordingCursor& cursor) const;
+
+private:
+  /// @brief Returns the position of the entry of `file_name`, or `m_entries.size()` if there is
+  /// none
+  std::size_t Find(const std::string_view file_name) const;
+
+  /// @brief Adds the recordings in `directory_path` & in the date directories below it to the
+  /// entries, `depth` levels below the mount directory. `directory_path` is used as a buffer for
+  /// the paths of the files, and is restored afterwards. The paths of recordings outside of their
+  /// day directories are appended to `misplaced_paths` instead
+  /// @return `true` if the directory could be opened, `false` otherwise
+  bool ScanDirectory(std::string& directory_path,
+                     const std::size_t depth,
+                     std::vector<std::string>& misplaced_paths);
+
+  /// @brief Moves the recordings at `misplaced_paths` into their day directories & adds them to
+  /// the entries. Called once no directory is read anymore, as a directory which changes while
+  /// it's read may list the moved recordings again
+  void MoveToDayDirectories(const std::span<const std::string> misplaced_paths);
+
+  /// @brief Writes the header & `count` entries starting with `first_entry` into the index file.
+  /// The file is recreated if all entries are written
+  bool Store(const std::size_t first_entry, const std::size_t count);
+
+private:
+  std::vector<RecordingEntry> m_entries;
+  bool m_is_clean = false;
+  std::optional<uint64_t> m_stored_free_space;
+  uint64_t m_free_space = 0;
+  uint8_t m_unsynced_mount_count = 0;
+  // incremented whenever the entries are replaced, which invalidates the cursors
+  uint32_t m_generation = 0;
+};
+
+} // namespace sd
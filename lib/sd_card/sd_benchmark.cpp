@@ -0,0 +1,364 @@
+#include "sd_benchmark.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <sys/stat.h>
+
+#include <Arduino.h>
+
+#include "esp_timer.h"
+
+#include "cluster_writer.hpp"
+#include "settings.hpp"
+#include "wav_header.hpp"
+
+#if DEBUG_SD
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+namespace sd {
+
+namespace {
+
+// header of the recordings, which is rewritten by the header commits
+const wav_header_t k_header;
+const std::span<const uint8_t> k_header_bytes(reinterpret_cast<const uint8_t*>(&k_header),
+                                              sizeof(k_header));
+// size of the data of the files which are renamed & deleted, about a second of a recording
+constexpr std::size_t k_renamed_file_size = 32 * 1024;
+
+/// @brief Formats `result` as a line of the CSV file, or the header line if it's `nullptr`
+/// @return length of the line
+std::size_t
+FormatResult(const BenchmarkResult* result,
+             const uint32_t spi_frequency_hz,
+             std::span<char> line)
+{
+  std::size_t length = 0;
+  const auto append = [&line, &length](const char* format, const auto... args) {
+    const int appended = std::snprintf(line.data() + length, line.size() - length, format, args...);
+    length = std::min(length + std::max(appended, 0), line.size() - 1);
+  };
+
+  if (result == nullptr) {
+    append("spi_frequency_hz,operation,operation_size,operation_count,throughput_kib_s,p50_us,"
+           "p99_us,max_us");
+    for (std::size_t i = 0; i + 1 < BenchmarkResult{}.latency_histogram.size(); ++i) {
+      append(",lt_%ums", 1U << i);
+    }
+    append(",ge_%ums\n", 1U << (BenchmarkResult{}.latency_histogram.size() - 2));
+    return length;
+  }
+
+  const uint64_t throughput_kib_s =
+    result->elapsed_us != 0 ? result->written_bytes * 1'000'000 / result->elapsed_us / 1024 : 0;
+  append("%lu,%.*s,%u,%u,%llu,%lu,%lu,%lu",
+         spi_frequency_hz,
+         result->operation.length(),
+         result->operation.data(),
+         result->operation_size,
+         result->operation_count,
+         throughput_kib_s,
+         result->p50_latency_us,
+         result->p99_latency_us,
+         result->max_latency_us);
+  for (const uint32_t count : result->latency_histogram) {
+    append(",%lu", count);
+  }
+  append("\n");
+
+  return length;
+}
+
+/// @brief Creates the scratch file of the benchmark in `file`, which writes it like the
+/// recordings: through the write buffer of the capture profile, with clusters reserved ahead
+/// @return `true` if successful, `false` otherwise
+bool
+OpenScratchFile(ClusterWriter& file)
+{
+  if (!file.Open(SDCard::GetFilePath(SD_BENCHMARK_FILE_NAME),
+                 k_header_bytes,
+                 CAPTURE_PROFILE.write_buffer_bytes,
+                 WAV_PREALLOCATION_BYTES,
+                 0)) {
+    LOG("%s:%d | Unable to create the benchmark file. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+} // namespace
+
+SDBenchmark::SDBenchmark(SDCard& sd_card)
+  : m_sd_card(sd_card)
+{
+}
+
+bool
+SDBenchmark::Run()
+{
+  Serial.printf("Running the SD card benchmark...\n");
+
+  m_results.clear();
+  m_latencies_us.reserve(SD_BENCHMARK_APPEND_BYTES / SD_BENCHMARK_APPEND_SIZES.front());
+
+  bool is_successful = true;
+  for (const std::size_t append_size : SD_BENCHMARK_APPEND_SIZES) {
+    is_successful = RunAppend(append_size) && is_successful;
+  }
+  is_successful = RunHeaderRewrite() && is_successful;
+  is_successful = RunRenameAndDelete() && is_successful;
+
+  std::remove(SDCard::GetFilePath(SD_BENCHMARK_FILE_NAME).c_str());
+
+  // the results are mirrored over serial, so they're available without taking the card out
+  const uint32_t spi_frequency_hz = m_sd_card.GetCardProfile().spi_frequency_hz;
+  std::array<char, 256> line;
+  std::size_t length = FormatResult(nullptr, spi_frequency_hz, line);
+  Serial.printf("%.*s", length, line.data());
+  for (const BenchmarkResult& result : m_results) {
+    length = FormatResult(&result, spi_frequency_hz, line);
+    Serial.printf("%.*s", length, line.data());
+  }
+
+  if (!StoreResults()) {
+    is_successful = false;
+  }
+
+  Serial.printf("SD card benchmark %s.\n", is_successful ? "finished" : "failed");
+
+  return is_successful;
+}
+
+bool
+SDBenchmark::RunAppend(const std::size_t append_size)
+{
+  ClusterWriter file;
+  if (!OpenScratchFile(file)) {
+    return false;
+  }
+
+  const std::vector<uint8_t> data(append_size, 0xA5);
+  m_latencies_us.clear();
+
+  // an append only copies into the write buffer, except the ones which fill it up to a cluster
+  // boundary & flush it
+  uint64_t written_bytes = 0;
+  const int64_t start_time_us = esp_timer_get_time();
+  while (written_bytes < SD_BENCHMARK_APPEND_BYTES) {
+    const int64_t write_start_us = esp_timer_get_time();
+    file.Write(data);
+    m_latencies_us.push_back(static_cast<uint32_t>(esp_timer_get_time() - write_start_us));
+    written_bytes += data.size();
+  }
+  // the flushes of the appends, without the one of the remaining data by `Close()`
+  const ClusterWriterStats file_stats = file.GetStats();
+  bool is_written = file.Close(k_header_bytes);
+  const int64_t elapsed_us = esp_timer_get_time() - start_time_us;
+  is_written = file.GetStats().write_errors == 0 && is_written;
+
+  if (!is_written) {
+    LOG("%s:%d | Appends of %u bytes failed after %u bytes.\n",
+        __FILE__,
+        __LINE__,
+        append_size,
+        file.GetFlushedSize());
+  }
+
+  AddResult("append", append_size, written_bytes, elapsed_us, file_stats);
+
+  return is_written;
+}
+
+bool
+SDBenchmark::RunHeaderRewrite()
+{
+  ClusterWriter file;
+  if (!OpenScratchFile(file)) {
+    return false;
+  }
+
+  // a file of a few clusters, the header of which is committed like the recordings' is
+  const std::vector<uint8_t> data(SD_CLUSTER_SIZE, 0xA5);
+  for (std::size_t i = 0; i < 4; ++i) {
+    file.Write(data);
+  }
+  bool is_written = file.Flush();
+
+  m_latencies_us.clear();
+  const int64_t start_time_us = esp_timer_get_time();
+  for (std::size_t i = 0; i < SD_BENCHMARK_FILE_OPERATIONS && is_written; ++i) {
+    const int64_t rewrite_start_us = esp_timer_get_time();
+    is_written = file.CommitHeader(k_header_bytes);
+    m_latencies_us.push_back(static_cast<uint32_t>(esp_timer_get_time() - rewrite_start_us));
+  }
+  const int64_t elapsed_us = esp_timer_get_time() - start_time_us;
+  const ClusterWriterStats file_stats = file.GetStats();
+  is_written = file.Close(k_header_bytes) && is_written;
+
+  if (!is_written) {
+    LOG("%s:%d | Header rewrites failed. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+  }
+
+  AddResult("header_rewrite",
+            sizeof(wav_header_t),
+            m_latencies_us.size() * sizeof(wav_header_t),
+            elapsed_us,
+            file_stats);
+
+  return is_written;
+}
+
+bool
+SDBenchmark::RunRenameAndDelete()
+{
+  const std::string scratch_path = SDCard::GetFilePath(SD_BENCHMARK_FILE_NAME);
+  const std::vector<uint8_t> data(k_renamed_file_size, 0xA5);
+
+  // the files are named like recordings of the first seconds of 1970, which no real recording
+  // has, and go through the recording index & the day directories like recordings do
+  std::vector<RecordingName> names;
+  names.reserve(SD_BENCHMARK_FILE_OPERATIONS);
+
+  bool is_successful = true;
+  m_latencies_us.clear();
+  int64_t elapsed_us = 0;
+  for (std::size_t i = 0; i < SD_BENCHMARK_FILE_OPERATIONS; ++i) {
+    ClusterWriter file;
+    if (!OpenScratchFile(file)) {
+      is_successful = false;
+      break;
+    }
+    file.Write(data);
+    if (!file.Close(k_header_bytes) || file.GetStats().write_errors != 0) {
+      is_successful = false;
+      break;
+    }
+
+    const RecordingEntry entry = { .timestamp = static_cast<uint32_t>(i + 1),
+                                   .size = 0,
+                                   .segment = 0,
+                                   .format = RECORDING_FORMAT,
+                                   .upload_state = UploadState::Pending,
+                                   .checksum = 0 };
+    names.push_back(entry.GetFileName());
+
+    const int64_t rename_start_us = esp_timer_get_time();
+    if (!m_sd_card.RenameRecording(scratch_path, names.back().View())) {
+      names.pop_back();
+      is_successful = false;
+      break;
+    }
+    const int64_t rename_time_us = esp_timer_get_time() - rename_start_us;
+    m_latencies_us.push_back(static_cast<uint32_t>(rename_time_us));
+    elapsed_us += rename_time_us;
+  }
+  AddResult("rename", 0, 0, elapsed_us);
+
+  m_latencies_us.clear();
+  const int64_t start_time_us = esp_timer_get_time();
+  for (const RecordingName& name : names) {
+    const int64_t delete_start_us = esp_timer_get_time();
+    if (!m_sd_card.DeleteRecording(name.View())) {
+      is_successful = false;
+    }
+    m_latencies_us.push_back(static_cast<uint32_t>(esp_timer_get_time() - delete_start_us));
+  }
+  AddResult("delete", 0, 0, esp_timer_get_time() - start_time_us);
+
+  if (!is_successful) {
+    LOG("%s:%d | Renames or deletes failed. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+  }
+
+  return is_successful;
+}
+
+void
+SDBenchmark::AddResult(const std::string_view operation,
+                       const std::size_t operation_size,
+                       const uint64_t written_bytes,
+                       const uint64_t elapsed_us,
+                       const ClusterWriterStats& file_stats)
+{
+  BenchmarkResult result = { .operation = operation,
+                             .operation_size = operation_size,
+                             .operation_count = m_latencies_us.size(),
+                             .written_bytes = written_bytes,
+                             .elapsed_us = elapsed_us,
+                             .p50_latency_us = 0,
+                             .p99_latency_us = 0,
+                             .max_latency_us = 0,
+                             .latency_histogram = {},
+                             .file = file_stats };
+
+  for (const uint32_t latency_us : m_latencies_us) {
+    const std::size_t bucket = std::min<std::size_t>(std::bit_width(latency_us / 1'000),
+                                                     result.latency_histogram.size() - 1);
+    ++result.latency_histogram[bucket];
+  }
+
+  if (!m_latencies_us.empty()) {
+    std::sort(m_latencies_us.begin(), m_latencies_us.end());
+    const std::size_t last = m_latencies_us.size() - 1;
+    result.p50_latency_us = m_latencies_us[last * 50 / 100];
+    result.p99_latency_us = m_latencies_us[last * 99 / 100];
+    result.max_latency_us = m_latencies_us[last];
+  }
+
+  m_results.push_back(result);
+}
+
+bool
+SDBenchmark::StoreResults() const
+{
+  // the results of all runs are appended to one file, so cards & firmware versions can be
+  // compared in one table
+  const std::string results_path = SDCard::GetFilePath(SD_BENCHMARK_RESULTS_NAME);
+  struct stat file_stats;
+  const bool is_new = stat(results_path.c_str(), &file_stats) != 0;
+
+  FILE* fp = fopen(results_path.c_str(), "a");
+  if (fp == nullptr) {
+    LOG("%s:%d | Unable to open the benchmark results. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  const uint32_t spi_frequency_hz = m_sd_card.GetCardProfile().spi_frequency_hz;
+  std::array<char, 256> line;
+  bool is_written = true;
+  if (is_new) {
+    const std::size_t length = FormatResult(nullptr, spi_frequency_hz, line);
+    is_written = std::fwrite(line.data(), length, 1, fp) == 1;
+  }
+  for (const BenchmarkResult& result : m_results) {
+    const std::size_t length = FormatResult(&result, spi_frequency_hz, line);
+    is_written = std::fwrite(line.data(), length, 1, fp) == 1 && is_written;
+  }
+
+  return fclose(fp) == 0 && is_written;
+}
+
+} // namespace sd
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#include "cluster_writer.hpp"
+#include "sd_card.hpp"
+
+namespace sd {
+
+/// @brief Latencies of one benchmark test & the data it has written
+struct BenchmarkResult
+{
+  std::string_view operation;
+  // size of each operation, 0 for the ones which don't write data
+  std::size_t operation_size;
+  std::size_t operation_count;
+  uint64_t written_bytes;
+  // wall time of the test, including the final sync
+  uint64_t elapsed_us;
+  uint32_t p50_latency_us;
+  uint32_t p99_latency_us;
+  uint32_t max_latency_us;
+  // bucket `i` counts operations which took less than 2^i ms, the last one counts all longer ones
+  std::array<uint32_t, 12> latency_histogram;
+  // the scratch file's writer during the operations, before the file is closed. Empty for the
+  // tests which don't write through one
+  ClusterWriterStats file;
+};
+
+/// @brief Measures the storage paths of the recorder on the mounted card: sequential appends of
+/// `SD_BENCHMARK_APPEND_SIZES` & header commits through a `ClusterWriter` set up like the one of
+/// the recordings, and renames & deletes of recordings through `SDCard`.
+/// Results are appended as CSV to `SD_BENCHMARK_RESULTS_NAME` & printed over serial
+class SDBenchmark
+{
+public:
+  explicit SDBenchmark(SDCard& sd_card);
+
+  /// @brief Runs all tests. Takes a few seconds per test, so it must not run while recording
+  /// @return `true` if all tests succeeded, `false` otherwise
+  bool Run();
+
+  const std::vector<BenchmarkResult>& GetResults() const { return m_results; }
+
+private:
+  bool RunAppend(const std::size_t append_size);
+  bool RunHeaderRewrite();
+  bool RunRenameAndDelete();
+
+  /// @brief Adds the result of a test from the latencies collected in `m_latencies_us`
+  void AddResult(const std::string_view operation,
+                 const std::size_t operation_size,
+                 const uint64_t written_bytes,
+                 const uint64_t elapsed_us,
+                 const ClusterWriterStats& file_stats = {});
+
+  bool StoreResults() const;
+
+private:
+  SDCard& m_sd_card;
+  std::vector<uint32_t> m_latencies_us;
+  std::vector<BenchmarkResult> m_results;
+};
+
+} // namespace sd
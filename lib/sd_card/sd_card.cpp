@@ -1,9 +1,16 @@
 #include "sd_card.hpp"
 
-#include <charconv>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cerrno>
 #include <cstdio>
-#include <dirent.h>
+#include <cstring>
 #include <filesystem>
+#include <iterator>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 // #if DEBUG_SD
 // #define LOG_LOCAL_LEVEL esp_log_level_t::ESP_LOG_DEBUG
@@ -12,9 +19,12 @@
 // #endif
 // #include "esp_log.h"
 
+#include "esp_timer.h"
+
 #include <SD.h>
 #include <SPI.h>
 
+#include "checksum.hpp"
 #include "settings.hpp"
 
 #if DEBUG_SD
@@ -25,6 +35,29 @@
 
 namespace sd {
 
+namespace {
+
+// start sector of the first partition in the master boot record
+constexpr std::size_t k_first_partition_start_offset = 0x1BE + 8;
+// fields of the boot sector of a FAT volume
+constexpr std::size_t k_bytes_per_sector_offset = 0x0B;
+constexpr std::size_t k_sectors_per_cluster_offset = 0x0D;
+// exFAT stores both as powers of two
+constexpr std::size_t k_exfat_bytes_per_sector_shift_offset = 0x6C;
+constexpr std::size_t k_exfat_sectors_per_cluster_shift_offset = 0x6D;
+constexpr std::string_view k_exfat_name = "EXFAT   ";
+
+/// @brief Returns `true` if `sector` is the boot sector of a FAT or exFAT volume, which starts
+/// with a jump instruction, unlike a master boot record
+bool
+IsBootSector(const std::span<const uint8_t, SD_SECTOR_SIZE> sector)
+{
+  return (sector[0] == 0xEB || sector[0] == 0xE9) && sector[SD_SECTOR_SIZE - 2] == 0x55 &&
+         sector[SD_SECTOR_SIZE - 1] == 0xAA;
+}
+
+} // namespace
+
 bool
 SDCard::Init()
 {
@@ -35,20 +68,47 @@ SDCard::Init()
     return ESP_OK;
   }
 
-  const bool b_result = SD.begin(pins::SD_CS, SPI, 4'000'000UL, VFS_MOUNT_POINT.data(), 5, false);
+  if (m_mutex == nullptr) {
+    m_mutex = xSemaphoreCreateMutex();
+    if (m_mutex == nullptr) {
+      LOG("%s:%d | Unable to create the SD card mutex.\n", __FILE__, __LINE__);
+      return false;
+    }
+  }
+
+  // a card without a known profile is mounted at the slowest clock first
+  if (m_profile.spi_frequency_hz == 0) {
+    if (!Mount(SD_SPI_FREQUENCIES_HZ.front())) {
+      LOG("Failed to mount the SD card.\n");
+      return false;
+    }
 
-  // const bool b_result = SD.begin(SD_PIN_CS);
-  if (!b_result) {
-    LOG("Failed to mount the SD card.\n");
-    return false;
+    if (!LoadProfile() && !ProbeClock()) {
+      LOG("%s:%d | Failed to probe the SD card.\n", __FILE__, __LINE__);
+      return false;
+    }
   }
 
-  const sdcard_type_t card_type = SD.cardType();
-  if (card_type == sdcard_type_t::CARD_NONE) {
-    LOG("No SD card detected.\n");
-    return false;
+  if (m_is_derate_requested.exchange(false)) {
+    LOG("I/O errors have been reported, ");
+    DerateClock();
   }
 
+  // a clock which doesn't work anymore is stepped down
+  while (!Mount(m_profile.spi_frequency_hz)) {
+    LOG("Failed to mount the SD card at %lu Hz, ", m_profile.spi_frequency_hz);
+    if (!DerateClock()) {
+      return false;
+    }
+  }
+  LOG("SD card is mounted at %lu Hz.\n", m_profile.spi_frequency_hz);
+
+  if (m_is_profile_changed && StoreProfile()) {
+    m_is_profile_changed = false;
+  }
+
+  const sdcard_type_t card_type = SD.cardType();
+
 #if DEBUG_SD
   LOG("SD card type: ");
   switch (card_type) {
@@ -75,6 +135,30 @@ SDCard::Init()
 
   m_is_init = true;
 
+  if (!LoadClusterSize()) {
+    LOG("The cluster size is unknown, assuming %u bytes.\n", SD_CLUSTER_SIZE);
+    m_cluster_size = SD_CLUSTER_SIZE;
+  }
+
+  // no other task uses the index yet
+  if (!m_index.Load()) {
+    LOG("%s:%d | Failed to load the recording index.\n", __FILE__, __LINE__);
+  }
+
+  // asking the file system for the free space can take a scan of the whole FAT, so it's only
+  // done if the free space isn't known from the last unmount. The periodic sync after
+  // `FREE_SPACE_SYNC_MOUNT_INTERVAL` mounts is left to the eviction, which runs in the background
+  const std::optional<uint64_t> stored_free_space = m_index.GetStoredFreeSpace();
+  if (stored_free_space.has_value()) {
+    m_free_space = stored_free_space.value();
+    m_unsynced_bytes = 0;
+    m_unsynced_mount_count = std::min<unsigned>(m_index.GetUnsyncedMountCount() + 1,
+                                                FREE_SPACE_SYNC_MOUNT_INTERVAL);
+  } else {
+    SyncFreeSpace();
+  }
+  LOG("Free space: %llu MB\n", m_free_space / (1024 * 1024));
+
   return true;
 }
 
@@ -87,53 +171,517 @@ SDCard::DeInit()
   //   LOG("SD card is not initialized. Skipping the de-initialization...\n");
   // }
 
+  // the eviction task still uses the index & the card, so both are left as they are. The index
+  // stays marked as in use, & is rebuilt at the next mount
+  if (!StopEviction()) {
+    LOG("%s:%d | Failed to stop the eviction, the card stays mounted.\n", __FILE__, __LINE__);
+    return;
+  }
+
+  // the index stays valid only if it's closed before the card is unmounted
+  if (m_is_init && !m_index.Close(m_free_space, m_unsynced_mount_count)) {
+    LOG("%s:%d | Failed to close the recording index.\n", __FILE__, __LINE__);
+  }
+
   SD.end();
 
   m_is_init = false;
+  m_mounted_frequency_hz = 0;
 }
 
-uint64_t
-SDCard::GetFreeSpace()
+bool
+SDCard::Mount(const uint32_t frequency_hz)
+{
+  if (m_mounted_frequency_hz == frequency_hz) {
+    return true;
+  }
+
+  if (m_mounted_frequency_hz != 0) {
+    SD.end();
+    m_mounted_frequency_hz = 0;
+  }
+
+  if (!SD.begin(
+        pins::SD_CS, SPI, frequency_hz, VFS_MOUNT_POINT.data(), SD_MAX_OPEN_FILES, false)) {
+    return false;
+  }
+
+  if (SD.cardType() == sdcard_type_t::CARD_NONE) {
+    LOG("No SD card detected.\n");
+    SD.end();
+    return false;
+  }
+
+  m_mounted_frequency_hz = frequency_hz;
+  return true;
+}
+
+bool
+SDCard::LoadProfile()
 {
-  return SD.totalBytes() - SD.usedBytes();
+  const std::string profile_path = GetFilePath(SD_CARD_PROFILE_NAME);
+  FILE* fp = fopen(profile_path.c_str(), "rb");
+  if (fp == nullptr) {
+    LOG("The SD card has no profile yet.\n");
+    return false;
+  }
+
+  CardProfile profile;
+  const bool is_read = std::fread(&profile, sizeof(profile), 1, fp) == 1;
+  fclose(fp);
+
+  // a profile copied from another card doesn't count
+  const CardProfile k_reference;
+  const bool is_valid =
+    is_read && std::memcmp(profile.magic, k_reference.magic, sizeof(profile.magic)) == 0 &&
+    profile.version == k_reference.version && profile.checksum == CalculateChecksum(profile) &&
+    profile.card_type == SD.cardType() && profile.card_size == SD.cardSize() &&
+    std::find(SD_SPI_FREQUENCIES_HZ.begin(),
+              SD_SPI_FREQUENCIES_HZ.end(),
+              profile.spi_frequency_hz) != SD_SPI_FREQUENCIES_HZ.end();
+  if (!is_valid) {
+    LOG("The SD card profile is invalid.\n");
+    return false;
+  }
+
+  m_profile = profile;
+  LOG("SD card profile: %lu Hz, %lu KB/s, worst write %lu us\n",
+      m_profile.spi_frequency_hz,
+      m_profile.write_throughput_bps / 1024,
+      m_profile.worst_write_latency_us);
+
+  return true;
+}
+
+bool
+SDCard::StoreProfile()
+{
+  m_profile.checksum = CalculateChecksum(m_profile);
+
+  const std::string profile_path = GetFilePath(SD_CARD_PROFILE_NAME);
+  FILE* fp = fopen(profile_path.c_str(), "wb");
+  if (fp == nullptr) {
+    LOG("%s:%d | Unable to store the SD card profile. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  const bool is_written = std::fwrite(&m_profile, sizeof(m_profile), 1, fp) == 1;
+  return fclose(fp) == 0 && is_written;
+}
+
+bool
+SDCard::ProbeClock()
+{
+  LOG("Probing the SD card...\n");
+
+  m_profile = CardProfile{ .card_type = static_cast<uint8_t>(SD.cardType()),
+                           .card_size = SD.cardSize(),
+                           .spi_frequency_hz = SD_SPI_FREQUENCIES_HZ.front() };
+
+  for (const uint32_t frequency_hz : SD_SPI_FREQUENCIES_HZ) {
+    if (!Mount(frequency_hz) || !VerifyScratchFile(frequency_hz)) {
+      LOG("The SD card fails at %lu Hz.\n", frequency_hz);
+      break;
+    }
+
+    m_profile.spi_frequency_hz = frequency_hz;
+  }
+
+  if (!Mount(m_profile.spi_frequency_hz)) {
+    return false;
+  }
+
+  MeasureWriteSpeed();
+  std::remove(GetFilePath(SD_PROBE_FILE_NAME).c_str());
+  m_is_profile_changed = true;
+
+  LOG("SD card probed: %lu Hz, %lu KB/s, worst write %lu us\n",
+      m_profile.spi_frequency_hz,
+      m_profile.write_throughput_bps / 1024,
+      m_profile.worst_write_latency_us);
+
+  return true;
+}
+
+bool
+SDCard::VerifyScratchFile(const uint32_t seed)
+{
+  // a few sectors of a pattern which differs from the one of the previous clock
+  std::array<uint32_t, SD_SECTOR_SIZE * 4 / sizeof(uint32_t)> pattern;
+  uint32_t value = seed;
+  for (uint32_t& word : pattern) {
+    value = value * 1'664'525 + 1'013'904'223;
+    word = value;
+  }
+
+  const std::string probe_path = GetFilePath(SD_PROBE_FILE_NAME);
+  FILE* fp = fopen(probe_path.c_str(), "wb");
+  if (fp == nullptr) {
+    return false;
+  }
+  const bool is_written = std::fwrite(pattern.data(), sizeof(pattern), 1, fp) == 1;
+  if (fclose(fp) != 0 || !is_written) {
+    return false;
+  }
+
+  // the file is reopened, so the data is read from the card
+  std::array<uint32_t, pattern.size()> read_back;
+  fp = fopen(probe_path.c_str(), "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  const bool is_read = std::fread(read_back.data(), sizeof(read_back), 1, fp) == 1;
+  fclose(fp);
+
+  return is_read && read_back == pattern;
 }
 
 void
-SDCard::EnsureFreeSpace(const uint64_t& free_bytes)
+SDCard::MeasureWriteSpeed()
 {
-  const uint64_t free_space = GetFreeSpace();
-  if (free_space > free_bytes) {
+  m_profile.write_throughput_bps = 0;
+  m_profile.worst_write_latency_us = 0;
+
+  std::vector<uint8_t> cluster(SD_CLUSTER_SIZE, 0);
+  FILE* fp = fopen(GetFilePath(SD_PROBE_FILE_NAME).c_str(), "wb");
+  if (fp == nullptr) {
     return;
   }
+  // the same unbuffered cluster writes as the recordings
+  setvbuf(fp, nullptr, _IONBF, 0);
+
+  const int64_t start_time_us = esp_timer_get_time();
+  std::size_t written = 0;
+  while (written < SD_PROBE_WRITE_BYTES) {
+    const int64_t write_start_us = esp_timer_get_time();
+    if (std::fwrite(cluster.data(), cluster.size(), 1, fp) != 1) {
+      break;
+    }
+    written += cluster.size();
+
+    m_profile.worst_write_latency_us = std::max(
+      m_profile.worst_write_latency_us,
+      static_cast<uint32_t>(esp_timer_get_time() - write_start_us));
+  }
+  fsync(fileno(fp));
+  const int64_t elapsed_us = esp_timer_get_time() - start_time_us;
+  fclose(fp);
+
+  if (elapsed_us > 0) {
+    m_profile.write_throughput_bps = static_cast<uint32_t>(written * 1'000'000 / elapsed_us);
+  }
+}
+
+bool
+SDCard::DerateClock()
+{
+  const auto it = std::find(
+    SD_SPI_FREQUENCIES_HZ.begin(), SD_SPI_FREQUENCIES_HZ.end(), m_profile.spi_frequency_hz);
+  if (it == SD_SPI_FREQUENCIES_HZ.begin() || it == SD_SPI_FREQUENCIES_HZ.end()) {
+    LOG("the SPI clock can't be lowered.\n");
+    return false;
+  }
+
+  m_profile.spi_frequency_hz = *std::prev(it);
+  m_is_profile_changed = true;
+  LOG("lowering the SPI clock to %lu Hz.\n", m_profile.spi_frequency_hz);
+
+  return true;
+}
+
+uint64_t
+SDCard::GetFreeSpace() const
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const uint64_t free_space = m_free_space;
+  xSemaphoreGive(m_mutex);
+
+  return free_space;
+}
+
+void
+SDCard::SyncFreeSpace()
+{
+  const int64_t start_time_us = esp_timer_get_time();
+  const uint64_t free_space = SD.totalBytes() - SD.usedBytes();
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  LOG("Free space synced in %lld ms, it was off by %lld KB.\n",
+      (esp_timer_get_time() - start_time_us) / 1'000,
+      (static_cast<int64_t>(free_space) - static_cast<int64_t>(m_free_space)) / 1024);
+  m_free_space = free_space;
+  m_unsynced_bytes = 0;
+  m_unsynced_mount_count = 0;
+  xSemaphoreGive(m_mutex);
+}
+
+bool
+SDCard::LoadClusterSize()
+{
+  // a card formatted without a partition table starts with the boot sector, otherwise it's
+  // found at the first partition, which is the one the file system mounts
+  std::array<uint8_t, SD_SECTOR_SIZE> sector;
+  if (!SD.readRAW(sector.data(), 0)) {
+    LOG("%s:%d | Unable to read the first sector.\n", __FILE__, __LINE__);
+    return false;
+  }
+  if (!IsBootSector(sector)) {
+    uint32_t first_sector;
+    std::memcpy(&first_sector,
+                sector.data() + k_first_partition_start_offset,
+                sizeof(first_sector));
+    if (first_sector == 0 || !SD.readRAW(sector.data(), first_sector) || !IsBootSector(sector)) {
+      LOG("%s:%d | Unable to find the boot sector.\n", __FILE__, __LINE__);
+      return false;
+    }
+  }
+
+  uint32_t cluster_size;
+  if (std::equal(k_exfat_name.begin(), k_exfat_name.end(), sector.begin() + 3)) {
+    const unsigned shift = sector[k_exfat_bytes_per_sector_shift_offset] +
+                           sector[k_exfat_sectors_per_cluster_shift_offset];
+    // exFAT clusters are at most 32 MiB
+    cluster_size = shift <= 25 ? 1U << shift : 0;
+  } else {
+    const uint32_t bytes_per_sector = sector[k_bytes_per_sector_offset] |
+                                      (sector[k_bytes_per_sector_offset + 1] << 8);
+    cluster_size = bytes_per_sector * sector[k_sectors_per_cluster_offset];
+  }
 
-  std::vector<FileInfo> wav_infos = GetAllWavInfo();
-  std::sort(wav_infos.begin(), wav_infos.end(), FileInfo::SortTimestamp);
+  if (!std::has_single_bit(cluster_size) || cluster_size < SD_SECTOR_SIZE) {
+    LOG("%s:%d | Invalid cluster size of %lu bytes.\n", __FILE__, __LINE__, cluster_size);
+    return false;
+  }
+
+  // recordings are still written in `SD_CLUSTER_SIZE` chunks, which are only aligned to the
+  // card's clusters if they're whole multiples of them
+  if (SD_CLUSTER_SIZE % cluster_size != 0) {
+    LOG("The card's clusters of %lu bytes don't divide SD_CLUSTER_SIZE.\n", cluster_size);
+  }
+
+  m_cluster_size = cluster_size;
+  LOG("Cluster size: %lu bytes\n", m_cluster_size);
+
+  return true;
+}
+
+bool
+SDCard::StartEviction(const uint64_t free_bytes)
+{
+  if (!m_is_init) {
+    LOG("%s:%d | SD card is not initialized.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  if (m_is_evicting) {
+    LOG("Eviction is already running.\n");
+    return true;
+  }
+
+  if (m_eviction_finished_semaphore == nullptr) {
+    m_eviction_finished_semaphore = xSemaphoreCreateBinary();
+    if (m_eviction_finished_semaphore == nullptr) {
+      LOG("%s:%d | Unable to create the eviction semaphore.\n", __FILE__, __LINE__);
+      return false;
+    }
+  }
+  // a run which finished without being waited for leaves the semaphore given
+  xSemaphoreTake(m_eviction_finished_semaphore, 0);
+
+  m_eviction_target = free_bytes;
+  m_is_eviction_stop_requested = false;
+  m_is_evicting = true;
+
+  const BaseType_t rtos_result = xTaskCreate(
+    EvictionTaskExecutor, "SD_Eviction", 4096, this, EVICTION_TASK_PRIORITY, nullptr);
+  if (rtos_result != pdPASS) {
+    LOG("%s:%d | Unable to create the eviction task.\n", __FILE__, __LINE__);
+    m_is_evicting = false;
+    return false;
+  }
+
+  return true;
+}
+
+bool
+SDCard::StopEviction()
+{
+  if (!m_is_evicting) {
+    return true;
+  }
+
+  m_is_eviction_stop_requested = true;
+
+  if (xSemaphoreTake(m_eviction_finished_semaphore, pdMS_TO_TICKS(SLEEP_TIMEOUT_MS)) != pdTRUE) {
+    LOG("%s:%d | Timed out waiting for the eviction task.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  return true;
+}
+
+EvictionStats
+SDCard::GetEvictionStats() const
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const EvictionStats stats = m_eviction_stats;
+  xSemaphoreGive(m_mutex);
+
+  return stats;
+}
+
+void
+SDCard::EvictionTaskExecutor(void* args)
+{
+  reinterpret_cast<SDCard*>(args)->EvictionLoop();
+  vTaskDelete(nullptr);
+}
+
+void
+SDCard::EvictionLoop()
+{
+  const int64_t start_time_us = esp_timer_get_time();
+
+  // the counted free space drifts from the real one, e.g. by files written by others
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const bool is_sync_due = m_unsynced_bytes >= FREE_SPACE_SYNC_INTERVAL_BYTES ||
+                           m_unsynced_mount_count >= FREE_SPACE_SYNC_MOUNT_INTERVAL;
+  xSemaphoreGive(m_mutex);
+  if (is_sync_due) {
+    SyncFreeSpace();
+  }
 
-  const std::filesystem::path base_path = GetMountPointFs();
-  int64_t bytes_to_free = free_bytes - GetFreeSpace();
   std::size_t delete_counter = 0;
+  RecordingCursor cursor;
 
-  while (bytes_to_free > 0) {
-    std::filesystem::path file_path = base_path;
-    file_path /= DEVICE_NAME;
-    file_path += "_";
-    file_path += std::to_string(wav_infos[delete_counter].timestamp);
-    file_path += ".wav";
-
-    if (!std::filesystem::remove(file_path)) {
-      const auto s = file_path.string();
-      LOG("Failed to delete %.*s", s.length(), s.c_str());
-      ++delete_counter;
+  // the index lists the recordings the oldest first
+  while (GetFreeSpace() < m_eviction_target && !m_is_eviction_stop_requested) {
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    const std::optional<RecordingEntry> entry = m_index.GetNext(cursor);
+    xSemaphoreGive(m_mutex);
+
+    if (!entry.has_value()) {
+      LOG("No recordings left to delete.\n");
+      break;
+    }
+
+    const RecordingName file_name = entry->GetFileName();
+    if (!DeleteRecording(file_name.View())) {
+      LOG("Failed to delete %.*s\n", file_name.length, file_name.data.data());
       continue;
     }
 
-    bytes_to_free -= wav_infos[delete_counter].size;
+    const uint64_t freed_bytes = GetAllocatedSize(entry->size);
     ++delete_counter;
+
+    xSemaphoreTake(m_mutex, portMAX_DELAY);
+    m_eviction_stats.freed_bytes += freed_bytes;
+    ++m_eviction_stats.removed_files;
+    xSemaphoreGive(m_mutex);
+
+    vTaskDelay(pdMS_TO_TICKS(EVICTION_PAUSE_MS));
+  }
+
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  m_eviction_stats.elapsed_us += esp_timer_get_time() - start_time_us;
+  ++m_eviction_stats.run_count;
+  xSemaphoreGive(m_mutex);
+
+  LOG("%u files have been deleted.\n", delete_counter);
+
+  m_is_evicting = false;
+  xSemaphoreGive(m_eviction_finished_semaphore);
+}
+
+bool
+SDCard::RenameRecording(const std::string_view file_path, const std::string_view new_file_name)
+{
+  struct stat file_stats;
+  if (stat(file_path.data(), &file_stats) != 0) {
+    return false;
+  }
+
+  // the day directory is created by the first recording of the day
+  const std::string new_file_path = GetFilePath(new_file_name);
+  if (rename(file_path.data(), new_file_path.c_str()) != 0 &&
+      (errno != ENOENT || !CreateParentDirectories(new_file_path) ||
+       rename(file_path.data(), new_file_path.c_str()) != 0)) {
+    return false;
+  }
+
+  // the file is renamed either way, a missing entry is added when the index is rebuilt.
+  // Its space is counted once it's finished. A recovered recording is counted twice, if the
+  // free space was synced after the reset, until the next sync
+  const uint64_t allocated_size = GetAllocatedSize(file_stats.st_size);
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const bool is_indexed = m_index.Add(new_file_name, file_stats.st_size);
+  m_free_space -= std::min(m_free_space, allocated_size);
+  m_unsynced_bytes += allocated_size;
+  xSemaphoreGive(m_mutex);
+  if (!is_indexed) {
+    LOG("%s:%d | Failed to index '%.*s'.\n",
+        __FILE__,
+        __LINE__,
+        new_file_name.length(),
+        new_file_name.data());
+  }
+
+  return true;
+}
+
+bool
+SDCard::DeleteRecording(const std::string_view file_name)
+{
+  const std::string file_path = GetFilePath(file_name);
+  const bool is_deleted = std::remove(file_path.c_str()) == 0;
+  if (is_deleted) {
+    RemoveEmptyDirectories(file_path);
+  } else if (errno != ENOENT) {
+    LOG("%s:%d | Error deleting '%.*s': %d = %s\n",
+        __FILE__,
+        __LINE__,
+        file_name.length(),
+        file_name.data(),
+        errno,
+        strerror(errno));
+    return false;
+  }
+
+  // a file which is already gone is dropped from the index as well
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const std::optional<RecordingEntry> entry = m_index.Remove(file_name);
+  if (is_deleted && entry.has_value()) {
+    const uint64_t allocated_size = GetAllocatedSize(entry->size);
+    m_free_space += allocated_size;
+    m_unsynced_bytes += allocated_size;
   }
+  xSemaphoreGive(m_mutex);
 
-  LOG("%d files have been deleted.\n", delete_counter);
+  return is_deleted;
+}
+
+bool
+SDCard::MarkUploaded(const std::string_view file_name)
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const bool is_marked = m_index.SetUploadState(file_name, UploadState::Uploaded);
+  xSemaphoreGive(m_mutex);
 
-  return;
+  return is_marked;
+}
+
+std::size_t
+SDCard::GetPendingRecordings(RecordingCursor& cursor, const std::span<RecordingName> names) const
+{
+  xSemaphoreTake(m_mutex, portMAX_DELAY);
+  const std::size_t count = m_index.GetPending(cursor, names);
+  xSemaphoreGive(m_mutex);
+
+  return count;
 }
 
 // SDCard::~SDCard()
@@ -145,17 +693,64 @@ std::string
 SDCard::GetFilePath(const std::string_view file_name)
 {
   std::string file_path;
-  file_path.reserve(VFS_MOUNT_POINT.size() + sizeof('/') + file_path.size() + sizeof('\0'));
+  file_path.reserve(VFS_MOUNT_POINT.size() + sizeof("/YYYY/MM/DD/") + file_name.size());
 
   file_path.append(VFS_MOUNT_POINT);
   if (file_name[0] != '/') {
     file_path.append(1, '/');
   }
+
+  const std::optional<RecordingEntry> entry = RecordingEntry::FromFileName(file_name);
+  if (entry.has_value()) {
+    file_path.append(entry->GetDirectory()).append(1, '/');
+  }
   file_path.append(file_name);
 
   return file_path;
 }
 
+bool
+SDCard::CreateParentDirectories(const std::string_view file_path)
+{
+  std::string directory_path;
+  directory_path.reserve(file_path.size());
+
+  std::size_t separator_index = file_path.find('/', VFS_MOUNT_POINT.size() + 1);
+  while (separator_index != std::string_view::npos) {
+    directory_path.assign(file_path.substr(0, separator_index));
+    if (mkdir(directory_path.c_str(), 0777) != 0 && errno != EEXIST) {
+      LOG("%s:%d | Unable to create '%s'. errno: %d = %s\n",
+          __FILE__,
+          __LINE__,
+          directory_path.c_str(),
+          errno,
+          std::strerror(errno));
+      return false;
+    }
+
+    separator_index = file_path.find('/', separator_index + 1);
+  }
+
+  return true;
+}
+
+void
+SDCard::RemoveEmptyDirectories(const std::string_view file_path)
+{
+  std::string directory_path(file_path);
+
+  // removing a directory which isn't empty fails, as does removing its parents then
+  std::size_t separator_index = directory_path.rfind('/');
+  while (separator_index != std::string::npos && separator_index > VFS_MOUNT_POINT.size()) {
+    directory_path.resize(separator_index);
+    if (rmdir(directory_path.c_str()) != 0) {
+      break;
+    }
+
+    separator_index = directory_path.rfind('/');
+  }
+}
+
 std::size_t
 SDCard::GetFileSize(const std::string_view file_path)
 {
@@ -170,6 +765,13 @@ SDCard::GetFileSize(const std::string_view file_path)
   // return file_stats.st_size;
 }
 
+uint64_t
+SDCard::GetAllocatedSize(const std::size_t file_size) const
+{
+  // the file system allocates whole clusters
+  return (uint64_t{ file_size } + m_cluster_size - 1) / m_cluster_size * m_cluster_size;
+}
+
 std::string_view
 SDCard::GetMountPoint()
 {
@@ -182,71 +784,4 @@ SDCard::GetMountPointFs()
   return std::filesystem::path(VFS_MOUNT_POINT);
 }
 
-bool
-SDCard::HasExtension(const std::string_view file, const std::string_view extension)
-{
-  return file.substr(file.find_last_of(".")) == extension;
-}
-
-std::size_t
-SDCard::GetTimestampFromName(const std::string_view file_name)
-{
-  // extract the timestamp from the file name
-  const std::size_t start_index = file_name.find_first_of("_");
-  const std::string_view string_timestamp =
-    file_name.substr(start_index + 1, file_name.find_last_of(".") - start_index - 1);
-
-  // convert it to int
-  std::size_t value = 0;
-  const std::from_chars_result result = std::from_chars(
-    string_timestamp.data(), string_timestamp.data() + string_timestamp.size(), value);
-  if (result.ec == std::errc::invalid_argument) {
-    LOG("Failed to convert `%.*s` to int.", string_timestamp.length(), string_timestamp.data());
-    return 0;
-  }
-
-  return value;
-}
-
-std::vector<FileInfo>
-SDCard::GetAllWavInfo()
-{
-  std::vector<FileInfo> result = {};
-
-  DIR* dir;
-  dir = opendir(GetMountPoint().data());
-
-  if (dir == nullptr) {
-    LOG("Failed to open the mount directory");
-    return result;
-  }
-
-  dirent* dir_entity;
-  while ((dir_entity = readdir(dir)) != nullptr) {
-    // skip the directory entity if it's not a file
-    if (dir_entity->d_type != DT_REG) {
-      continue;
-    }
-
-    const std::string_view file_name(dir_entity->d_name);
-    if (!HasExtension(file_name, ".wav")) {
-      // skip the file if it's not a .wav file
-      continue;
-    }
-
-    const std::size_t timestamp = GetTimestampFromName(file_name);
-    if (timestamp == 0) {
-      // skip the file if there is something wrong with the timestamp
-      continue;
-    }
-
-    result.push_back(
-      FileInfo{ .timestamp = timestamp, .size = GetFileSize(GetFilePath(file_name)) });
-  }
-
-  closedir(dir);
-
-  return result;
-}
-
 } // namespace sd
\ No newline at end of file
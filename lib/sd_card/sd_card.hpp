@@ -1,54 +1,194 @@
 #pragma once
 
+#include <atomic>
 #include <filesystem>
+#include <span>
 #include <string>
 #include <string_view>
-#include <vector>
 
 #include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "recording_index.hpp"
 
 namespace sd {
 
-struct FileInfo
+struct EvictionStats
 {
-  std::size_t timestamp;
-  std::size_t size;
+  // space freed & recordings deleted by all eviction runs since boot
+  uint64_t freed_bytes;
+  std::size_t removed_files;
+  // time spent in eviction runs, including the pauses between deletions
+  uint64_t elapsed_us;
+  std::size_t run_count;
+};
 
-  static bool SortTimestamp(const FileInfo& a, const FileInfo& b)
-  {
-    return a.timestamp < b.timestamp;
-  }
+/// @brief SPI clock & write performance of a card, measured when it's first mounted, and stored
+/// on it, so later mounts skip the measurement
+struct CardProfile
+{
+  char magic[4] = { 'S', 'D', 'P', 'F' };
+  uint16_t version = 1;
+  uint8_t card_type = 0;
+  uint8_t reserved = 0;
+  // identifies the card together with its type
+  uint64_t card_size = 0;
+  // fastest clock at which the card passed the read-back check, stepped down after errors
+  uint32_t spi_frequency_hz = 0;
+  // sustained sequential write throughput & the slowest write of a cluster, at the clock above
+  uint32_t write_throughput_bps = 0;
+  uint32_t worst_write_latency_us = 0;
+  // CRC-32 of the fields above
+  uint32_t checksum = 0;
 };
 
+/// @brief The SD card & the recordings on it.
+/// Recordings are renamed, deleted & listed through the recording index, which is guarded by
+/// a mutex, so the recorder's storage task, the upload & the eviction task can share it
 class SDCard
 {
 public:
+  /// @brief Mounts the card at the SPI clock of its profile. A card without a profile is mounted
+  /// at the slowest clock of `SD_SPI_FREQUENCIES_HZ`, then probed at each faster one, and the
+  /// fastest one which passes a read-back check is stored in its profile. The profile is also
+  /// kept in RAM, so mounts after a sleep don't read it again
+  /// @return `true` if successful, `false` otherwise
   bool Init();
+  /// @brief Stops the eviction, closes the recording index & unmounts the card. If the eviction
+  /// task doesn't stop, the card is left mounted under it & the index is not closed
   void DeInit();
 
-  uint64_t GetFreeSpace();
-  void EnsureFreeSpace(const uint64_t& free_bytes);
+  const CardProfile& GetCardProfile() const { return m_profile; }
+
+  /// @brief Reports a failed read or write, e.g. a CRC error or a timeout. The SPI clock is
+  /// stepped down at the next mount
+  void ReportIoError() { m_is_derate_requested = true; }
+
+  /// @brief Returns the free space, which is counted down & up by the recordings renamed &
+  /// deleted through this class, so it costs no file system access. It's kept across unmounts
+  /// in the recording index, & synced with the file system when the index is stale, and by the
+  /// eviction after `FREE_SPACE_SYNC_INTERVAL_BYTES` have been counted or after
+  /// `FREE_SPACE_SYNC_MOUNT_INTERVAL` mounts
+  uint64_t GetFreeSpace() const;
+
+  /// @brief Asks the file system for the free space. On a large & full card this can take a scan
+  /// of the whole FAT
+  void SyncFreeSpace();
+
+  /// @brief Starts a low-priority task which deletes the oldest recordings until at least
+  /// `free_bytes` are free. It deletes one recording at a time & pauses in between, so it never
+  /// holds the card or the index for long, & it needs no memory for the list of recordings
+  /// @return `true` if the task is running, `false` otherwise
+  bool StartEviction(const uint64_t free_bytes);
+
+  /// @brief Stops the eviction task after its current deletion & waits for it
+  /// @return `true` if the task is not running anymore, `false` otherwise
+  bool StopEviction();
+
+  bool IsEvicting() const { return m_is_evicting; }
+
+  EvictionStats GetEvictionStats() const;
+
+  /// @brief Renames the finished recording at `file_path` to `new_file_name` & adds it to the
+  /// recording index
+  /// @return `true` if successful, `false` if the file could not be renamed. `errno` is set then
+  bool RenameRecording(const std::string_view file_path, const std::string_view new_file_name);
+
+  /// @brief Deletes the recording `file_name` & removes it from the recording index
+  /// @return `true` if successful, `false` otherwise
+  bool DeleteRecording(const std::string_view file_name);
+
+  /// @brief Marks the recording `file_name` as uploaded in the recording index, so it's not
+  /// uploaded again
+  bool MarkUploaded(const std::string_view file_name);
+
+  /// @brief Copies the names of the next recordings waiting to be uploaded into `names`, the
+  /// oldest first, and advances `cursor` past them. Recordings deleted or marked as uploaded
+  /// meanwhile don't shift the cursor, so every recording is returned at most once
+  /// @return amount of names copied, 0 once all recordings have been enumerated
+  std::size_t GetPendingRecordings(RecordingCursor& cursor,
+                                   const std::span<RecordingName> names) const;
 
   // ~SDCard();
 
   /// @brief Creates a full file path string for `file_name`, which includes SD card VFS mount
-  /// point
+  /// point. Recordings are stored in a directory per day, "YYYY/MM/DD", so no directory holds
+  /// more than a day's worth of them, and their paths include it
   /// @param file_name file name
   /// @return file path
   static std::string GetFilePath(const std::string_view file_name);
+
+  /// @brief Creates the missing directories of `file_path` below the mount point
+  /// @return `true` if successful, `false` otherwise. `errno` is set then
+  static bool CreateParentDirectories(const std::string_view file_path);
   static std::size_t GetFileSize(const std::string_view file_path);
 
+  /// @brief Returns the space a file of `file_size` bytes takes on the mounted card
+  uint64_t GetAllocatedSize(const std::size_t file_size) const;
+
   static std::string_view GetMountPoint();
   static std::filesystem::path GetMountPointFs();
 
 private:
-  static bool HasExtension(const std::string_view file, const std::string_view extension);
-  static std::size_t GetTimestampFromName(const std::string_view file_name);
+  /// @brief Mounts the card at `frequency_hz`, unmounting it first if it's mounted at another clock
+  bool Mount(const uint32_t frequency_hz);
+
+  /// @brief Loads the profile stored on the mounted card
+  /// @return `true` if the card has a valid profile, `false` otherwise
+  bool LoadProfile();
+  bool StoreProfile();
+  /// @brief Reads the cluster size from the boot sector of the mounted card's volume
+  /// @return `true` if successful, `false` otherwise
+  bool LoadClusterSize();
 
-  std::vector<FileInfo> GetAllWavInfo();
+  /// @brief Steps the clock up until the card fails the read-back check, and measures the write
+  /// performance at the fastest clock which passed it
+  /// @return `true` if the card is mounted at that clock, `false` otherwise
+  bool ProbeClock();
+  /// @brief Writes a pattern depending on `seed` into a scratch file, & reads it back
+  /// @return `true` if the pattern has been read back intact, `false` otherwise
+  bool VerifyScratchFile(const uint32_t seed);
+  /// @brief Writes `SD_PROBE_WRITE_BYTES` into a scratch file in clusters, the way recordings
+  /// are written, & stores the throughput & the worst latency in the profile
+  void MeasureWriteSpeed();
+  /// @brief Steps the profile's clock down to the next slower one
+  /// @return `true` if successful, `false` if it's already at the slowest one
+  bool DerateClock();
+
+  /// @brief Removes the directories of `file_path` below the mount point which are empty
+  static void RemoveEmptyDirectories(const std::string_view file_path);
+
+  static void EvictionTaskExecutor(void* args);
+
+  void EvictionLoop();
 
 private:
   bool m_is_init = false;
+  RecordingIndex m_index;
+
+  CardProfile m_profile;
+  // set when the profile has changed & has to be stored on the card
+  bool m_is_profile_changed = false;
+  std::atomic<bool> m_is_derate_requested = false;
+  // clock the card is mounted at, 0 if it's not mounted
+  uint32_t m_mounted_frequency_hz = 0;
+  // guards the index, the free space & the eviction statistics
+  SemaphoreHandle_t m_mutex = nullptr;
+  uint64_t m_free_space = 0;
+  // space of the files counted into the free space since it was last synced
+  uint64_t m_unsynced_bytes = 0;
+  // mounts since the free space was last synced, kept across unmounts in the recording index
+  uint8_t m_unsynced_mount_count = 0;
+  // of the mounted card's volume, the file system allocates files in whole clusters
+  uint32_t m_cluster_size = SD_CLUSTER_SIZE;
+
+  SemaphoreHandle_t m_eviction_finished_semaphore = nullptr;
+  std::atomic<bool> m_is_evicting = false;
+  std::atomic<bool> m_is_eviction_stop_requested = false;
+  uint64_t m_eviction_target = 0;
+  EvictionStats m_eviction_stats = {};
 };
 
 } // namespace sd
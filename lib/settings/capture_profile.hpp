@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// One frame is a single 32-bit I2S word, holding 24 bits of microphone data
+constexpr std::size_t I2S_FRAME_BYTES = sizeof(int32_t);
+// Maximum size of a single DMA buffer supported by the I2S driver
+constexpr std::size_t I2S_MAX_DMA_BUFFER_BYTES = 4092;
+
+struct CaptureProfile
+{
+  uint32_t sample_rate_hz;
+  // amount of DMA buffers (descriptors) in the I2S DMA ring
+  uint32_t dma_desc_num;
+  // amount of frames in each DMA buffer
+  uint32_t dma_frame_num;
+  // amount of frames read from the I2S at once
+  std::size_t read_chunk_frames;
+  // size of the WAV writer's buffer, must be a multiple of the SD card's cluster size
+  std::size_t write_buffer_bytes;
+};
+
+/// @brief Size of a single DMA buffer
+constexpr std::size_t
+DmaBufferBytes(const CaptureProfile& profile)
+{
+  return profile.dma_frame_num * I2S_FRAME_BYTES;
+}
+
+/// @brief RAM used by the whole DMA ring
+constexpr std::size_t
+DmaRingBytes(const CaptureProfile& profile)
+{
+  return profile.dma_desc_num * DmaBufferBytes(profile);
+}
+
+/// @brief For how long the DMA ring can keep receiving frames without being read
+constexpr std::size_t
+DmaRingDurationMs(const CaptureProfile& profile)
+{
+  // one buffer is always being filled by the hardware, so it can not be counted
+  return (profile.dma_desc_num - 1) * profile.dma_frame_num * 1'000 / profile.sample_rate_hz;
+}
+
+/// @brief Derives the minimum amount of DMA descriptors, which can absorb a reader stall
+/// of `worst_latency_ms` without losing frames
+/// @param profile profile which sample rate, frame & chunk sizes are used
+/// @param worst_latency_ms measured worst-case time between two reads
+/// @return minimum safe `dma_desc_num`
+constexpr uint32_t
+MinDmaDescriptors(const CaptureProfile& profile, const std::size_t worst_latency_ms)
+{
+  // frames arriving during the stall, plus the chunk the reader is waiting for
+  const std::size_t frames_to_hold =
+    (worst_latency_ms * profile.sample_rate_hz + 999) / 1'000 + profile.read_chunk_frames;
+  const std::size_t buffers_to_hold =
+    (frames_to_hold + profile.dma_frame_num - 1) / profile.dma_frame_num;
+
+  // plus the buffer which is being filled by the hardware
+  return buffers_to_hold + 1;
+}
+
+/// @brief Checks whether the driver accepts the profile, whether its DMA ring can hold at
+/// least one read chunk, and whether the write buffer consists of whole clusters
+constexpr bool
+IsCaptureProfileValid(const CaptureProfile& profile, const std::size_t cluster_size)
+{
+  return profile.sample_rate_hz != 0 && profile.dma_desc_num >= 2 && profile.dma_frame_num != 0 &&
+         profile.read_chunk_frames != 0 && DmaBufferBytes(profile) <= I2S_MAX_DMA_BUFFER_BYTES &&
+         profile.dma_desc_num >= MinDmaDescriptors(profile, 0) &&
+         profile.write_buffer_bytes != 0 && profile.write_buffer_bytes % cluster_size == 0;
+}
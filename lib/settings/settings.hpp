@@ -1,15 +1,127 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cstdint>
 #include <string_view>
 #include <tuple>
 
 // #include "hal/gpio_types.h"
 
-constexpr std::size_t MIC_SAMPLE_RATE = 16'000; // Hz
-// constexpr std::size_t MIC_SAMPLE_RATE = 32'000; // Hz
-// constexpr std::size_t MIC_SAMPLE_RATE = 44'100; // Hz
+#include "capture_profile.hpp"
+
+// Cluster size of the SD card's FAT file system. 32 KB is the SD Association's default for
+// SDHC cards
+constexpr std::size_t SD_CLUSTER_SIZE = 32 * 1024; // bytes
+
+constexpr CaptureProfile CAPTURE_PROFILE_16K = { .sample_rate_hz = 16'000,
+                                                 .dma_desc_num = 8,
+                                                 .dma_frame_num = 256,
+                                                 .read_chunk_frames = 1024,
+                                                 .write_buffer_bytes = SD_CLUSTER_SIZE };
+constexpr CaptureProfile CAPTURE_PROFILE_32K = { .sample_rate_hz = 32'000,
+                                                 .dma_desc_num = 8,
+                                                 .dma_frame_num = 512,
+                                                 .read_chunk_frames = 1024,
+                                                 .write_buffer_bytes = SD_CLUSTER_SIZE };
+constexpr CaptureProfile CAPTURE_PROFILE_44K1 = { .sample_rate_hz = 44'100,
+                                                  .dma_desc_num = 12,
+                                                  .dma_frame_num = 512,
+                                                  .read_chunk_frames = 1024,
+                                                  .write_buffer_bytes = 2 * SD_CLUSTER_SIZE };
+constexpr std::array<CaptureProfile, 3> CAPTURE_PROFILES = { CAPTURE_PROFILE_16K,
+                                                             CAPTURE_PROFILE_32K,
+                                                             CAPTURE_PROFILE_44K1 };
+
+constexpr CaptureProfile CAPTURE_PROFILE = CAPTURE_PROFILE_16K;
+// constexpr CaptureProfile CAPTURE_PROFILE = CAPTURE_PROFILE_32K;
+// constexpr CaptureProfile CAPTURE_PROFILE = CAPTURE_PROFILE_44K1;
+
+constexpr std::size_t MIC_SAMPLE_RATE = CAPTURE_PROFILE.sample_rate_hz; // Hz
+
+// Amount of samples read from the I2S sampler at once
+constexpr std::size_t MIC_READ_CHUNK_SAMPLES = CAPTURE_PROFILE.read_chunk_frames;
+
+// Microphone warm-up. Samples are discarded in blocks, until the DC level & the variance of
+// two consecutive blocks differ by no more than the tolerances, or the maximum is reached
+constexpr std::size_t WARMUP_BLOCK_SAMPLES = 256;
+constexpr std::size_t WARMUP_MAX_SAMPLES = 128 * 60;
+constexpr int64_t WARMUP_DC_TOLERANCE = 16;       // 16-bit sample units
+constexpr int64_t WARMUP_VARIANCE_FLOOR = 16 * 16; // 16-bit sample units squared
+constexpr int64_t WARMUP_VARIANCE_TOLERANCE_PERCENT = 25;
+
+// Sample conditioning. The DC-blocking high-pass filter's pole is 1 - 2^-CONDITIONER_DC_POLE_SHIFT,
+// its corner frequency is about MIC_SAMPLE_RATE / (2 * pi * 2^shift), 2.5 Hz at 16 kHz
+constexpr uint8_t CONDITIONER_DC_POLE_SHIFT = 10;
+// How many of the 24 data bits are dropped. 8 keeps the 16 most significant bits
+constexpr uint8_t CONDITIONER_GAIN_SHIFT = 8;
+
+// Automatic gain. The gain shift is picked per block, so the block's peak has AGC_HEADROOM_BITS
+// of headroom. It ranges from CONDITIONER_GAIN_SHIFT (lowest gain) to AGC_MIN_GAIN_SHIFT
+// (highest gain, +36 dB). Gain is raised by one step (6 dB) after AGC_RELEASE_BLOCKS quiet blocks
+constexpr bool AGC_ENABLED = true;
+constexpr uint8_t AGC_MIN_GAIN_SHIFT = 2;
+constexpr int AGC_HEADROOM_BITS = 1;
+constexpr std::size_t AGC_RELEASE_BLOCKS = 32; // 2 s at 16 kHz
+// Maximum amount of gain changes stored per recording, the gain is frozen once it's full
+constexpr std::size_t AGC_GAIN_LOG_SIZE = 256;
+
+// Pre-roll. While the device is awake & idle, the microphone keeps being captured, and the last
+// PREROLL_MS of audio are prepended to a new recording. 0 disables the pre-roll
+constexpr std::size_t PREROLL_MS = 500;
+constexpr std::size_t PREROLL_SAMPLES = MIC_SAMPLE_RATE * PREROLL_MS / 1'000;
+// A pre-roll capture which fails to start is retried after PREROLL_RETRY_MIN_MS, & the interval
+// doubles with every further failure, up to PREROLL_RETRY_MAX_MS
+constexpr std::size_t PREROLL_RETRY_MIN_MS = 1'000;
+constexpr std::size_t PREROLL_RETRY_MAX_MS = 60'000;
+
+// Duration of an SD card write stall the capture buffer must absorb without losing samples
+constexpr std::size_t CAPTURE_BUFFER_STALL_MS = 500;
+// Capacity of the ring buffer between the capture & the storage tasks. Must be a power of two.
+// Also holds the pre-roll audio
+constexpr std::size_t CAPTURE_BUFFER_SAMPLES = std::bit_ceil(
+  MIC_SAMPLE_RATE * CAPTURE_BUFFER_STALL_MS / 1'000 + PREROLL_SAMPLES + MIC_READ_CHUNK_SAMPLES);
+
+// The driver must accept every profile. Its buffering math is verified by the
+// `test_capture_profile` test of the `native` environment
+static_assert(std::all_of(CAPTURE_PROFILES.begin(),
+                          CAPTURE_PROFILES.end(),
+                          [](const CaptureProfile& profile) {
+                            return IsCaptureProfileValid(profile, SD_CLUSTER_SIZE);
+                          }));
+
+// Runs the capture stress test at startup. Set by the `capture-stress` environment of
+// platformio.ini
+#ifndef CAPTURE_STRESS
+#define CAPTURE_STRESS 0
+#endif
+struct CaptureStressStep
+{
+  uint32_t sample_rate_hz;
+  // channels are interleaved into the mono pipeline, which then runs at
+  // `sample_rate_hz * channels`
+  uint8_t channels;
+};
+// Steps of the capture stress test, the production profile first, then with a rising load.
+// The test stops at the first step which loses samples
+constexpr std::array<CaptureStressStep, 8> CAPTURE_STRESS_STEPS = { {
+  { .sample_rate_hz = MIC_SAMPLE_RATE, .channels = 1 },
+  { .sample_rate_hz = 32'000, .channels = 1 },
+  { .sample_rate_hz = 44'100, .channels = 1 },
+  { .sample_rate_hz = 48'000, .channels = 1 },
+  { .sample_rate_hz = 44'100, .channels = 2 },
+  { .sample_rate_hz = 48'000, .channels = 2 },
+  { .sample_rate_hz = 96'000, .channels = 2 },
+  { .sample_rate_hz = 192'000, .channels = 2 },
+} };
+// Duration of each step, long enough for the SD card's occasional long writes
+constexpr std::size_t CAPTURE_STRESS_STEP_MS = 20'000;
+constexpr std::string_view CAPTURE_STRESS_FILE_NAME = "stress.tmp";
+
+constexpr unsigned CAPTURE_TASK_PRIORITY = 20;
+constexpr unsigned STORAGE_TASK_PRIORITY = 10;
+constexpr unsigned EVICTION_TASK_PRIORITY = 1;
 
 namespace pins {
 
@@ -70,9 +182,130 @@ constexpr int ROT_DEF_VALUE = 1;
 
 constexpr std::size_t SLEEP_TIMEOUT_MS = 10'000;
 
-constexpr std::string_view VFS_MOUNT_POINT = "/storage";
+// The `native` environment of platformio.ini mounts the fake card of the tests elsewhere
+#ifndef VFS_MOUNT_POINT_PATH
+#define VFS_MOUNT_POINT_PATH "/storage"
+#endif
+constexpr std::string_view VFS_MOUNT_POINT = VFS_MOUNT_POINT_PATH;
+constexpr uint8_t SD_MAX_OPEN_FILES = 5;
+// SPI clocks the SD card is probed at when it's mounted for the first time, the slowest first.
+// The slowest one must work with every card
+constexpr std::array<uint32_t, 7> SD_SPI_FREQUENCIES_HZ = {
+  4'000'000, 8'000'000, 10'000'000, 16'000'000, 20'000'000, 26'666'666, 40'000'000,
+};
+// The card's profile, with the clock it has been probed at, is stored in this file
+constexpr std::string_view SD_CARD_PROFILE_NAME = "card_profile.bin";
+// Scratch file of the probing
+constexpr std::string_view SD_PROBE_FILE_NAME = "probe.tmp";
+// Amount of data written to measure the card's write performance
+constexpr std::size_t SD_PROBE_WRITE_BYTES = 1024 * 1024;
+// Runs the SD card benchmark once the card is mounted at startup. Set by the `sd-benchmark`
+// environment of platformio.ini
+#ifndef SD_BENCHMARK
+#define SD_BENCHMARK 0
+#endif
+// Sizes of the appends of the benchmark, each of which writes `SD_BENCHMARK_APPEND_BYTES`
+constexpr std::array<std::size_t, 6> SD_BENCHMARK_APPEND_SIZES = {
+  512, 1024, 4 * 1024, 16 * 1024, 32 * 1024, 64 * 1024,
+};
+constexpr std::size_t SD_BENCHMARK_APPEND_BYTES = 1024 * 1024;
+// Amount of header rewrites, renames & deletes of the benchmark
+constexpr std::size_t SD_BENCHMARK_FILE_OPERATIONS = 32;
+constexpr std::string_view SD_BENCHMARK_FILE_NAME = "benchmark.tmp";
+// The results of all benchmark runs are appended to this file
+constexpr std::string_view SD_BENCHMARK_RESULTS_NAME = "benchmark.csv";
+// Sector size of the SD card. WAV audio data is aligned to, and written in whole sectors
+constexpr std::size_t SD_SECTOR_SIZE = 512; // bytes
+enum class WavFormat : uint8_t
+{
+  // 16-bit PCM, 32 KB/s at 16 kHz
+  Pcm16,
+  // 4-bit IMA-ADPCM, about a quarter of the PCM size
+  ImaAdpcm,
+};
+constexpr WavFormat WAV_FORMAT = WavFormat::Pcm16;
+// Size of an IMA-ADPCM block, a whole sector keeps blocks sector-aligned
+constexpr std::size_t ADPCM_BLOCK_BYTES = SD_SECTOR_SIZE;
+// A block holds the first sample in its 4-byte header, and two samples per remaining byte
+constexpr std::size_t ADPCM_BYTE_RATE =
+  MIC_SAMPLE_RATE * ADPCM_BLOCK_BYTES / ((ADPCM_BLOCK_BYTES - 4) * 2 + 1);
+// Bytes of audio data per second of recording
+constexpr std::size_t WAV_BYTE_RATE =
+  WAV_FORMAT == WavFormat::Pcm16 ? MIC_SAMPLE_RATE * sizeof(int16_t) : ADPCM_BYTE_RATE;
+
+// Recordings reserve clusters ahead of the write position in chunks of this much audio, so the
+// FAT chain is extended in rare planned bursts instead of on every cluster. 0 disables it
+constexpr std::size_t WAV_PREALLOCATION_MS = 30'000;
+constexpr std::size_t WAV_PREALLOCATION_BYTES =
+  (WAV_BYTE_RATE * WAV_PREALLOCATION_MS / 1'000 + SD_CLUSTER_SIZE - 1) / SD_CLUSTER_SIZE *
+  SD_CLUSTER_SIZE;
+// The WAV header is rewritten & the file synced after every this much audio, so a power loss
+// or a reset loses at most this much of a recording. Shorter intervals cost an extra sector
+// write & a FAT update more often. 0 disables it
+constexpr std::size_t WAV_HEADER_COMMIT_INTERVAL_MS = 5'000;
+constexpr std::size_t WAV_HEADER_COMMIT_INTERVAL_BYTES =
+  WAV_BYTE_RATE * WAV_HEADER_COMMIT_INTERVAL_MS / 1'000;
+
+enum class RecordingFormat : uint8_t
+{
+  // .wav in the format selected by `WAV_FORMAT`
+  Wav,
+  // lossless FLAC, about half the PCM size on speech
+  Flac,
+};
+constexpr RecordingFormat RECORDING_FORMAT = RecordingFormat::Wav;
+constexpr std::string_view RECORDING_FILE_EXTENSION =
+  RECORDING_FORMAT == RecordingFormat::Wav ? ".wav" : ".flac";
+// Samples per FLAC frame. Longer frames predict a bit better, but the encoder keeps 6 bytes
+// per sample of the frame in RAM
+constexpr std::size_t FLAC_BLOCK_SAMPLES = 4'096;
+// FLAC files are committed after about the same time as WAV files, assuming half the PCM size.
+// Their clusters are not reserved ahead, so the synced file size marks the committed frames
+constexpr std::size_t FLAC_HEADER_COMMIT_INTERVAL_BYTES =
+  MIC_SAMPLE_RATE * sizeof(int16_t) / 2 * WAV_HEADER_COMMIT_INTERVAL_MS / 1'000;
+
+// Long recordings are split into segments, each finished & renamed with a sequence number while
+// the recording continues, so they can be uploaded early & a damaged file loses only a part of
+// the session. A segment ends after this many seconds of audio, or once its file reaches
+// `RECORDING_SEGMENT_BYTES`, whichever comes first. 0 disables either limit
+constexpr std::size_t RECORDING_SEGMENT_SECONDS = 0;
+constexpr std::size_t RECORDING_SEGMENT_SAMPLES = MIC_SAMPLE_RATE * RECORDING_SEGMENT_SECONDS;
+constexpr std::size_t RECORDING_SEGMENT_BYTES = 0 * 1024 * 1024;
+
+// Recordings are written into this file, & renamed once they're finished
+constexpr std::string_view TEMP_RECORDING_NAME =
+  RECORDING_FORMAT == RecordingFormat::Wav ? "temp.wav" : "temp.flac";
+// Binary index of the recordings on the card, which spares scanning the directory
+constexpr std::string_view RECORDING_INDEX_NAME = "recordings.idx";
 // Amount of free space below which files will be deleted
 constexpr uint64_t FULL_STORAGE_THRESHOLD = 100 * 1024 * 1024; // bytes
+// The eviction deletes one recording at a time, and waits this long after each, so it shares
+// the card with the recording & the upload
+constexpr std::size_t EVICTION_PAUSE_MS = 20;
+// The free space is counted with every renamed & deleted recording, and synced with the file
+// system, which may have to scan the whole FAT for it, once this much has been counted
+constexpr uint64_t FREE_SPACE_SYNC_INTERVAL_BYTES = 1024 * 1024 * 1024;
+// Files written or deleted outside of the recorder, & partly used clusters, aren't counted, so
+// the free space is synced as well after this many mounts without a sync. At most 255
+constexpr uint8_t FREE_SPACE_SYNC_MOUNT_INTERVAL = 50;
+
+enum class RecordingStore : uint8_t
+{
+  // a file per recording on the FAT file system
+  Fat,
+  // records of a circular append-only log on a raw partition, with no file system metadata to
+  // update while recording. Recordings are 16-bit PCM, & uploaded as .wav streams. The oldest
+  // records are overwritten instead of evicted, and comments & gain logs are not kept
+  Log,
+};
+constexpr RecordingStore RECORDING_STORE = RecordingStore::Fat;
+// MBR type of the partition which holds the log, 0xDA marks non-file system data
+constexpr uint8_t LOG_STORE_PARTITION_TYPE = 0xDA;
+// Cards without such a partition keep the log in a preallocated file of this size instead
+constexpr std::string_view LOG_STORE_FILE_NAME = "recordings.log";
+constexpr uint64_t LOG_STORE_FILE_BYTES = 256 * 1024 * 1024;
+// Audio is appended to the log in whole sectors, collected in a buffer of this size
+constexpr std::size_t LOG_STORE_WRITE_BUFFER_BYTES = 16 * SD_SECTOR_SIZE;
 
 constexpr std::string_view DEVICE_NAME = "esp-recorder";
 
@@ -84,6 +317,8 @@ constexpr std::string_view CONFIG_FTP_SERVER = "192.168.0.136";
 constexpr uint16_t CONFIG_FTP_PORT = 21;
 constexpr std::string_view CONFIG_FTP_USER = "esp-recordings";
 constexpr std::string_view CONFIG_FTP_PASSWORD = "Admin0308";
+// Amount of recording names enumerated at once for the upload
+constexpr std::size_t UPLOAD_BATCH_SIZE = 8;
 
 #define DEBUG_SD 1
 #define DEBUG_MIC 1
@@ -91,4 +326,5 @@ constexpr std::string_view CONFIG_FTP_PASSWORD = "Admin0308";
 #define DEBUG_COM 1
 #define DEBUG_SCREEN 1
 #define DEBUG_SPI 1
-#define DEBUG_TIMER 1
\ No newline at end of file
+#define DEBUG_TIMER 1
+#define DEBUG_REC 1
\ No newline at end of file
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "wav_header.hpp"
+
+/// @brief Recording file which the recorder's storage task writes samples into,
+/// regardless of the file format
+class AudioWriter
+{
+public:
+  virtual ~AudioWriter() = default;
+
+  virtual void WriteSamples(const std::span<const int16_t> samples) = 0;
+
+  /// @brief Sets a comment which is stored in the file's metadata when the file is closed.
+  /// Longer comments are truncated
+  virtual void SetComment(const std::string_view comment) = 0;
+
+  /// @brief Sets the per-block gain log, which is stored in the file's metadata when the file is
+  /// closed, if the format supports it. `gain_log` must stay valid until then
+  virtual void SetGainLog(const std::span<const wav_gain_entry_t> gain_log) = 0;
+
+  virtual bool Close() = 0;
+
+  /// @brief Returns the size of the file written so far, including buffered data
+  virtual std::size_t GetFileSize() const = 0;
+};
@@ -0,0 +1,318 @@
+#include "cluster_writer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+
+#include "esp_timer.h"
+
+#include "settings.hpp"
+
+#if DEBUG_WAV
+#define LOG(...) Serial.printf(__VA_ARGS__)
+#else
+#define LOG(...)
+#endif
+
+// Write buffer shared by all writers, sized for the selected capture profile
+static std::array<uint8_t, CAPTURE_PROFILE.write_buffer_bytes> s_write_buffer;
+static bool s_is_write_buffer_used = false;
+
+static constexpr std::size_t
+RoundUpToCluster(const std::size_t size)
+{
+  return (size + SD_CLUSTER_SIZE - 1) / SD_CLUSTER_SIZE * SD_CLUSTER_SIZE;
+}
+
+bool
+ClusterWriter::Open(const std::string_view file_path,
+                    const std::span<const uint8_t> header,
+                    const std::size_t write_buffer_size,
+                    const std::size_t preallocation_size,
+                    const std::size_t header_commit_interval)
+{
+  LOG("Opening file '%.*s'...\n", file_path.size(), file_path.data());
+
+  if (s_is_write_buffer_used) {
+    LOG("%s:%d | Another file is already open.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  m_fp = fopen(file_path.data(), "wb");
+
+  if (m_fp == nullptr) {
+    perror("");
+    return false;
+  }
+
+  // writes are already sized in whole clusters, stdio buffering would only split them
+  setvbuf(m_fp, nullptr, _IONBF, 0);
+
+  // write out the header - the owner fills in the blanks later
+  const std::size_t written = std::fwrite(header.data(), header.size(), 1, m_fp);
+  if (written != 1) {
+    LOG("%s:%d | Error writing the header:\n", __FILE__, __LINE__);
+    perror("");
+    fclose(m_fp);
+    m_fp = nullptr;
+    return false;
+  }
+
+  s_is_write_buffer_used = true;
+  m_buffer = s_write_buffer.data();
+  m_buffer_capacity = std::max(
+    SD_CLUSTER_SIZE,
+    std::min(write_buffer_size, s_write_buffer.size()) / SD_CLUSTER_SIZE * SD_CLUSTER_SIZE);
+  m_buffer_size = 0;
+  m_flushed_size = header.size();
+  // the first flush completes the cluster which holds the header
+  m_flush_threshold = m_buffer_capacity - m_flushed_size % SD_CLUSTER_SIZE;
+  m_stats = ClusterWriterStats{};
+
+  m_header_commit_interval = header_commit_interval;
+  m_committed_size = m_flushed_size;
+
+  m_preallocation_size = RoundUpToCluster(preallocation_size);
+  m_reserved_size = header.size();
+  m_allocated_size = SD_CLUSTER_SIZE;
+  // the first chunk is reserved before the recording starts, away from the capture path
+  if (m_preallocation_size != 0) {
+    Reserve(m_flushed_size + m_buffer_capacity);
+  }
+
+  m_file_size = header.size();
+
+  return true;
+}
+
+bool
+ClusterWriter::Close(const std::span<const uint8_t> header)
+{
+  if (m_fp == nullptr) {
+    return true;
+  }
+
+  Flush();
+  m_buffer = nullptr;
+  s_is_write_buffer_used = false;
+
+  LOG("Finished file size: %u, buffer flushes: %u, worst flush: %lu us\n",
+      m_file_size,
+      m_stats.flush_count,
+      m_stats.worst_flush_latency_us);
+  for (std::size_t i = 0; i < m_stats.flush_latency_histogram.size(); ++i) {
+    LOG("  < %5u ms: %lu\n", 1U << i, m_stats.flush_latency_histogram[i]);
+  }
+  // without preallocation every cluster of the file would have been allocated by a write
+  LOG("FAT allocations: %u (%u reservations of %u clusters, %u by writes), without "
+      "preallocation: %u\n",
+      m_stats.reservation_count + m_stats.write_allocations,
+      m_stats.reservation_count,
+      m_stats.reserved_clusters,
+      m_stats.write_allocations,
+      RoundUpToCluster(m_file_size) / SD_CLUSTER_SIZE);
+  LOG("Header commits: %u, write errors: %u\n", m_stats.header_commits, m_stats.write_errors);
+
+  fseek(m_fp, 0, SEEK_SET);
+  fwrite(header.data(), header.size(), 1, m_fp);
+
+  // release the reserved clusters which have not been used
+  if (m_reserved_size > m_file_size && ftruncate(fileno(m_fp), m_file_size) != 0) {
+    LOG("%s:%d | Unable to truncate the file to %u bytes. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        m_file_size,
+        errno,
+        std::strerror(errno));
+  }
+
+  if (fclose(m_fp) != 0) {
+    LOG("%s:%d | Unable to close the file. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    m_fp = nullptr;
+    return false;
+  }
+
+  m_fp = nullptr;
+
+  return true;
+}
+
+ClusterWriter::~ClusterWriter()
+{
+  if (m_fp != nullptr) {
+    Flush();
+    fclose(m_fp);
+    s_is_write_buffer_used = false;
+  }
+}
+
+void
+ClusterWriter::Write(const std::span<const uint8_t> data)
+{
+  const uint8_t* bytes = data.data();
+  std::size_t size = data.size();
+
+  // keep track of the file size so far, flushes subtract bytes they fail to write
+  m_file_size += size;
+
+  while (size != 0) {
+    const std::size_t to_copy = std::min(size, m_flush_threshold - m_buffer_size);
+    std::copy_n(bytes, to_copy, m_buffer + m_buffer_size);
+    m_buffer_size += to_copy;
+    bytes += to_copy;
+    size -= to_copy;
+
+    if (m_buffer_size == m_flush_threshold) {
+      Flush();
+    }
+  }
+}
+
+bool
+ClusterWriter::WriteUnbuffered(const std::span<const uint8_t> data)
+{
+  Flush();
+
+  const std::size_t written = std::fwrite(data.data(), 1, data.size(), m_fp);
+  m_file_size += written;
+  m_flushed_size += written;
+  m_flush_threshold = m_buffer_capacity - m_flushed_size % SD_CLUSTER_SIZE;
+
+  if (written != data.size()) {
+    ++m_stats.write_errors;
+    perror("");
+    return false;
+  }
+
+  return true;
+}
+
+bool
+ClusterWriter::Flush()
+{
+  if (m_buffer_size == 0) {
+    return true;
+  }
+
+  const int64_t flush_start_us = esp_timer_get_time();
+  if (m_preallocation_size != 0 && m_flushed_size + m_buffer_size > m_reserved_size) {
+    Reserve(m_flushed_size + m_buffer_size);
+  }
+  const std::size_t written = std::fwrite(m_buffer, 1, m_buffer_size, m_fp);
+  const uint32_t flush_latency_us = static_cast<uint32_t>(esp_timer_get_time() - flush_start_us);
+
+  ++m_stats.flush_count;
+  m_stats.flush_time_us += flush_latency_us;
+  m_stats.worst_flush_latency_us = std::max(m_stats.worst_flush_latency_us, flush_latency_us);
+  const std::size_t bucket = std::min<std::size_t>(std::bit_width(flush_latency_us / 1'000),
+                                                   m_stats.flush_latency_histogram.size() - 1);
+  ++m_stats.flush_latency_histogram[bucket];
+
+  const bool is_written = written == m_buffer_size;
+  if (!is_written) {
+    LOG("%s:%d | Error writing data. Bytes to write: %u | written: %u\n",
+        __FILE__,
+        __LINE__,
+        m_buffer_size,
+        written);
+    perror("");
+    ++m_stats.write_errors;
+    m_file_size -= m_buffer_size - written;
+  }
+
+  m_flushed_size += written;
+  m_buffer_size = 0;
+
+  // writes past the reserved extent make the file system allocate clusters one by one
+  const std::size_t allocated_size = RoundUpToCluster(m_flushed_size);
+  if (allocated_size > m_allocated_size) {
+    m_stats.write_allocations += (allocated_size - m_allocated_size) / SD_CLUSTER_SIZE;
+    m_allocated_size = allocated_size;
+  }
+  m_flush_threshold = m_buffer_capacity - m_flushed_size % SD_CLUSTER_SIZE;
+
+  return is_written;
+}
+
+bool
+ClusterWriter::CommitHeader(const std::span<const uint8_t> header)
+{
+  const bool is_committed = fseek(m_fp, 0, SEEK_SET) == 0 &&
+                            std::fwrite(header.data(), header.size(), 1, m_fp) == 1 &&
+                            fseek(m_fp, m_flushed_size, SEEK_SET) == 0 &&
+                            fsync(fileno(m_fp)) == 0;
+  if (!is_committed) {
+    ++m_stats.write_errors;
+    LOG("%s:%d | Unable to commit the header. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  m_committed_size = m_flushed_size;
+  ++m_stats.header_commits;
+
+  return true;
+}
+
+bool
+ClusterWriter::Reserve(const std::size_t size)
+{
+  // seeking past the end of a file opened for writing makes FATFS extend its cluster chain
+  // without writing any data. Clusters allocated in one go follow each other on a card with
+  // unfragmented free space
+  const std::size_t target_size = RoundUpToCluster(size + m_preallocation_size);
+
+  const bool is_seeked = fseek(m_fp, target_size, SEEK_SET) == 0;
+
+  struct stat file_stats;
+  const bool is_stated = fstat(fileno(m_fp), &file_stats) == 0;
+
+  if (fseek(m_fp, m_flushed_size, SEEK_SET) != 0) {
+    LOG("%s:%d | Unable to restore the write position. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  if (!is_seeked || !is_stated) {
+    LOG("%s:%d | Unable to reserve %u bytes. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        target_size,
+        errno,
+        std::strerror(errno));
+    return false;
+  }
+
+  // the file system stops extending the file when the card is full
+  const std::size_t reserved_size = static_cast<std::size_t>(file_stats.st_size);
+  if (reserved_size <= m_reserved_size) {
+    LOG("%s:%d | No clusters could be reserved, disabling preallocation.\n", __FILE__, __LINE__);
+    m_preallocation_size = 0;
+    return false;
+  }
+
+  const std::size_t allocated_size = RoundUpToCluster(reserved_size);
+  ++m_stats.reservation_count;
+  if (allocated_size > m_allocated_size) {
+    m_stats.reserved_clusters += (allocated_size - m_allocated_size) / SD_CLUSTER_SIZE;
+    m_allocated_size = allocated_size;
+  }
+  m_reserved_size = reserved_size;
+
+  return reserved_size == target_size;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string_view>
+
+#include "settings.hpp"
+
+struct ClusterWriterStats
+{
+  // amount of buffer flushes into the file
+  std::size_t flush_count;
+  // histogram of the flush latency: bucket `i` counts flushes which took less than 2^i ms,
+  // the last one counts all longer flushes
+  std::array<uint32_t, 12> flush_latency_histogram;
+  uint32_t worst_flush_latency_us;
+  // time spent in all flushes, i.e. for how long the card has been busy with the file's data
+  uint64_t flush_time_us;
+  // FAT chain extensions done up front, & the clusters they have reserved
+  std::size_t reservation_count;
+  std::size_t reserved_clusters;
+  // clusters allocated one by one by writes beyond the reserved extent
+  std::size_t write_allocations;
+  // header rewrites followed by a file sync
+  std::size_t header_commits;
+  // failed data & header writes, which hint at a card that can't keep up with the SPI clock
+  std::size_t write_errors;
+};
+
+/// @brief Writes a file which consists of a fixed-size header followed by appended data.
+/// Data is collected in a statically allocated buffer of whole SD clusters, which is flushed
+/// only when it reaches a cluster boundary of the file, so the file system sees few, large,
+/// cluster-aligned writes. Clusters can be reserved ahead of the write position, and the header
+/// can be committed periodically, so the file survives a power loss.
+/// Only one file can be open at a time
+class ClusterWriter
+{
+public:
+  /// @brief Creates the file at `file_path` & writes `header`
+  /// @param write_buffer_size size of the write buffer, rounded down to whole clusters
+  /// and limited by the static buffer
+  /// @param preallocation_size clusters are reserved this far ahead of the write position,
+  /// 0 disables preallocation. The file is truncated to its real size when it's closed
+  /// @param header_commit_interval a header commit is due whenever this many bytes have been
+  /// flushed since the last commit, 0 disables it
+  /// @return `true` if successful, `false` otherwise
+  bool Open(const std::string_view file_path,
+            const std::span<const uint8_t> header,
+            const std::size_t write_buffer_size,
+            const std::size_t preallocation_size,
+            const std::size_t header_commit_interval);
+
+  /// @brief Flushes the buffered data, rewrites the header, truncates the unused reserved
+  /// clusters, and closes the file
+  bool Close(const std::span<const uint8_t> header);
+
+  ~ClusterWriter();
+
+  bool IsOpen() const { return m_fp != nullptr; }
+
+  /// @brief Appends `data` through the write buffer
+  void Write(const std::span<const uint8_t> data);
+  /// @brief Flushes the write buffer, & appends `data` straight to the file.
+  /// Meant for metadata written once at the end
+  bool WriteUnbuffered(const std::span<const uint8_t> data);
+
+  /// @brief Writes all buffered data into the file
+  bool Flush();
+
+  /// @brief Returns `true` if enough data has been flushed to commit the header
+  bool IsHeaderCommitDue() const
+  {
+    return m_header_commit_interval != 0 &&
+           m_flushed_size - m_committed_size >= m_header_commit_interval;
+  }
+  /// @brief Rewrites `header`, which describes the data flushed so far, & syncs the file,
+  /// so the file system's directory entry & FAT are up to date as well
+  bool CommitHeader(const std::span<const uint8_t> header);
+
+  /// @brief Returns the size of the file, including the buffered data
+  std::size_t GetFileSize() const { return m_file_size; }
+  /// @brief Returns how many bytes have reached the file
+  std::size_t GetFlushedSize() const { return m_flushed_size; }
+
+  const ClusterWriterStats& GetStats() const { return m_stats; }
+
+private:
+  /// @brief Extends the file, so it spans at least `size` bytes plus the preallocation size.
+  /// The write position is kept
+  bool Reserve(const std::size_t size);
+
+private:
+  FILE* m_fp = nullptr;
+
+  std::size_t m_file_size = 0;
+
+  // points to the static write buffer while the file is open
+  uint8_t* m_buffer = nullptr;
+  std::size_t m_buffer_capacity = 0;
+  std::size_t m_buffer_size = 0;
+  // the buffer is flushed once it's filled up to here, which is a cluster boundary of the file
+  std::size_t m_flush_threshold = 0;
+  // bytes written into the file so far
+  std::size_t m_flushed_size = 0;
+
+  std::size_t m_preallocation_size = 0;
+  // size of the file including the reserved, not yet written clusters
+  std::size_t m_reserved_size = 0;
+  // bytes covered by the file's cluster chain
+  std::size_t m_allocated_size = 0;
+
+  std::size_t m_header_commit_interval = 0;
+  // file size at the last header commit
+  std::size_t m_committed_size = 0;
+
+  ClusterWriterStats m_stats;
+};
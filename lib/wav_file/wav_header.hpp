@@ -1,9 +1,23 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
 #include "settings.hpp"
 
-struct wav_header_t
+/// @brief Header of a PCM .wav file, with all format fields derived from the template
+/// parameters. `Sample` is `uint8_t`, `int16_t` or `int32_t`, channels are interleaved
+template<typename Sample, uint16_t Channels, uint32_t SampleRate>
+struct wav_pcm_header_t
 {
+  static_assert(std::is_same_v<Sample, uint8_t> || std::is_same_v<Sample, int16_t> ||
+                  std::is_same_v<Sample, int32_t>,
+                "PCM samples are 8-bit unsigned, 16-bit or 32-bit signed integers");
+  static_assert(Channels >= 1 && Channels <= 8, "Unsupported amount of channels");
+  static_assert(uint64_t{ SampleRate } * Channels * sizeof(Sample) <= INT32_MAX,
+                "Byte rate does not fit the header");
+
   // RIFF Header
   const char riff_header[4] = { 'R', 'I', 'F', 'F' };
   int32_t wav_size = 0; // Size of the wav portion of the file, which follows the
@@ -14,22 +28,102 @@ struct wav_header_t
   const char fmt_header[4] = { 'f', 'm', 't', ' ' }; // Contains "fmt " (includes trailing space)
   const int32_t fmt_chunk_size = 16;                 // Number of bytes left in "fmt" subchunk
   const int16_t audio_format = 1;                    // Should be 1 for PCM. 3 for IEEE Float
-  const int16_t num_channels = 1;                    // Mono
-  const int32_t sample_rate = static_cast<int>(MIC_SAMPLE_RATE);
+  const int16_t num_channels = Channels;
+  const int32_t sample_rate = SampleRate;
 
   // Number of bytes per second. sample_rate * num_channels * Bytes Per Sample
-  const int32_t byte_rate = sample_rate * 2;
+  const int32_t byte_rate = SampleRate * Channels * sizeof(Sample);
 
   // The number of bytes for one sample including all channels. num_channels * Bytes Per Sample
-  const int16_t sample_alignment = 2;
-  // const int16_t sample_alignment = 2;
+  const int16_t sample_alignment = Channels * sizeof(Sample);
 
   // Number of bits per sample
-  const int16_t bits_per_sample = 16;
+  const int16_t bits_per_sample = 8 * sizeof(Sample);
+
+  // Padding, so the audio data starts at a sector boundary of the storage
+  const char junk_header[4] = { 'J', 'U', 'N', 'K' };
+  const int32_t junk_chunk_size = 460; // Number of bytes in the padding
+  const char junk_data[460] = {};
+
+  // Data
+  const char data_header[4] = { 'd', 'a', 't', 'a' };
+  int32_t data_bytes = 0; // Number of bytes in data
+                          // Number of samples * num_channels * sample byte size
+
+} __attribute__((packed));
+
+/// @brief Header of the recorder's own format, which all PCM files share the layout of
+using wav_header_t = wav_pcm_header_t<int16_t, 1, MIC_SAMPLE_RATE>;
+static_assert(sizeof(wav_header_t) == SD_SECTOR_SIZE, "WAV header must fill exactly one sector");
+
+/// @brief Header of a mono IMA-ADPCM .wav file with blocks of `BlockBytes`
+template<uint32_t SampleRate, uint16_t BlockBytes>
+struct wav_ima_adpcm_header_t
+{
+  // A block holds the first sample in its 4-byte header, and two samples per remaining byte
+  static constexpr uint16_t k_samples_per_block = (BlockBytes - 4) * 2 + 1;
+
+  // RIFF Header
+  const char riff_header[4] = { 'R', 'I', 'F', 'F' };
+  int32_t wav_size = 0; // File size - 8
+  const char wave_header[4] = { 'W', 'A', 'V', 'E' };
+
+  // Format Header
+  const char fmt_header[4] = { 'f', 'm', 't', ' ' };
+  const int32_t fmt_chunk_size = 20;
+  const int16_t audio_format = 0x11; // IMA-ADPCM
+  const int16_t num_channels = 1;    // Mono
+  const int32_t sample_rate = SampleRate;
+  const int32_t byte_rate = uint64_t{ SampleRate } * BlockBytes / k_samples_per_block;
+  // Size of a block, the decoder resets its prediction at every block
+  const int16_t block_align = BlockBytes;
+  const int16_t bits_per_sample = 4;
+  const int16_t extra_size = 2; // Number of format bytes which follow
+  const int16_t samples_per_block = k_samples_per_block;
+
+  // Fact, required by compressed formats
+  const char fact_header[4] = { 'f', 'a', 'c', 't' };
+  const int32_t fact_chunk_size = 4;
+  int32_t sample_count = 0; // Number of samples, the last block is padded
+
+  // Padding, so the audio data starts at a sector boundary of the storage
+  const char junk_header[4] = { 'J', 'U', 'N', 'K' };
+  const int32_t junk_chunk_size = 444;
+  const char junk_data[444] = {};
 
   // Data
   const char data_header[4] = { 'd', 'a', 't', 'a' };
-  int data_bytes = 0; // Number of bytes in data
-                      // Number of samples * num_channels * sample byte size
+  int32_t data_bytes = 0; // Number of bytes in data, whole blocks
 
-} __attribute__((packed));
\ No newline at end of file
+} __attribute__((packed));
+
+/// @brief Checks the layout of a header at compile time. Recovery patches the sizes of any
+/// header at the places where `wav_header_t` keeps them
+template<typename Header>
+constexpr bool
+IsWavHeaderLayoutValid()
+{
+  return sizeof(Header) == SD_SECTOR_SIZE &&
+         offsetof(Header, wav_size) == offsetof(wav_header_t, wav_size) &&
+         offsetof(Header, data_bytes) == offsetof(wav_header_t, data_bytes) &&
+         offsetof(Header, data_bytes) + sizeof(int32_t) == SD_SECTOR_SIZE;
+}
+
+// Header of a generic RIFF chunk, e.g. the metadata written after the data chunk
+struct wav_chunk_header_t
+{
+  char id[4];
+  int32_t size; // Number of bytes in the chunk, excluding this header and the pad byte
+} __attribute__((packed));
+
+// Entry of the custom "gain" chunk, written after the data chunk when the automatic gain is used.
+// The gain shift applies from `sample_offset` up to the next entry's offset. The original 24-bit
+// level is `sample * 2^gain_shift`, so `sample * 2^(gain_shift - 8)` in 16-bit units. Shifts
+// below 8 are gain, which a reader undoes by dividing by `2^(8 - gain_shift)`, not by shifting by
+// a negative amount
+struct wav_gain_entry_t
+{
+  uint32_t sample_offset;
+  uint8_t gain_shift;
+  uint8_t reserved[3];
+} __attribute__((packed));
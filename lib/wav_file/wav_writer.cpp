@@ -1,7 +1,11 @@
 #include "wav_writer.hpp"
 
+#include <algorithm>
 #include <cerrno>
+#include <cstddef>
 #include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <Arduino.h>
 
@@ -14,87 +18,219 @@
 #endif
 
 bool
-WavWriter::Open(const std::string_view file_path /* , const std::size_t sample_rate */)
+WavWriterBase::OpenFile(const std::string_view file_path,
+                        const std::span<const uint8_t> header,
+                        const std::size_t write_buffer_size,
+                        const std::size_t preallocation_size,
+                        const std::size_t header_commit_interval)
 {
-  LOG("Opening file '%.*s'...\n", file_path.size(), file_path.data());
+  // write out the header - we'll fill in some of the blanks later
+  if (!m_file.Open(
+        file_path, header, write_buffer_size, preallocation_size, header_commit_interval)) {
+    LOG("%s:%d | Error opening the WAV file.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  m_comment_length = 0;
+  m_gain_log = {};
+
+  return true;
+}
 
-  m_fp = fopen(file_path.data(), "wb");
+void
+WavWriterBase::LogEncodingCycles(const char* encoding, const uint64_t cycles_per_100_samples)
+{
+  LOG("%s encoding: %llu cycles per 100 samples\n", encoding, cycles_per_100_samples);
+}
 
-  if (m_fp == nullptr) {
+bool
+WavWriterBase::Recover(const std::string_view file_path)
+{
+  LOG("Recovering file '%.*s'...\n", file_path.size(), file_path.data());
+
+  FILE* fp = fopen(file_path.data(), "r+b");
+  if (fp == nullptr) {
     perror("");
     return false;
-  } else {
-    // Serial.println("File opened.");
   }
 
-  // m_header.sample_rate = sample_rate;
-  // write out the header - we'll fill in some of the blanks later
-  const std::size_t written = std::fwrite(&m_header, sizeof(wav_header_t), 1, m_fp);
-  if (written != 1) {
-    LOG("%s:%d | Error writing the WAV header:\n", __FILE__, __LINE__);
-    perror("");
+  // the header is patched as raw bytes, so the file keeps its own format fields
+  std::array<uint8_t, sizeof(wav_header_t)> header;
+  struct stat file_stats;
+  if (std::fread(header.data(), header.size(), 1, fp) != 1 || fstat(fileno(fp), &file_stats) != 0) {
+    LOG("%s:%d | Unable to read the WAV header.\n", __FILE__, __LINE__);
+    fclose(fp);
     return false;
   }
 
-  m_file_size = sizeof(wav_header_t);
+  const wav_header_t k_reference;
+  const bool is_wav_file =
+    std::memcmp(header.data(), k_reference.riff_header, sizeof(k_reference.riff_header)) == 0 &&
+    std::memcmp(header.data() + offsetof(wav_header_t, wave_header),
+                k_reference.wave_header,
+                sizeof(k_reference.wave_header)) == 0 &&
+    std::memcmp(header.data() + offsetof(wav_header_t, data_header),
+                k_reference.data_header,
+                sizeof(k_reference.data_header)) == 0;
+  if (!is_wav_file) {
+    LOG("%s:%d | Not a WAV file.\n", __FILE__, __LINE__);
+    fclose(fp);
+    return false;
+  }
 
-  return true;
-}
+  int16_t sample_alignment;
+  int32_t committed_data_bytes;
+  std::memcpy(&sample_alignment,
+              header.data() + offsetof(wav_header_t, sample_alignment),
+              sizeof(sample_alignment));
+  std::memcpy(&committed_data_bytes,
+              header.data() + offsetof(wav_header_t, data_bytes),
+              sizeof(committed_data_bytes));
+
+  // reserved clusters count into the file size, but they're never past a committed header
+  const int32_t available_data_bytes = std::max<int32_t>(file_stats.st_size - header.size(), 0);
+  int32_t data_bytes = committed_data_bytes > 0
+                         ? std::min(committed_data_bytes, available_data_bytes)
+                         : available_data_bytes;
+  if (sample_alignment > 0) {
+    data_bytes -= data_bytes % sample_alignment;
+  }
 
-bool
-WavWriter::Close()
-{
-  if (m_fp != nullptr) {
-    return FinishAndClose();
-  } else {
-    return true;
+  const int32_t file_size = header.size() + data_bytes;
+  const int32_t wav_size = file_size - 8;
+  std::memcpy(header.data() + offsetof(wav_header_t, wav_size), &wav_size, sizeof(wav_size));
+  std::memcpy(header.data() + offsetof(wav_header_t, data_bytes), &data_bytes, sizeof(data_bytes));
+
+  // compressed files count their samples in a fact chunk. The layout doesn't depend on the
+  // header's parameters
+  using AdpcmHeader = wav_ima_adpcm_header_t<MIC_SAMPLE_RATE, ADPCM_BLOCK_BYTES>;
+  const AdpcmHeader k_adpcm_reference;
+  if (std::memcmp(header.data() + offsetof(AdpcmHeader, fact_header),
+                  k_adpcm_reference.fact_header,
+                  sizeof(k_adpcm_reference.fact_header)) == 0) {
+    int16_t samples_per_block;
+    std::memcpy(&samples_per_block,
+                header.data() + offsetof(AdpcmHeader, samples_per_block),
+                sizeof(samples_per_block));
+
+    const int32_t sample_count =
+      sample_alignment > 0 ? data_bytes / sample_alignment * samples_per_block : 0;
+    std::memcpy(header.data() + offsetof(AdpcmHeader, sample_count),
+                &sample_count,
+                sizeof(sample_count));
+  }
+
+  const bool is_repaired = fseek(fp, 0, SEEK_SET) == 0 &&
+                           std::fwrite(header.data(), header.size(), 1, fp) == 1 &&
+                           ftruncate(fileno(fp), file_size) == 0;
+  if (!is_repaired) {
+    LOG("%s:%d | Unable to repair the WAV header. errno: %d = %s\n",
+        __FILE__,
+        __LINE__,
+        errno,
+        std::strerror(errno));
+  }
+
+  if (fclose(fp) != 0) {
+    perror("");
+    return false;
   }
+
+  LOG("Recovered %ld bytes of audio data, %ld bytes were committed.\n",
+      data_bytes,
+      committed_data_bytes);
+
+  return is_repaired && data_bytes > 0;
 }
 
-WavWriter::~WavWriter()
+void
+WavWriterBase::SetComment(const std::string_view comment)
 {
-  Close();
+  m_comment_length = std::min(comment.size(), m_comment.size());
+  std::copy_n(comment.begin(), m_comment_length, m_comment.begin());
 }
 
 void
-WavWriter::WriteSamples(const std::span<int16_t> samples)
+WavWriterBase::WriteMetadata()
 {
-  // write the samples and keep track of the file size so far
-  const std::size_t written = fwrite(samples.data(), sizeof(samples[0]), samples.size(), m_fp);
-  if (written != samples.size()) {
-    LOG("%s:%d | Error writing samples. Samples to write: %u | written: %u\n",
-                  __FILE__,
-                  __LINE__,
-                  samples.size(),
-                  written);
-    perror("");
+  m_file.Flush();
+
+  // chunks start at even offsets, so an odd-sized data chunk is followed by a pad byte
+  if (m_file.GetFileSize() % 2 != 0) {
+    constexpr uint8_t k_pad = 0;
+    m_file.WriteUnbuffered(std::span(&k_pad, 1));
+  }
+
+  if (!m_gain_log.empty() && !WriteGainChunk()) {
+    LOG("%s:%d | Error writing the WAV gain log.\n", __FILE__, __LINE__);
   }
 
-  m_file_size += sizeof(samples[0]) * written;
+  if (m_comment_length != 0 && !WriteInfoChunk()) {
+    LOG("%s:%d | Error writing the WAV comment.\n", __FILE__, __LINE__);
+  }
 }
 
 bool
-WavWriter::FinishAndClose()
+WavWriterBase::WriteInfoChunk()
 {
-  LOG("Finished wav file size: %d\n", m_file_size);
-
-  // now fill in the header with the correct information and write it again
-  m_header.data_bytes = m_file_size - sizeof(wav_header_t);
-  m_header.wav_size = m_file_size - 8;
-
-  fseek(m_fp, 0, SEEK_SET);
-  fwrite(&m_header, sizeof(m_header), 1, m_fp);
-
-  if (fclose(m_fp) != 0) {
-    LOG("%s:%d | Unable to close the file. errno: %d = %s",
-                  __FILE__,
-                  __LINE__,
-                  errno,
-                  std::strerror(errno));
-    return false;
-  }
+  // the comment is stored as a null-terminated string, padded to an even size
+  const int32_t comment_size = m_comment_length + 1;
+  const std::size_t pad_size = comment_size % 2;
+
+  const wav_chunk_header_t list_header = { .id = { 'L', 'I', 'S', 'T' },
+                                           .size = static_cast<int32_t>(
+                                             4 + sizeof(wav_chunk_header_t) + comment_size +
+                                             pad_size) };
+  constexpr char k_info_type[4] = { 'I', 'N', 'F', 'O' };
+  const wav_chunk_header_t comment_header = { .id = { 'I', 'C', 'M', 'T' },
+                                              .size = comment_size };
+  constexpr char k_terminator[2] = { '\0', '\0' };
+
+  return m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(&list_header), sizeof(list_header))) &&
+         m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(k_info_type), sizeof(k_info_type))) &&
+         m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(&comment_header), sizeof(comment_header))) &&
+         m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(m_comment.data()), m_comment_length)) &&
+         m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(k_terminator), 1 + pad_size));
+}
 
-  m_fp = nullptr;
+bool
+WavWriterBase::WriteGainChunk()
+{
+  // entries are 8 bytes long, so the chunk never needs padding
+  const wav_chunk_header_t gain_header = { .id = { 'g', 'a', 'i', 'n' },
+                                           .size = static_cast<int32_t>(m_gain_log.size_bytes()) };
+
+  return m_file.WriteUnbuffered(
+           std::span(reinterpret_cast<const uint8_t*>(&gain_header), sizeof(gain_header))) &&
+         m_file.WriteUnbuffered(std::span(
+           reinterpret_cast<const uint8_t*>(m_gain_log.data()), m_gain_log.size_bytes()));
+}
 
-  return true;
-}
\ No newline at end of file
+// Compile-time checks of the headers & the sample conversion of other formats than the
+// recorder's own
+
+static_assert(IsWavHeaderLayoutValid<wav_pcm_header_t<uint8_t, 1, 8'000>>());
+static_assert(IsWavHeaderLayoutValid<wav_pcm_header_t<int32_t, 2, 48'000>>());
+static_assert(IsWavHeaderLayoutValid<wav_ima_adpcm_header_t<44'100, 1'024>>());
+
+static_assert(wav_pcm_header_t<uint8_t, 1, 8'000>{}.byte_rate == 8'000);
+static_assert(wav_pcm_header_t<uint8_t, 1, 8'000>{}.bits_per_sample == 8);
+static_assert(wav_pcm_header_t<int16_t, 2, 44'100>{}.byte_rate == 176'400);
+static_assert(wav_pcm_header_t<int16_t, 2, 44'100>{}.sample_alignment == 4);
+static_assert(wav_pcm_header_t<int32_t, 2, 48'000>{}.byte_rate == 384'000);
+static_assert(wav_pcm_header_t<int32_t, 2, 48'000>{}.sample_alignment == 8);
+static_assert(wav_pcm_header_t<int32_t, 2, 48'000>{}.bits_per_sample == 32);
+// the recorder's 16 kHz IMA-ADPCM format, as written by common encoders
+static_assert(wav_ima_adpcm_header_t<16'000, 512>{}.samples_per_block == 1'017);
+static_assert(wav_ima_adpcm_header_t<16'000, 512>{}.byte_rate == 8'055);
+
+static_assert(PcmWavWriter<uint8_t, 1, 8'000>::ConvertSample(0) == 128);
+static_assert(PcmWavWriter<uint8_t, 1, 8'000>::ConvertSample(INT16_MIN) == 0);
+static_assert(PcmWavWriter<uint8_t, 1, 8'000>::ConvertSample(INT16_MAX) == 255);
+static_assert(PcmWavWriter<int32_t, 1, 8'000>::ConvertSample(-1) == -65'536);
+static_assert(PcmWavWriter<int32_t, 1, 8'000>::ConvertSample(INT16_MAX) == INT16_MAX << 16);
@@ -1,30 +1,321 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cstddef>
 #include <cstdint>
-#include <cstdio>
 #include <span>
 #include <string_view>
+#include <type_traits>
 
-#include "esp_err.h"
+#include "esp_cpu.h"
 
+#include "audio_writer.hpp"
+#include "cluster_writer.hpp"
+#include "ima_adpcm_encoder.hpp"
+#include "settings.hpp"
 #include "wav_header.hpp"
 
-class WavWriter
+struct WavWriterStats
+{
+  ClusterWriterStats file;
+  // CPU cycles spent encoding the samples, 0 for PCM
+  uint64_t encoding_cycles;
+  std::size_t encoded_samples;
+};
+
+/// @brief Parts of a .wav writer which don't depend on the format: the file, the metadata
+/// written after the audio data, and the recovery of unfinished files.
+/// The file is written through a `ClusterWriter`, so only one file can be open at a time
+class WavWriterBase : public AudioWriter
+{
+public:
+  /// @brief Sets a comment which is written into a LIST/INFO chunk after the audio data when the
+  /// file is closed. Longer comments are truncated
+  void SetComment(const std::string_view comment) override;
+
+  /// @brief Sets the per-block gain log, which is written into a "gain" chunk after the audio data
+  /// when the file is closed. `gain_log` must stay valid until then
+  void SetGainLog(const std::span<const wav_gain_entry_t> gain_log) override
+  {
+    m_gain_log = gain_log;
+  }
+
+  std::size_t GetFileSize() const override { return m_file.GetFileSize(); }
+
+  /// @brief Repairs a file which has not been closed, e.g. due to a power loss. The audio data
+  /// ends at the last committed header, or at the file's size if no header has been committed.
+  /// Reserved clusters & unfinished metadata after it are truncated
+  /// @return `true` if the file holds a valid recording, `false` if it's empty or not a WAV file
+  static bool Recover(const std::string_view file_path);
+
+protected:
+  /// @brief Creates the file at `file_path` & writes the placeholder `header`
+  bool OpenFile(const std::string_view file_path,
+                const std::span<const uint8_t> header,
+                const std::size_t write_buffer_size,
+                const std::size_t preallocation_size,
+                const std::size_t header_commit_interval);
+
+  /// @brief Writes the gain log & the comment after the audio data
+  void WriteMetadata();
+
+  static void LogEncodingCycles(const char* encoding, const uint64_t cycles_per_100_samples);
+
+  template<typename Header>
+  static std::span<const uint8_t> AsBytes(const Header& header)
+  {
+    return std::span(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+  }
+
+private:
+  bool WriteInfoChunk();
+  bool WriteGainChunk();
+
+protected:
+  ClusterWriter m_file;
+
+private:
+  std::array<char, 128> m_comment;
+  std::size_t m_comment_length = 0;
+
+  std::span<const wav_gain_entry_t> m_gain_log;
+};
+
+/// @brief Writes PCM .wav files of `Channels` interleaved channels of `Sample`s.
+/// Input samples are 16-bit, & converted to `Sample` at compile time
+template<typename Sample, uint16_t Channels, uint32_t SampleRate>
+class PcmWavWriter final : public WavWriterBase
+{
+public:
+  using Header = wav_pcm_header_t<Sample, Channels, SampleRate>;
+  static_assert(IsWavHeaderLayoutValid<Header>(), "WAV header must fill exactly one sector");
+
+  ~PcmWavWriter() override { Close(); }
+
+  /// @brief Creates the file at `file_path` & writes a placeholder header
+  /// @param write_buffer_size size of the write buffer, rounded down to whole clusters
+  /// and limited by the static buffer
+  /// @param preallocation_size clusters are reserved this far ahead of the write position,
+  /// 0 disables preallocation. The file is truncated to its real size when it's closed
+  /// @param header_commit_interval the header is updated & the file synced whenever this many
+  /// bytes of audio have been written since the last commit, 0 disables it
+  /// @return `true` if successful, `false` otherwise
+  bool Open(const std::string_view file_path,
+            const std::size_t write_buffer_size,
+            const std::size_t preallocation_size = 0,
+            const std::size_t header_commit_interval = 0)
+  {
+    UpdateHeader(sizeof(Header));
+    return OpenFile(file_path,
+                    AsBytes(m_header),
+                    write_buffer_size,
+                    preallocation_size,
+                    header_commit_interval);
+  }
+
+  bool Close() override
+  {
+    if (!m_file.IsOpen()) {
+      return true;
+    }
+
+    // the data chunk ends here, metadata goes after it
+    const std::size_t data_end = m_file.GetFileSize();
+    WriteMetadata();
+    UpdateHeader(data_end);
+    m_header.wav_size = m_file.GetFileSize() - 8;
+
+    return m_file.Close(AsBytes(m_header));
+  }
+
+  void WriteSamples(const std::span<const int16_t> samples) override
+  {
+    if constexpr (std::is_same_v<Sample, int16_t>) {
+      m_file.Write(
+        std::span(reinterpret_cast<const uint8_t*>(samples.data()), samples.size_bytes()));
+    } else {
+      // converted in small batches, so the conversion needs no large buffer
+      std::array<Sample, 64> converted;
+      for (std::size_t start = 0; start < samples.size(); start += converted.size()) {
+        const std::size_t count = std::min(converted.size(), samples.size() - start);
+        std::transform(samples.begin() + start,
+                       samples.begin() + start + count,
+                       converted.begin(),
+                       ConvertSample);
+        m_file.Write(std::span(reinterpret_cast<const uint8_t*>(converted.data()),
+                               count * sizeof(Sample)));
+      }
+    }
+
+    if (m_file.IsHeaderCommitDue()) {
+      // the committed data must end with a whole sample of every channel
+      const std::size_t flushed_size = m_file.GetFlushedSize();
+      UpdateHeader(flushed_size - (flushed_size - sizeof(Header)) % (Channels * sizeof(Sample)));
+      m_file.CommitHeader(AsBytes(m_header));
+    }
+  }
+
+  WavWriterStats GetStats() const
+  {
+    return WavWriterStats{ .file = m_file.GetStats(), .encoding_cycles = 0, .encoded_samples = 0 };
+  }
+
+  /// @brief Converts a 16-bit sample into the file's sample format
+  static constexpr Sample ConvertSample(const int16_t sample)
+  {
+    if constexpr (std::is_same_v<Sample, uint8_t>) {
+      // 8-bit samples are unsigned, 128 is silence
+      return static_cast<uint8_t>((sample >> 8) + 128);
+    } else if constexpr (std::is_same_v<Sample, int32_t>) {
+      return static_cast<int32_t>(static_cast<uint32_t>(sample) << 16);
+    } else {
+      return sample;
+    }
+  }
+
+private:
+  /// @brief Sets the sizes in the header for a file which ends at `data_end`
+  void UpdateHeader(const std::size_t data_end)
+  {
+    m_header.wav_size = data_end - 8;
+    m_header.data_bytes = data_end - sizeof(Header);
+  }
+
+private:
+  Header m_header;
+};
+
+/// @brief Writes mono IMA-ADPCM .wav files, encoded on the fly in blocks of `BlockBytes`
+template<uint32_t SampleRate, uint16_t BlockBytes>
+class ImaAdpcmWavWriter final : public WavWriterBase
 {
 public:
-  bool Open(const std::string_view file_path/* , const std::size_t sample_rate */);
-  bool Close();
+  using Header = wav_ima_adpcm_header_t<SampleRate, BlockBytes>;
+  static_assert(IsWavHeaderLayoutValid<Header>(), "WAV header must fill exactly one sector");
+  static_assert(offsetof(Header, block_align) == offsetof(wav_header_t, sample_alignment),
+                "Recovery aligns the data to whole blocks");
+  static_assert(Header::k_samples_per_block == ImaAdpcmEncoder::SamplesPerBlock(BlockBytes));
+
+  ~ImaAdpcmWavWriter() override { Close(); }
+
+  /// @brief Creates the file at `file_path` & writes a placeholder header
+  /// @see PcmWavWriter::Open
+  bool Open(const std::string_view file_path,
+            const std::size_t write_buffer_size,
+            const std::size_t preallocation_size = 0,
+            const std::size_t header_commit_interval = 0)
+  {
+    m_sample_count = 0;
+    m_encoder.Reset();
+    m_block_samples_size = 0;
+    m_encoding_cycles = 0;
+    m_encoded_samples = 0;
 
-  ~WavWriter();
+    UpdateHeader(sizeof(Header), 0);
+    return OpenFile(file_path,
+                    AsBytes(m_header),
+                    write_buffer_size,
+                    preallocation_size,
+                    header_commit_interval);
+  }
 
-  void WriteSamples(const std::span<int16_t> samples);
+  bool Close() override
+  {
+    if (!m_file.IsOpen()) {
+      return true;
+    }
+
+    if (m_block_samples_size != 0) {
+      WriteBlock();
+    }
+    if (m_encoded_samples != 0) {
+      LogEncodingCycles("ADPCM", m_encoding_cycles * 100 / m_encoded_samples);
+    }
+
+    // the data chunk ends here, metadata goes after it
+    const std::size_t data_end = m_file.GetFileSize();
+    WriteMetadata();
+    UpdateHeader(data_end, m_sample_count);
+    m_header.wav_size = m_file.GetFileSize() - 8;
+
+    return m_file.Close(AsBytes(m_header));
+  }
+
+  void WriteSamples(const std::span<const int16_t> samples) override
+  {
+    m_sample_count += samples.size();
+
+    std::span<const int16_t> remaining = samples;
+    while (!remaining.empty()) {
+      const std::size_t to_copy =
+        std::min(remaining.size(), m_block_samples.size() - m_block_samples_size);
+      std::copy_n(remaining.begin(), to_copy, m_block_samples.begin() + m_block_samples_size);
+      m_block_samples_size += to_copy;
+      remaining = remaining.subspan(to_copy);
+
+      if (m_block_samples_size == m_block_samples.size()) {
+        WriteBlock();
+      }
+    }
+
+    if (m_file.IsHeaderCommitDue()) {
+      // only whole blocks are flushed between commits
+      const std::size_t flushed_size = m_file.GetFlushedSize();
+      const std::size_t blocks = (flushed_size - sizeof(Header)) / BlockBytes;
+      UpdateHeader(sizeof(Header) + blocks * BlockBytes, blocks * Header::k_samples_per_block);
+      m_file.CommitHeader(AsBytes(m_header));
+    }
+  }
+
+  WavWriterStats GetStats() const
+  {
+    return WavWriterStats{ .file = m_file.GetStats(),
+                           .encoding_cycles = m_encoding_cycles,
+                           .encoded_samples = m_encoded_samples };
+  }
 
 private:
-  bool FinishAndClose();
+  /// @brief Encodes the collected samples into a block & writes it
+  void WriteBlock()
+  {
+    // the last block of a file is padded by repeating its last sample
+    std::fill(m_block_samples.begin() + m_block_samples_size,
+              m_block_samples.end(),
+              m_block_samples_size != 0 ? m_block_samples[m_block_samples_size - 1] : 0);
+
+    const uint32_t encoding_start = esp_cpu_get_cycle_count();
+    m_encoder.EncodeBlock(m_block_samples, m_block);
+    m_encoding_cycles += esp_cpu_get_cycle_count() - encoding_start;
+    m_encoded_samples += m_block_samples.size();
+
+    m_block_samples_size = 0;
+    m_file.Write(m_block);
+  }
+
+  /// @brief Sets the sizes in the header for a file which ends at `data_end`
+  void UpdateHeader(const std::size_t data_end, const std::size_t sample_count)
+  {
+    m_header.wav_size = data_end - 8;
+    m_header.data_bytes = data_end - sizeof(Header);
+    m_header.sample_count = sample_count;
+  }
 
 private:
-  FILE* m_fp;
+  Header m_header;
+  // samples written so far, including the ones waiting to be encoded
+  std::size_t m_sample_count = 0;
+
+  ImaAdpcmEncoder m_encoder;
+  // samples waiting to fill a block
+  std::array<int16_t, Header::k_samples_per_block> m_block_samples;
+  std::size_t m_block_samples_size = 0;
+  std::array<uint8_t, BlockBytes> m_block;
+  uint64_t m_encoding_cycles = 0;
+  std::size_t m_encoded_samples = 0;
+};
 
-  wav_header_t m_header;
-  int m_file_size;
-};
\ No newline at end of file
+/// @brief Writer of the format selected by `WAV_FORMAT`
+using WavWriter = std::conditional_t<WAV_FORMAT == WavFormat::Pcm16,
+                                     PcmWavWriter<int16_t, 1, MIC_SAMPLE_RATE>,
+                                     ImaAdpcmWavWriter<MIC_SAMPLE_RATE, ADPCM_BLOCK_BYTES>>;
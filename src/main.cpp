@@ -17,6 +17,14 @@ Connection s_connection;
 Timeout s_sleep_timeout;
 PCF8563 s_rtc_driver;
 sd::SDCard s_sd_card;
+SdPartition s_log_partition;
+FileBlockDevice s_log_file;
+LogStore s_log_store;
+I2sSampler s_i2s_sampler;
+Recorder s_recorder;
+// tick of the last failed start of the pre-roll capture, & how long to wait before the next one
+std::optional<TickType_t> s_preroll_failure_tick;
+TickType_t s_preroll_retry_ticks = pdMS_TO_TICKS(PREROLL_RETRY_MIN_MS);
 Freenove_ESP32_WS2812 s_led_strip =
   Freenove_ESP32_WS2812(ARGB_LEDS_COUNT, pins::ARGB_LED, 0, TYPE_GRB);
 
@@ -42,12 +50,32 @@ setup()
 
   // Initialize the SD card
   s_sd_card.Init();
+  if constexpr (RECORDING_STORE == RecordingStore::Log) {
+    MountLogStore();
+  }
+
+#if SD_BENCHMARK
+  // nothing else uses the card yet
+  sd::SDBenchmark(s_sd_card).Run();
+#endif
+
+#if CAPTURE_STRESS
+  // the capture is not running yet, the stress test drives it with a simulated source
+  RunCaptureStressTest();
+#endif
+
+  // a recording interrupted by a reset would be overwritten by the next one
+  RecoverTempRecording();
 
   // Initialize the screens
   s_screen_1_driver.Init();
   s_screen_2_driver.Init();
 
-  s_sd_card.EnsureFreeSpace(FULL_STORAGE_THRESHOLD);
+  // old recordings are deleted in the background, so they don't delay the first recording. The
+  // log store reclaims its own space as it wraps
+  if constexpr (RECORDING_STORE == RecordingStore::Fat) {
+    s_sd_card.StartEviction(FULL_STORAGE_THRESHOLD);
+  }
 
   // manage wi-fi startup, time sync, ePaper initialization, sleep timeout timer in a separate
   // thread to start the recording process as quick as possible
@@ -79,6 +107,11 @@ loop()
     UpdateLeds();
   }
 
+  // keep the pre-roll filled while idle
+  if (PREROLL_SAMPLES != 0) {
+    KeepPrerollCapture();
+  }
+
   if (s_sleep_timeout.IsTimeoutReached()) {
     s_sleep_timeout.DeInit();
 
@@ -147,6 +180,11 @@ StartRecordingProcess()
     return false;
   }
 
+  // make room for the next recording
+  if constexpr (RECORDING_STORE == RecordingStore::Fat) {
+    s_sd_card.StartEviction(FULL_STORAGE_THRESHOLD);
+  }
+
   const TickType_t wait_start = xTaskGetTickCount();
   const TickType_t wait_end = wait_start + pdMS_TO_TICKS(SLEEP_TIMEOUT_MS);
   while (!s_connection.IsWifiConnected() && (xTaskGetTickCount() <= wait_end)) {
@@ -166,91 +204,406 @@ StartRecordingProcess()
 bool
 RecordMicro()
 {
+  const int64_t press_time_us = esp_timer_get_time();
+
   SetScreen2State(ScreenState::Recording, true);
 
-  // create & initialize the I2S sampler which samples the microphone
-  I2sSampler i2s_sampler;
-  if (!i2s_sampler.Init()) {
-    Serial.printf("%s:%d | Error initializing the I2S sampler.\n", __FILE__, __LINE__);
+  // the capture is already running if the pre-roll is enabled
+  if (!StartAudioCapture()) {
+    Serial.printf("%s:%d | Error starting the audio capture.\n", __FILE__, __LINE__);
     return false;
   }
 
-  const std::string temp_file_path = sd::SDCard::GetFilePath("temp.wav");
+  const std::string temp_file_path = sd::SDCard::GetFilePath(TEMP_RECORDING_NAME);
 
-  // create a new wav file writer
-  WavWriter writer;
-  if (!writer.Open(temp_file_path)) {
+  // create a new file writer of the selected format
+  RecordingWriter writer;
+  if (!OpenRecordingFile(writer, temp_file_path)) {
     Serial.printf("Error opening a file for writing.\n");
+    // without the pre-roll the microphone is sampled only while recording
+    if (PREROLL_SAMPLES == 0) {
+      StopAudioCapture();
+    }
     return false;
   }
 
-  // First few samples are a bit rough, it's best to discard them
-  i2s_sampler.DiscardSamples(128 * 60);
+  // samples are written to the file by the recorder's storage task, starting with the pre-roll.
+  // Long recordings are split into segments, which the storage task finishes on the fly
+  RecordingSegments segments = { .temp_file_path = temp_file_path,
+                                 .press_time_us = press_time_us,
+                                 .start_time = 0,
+                                 .finished_count = 0 };
+  const RecordingSegmentation segmentation = { .max_samples = RECORDING_SEGMENT_SAMPLES,
+                                               .max_bytes = RECORDING_SEGMENT_BYTES,
+                                               .handler = FinishRecordingSegment,
+                                               .arg = &segments };
+  if (!s_recorder.StartRecording(writer, segmentation)) {
+    Serial.printf("%s:%d | Error starting the recording.\n", __FILE__, __LINE__);
+    writer.Close();
+    if (PREROLL_SAMPLES == 0) {
+      StopAudioCapture();
+    }
+    return false;
+  }
 
   Serial.printf("Recording...\n");
 
-  std::vector<int16_t> samples = i2s_sampler.ReadSamples(1024);
-  writer.WriteSamples(samples);
-
-  // keep writing until the user releases the button
+  // keep recording until the user releases the button
   while (IsRecButtonPressed()) {
-    std::vector<int16_t> samples = i2s_sampler.ReadSamples(1024);
-    writer.WriteSamples(samples);
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+
+  if (!s_recorder.StopRecording()) {
+    Serial.printf("%s:%d | Error stopping the recording.\n", __FILE__, __LINE__);
+    return false;
   }
 
   Serial.printf("Finished recording.\n");
 
-  // stop the sampler
-  if (!i2s_sampler.DeInit()) {
-    Serial.printf("%s:%d | Error de-initializing the I2S sampler.\n", __FILE__, __LINE__);
+  // the storage task notes when it has handed the first samples to the writer
+  const int64_t first_write_time_us = s_recorder.GetStats().first_write_time_us;
+  if (first_write_time_us != 0) {
+    LOG("First sample written after %lld ms.\n", (first_write_time_us - press_time_us) / 1'000);
+  }
+
+  // without the pre-roll the microphone is sampled only while recording
+  if (PREROLL_SAMPLES == 0 && !StopAudioCapture()) {
+    Serial.printf("%s:%d | Error stopping the audio capture.\n", __FILE__, __LINE__);
     return false;
   }
 
   // finish the writing
   writer.Close();
+  // a card which fails writes is mounted at a slower clock next time
+  if (writer.GetStats().file.write_errors != 0) {
+    s_sd_card.ReportIoError();
+  }
 
   SetScreen2State(ScreenState::Recorded, true);
 
-  // wait for system time to synchronize before renaming the file
-  const TickType_t wait_start = xTaskGetTickCount();
-  const TickType_t wait_end = wait_start + pdMS_TO_TICKS(SLEEP_TIMEOUT_MS);
-  while (!s_connection.WasTimeSyncAttempted() && xTaskGetTickCount() <= wait_end) {
-    vTaskDelay(pdMS_TO_TICKS(500));
+  // the last segment is named like the ones before it
+  const std::time_t start_time = GetRecordingStartTime(segments);
+  const bool is_renamed =
+    segments.finished_count == 0
+      ? NameRecording(writer, temp_file_path, start_time)
+      : NameRecording(writer, temp_file_path, start_time, segments.finished_count + 1);
+  if (!is_renamed) {
+    Serial.printf("%s:%d | Error renaming file.\n", __FILE__, __LINE__);
+    return false;
   }
 
-  if (!RenameFile(temp_file_path)) {
-    Serial.printf("%s:%d | Error renaming file.\n", __FILE__, __LINE__);
+  return true;
+}
+
+bool
+StartAudioCapture()
+{
+  if (s_recorder.IsCapturing()) {
+    return true;
+  }
+
+  // initialize the I2S sampler which samples the microphone
+  if (!s_i2s_sampler.Init(CAPTURE_PROFILE)) {
+    Serial.printf("%s:%d | Error initializing the I2S sampler.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  // First few samples are a bit rough, it's best to discard them until the mic settles
+  const int64_t warmup_start_us = esp_timer_get_time();
+  const std::size_t discarded_samples = s_i2s_sampler.WarmUp(WARMUP_MAX_SAMPLES);
+  LOG("Microphone warm-up discarded %u samples in %lld ms.\n",
+      discarded_samples,
+      (esp_timer_get_time() - warmup_start_us) / 1'000);
+
+  if (!s_recorder.StartCapture(s_i2s_sampler, PREROLL_SAMPLES)) {
+    Serial.printf("%s:%d | Error starting the capture.\n", __FILE__, __LINE__);
+    s_i2s_sampler.DeInit();
+    return false;
+  }
+
+  return true;
+}
+
+void
+KeepPrerollCapture()
+{
+  if (s_recorder.IsCapturing()) {
+    return;
+  }
+
+  const TickType_t now = xTaskGetTickCount();
+  if (s_preroll_failure_tick.has_value() && now - *s_preroll_failure_tick < s_preroll_retry_ticks) {
+    return;
+  }
+
+  if (StartAudioCapture()) {
+    s_preroll_failure_tick.reset();
+    s_preroll_retry_ticks = pdMS_TO_TICKS(PREROLL_RETRY_MIN_MS);
+    return;
+  }
+
+  if (s_preroll_failure_tick.has_value()) {
+    s_preroll_retry_ticks =
+      std::min(s_preroll_retry_ticks * 2, pdMS_TO_TICKS(PREROLL_RETRY_MAX_MS));
+  }
+  s_preroll_failure_tick = now;
+  LOG("The pre-roll capture has failed to start, retrying in %lu ms.\n",
+      s_preroll_retry_ticks * portTICK_PERIOD_MS);
+}
+
+bool
+StopAudioCapture()
+{
+  if (!s_recorder.StopCapture()) {
+    Serial.printf("%s:%d | Error stopping the capture.\n", __FILE__, __LINE__);
+    return false;
+  }
+
+  if (!s_i2s_sampler.DeInit()) {
+    Serial.printf("%s:%d | Error de-initializing the I2S sampler.\n", __FILE__, __LINE__);
     return false;
   }
 
   return true;
 }
 
+bool
+RunCaptureStressTest()
+{
+  Serial.printf("Running the capture stress test...\n");
+
+  const std::string file_path = sd::SDCard::GetFilePath(CAPTURE_STRESS_FILE_NAME);
+  const CaptureStressStep* sustained_step = nullptr;
+
+  for (const CaptureStressStep& step : CAPTURE_STRESS_STEPS) {
+    // the production profile's DMA ring, filled at the step's rate
+    CaptureProfile profile = CAPTURE_PROFILE;
+    profile.sample_rate_hz = step.sample_rate_hz * step.channels;
+
+    if (!s_i2s_sampler.InitSynthetic(profile)) {
+      Serial.printf("%s:%d | Error initializing the simulated source.\n", __FILE__, __LINE__);
+      break;
+    }
+    if (!s_recorder.StartCapture(s_i2s_sampler, 0)) {
+      Serial.printf("%s:%d | Error starting the capture.\n", __FILE__, __LINE__);
+      s_i2s_sampler.DeInit();
+      break;
+    }
+
+    RecordingWriter writer;
+    if (!OpenRecordingFile(writer, file_path) || !s_recorder.StartRecording(writer)) {
+      Serial.printf("%s:%d | Error starting the recording.\n", __FILE__, __LINE__);
+      StopAudioCapture();
+      break;
+    }
+
+    const int64_t start_time_us = esp_timer_get_time();
+    vTaskDelay(pdMS_TO_TICKS(CAPTURE_STRESS_STEP_MS));
+    // returns only once the storage task is done with the writer
+    const bool is_stopped = s_recorder.StopRecording();
+    const int64_t elapsed_us = esp_timer_get_time() - start_time_us;
+
+    writer.Close();
+    const RecorderStats stats = s_recorder.GetStats();
+    StopAudioCapture();
+    remove(file_path.c_str());
+
+    if (!is_stopped) {
+      Serial.printf("%s:%d | Error stopping the recording.\n", __FILE__, __LINE__);
+      break;
+    }
+
+    // CPU time of the conditioning in the capture task & of the encoding in the storage task
+    const auto writer_stats = writer.GetStats();
+    const uint64_t cpu_cycles = stats.sampler.conditioning_cycles + writer_stats.encoding_cycles;
+    const uint64_t cpu_duty_permille =
+      cpu_cycles * 1'000 / (static_cast<uint64_t>(getCpuFrequencyMhz()) * elapsed_us);
+    const uint64_t sd_duty_permille = writer_stats.file.flush_time_us * 1'000 / elapsed_us;
+    const std::size_t lost_samples = stats.sampler.frames_lost + stats.overrun_samples;
+
+    Serial.printf("%lu Hz x %u: lost %u (I2S %lu, buffer %u), buffer high-water mark %u/%u, "
+                  "CPU %llu.%llu%%, SD %llu.%llu%%, worst flush %lu us\n",
+                  step.sample_rate_hz,
+                  step.channels,
+                  lost_samples,
+                  stats.sampler.frames_lost,
+                  stats.overrun_samples,
+                  stats.high_water_mark,
+                  CAPTURE_BUFFER_SAMPLES,
+                  cpu_duty_permille / 10,
+                  cpu_duty_permille % 10,
+                  sd_duty_permille / 10,
+                  sd_duty_permille % 10,
+                  writer_stats.file.worst_flush_latency_us);
+
+    if (lost_samples != 0) {
+      break;
+    }
+    sustained_step = &step;
+  }
+
+  if (sustained_step == nullptr) {
+    Serial.printf("Not even the production profile has been sustained.\n");
+    return false;
+  }
+
+  Serial.printf("Highest sustained load: %lu Hz x %u = %lu samples/s\n",
+                sustained_step->sample_rate_hz,
+                sustained_step->channels,
+                sustained_step->sample_rate_hz * sustained_step->channels);
+
+  return true;
+}
+
 bool
 IsRecButtonPressed()
 {
   return digitalRead(pins::BUTTON) == 0;
 }
 
+bool
+RecoverTempRecording()
+{
+  const std::string temp_file_path = sd::SDCard::GetFilePath(TEMP_RECORDING_NAME);
+  if (!DoesFileExist(temp_file_path)) {
+    return true;
+  }
+
+  LOG("Found an unfinished recording.\n");
+
+  // the system time is not set yet, but the file system has stamped the file at its last sync
+  struct stat file_stats;
+  if (stat(temp_file_path.c_str(), &file_stats) != 0) {
+    Serial.printf("%s:%d | Unable to stat '%s'.\n", __FILE__, __LINE__, temp_file_path.c_str());
+    return false;
+  }
+
+  if (!FileRecordingWriter::Recover(temp_file_path)) {
+    LOG("Nothing to recover, deleting the file.\n");
+    remove(temp_file_path.c_str());
+    return false;
+  }
+
+  return RenameFile(temp_file_path, file_stats.st_mtime);
+}
+
+template<typename Writer>
+bool
+OpenRecordingFile(Writer& writer, const std::string_view file_path)
+{
+  if constexpr (std::is_same_v<Writer, LogWriter>) {
+    return writer.Open(s_log_store, WAV_HEADER_COMMIT_INTERVAL_BYTES);
+  } else if constexpr (std::is_same_v<Writer, FlacWriter>) {
+    return writer.Open(
+      file_path, CAPTURE_PROFILE.write_buffer_bytes, FLAC_HEADER_COMMIT_INTERVAL_BYTES);
+  } else {
+    return writer.Open(file_path,
+                       CAPTURE_PROFILE.write_buffer_bytes,
+                       WAV_PREALLOCATION_BYTES,
+                       WAV_HEADER_COMMIT_INTERVAL_BYTES);
+  }
+}
+
+template<typename Writer>
+bool
+NameRecording(const Writer& writer,
+              const std::string_view temp_file_path,
+              const std::time_t time,
+              const std::size_t segment_number)
+{
+  if constexpr (std::is_same_v<Writer, LogWriter>) {
+    return s_log_store.NameRecord(writer.GetRecordPosition(), time, segment_number);
+  } else {
+    return RenameFile(temp_file_path, time, segment_number);
+  }
+}
+
+bool
+FinishRecordingSegment(AudioWriter& writer, void* arg)
+{
+  RecordingSegments& segments = *static_cast<RecordingSegments*>(arg);
+  RecordingWriter& recording_writer = static_cast<RecordingWriter&>(writer);
+
+  if (!recording_writer.Close()) {
+    Serial.printf("%s:%d | Error closing segment %u.\n",
+                  __FILE__,
+                  __LINE__,
+                  segments.finished_count + 1);
+  }
+  if (recording_writer.GetStats().file.write_errors != 0) {
+    s_sd_card.ReportIoError();
+  }
+
+  ++segments.finished_count;
+
+  // reopening the temporary file would overwrite the segment
+  if (!NameRecording(recording_writer,
+                     segments.temp_file_path,
+                     GetRecordingStartTime(segments),
+                     segments.finished_count)) {
+    Serial.printf("%s:%d | Error renaming segment %u.\n",
+                  __FILE__,
+                  __LINE__,
+                  segments.finished_count);
+    return false;
+  }
+
+  return OpenRecordingFile(recording_writer, segments.temp_file_path);
+}
+
+std::time_t
+GetRecordingStartTime(RecordingSegments& segments)
+{
+  if (segments.start_time != 0) {
+    return segments.start_time;
+  }
+
+  // wait for system time to synchronize before the recording is named
+  const TickType_t wait_start = xTaskGetTickCount();
+  const TickType_t wait_end = wait_start + pdMS_TO_TICKS(SLEEP_TIMEOUT_MS);
+  while (!s_connection.WasTimeSyncAttempted() && xTaskGetTickCount() <= wait_end) {
+    vTaskDelay(pdMS_TO_TICKS(500));
+  }
+
+  // the clock may have been set since the button was pressed, the time since is independent of it
+  const int64_t elapsed_s = (esp_timer_get_time() - segments.press_time_us) / 1'000'000;
+  segments.start_time = std::time(nullptr) - elapsed_s;
+
+  return segments.start_time;
+}
+
 bool
 RenameFile(const std::string_view temp_file_path)
 {
-  // Get current time
-  const std::time_t now_time = std::time(nullptr);
-  std::string new_file_name(DEVICE_NAME);
-  new_file_name.append("_").append(std::to_string(now_time)).append(".wav");
+  return RenameFile(temp_file_path, std::time(nullptr));
+}
 
+bool
+RenameFile(const std::string_view temp_file_path,
+           const std::time_t now_time,
+           const std::size_t segment_number)
+{
+  const auto make_file_name = [segment_number](const std::time_t time) {
+    std::string file_name(DEVICE_NAME);
+    file_name.append("_").append(std::to_string(time));
+    if (segment_number != 0) {
+      file_name.append("_").append(std::to_string(segment_number));
+    }
+    return file_name.append(RECORDING_FILE_EXTENSION);
+  };
+
+  std::string new_file_name = make_file_name(now_time);
   std::string new_path = sd::SDCard::GetFilePath(new_file_name);
 
   // make another name if file exists
   if (access(new_path.c_str(), F_OK) == 0) {
-    new_file_name = DEVICE_NAME;
-    new_file_name.append("_").append(std::to_string(now_time + 1)).append(".wav");
+    new_file_name = make_file_name(now_time + 1);
+    new_path = sd::SDCard::GetFilePath(new_file_name);
   }
 
   Serial.printf("New file name: %s\n", new_file_name.c_str());
 
-  if (rename(temp_file_path.data(), new_path.c_str()) != 0) {
+  if (!s_sd_card.RenameRecording(temp_file_path, new_file_name)) {
     Serial.printf("%s:%d | Unable to rename '%.*s' to '%.*s'. errno: %d = %s\n",
                   __FILE__,
                   __LINE__,
@@ -273,8 +626,14 @@ EnterSleep()
 
   SetScreen2State(ScreenState::Standby, false);
 
+  // the microphone is not sampled during sleep
+  if (!StopAudioCapture()) {
+    LOG("Failed to stop the audio capture.\n");
+  }
+
   // De-init the SD card BEFORE de-initializing screens
   // GxEDP2 deinitializes SPI bus by itself
+  UnmountLogStore();
   s_sd_card.DeInit();
 
   s_screen_1_driver.DeInit();
@@ -300,11 +659,18 @@ EnterSleep()
 
   LOG("Awakened from sleep.\n");
 
+  // the microphone gets a fresh chance to start the pre-roll
+  s_preroll_failure_tick.reset();
+  s_preroll_retry_ticks = pdMS_TO_TICKS(PREROLL_RETRY_MIN_MS);
+
   SPI.begin(pins::SPI_CLK, pins::SPI_MISO, pins::SPI_MOSI);
   // SPI.setFrequency(4'000'000);
 
   // Initialize the SD card
   s_sd_card.Init();
+  if constexpr (RECORDING_STORE == RecordingStore::Log) {
+    MountLogStore();
+  }
 
   // Initialize the screens
   s_screen_1_driver.Init();
@@ -349,18 +715,32 @@ SendStoredFilesToServer()
 
   std::size_t upload_count = 0;
   std::size_t failed_count = 0;
-  std::vector<std::string> wav_names = GetWavFileNames(8, 0);
 
-  // upload all stored files to the server by a batch of 8 at a time
-  while (wav_names.size() != 0) {
-    for (auto wav_file : wav_names) {
-      UploadFileAndDelete(ftp_client, sd::SDCard::GetFilePath(wav_file), wav_file) ? ++upload_count
-                                                                                   : ++failed_count;
+  if constexpr (RECORDING_STORE == RecordingStore::Log) {
+    // records stay in the log until they're reclaimed, uploaded ones are just skipped
+    LogCursor cursor;
+    std::optional<LogRecordHeader> record;
+    while ((record = s_log_store.GetNextRecord(cursor))) {
+      UploadLogRecord(ftp_client, *record) ? ++upload_count : ++failed_count;
+    }
+  } else {
+    std::array<sd::RecordingName, UPLOAD_BATCH_SIZE> file_names;
+    sd::RecordingCursor cursor;
+
+    // upload all stored files to the server by a batch at a time, failed ones are not retried
+    std::size_t batch_size;
+    while ((batch_size = s_sd_card.GetPendingRecordings(cursor, file_names)) != 0) {
+      for (const sd::RecordingName& file_name : std::span(file_names).first(batch_size)) {
+        UploadFileAndDelete(
+          ftp_client, sd::SDCard::GetFilePath(file_name.View()), file_name.View())
+          ? ++upload_count
+          : ++failed_count;
+      }
     }
-
-    wav_names = GetWavFileNames(8, failed_count);
   }
 
+  LOG("%u files uploaded, %u failed.\n", upload_count, failed_count);
+
   ftp_client.ftpClientQuit();
 
   return upload_count;
@@ -383,72 +763,78 @@ UploadFileAndDelete(FtpClient& ftp_client,
     return false;
   }
 
-  result = std::remove(file_path.data());
-  if (result != 0) {
-    LOG("%s:%d | Error deleting '%.*s': %d = %s\n",
-        __FILE__,
-        __LINE__,
-        file_path.length(),
-        file_path.data(),
-        errno,
-        strerror(errno));
+  // a recording which can't be deleted is still not uploaded again
+  if (!s_sd_card.DeleteRecording(remote_new_name)) {
+    s_sd_card.MarkUploaded(remote_new_name);
     return false;
   }
 
   return true;
 }
 
-std::vector<std::string>
-GetWavFileNames(const std::size_t max_amount, const std::size_t offset)
+bool
+UploadLogRecord(FtpClient& ftp_client, const LogRecordHeader& record)
 {
-  DIR* dir;
-  dir = opendir(sd::SDCard::GetMountPoint().data());
+  const sd::RecordingName file_name = LogStore::GetFileName(record);
+  LOG("Uploading record '%s'...\n", file_name.data.data());
 
-  if (dir == nullptr) {
-    return {};
+  NetBuf* data_connection = nullptr;
+  if (ftp_client.ftpClientAccess(
+        file_name.data.data(), FTP_CLIENT_FILE_WRITE, FTP_CLIENT_BINARY, &data_connection) != 1) {
+    LOG("%s:%d | Error opening '%s' on the server.\n", __FILE__, __LINE__, file_name.data.data());
+    return false;
   }
 
-  std::size_t file_count = 0;
-  dirent* dir_entity;
-  std::vector<std::string> wav_names;
-  std::size_t remaining_to_skip = offset;
-
-  while ((dir_entity = readdir(dir)) != nullptr && file_count < max_amount) {
-    // skip the directory entity if it's not a file
-    if (dir_entity->d_type != DT_REG) {
-      // LOG("'%s' is not a file. Skipping...\n", dir_entity->d_name);
-      continue;
-    }
-
-    const std::string_view file_path(dir_entity->d_name);
-
-    // skip the file if it's not a .wav file
-    if (!IsWavFile(file_path)) {
-      // LOG("'%s' is not a .wav file. Skipping...\n", dir_entity->d_name);
-      continue;
-    }
+  // there is no file to upload, the .wav stream is read from the log a few sectors at a time
+  static std::array<uint8_t, 8 * SD_SECTOR_SIZE> s_upload_buffer;
+  const std::size_t wav_size = sizeof(wav_header_t) + record.data_bytes;
+  std::size_t offset = 0;
+  bool is_sent = true;
+  while (is_sent && offset < wav_size) {
+    // a record which is reclaimed during the upload ends the stream early
+    const int length = s_log_store.ReadWav(record, offset, s_upload_buffer);
+    is_sent = length != 0 &&
+              ftp_client.ftpClientWrite(s_upload_buffer.data(), length, data_connection) == length;
+    offset += length;
+  }
+  is_sent = ftp_client.ftpClientClose(data_connection) == 1 && is_sent;
 
-    // skip first `remaining_to_skip` files
-    if (remaining_to_skip > 0) {
-      --remaining_to_skip;
-      continue;
-    }
+  if (!is_sent) {
+    LOG("%s:%d | Error uploading '%s' to the server after %u bytes.\n",
+        __FILE__,
+        __LINE__,
+        file_name.data.data(),
+        offset);
+    return false;
+  }
 
-    wav_names.push_back(std::string(file_path));
-    ++file_count;
+  return s_log_store.MarkUploaded(record.position);
+}
 
-    // LOG("'%.*s' has been added to the list.\n", file_path.length(), file_path.data());
+bool
+MountLogStore()
+{
+  if (s_log_partition.Open(LOG_STORE_PARTITION_TYPE)) {
+    return s_log_store.Mount(s_log_partition);
   }
 
-  closedir(dir);
+  LOG("Keeping the log store in '%.*s'.\n",
+      LOG_STORE_FILE_NAME.length(),
+      LOG_STORE_FILE_NAME.data());
+  if (!s_log_file.Open(sd::SDCard::GetFilePath(LOG_STORE_FILE_NAME),
+                       LOG_STORE_FILE_BYTES / SD_SECTOR_SIZE)) {
+    Serial.printf("%s:%d | Unable to open the log store file.\n", __FILE__, __LINE__);
+    return false;
+  }
 
-  return wav_names;
+  return s_log_store.Mount(s_log_file);
 }
 
-bool
-IsWavFile(const std::string_view file_path)
+void
+UnmountLogStore()
 {
-  return file_path.substr(file_path.find_last_of(".")) == ".wav";
+  s_log_store.Unmount();
+  s_log_file.Close();
 }
 
 std::string
@@ -1,11 +1,15 @@
+#include <array>
 #include <charconv>
 #include <cstdio>
 #include <ctime>
-#include <dirent.h>
 #include <expected>
+#include <optional>
+#include <span>
+#include <type_traits>
 #include <unistd.h>
 
 #include "driver/gptimer.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
 #include "freertos/task.h"
@@ -13,12 +17,18 @@
 #include "Freenove_WS2812_Lib_for_ESP32.h"
 #include <Arduino.h>
 
+#include "block_device.hpp"
 #include "connection.hpp"
+#include "flac_writer.hpp"
 #include "ftp_client.hpp"
 #include "i2s_sampler.hpp"
+#include "log_store.hpp"
+#include "log_writer.hpp"
 #include "pcf8563.hpp"
+#include "recorder.hpp"
 #include "rotary_encoder.hpp"
 #include "screen_driver.hpp"
+#include "sd_benchmark.hpp"
 #include "sd_card.hpp"
 #include "settings.hpp"
 #include "timeout.hpp"
@@ -60,14 +70,13 @@ bool
 StartRecordingProcess();
 
 /// @brief
-/// Initializes the I2S audio sampler,
-/// records data from it into a temporary .wav file while the recording button
+/// Starts the audio capture if it's not running yet,
+/// records the pre-roll & data from it into a temporary recording file while the recording button
 /// is pushed, renames the temp file to a name which contains the device name
-/// and a timestamp.
+/// and the time the button was pressed.
 ///
-/// Note: Because `ResumeAfterSleep()` does not wait for system time to
-/// synchronize via SNTP, file timestamp may be inaccurate if recording is short
-/// enough.
+/// Note: The clock may not be set yet when the button is pressed right after power-up, so the
+/// naming waits for the time sync to be attempted, see `GetRecordingStartTime()`.
 /// @return `true` if recording was successful & file renamed, `false` otherwise
 bool
 RecordMicro();
@@ -83,6 +92,48 @@ UploadFileAndDelete(FtpClient& ftp_client,
                     const std::string_view file_path,
                     const std::string_view remote_new_name);
 
+/// @brief Streams `record` of the log store to the server as a .wav file, and marks it as
+/// uploaded if the transfer was a success
+/// @return `true` if successful, `false` otherwise
+bool
+UploadLogRecord(FtpClient& ftp_client, const LogRecordHeader& record);
+
+/// @brief Mounts the log store on the card's raw partition, or on a preallocated file if the card
+/// has no such partition. Must follow the SD card's initialization
+/// @return `true` if successful, `false` otherwise
+bool
+MountLogStore();
+
+/// @brief Unmounts the log store, before the SD card is de-initialized
+void
+UnmountLogStore();
+
+/// @brief Initializes the I2S sampler, waits for the microphone to warm up,
+/// and starts the recorder's capture task, unless it is already running
+/// @return `true` if the capture is running, `false` otherwise
+bool
+StartAudioCapture();
+
+/// @brief Starts the capture of the pre-roll while idle, unless it's running. A failed start is
+/// retried only after a back-off, so a broken microphone doesn't cost an I2S initialization & a
+/// warm-up on every loop
+void
+KeepPrerollCapture();
+
+/// @brief Stops the recorder's capture task and de-initializes the I2S sampler
+/// @return `true` if successful, `false` otherwise
+bool
+StopAudioCapture();
+
+/// @brief Records from the simulated I2S source at each of `CAPTURE_STRESS_STEPS` for
+/// `CAPTURE_STRESS_STEP_MS`, through the recorder, the conditioner & the recording writer into a
+/// scratch file, until a step loses samples. Prints the CPU time spent on conditioning & encoding,
+/// and the time the card spent writing, per step, and the highest load which has been sustained.
+/// The capture must not be running
+/// @return `true` if the production profile has been sustained, `false` otherwise
+bool
+RunCaptureStressTest();
+
 /// @brief Check if the recording button is pressed
 /// @return `true` if recording should be started, `false` otherwise
 bool
@@ -93,26 +144,79 @@ IsRecButtonPressed();
 
 /// @brief Renames the file at `temp_tile_path`
 /// to contain date and time in its name
-/// @param temp_file_path path to the temporary .wav
+/// @param temp_file_path path to the temporary recording
 /// file into which the mic recording was stored
 /// @return `true` if successful, `false` otherwise
 bool
 RenameFile(const std::string_view temp_file_path);
 
-/// @brief Returns an array of file names in the root directory
-/// which should be sent to the remote server
-/// @param max_amount maximum amount if file names to return
-/// @param offset ignore first `offset` files
-/// @return An array of file names in the root directory
-/// which should be sent to the remote server
-std::vector<std::string>
-GetWavFileNames(const std::size_t max_amount, const std::size_t offset);
+/// @brief Renames the file at `temp_file_path` to contain `now_time` in its name
+/// @param segment_number number of the segment, starting with 1, which follows the time in the
+/// name. 0 if the recording is not split into segments
+bool
+RenameFile(const std::string_view temp_file_path,
+           const std::time_t now_time,
+           const std::size_t segment_number = 0);
+
+/// @brief Writer of the file format selected by `RECORDING_FORMAT`
+using FileRecordingWriter =
+  std::conditional_t<RECORDING_FORMAT == RecordingFormat::Flac, FlacWriter, WavWriter>;
+
+/// @brief Writer of the store selected by `RECORDING_STORE`
+using RecordingWriter =
+  std::conditional_t<RECORDING_STORE == RecordingStore::Log, LogWriter, FileRecordingWriter>;
+
+/// @brief Opens `writer` for a recording into `file_path`, with the settings of its format.
+/// A record of the log store has no file, so `file_path` is not used for it
+/// @return `true` if successful, `false` otherwise
+template<typename Writer>
+bool
+OpenRecordingFile(Writer& writer, const std::string_view file_path);
+
+/// @brief Names the recording which `writer` has finished after `time` & `segment_number`:
+/// renames its temporary file at `temp_file_path`, or names its record in the log store
+/// @return `true` if successful, `false` otherwise
+template<typename Writer>
+bool
+NameRecording(const Writer& writer,
+              const std::string_view temp_file_path,
+              const std::time_t time,
+              const std::size_t segment_number = 0);
+
+/// @brief Segments of a recording which have been finished so far
+struct RecordingSegments
+{
+  std::string_view temp_file_path;
+  // system timer when the recording button was pressed
+  int64_t press_time_us;
+  // all segments of a recording are named after the time the recording was started, which is
+  // known once the time sync has been attempted, 0 until then
+  std::time_t start_time;
+  std::size_t finished_count;
+};
+
+/// @brief Returns the time the recording of `segments` was started. The first call waits for the
+/// time sync to be attempted, at most `SLEEP_TIMEOUT_MS`, as the clock isn't set yet right after
+/// a cold boot, & dates the button press back from the synchronized time.
+/// Segments are long enough for the sync to have been attempted before the first one is finished,
+/// so the storage task doesn't wait in practice
+std::time_t
+GetRecordingStartTime(RecordingSegments& segments);
+
+/// @brief Segment handler of the recorder, runs in its storage task. Closes the finished segment,
+/// renames it after the recording's time & its number, and opens the temporary file for the
+/// next segment
+/// @param arg the recording's `RecordingSegments`
+/// @return `true` if the next segment can be written, `false` otherwise
+bool
+FinishRecordingSegment(AudioWriter& writer, void* arg);
 
-/// @brief Checks if the file's extension at `file_path` is .wav
-/// @param file_path path to the file to check
-/// @return `true` if `file_path` is a .wav file, `false` otherwise
+/// @brief Repairs the temporary recording file left by a recording which has been interrupted
+/// by a power loss or a reset, and renames it after the time of its last sync.
+/// Deletes the file if it holds no audio
+/// @return `true` if there was nothing to recover or the recovery succeeded, `false` otherwise
 bool
-IsWavFile(const std::string_view file_path);
+RecoverTempRecording();
 
 /// @brief Just adds _(1) to the end of the file name
 /// @param file_path file to the path of which name should be changed
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+
+class HardwareSerial
+{
+public:
+  void begin(const unsigned long) {}
+  void flush() { std::fflush(stdout); }
+
+  template<typename... Args>
+  int printf(const char* format, Args... args)
+  {
+    if constexpr (sizeof...(Args) == 0) {
+      return std::fputs(format, stdout);
+    } else {
+      return std::printf(format, args...);
+    }
+  }
+
+  template<typename T>
+  void print(const T& value)
+  {
+    Print(value);
+  }
+
+  template<typename T>
+  void println(const T& value)
+  {
+    Print(value);
+    std::putchar('\n');
+  }
+  void println() { std::putchar('\n'); }
+
+private:
+  static void Print(const char* value) { std::fputs(value, stdout); }
+  static void Print(const long long value) { std::printf("%lld", value); }
+  static void Print(const unsigned long long value) { std::printf("%llu", value); }
+  static void Print(const double value) { std::printf("%.2f", value); }
+};
+
+inline HardwareSerial Serial;
+
+inline unsigned long
+millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+inline unsigned long
+micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+inline void
+delay(const unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <Arduino.h>
+
+#include "SPI.h"
+
+typedef enum
+{
+  CARD_NONE,
+  CARD_MMC,
+  CARD_SD,
+  CARD_SDHC,
+  CARD_UNKNOWN
+} sdcard_type_t;
+
+/// @brief Fake card. Its file system is the mount point's directory on the host, & its raw
+/// sectors are kept in memory, zeroed, so a test sets up the MBR & the boot sector it needs.
+/// The sizes are set by the tests
+class SDFS
+{
+public:
+  bool begin(const uint8_t, SPIClass&, const uint32_t, const char*, const uint8_t, const bool)
+  {
+    is_mounted = is_present;
+    ++mount_count;
+    return is_mounted;
+  }
+  void end() { is_mounted = false; }
+
+  sdcard_type_t cardType() const { return is_mounted ? CARD_SDHC : CARD_NONE; }
+  uint64_t cardSize() const { return sectors.size(); }
+  uint64_t totalBytes() const { return total_bytes; }
+  uint64_t usedBytes() const { return used_bytes; }
+
+  bool readRAW(uint8_t* buffer, const uint32_t sector)
+  {
+    if (!is_mounted || (uint64_t{ sector } + 1) * k_sector_size > sectors.size()) {
+      return false;
+    }
+    std::memcpy(buffer, sectors.data() + uint64_t{ sector } * k_sector_size, k_sector_size);
+    return true;
+  }
+
+  bool writeRAW(uint8_t* buffer, const uint32_t sector)
+  {
+    if (!is_mounted || (uint64_t{ sector } + 1) * k_sector_size > sectors.size()) {
+      return false;
+    }
+    std::memcpy(sectors.data() + uint64_t{ sector } * k_sector_size, buffer, k_sector_size);
+    return true;
+  }
+
+  static constexpr std::size_t k_sector_size = 512;
+
+  // set to `false` to simulate a missing card
+  bool is_present = true;
+  bool is_mounted = false;
+  std::size_t mount_count = 0;
+  std::vector<uint8_t> sectors = std::vector<uint8_t>(64 * k_sector_size);
+  uint64_t total_bytes = uint64_t{ 8 } * 1024 * 1024 * 1024;
+  uint64_t used_bytes = 0;
+};
+
+inline SDFS SD;
@@ -0,0 +1,6 @@
+#pragma once
+
+class SPIClass
+{};
+
+inline SPIClass SPI;
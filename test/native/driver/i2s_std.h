@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_err.h"
+
+// the host has no I2S peripheral. Channels can be created & deleted, which is counted, but not
+// read, so only the sampler's synthetic source produces frames
+
+enum gpio_num_t : int
+{
+  GPIO_NUM_NC = -1,
+};
+#define I2S_GPIO_UNUSED GPIO_NUM_NC
+
+typedef struct i2s_channel_obj_t* i2s_chan_handle_t;
+
+typedef enum
+{
+  I2S_NUM_0,
+  I2S_NUM_AUTO,
+} i2s_port_t;
+typedef enum
+{
+  I2S_ROLE_MASTER,
+  I2S_ROLE_SLAVE,
+} i2s_role_t;
+typedef enum
+{
+  I2S_CLK_SRC_DEFAULT,
+} i2s_clock_src_t;
+typedef enum
+{
+  I2S_MCLK_MULTIPLE_256 = 256,
+} i2s_mclk_multiple_t;
+typedef enum
+{
+  I2S_DATA_BIT_WIDTH_16BIT = 16,
+  I2S_DATA_BIT_WIDTH_32BIT = 32,
+} i2s_data_bit_width_t;
+typedef enum
+{
+  I2S_SLOT_BIT_WIDTH_AUTO = 0,
+} i2s_slot_bit_width_t;
+typedef enum
+{
+  I2S_SLOT_MODE_MONO = 1,
+  I2S_SLOT_MODE_STEREO = 2,
+} i2s_slot_mode_t;
+typedef enum
+{
+  I2S_STD_SLOT_LEFT = 1,
+  I2S_STD_SLOT_RIGHT = 2,
+} i2s_std_slot_mask_t;
+
+typedef struct
+{
+  uint32_t sample_rate_hz;
+  i2s_clock_src_t clk_src;
+  i2s_mclk_multiple_t mclk_multiple;
+} i2s_std_clk_config_t;
+
+typedef struct
+{
+  i2s_data_bit_width_t data_bit_width;
+  i2s_slot_bit_width_t slot_bit_width;
+  i2s_slot_mode_t slot_mode;
+  i2s_std_slot_mask_t slot_mask;
+  uint32_t ws_width;
+  bool ws_pol;
+  bool bit_shift;
+  bool left_align;
+  bool big_endian;
+  bool bit_order_lsb;
+} i2s_std_slot_config_t;
+
+typedef struct
+{
+  gpio_num_t mclk;
+  gpio_num_t bclk;
+  gpio_num_t ws;
+  gpio_num_t dout;
+  gpio_num_t din;
+  struct
+  {
+    uint32_t mclk_inv : 1;
+    uint32_t bclk_inv : 1;
+    uint32_t ws_inv : 1;
+  } invert_flags;
+} i2s_std_gpio_config_t;
+
+typedef struct
+{
+  i2s_std_clk_config_t clk_cfg;
+  i2s_std_slot_config_t slot_cfg;
+  i2s_std_gpio_config_t gpio_cfg;
+} i2s_std_config_t;
+
+typedef struct
+{
+  i2s_port_t id;
+  i2s_role_t role;
+  uint32_t dma_desc_num;
+  uint32_t dma_frame_num;
+  bool auto_clear;
+  int intr_priority;
+} i2s_chan_config_t;
+
+#define I2S_CHANNEL_DEFAULT_CONFIG(i2s_num, i2s_role)                                             \
+  {                                                                                               \
+    .id = i2s_num, .role = i2s_role, .dma_desc_num = 6, .dma_frame_num = 240,                     \
+    .auto_clear = false, .intr_priority = 0,                                                      \
+  }
+
+typedef struct
+{
+  void* data;
+  size_t size;
+} i2s_event_data_t;
+
+typedef bool (*i2s_isr_callback_t)(i2s_chan_handle_t handle,
+                                   i2s_event_data_t* event,
+                                   void* user_ctx);
+
+typedef struct
+{
+  i2s_isr_callback_t on_recv;
+  i2s_isr_callback_t on_recv_q_ovf;
+  i2s_isr_callback_t on_sent;
+  i2s_isr_callback_t on_send_q_ovf;
+} i2s_event_callbacks_t;
+
+/// @brief Results of the fake driver's calls, & the channels which are allocated. Set by the
+/// tests to fail a step of the initialization
+struct I2sFakeDriver
+{
+  esp_err_t new_channel_result = ESP_OK;
+  esp_err_t init_std_mode_result = ESP_OK;
+  esp_err_t register_callback_result = ESP_OK;
+  esp_err_t enable_result = ESP_OK;
+  int allocated_channels = 0;
+};
+
+inline I2sFakeDriver i2s_fake_driver;
+
+inline esp_err_t
+i2s_new_channel(const i2s_chan_config_t*,
+                i2s_chan_handle_t* tx_handle,
+                i2s_chan_handle_t* rx_handle)
+{
+  if (i2s_fake_driver.new_channel_result != ESP_OK) {
+    return i2s_fake_driver.new_channel_result;
+  }
+  i2s_chan_handle_t& handle = rx_handle != nullptr ? *rx_handle : *tx_handle;
+  handle = reinterpret_cast<i2s_chan_handle_t>(&i2s_fake_driver);
+  ++i2s_fake_driver.allocated_channels;
+  return ESP_OK;
+}
+
+inline esp_err_t
+i2s_del_channel(i2s_chan_handle_t)
+{
+  --i2s_fake_driver.allocated_channels;
+  return ESP_OK;
+}
+
+inline esp_err_t
+i2s_channel_init_std_mode(i2s_chan_handle_t, const i2s_std_config_t*)
+{
+  return i2s_fake_driver.init_std_mode_result;
+}
+
+inline esp_err_t
+i2s_channel_register_event_callback(i2s_chan_handle_t, const i2s_event_callbacks_t*, void*)
+{
+  return i2s_fake_driver.register_callback_result;
+}
+
+inline esp_err_t
+i2s_channel_enable(i2s_chan_handle_t)
+{
+  return i2s_fake_driver.enable_result;
+}
+
+inline esp_err_t
+i2s_channel_disable(i2s_chan_handle_t)
+{
+  return ESP_OK;
+}
+
+inline esp_err_t
+i2s_channel_read(i2s_chan_handle_t, void*, size_t, size_t* bytes_read, uint32_t)
+{
+  *bytes_read = 0;
+  return ESP_ERR_NOT_SUPPORTED;
+}
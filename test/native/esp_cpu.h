@@ -0,0 +1,15 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+typedef uint32_t esp_cpu_cycle_count_t;
+
+/// @brief The host has no cycle counter which is portable, so nanoseconds are counted instead
+inline esp_cpu_cycle_count_t
+esp_cpu_get_cycle_count()
+{
+  return static_cast<esp_cpu_cycle_count_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::steady_clock::now().time_since_epoch())
+                                              .count());
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+/// @brief CRC-32 of the ROM, polynomial 0xEDB88320, bit by bit
+inline uint32_t
+esp_rom_crc32_le(uint32_t crc, const uint8_t* buffer, const uint32_t size)
+{
+  crc = ~crc;
+  for (uint32_t i = 0; i < size; ++i) {
+    crc ^= buffer[i];
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320U & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL 0
+#define pdPASS 1
+// a tick is a millisecond
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) (static_cast<TickType_t>(ms))
+#define portMAX_DELAY 0xFFFFFFFFU
+
+/// @brief Counting semaphore, which mutexes & binary semaphores are made of
+struct QueueDefinition
+{
+  std::mutex mutex;
+  std::condition_variable condition;
+  UBaseType_t count = 0;
+  UBaseType_t max_count = 1;
+};
+typedef QueueDefinition* QueueHandle_t;
+
+struct TaskDefinition;
+typedef TaskDefinition* TaskHandle_t;
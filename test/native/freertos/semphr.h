@@ -0,0 +1,70 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef QueueHandle_t SemaphoreHandle_t;
+
+inline SemaphoreHandle_t
+xSemaphoreCreateCounting(const UBaseType_t max_count, const UBaseType_t initial_count)
+{
+  SemaphoreHandle_t semaphore = new QueueDefinition;
+  semaphore->count = initial_count;
+  semaphore->max_count = max_count;
+  return semaphore;
+}
+
+inline SemaphoreHandle_t
+xSemaphoreCreateBinary()
+{
+  return xSemaphoreCreateCounting(1, 0);
+}
+
+inline SemaphoreHandle_t
+xSemaphoreCreateMutex()
+{
+  return xSemaphoreCreateCounting(1, 1);
+}
+
+inline void
+vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+  delete semaphore;
+}
+
+inline BaseType_t
+xSemaphoreTake(SemaphoreHandle_t semaphore, const TickType_t ticks)
+{
+  std::unique_lock lock(semaphore->mutex);
+  const auto is_available = [semaphore] { return semaphore->count != 0; };
+  if (ticks == portMAX_DELAY) {
+    semaphore->condition.wait(lock, is_available);
+  } else if (!semaphore->condition.wait_for(
+               lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), is_available)) {
+    return pdFALSE;
+  }
+  --semaphore->count;
+  return pdTRUE;
+}
+
+inline BaseType_t
+xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+  {
+    std::lock_guard lock(semaphore->mutex);
+    if (semaphore->count == semaphore->max_count) {
+      return pdFALSE;
+    }
+    ++semaphore->count;
+  }
+  semaphore->condition.notify_one();
+  return pdTRUE;
+}
+
+inline BaseType_t
+xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t* higher_priority_task_woken)
+{
+  if (higher_priority_task_woken != nullptr) {
+    *higher_priority_task_woken = pdFALSE;
+  }
+  return xSemaphoreGive(semaphore);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "FreeRTOS.h"
+
+typedef void (*TaskFunction_t)(void*);
+
+/// @brief Runs the task on a detached thread. Priorities & stack sizes don't apply
+inline BaseType_t
+xTaskCreate(TaskFunction_t function,
+            const char*,
+            const uint32_t,
+            void* parameters,
+            const UBaseType_t,
+            TaskHandle_t* handle)
+{
+  std::thread(function, parameters).detach();
+  if (handle != nullptr) {
+    *handle = nullptr;
+  }
+  return pdPASS;
+}
+
+/// @brief Tasks delete themselves at the end of their function, the thread then simply returns
+inline void
+vTaskDelete(TaskHandle_t)
+{
+}
+
+inline void
+vTaskDelay(const TickType_t ticks)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+inline TickType_t
+xTaskGetTickCount()
+{
+  return static_cast<TickType_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                   std::chrono::steady_clock::now().time_since_epoch())
+                                   .count());
+}
@@ -0,0 +1,128 @@
+#include <array>
+#include <cstdio>
+
+#include <unity.h>
+
+#include "settings.hpp"
+
+// Reader stalls the derived DMA depths are checked for
+constexpr std::array<std::size_t, 6> k_latencies_ms = { 0, 10, 50, 100, 250, 500 };
+
+/// @brief Time it takes to capture a read chunk
+constexpr std::size_t
+ChunkDurationMs(const CaptureProfile& profile)
+{
+  return profile.read_chunk_frames * 1'000 / profile.sample_rate_hz;
+}
+
+void
+setUp()
+{
+}
+
+void
+tearDown()
+{
+}
+
+void
+test_profiles_are_valid()
+{
+  for (const CaptureProfile& profile : CAPTURE_PROFILES) {
+    TEST_ASSERT_TRUE(IsCaptureProfileValid(profile, SD_CLUSTER_SIZE));
+  }
+}
+
+void
+test_invalid_profiles_are_rejected()
+{
+  CaptureProfile profile = CAPTURE_PROFILE_16K;
+  profile.dma_frame_num = I2S_MAX_DMA_BUFFER_BYTES / I2S_FRAME_BYTES + 1;
+  TEST_ASSERT_FALSE(IsCaptureProfileValid(profile, SD_CLUSTER_SIZE));
+
+  profile = CAPTURE_PROFILE_16K;
+  profile.dma_desc_num = 1;
+  TEST_ASSERT_FALSE(IsCaptureProfileValid(profile, SD_CLUSTER_SIZE));
+
+  // the ring can't hold a read chunk
+  profile = CAPTURE_PROFILE_16K;
+  profile.read_chunk_frames = profile.dma_desc_num * profile.dma_frame_num;
+  TEST_ASSERT_FALSE(IsCaptureProfileValid(profile, SD_CLUSTER_SIZE));
+
+  profile = CAPTURE_PROFILE_16K;
+  profile.write_buffer_bytes = SD_CLUSTER_SIZE + SD_SECTOR_SIZE;
+  TEST_ASSERT_FALSE(IsCaptureProfileValid(profile, SD_CLUSTER_SIZE));
+}
+
+void
+test_dma_ring_size()
+{
+  // 8 buffers of 256 frames, 7 of which hold 112 ms at 16 kHz
+  TEST_ASSERT_EQUAL_size_t(1'024, DmaBufferBytes(CAPTURE_PROFILE_16K));
+  TEST_ASSERT_EQUAL_size_t(8'192, DmaRingBytes(CAPTURE_PROFILE_16K));
+  TEST_ASSERT_EQUAL_size_t(112, DmaRingDurationMs(CAPTURE_PROFILE_16K));
+
+  TEST_ASSERT_EQUAL_size_t(24'576, DmaRingBytes(CAPTURE_PROFILE_44K1));
+  TEST_ASSERT_EQUAL_size_t(127, DmaRingDurationMs(CAPTURE_PROFILE_44K1));
+}
+
+void
+test_derived_depth_holds_the_stall()
+{
+  for (const CaptureProfile& profile : CAPTURE_PROFILES) {
+    for (const std::size_t latency_ms : k_latencies_ms) {
+      CaptureProfile derived = profile;
+      derived.dma_desc_num = MinDmaDescriptors(profile, latency_ms);
+
+      TEST_ASSERT_GREATER_OR_EQUAL_size_t(latency_ms + ChunkDurationMs(profile),
+                                          DmaRingDurationMs(derived));
+
+      // one descriptor less must not be enough
+      derived.dma_desc_num -= 1;
+      if (latency_ms != 0) {
+        TEST_ASSERT_LESS_OR_EQUAL_size_t(latency_ms + ChunkDurationMs(profile) + 1,
+                                         DmaRingDurationMs(derived));
+      }
+    }
+  }
+}
+
+void
+test_buffering_table()
+{
+  // the RAM a profile costs for each stall it's sized for, to pick a profile on the host
+  std::printf("%8s %6s %6s %10s %10s %8s %10s\n",
+              "rate Hz",
+              "frames",
+              "chunk",
+              "stall ms",
+              "desc num",
+              "ring ms",
+              "ring B");
+  for (const CaptureProfile& profile : CAPTURE_PROFILES) {
+    for (const std::size_t latency_ms : k_latencies_ms) {
+      CaptureProfile derived = profile;
+      derived.dma_desc_num = MinDmaDescriptors(profile, latency_ms);
+      std::printf("%8lu %6lu %6zu %10zu %10lu %8zu %10zu\n",
+                  static_cast<unsigned long>(profile.sample_rate_hz),
+                  static_cast<unsigned long>(profile.dma_frame_num),
+                  profile.read_chunk_frames,
+                  latency_ms,
+                  static_cast<unsigned long>(derived.dma_desc_num),
+                  DmaRingDurationMs(derived),
+                  DmaRingBytes(derived));
+    }
+  }
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_profiles_are_valid);
+  RUN_TEST(test_invalid_profiles_are_rejected);
+  RUN_TEST(test_dma_ring_size);
+  RUN_TEST(test_derived_depth_holds_the_stall);
+  RUN_TEST(test_buffering_table);
+  return UNITY_END();
+}
@@ -0,0 +1,504 @@
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <unity.h>
+
+#include "flac_encoder.hpp"
+#include "flac_writer.hpp"
+#include "settings.hpp"
+
+#if HAVE_LIBFLAC
+#include <FLAC/stream_decoder.h>
+#endif
+
+// The encoder is checked against a minimal decoder of the frames it produces, & with libFLAC as
+// the reference decoder in the native-flac environment
+
+constexpr std::size_t k_block_size = 1'024;
+// three whole blocks & a short last one
+constexpr std::size_t k_samples = k_block_size * 3 + 300;
+constexpr uint32_t k_sample_rate_hz = 16'000;
+
+using TestEncoder = FlacEncoder<k_block_size>;
+using Frame = std::array<uint8_t, TestEncoder::MAX_FRAME_BYTES>;
+
+constexpr std::array<uint8_t, 9> k_crc_check = { '1', '2', '3', '4', '5', '6', '7', '8', '9' };
+
+/// @brief Two tones, 440 Hz & 3 kHz at 16 kHz, generated by fixed-point "magic circle"
+/// oscillators, with 6 bits of noise & a stretch of silence
+std::vector<int16_t>
+MakeTestSignal(const std::size_t size)
+{
+  std::vector<int16_t> signal(size);
+
+  // 2 * sin(pi * f / fs) in Q15
+  constexpr int32_t k_low_coefficient = 5'655;
+  constexpr int32_t k_high_coefficient = 36'409;
+  int32_t low_x = 0;
+  int32_t low_y = 10'000;
+  int32_t high_x = 0;
+  int32_t high_y = 1'000;
+  uint32_t noise = 1;
+
+  for (std::size_t i = 0; i < size; ++i) {
+    low_x += (k_low_coefficient * low_y) >> 15;
+    low_y -= (k_low_coefficient * low_x) >> 15;
+    high_x += (k_high_coefficient * high_y) >> 15;
+    high_y -= (k_high_coefficient * high_x) >> 15;
+    noise = noise * 1'664'525 + 1'013'904'223;
+
+    // the second block is silent
+    const bool is_silent = i >= k_block_size && i < 2 * k_block_size;
+    signal[i] = is_silent ? 0 : static_cast<int16_t>(low_x + high_x + (noise >> 26) - 32);
+  }
+
+  return signal;
+}
+
+class BitReader
+{
+public:
+  explicit BitReader(const std::span<const uint8_t> input)
+    : m_input(input)
+  {
+  }
+
+  uint32_t Read(const unsigned bits)
+  {
+    uint32_t value = 0;
+    for (unsigned i = 0; i < bits; ++i, ++m_position) {
+      value = (value << 1) | ((m_input[m_position / 8] >> (7 - m_position % 8)) & 1);
+    }
+    return value;
+  }
+
+  int32_t ReadSigned(const unsigned bits)
+  {
+    const uint32_t value = Read(bits);
+    return static_cast<int32_t>(value << (32 - bits)) >> (32 - bits);
+  }
+
+  void AlignToByte() { m_position = (m_position + 7) / 8 * 8; }
+
+  std::size_t GetBytePosition() const { return m_position / 8; }
+
+private:
+  std::span<const uint8_t> m_input;
+  std::size_t m_position = 0;
+};
+
+struct FrameHeader
+{
+  std::size_t block_size;
+  uint8_t sample_rate_code;
+  // 0 if the rate is taken from STREAMINFO
+  uint32_t sample_rate_hz;
+};
+
+/// @brief Reads the header of a frame, whose frame number fits into one byte
+/// @return the header, or nothing if it's invalid
+std::optional<FrameHeader>
+ReadFrameHeader(BitReader& reader, const std::span<const uint8_t> frame, const uint64_t number)
+{
+  if (reader.Read(16) != 0b11111111'11111000) {
+    return std::nullopt;
+  }
+  const uint32_t block_size_code = reader.Read(4);
+  const uint8_t sample_rate_code = static_cast<uint8_t>(reader.Read(4));
+  // mono, 16 bits per sample
+  if (reader.Read(8) != 0b0000'100'0 || reader.Read(8) != number) {
+    return std::nullopt;
+  }
+
+  FrameHeader header = { .block_size = block_size_code == 0b0111 ? reader.Read(16) + 1
+                                                                  : 256U << (block_size_code - 8),
+                         .sample_rate_code = sample_rate_code,
+                         .sample_rate_hz = 0 };
+  constexpr std::array<uint32_t, 12> k_rates = { 0,      88'200, 176'400, 192'000,
+                                                 8'000,  16'000, 22'050,  24'000,
+                                                 32'000, 44'100, 48'000,  96'000 };
+  if (sample_rate_code < k_rates.size()) {
+    header.sample_rate_hz = k_rates[sample_rate_code];
+  } else if (sample_rate_code == 0b1100) {
+    header.sample_rate_hz = reader.Read(8) * 1'000;
+  } else if (sample_rate_code == 0b1101) {
+    header.sample_rate_hz = reader.Read(16);
+  } else if (sample_rate_code == 0b1110) {
+    header.sample_rate_hz = reader.Read(16) * 10;
+  } else {
+    return std::nullopt;
+  }
+
+  const std::size_t header_size = reader.GetBytePosition();
+  if (reader.Read(8) != TestEncoder::Crc8(frame.first(header_size))) {
+    return std::nullopt;
+  }
+
+  return header;
+}
+
+/// @brief Decodes one frame of the subset the encoder produces
+/// @return amount of decoded samples, 0 if the frame is invalid
+std::size_t
+DecodeFrame(const std::span<const uint8_t> frame,
+            const uint64_t frame_number,
+            const std::span<int16_t> samples)
+{
+  BitReader reader(frame);
+  const std::optional<FrameHeader> header = ReadFrameHeader(reader, frame, frame_number);
+  if (!header || header->sample_rate_hz != k_sample_rate_hz) {
+    return 0;
+  }
+  const std::size_t size = header->block_size;
+
+  const uint32_t subframe_type = reader.Read(8) >> 1;
+  if (subframe_type == 0b000000) {
+    std::fill_n(samples.begin(), size, static_cast<int16_t>(reader.ReadSigned(16)));
+  } else if (subframe_type == 0b000001) {
+    for (std::size_t i = 0; i < size; ++i) {
+      samples[i] = static_cast<int16_t>(reader.ReadSigned(16));
+    }
+  } else if ((subframe_type & 0b111000) == 0b001000) {
+    const unsigned order = subframe_type & 0b111;
+    for (std::size_t i = 0; i < order; ++i) {
+      samples[i] = static_cast<int16_t>(reader.ReadSigned(16));
+    }
+    if (reader.Read(2) != 0b00) {
+      return 0;
+    }
+    const unsigned partition_order = reader.Read(4);
+    const std::size_t partition_size = size >> partition_order;
+    std::size_t i = order;
+    for (std::size_t partition = 0; partition < (1U << partition_order); ++partition) {
+      const unsigned parameter = reader.Read(4);
+      for (; i < (partition + 1) * partition_size; ++i) {
+        uint32_t quotient = 0;
+        while (reader.Read(1) == 0) {
+          ++quotient;
+        }
+        const uint32_t folded = (quotient << parameter) | reader.Read(parameter);
+        const int32_t residual =
+          static_cast<int32_t>(folded >> 1) ^ -static_cast<int32_t>(folded & 1);
+        // the prediction is the sample minus its residual, with the residual taken as 0
+        samples[i] = 0;
+        const int32_t prediction = -TestEncoder::FixedResidual(samples, i, order);
+        samples[i] = static_cast<int16_t>(prediction + residual);
+      }
+    }
+  } else {
+    return 0;
+  }
+
+  reader.AlignToByte();
+  const std::size_t frame_size = reader.GetBytePosition();
+  if (reader.Read(16) != TestEncoder::Crc16(frame.first(frame_size))) {
+    return 0;
+  }
+  if (frame_size + 2 != frame.size()) {
+    return 0;
+  }
+
+  return size;
+}
+
+/// @brief Encodes `signal` into a FLAC stream of `k_block_size` frames, with a STREAMINFO block
+/// which leaves the frame sizes & the MD5 signature unknown
+std::vector<uint8_t>
+EncodeStream(const uint32_t sample_rate_hz, const std::span<const int16_t> signal)
+{
+  std::vector<uint8_t> stream(4 + 4 + 34);
+  FlacBitWriter writer(stream);
+  for (const char c : { 'f', 'L', 'a', 'C' }) {
+    writer.Write(c, 8);
+  }
+  // the last metadata block, STREAMINFO
+  writer.Write(1, 1);
+  writer.Write(0, 7);
+  writer.Write(34, 24);
+  writer.Write(k_block_size, 16);
+  writer.Write(k_block_size, 16);
+  writer.Write(0, 24);
+  writer.Write(0, 24);
+  writer.Write(sample_rate_hz, 20);
+  writer.Write(0, 3);
+  writer.Write(TestEncoder::BITS_PER_SAMPLE - 1, 5);
+  writer.Write(0, 4);
+  writer.Write(signal.size(), 32);
+  for (std::size_t i = 0; i < 4; ++i) {
+    writer.Write(0, 32);
+  }
+
+  TestEncoder encoder;
+  Frame frame = {};
+  uint64_t frame_number = 0;
+  for (std::size_t start = 0; start < signal.size(); start += k_block_size, ++frame_number) {
+    const std::size_t frame_size = encoder.EncodeFrame(
+      sample_rate_hz,
+      frame_number,
+      signal.subspan(start, std::min(k_block_size, signal.size() - start)),
+      frame);
+    stream.insert(stream.end(), frame.begin(), frame.begin() + frame_size);
+  }
+
+  return stream;
+}
+
+#if HAVE_LIBFLAC
+struct ReferenceDecoding
+{
+  std::span<const uint8_t> input;
+  std::vector<int16_t> samples;
+  std::vector<uint32_t> frame_sample_rates;
+  bool has_errors = false;
+};
+
+FLAC__StreamDecoderReadStatus
+ReadStream(const FLAC__StreamDecoder*, FLAC__byte buffer[], size_t* bytes, void* client_data)
+{
+  ReferenceDecoding& decoding = *static_cast<ReferenceDecoding*>(client_data);
+  *bytes = std::min(*bytes, decoding.input.size());
+  std::copy_n(decoding.input.begin(), *bytes, buffer);
+  decoding.input = decoding.input.subspan(*bytes);
+  return *bytes == 0 ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM
+                     : FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+FLAC__StreamDecoderWriteStatus
+WriteSamples(const FLAC__StreamDecoder*,
+             const FLAC__Frame* frame,
+             const FLAC__int32* const buffer[],
+             void* client_data)
+{
+  ReferenceDecoding& decoding = *static_cast<ReferenceDecoding*>(client_data);
+  decoding.frame_sample_rates.push_back(frame->header.sample_rate);
+  for (uint32_t i = 0; i < frame->header.blocksize; ++i) {
+    decoding.samples.push_back(static_cast<int16_t>(buffer[0][i]));
+  }
+  return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+void
+ReportError(const FLAC__StreamDecoder*, const FLAC__StreamDecoderErrorStatus status, void* data)
+{
+  std::printf("libFLAC: %s\n", FLAC__StreamDecoderErrorStatusString[status]);
+  static_cast<ReferenceDecoding*>(data)->has_errors = true;
+}
+
+/// @brief Decodes a stream, or the file at `file_path` if it's given, with libFLAC
+ReferenceDecoding
+DecodeWithReference(const std::span<const uint8_t> stream, const char* file_path = nullptr)
+{
+  ReferenceDecoding decoding = { .input = stream };
+  FLAC__StreamDecoder* decoder = FLAC__stream_decoder_new();
+  TEST_ASSERT_NOT_NULL(decoder);
+
+  const FLAC__StreamDecoderInitStatus status =
+    file_path != nullptr
+      ? FLAC__stream_decoder_init_file(
+          decoder, file_path, WriteSamples, nullptr, ReportError, &decoding)
+      : FLAC__stream_decoder_init_stream(decoder,
+                                         ReadStream,
+                                         nullptr,
+                                         nullptr,
+                                         nullptr,
+                                         nullptr,
+                                         WriteSamples,
+                                         nullptr,
+                                         ReportError,
+                                         &decoding);
+  TEST_ASSERT_EQUAL(FLAC__STREAM_DECODER_INIT_STATUS_OK, status);
+  decoding.has_errors |= !FLAC__stream_decoder_process_until_end_of_stream(decoder);
+  FLAC__stream_decoder_delete(decoder);
+
+  return decoding;
+}
+#endif
+
+void
+setUp()
+{
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+}
+
+void
+tearDown()
+{
+}
+
+void
+test_checksums()
+{
+  // the check values of the CRCs FLAC uses
+  TEST_ASSERT_EQUAL_HEX8(0xF4, TestEncoder::Crc8(k_crc_check));
+  TEST_ASSERT_EQUAL_HEX16(0xFEE8, TestEncoder::Crc16(k_crc_check));
+  TEST_ASSERT_EQUAL_UINT32(5, TestEncoder::FoldResidual(-3));
+  TEST_ASSERT_EQUAL_UINT32(6, TestEncoder::FoldResidual(3));
+}
+
+void
+test_round_trip()
+{
+  const std::vector<int16_t> signal = MakeTestSignal(k_samples);
+
+  TestEncoder encoder;
+  Frame frame = {};
+  std::array<int16_t, k_block_size> decoded = {};
+  std::size_t encoded_size = 0;
+
+  uint64_t frame_number = 0;
+  for (std::size_t start = 0; start < k_samples; start += k_block_size, ++frame_number) {
+    const std::span<const int16_t> block =
+      std::span(signal).subspan(start, std::min(k_block_size, k_samples - start));
+    const std::size_t frame_size =
+      encoder.EncodeFrame(k_sample_rate_hz, frame_number, block, frame);
+    encoded_size += frame_size;
+
+    const std::size_t decoded_size =
+      DecodeFrame(std::span(frame).first(frame_size), frame_number, decoded);
+    TEST_ASSERT_EQUAL_size_t(block.size(), decoded_size);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(block.data(), decoded.data(), block.size());
+  }
+
+  // the tones with noise compress to about 78% of their PCM size, the silent block to nothing,
+  // which makes 55% overall
+  TEST_ASSERT_LESS_THAN_size_t(k_samples * sizeof(int16_t) * 6, encoded_size * 10);
+}
+
+void
+test_sample_rate_codes()
+{
+  struct Case
+  {
+    uint32_t sample_rate_hz;
+    uint8_t code;
+  };
+  constexpr std::array<Case, 11> k_cases = { {
+    { 16'000, 0b0101 },
+    { 44'100, 0b1001 },
+    { 88'200, 0b0001 },
+    { 96'000, 0b1011 },
+    { 192'000, 0b0011 },
+    { 12'000, 0b1100 },
+    { 250'000, 0b1100 },
+    { 11'025, 0b1101 },
+    { 65'535, 0b1101 },
+    // above 16 bits, in tens of Hz
+    { 96'010, 0b1110 },
+    // neither, so the rate is only stored in STREAMINFO
+    { 100'001, 0b0000 },
+  } };
+
+  const std::vector<int16_t> signal = MakeTestSignal(16);
+  TestEncoder encoder;
+  Frame frame = {};
+
+  for (const Case& test_case : k_cases) {
+    const std::size_t frame_size = encoder.EncodeFrame(test_case.sample_rate_hz, 5, signal, frame);
+    const std::span<const uint8_t> encoded = std::span(frame).first(frame_size);
+    BitReader reader(encoded);
+    const std::optional<FrameHeader> header = ReadFrameHeader(reader, encoded, 5);
+
+    TEST_ASSERT_TRUE(header.has_value());
+    TEST_ASSERT_EQUAL_size_t(16, header->block_size);
+    TEST_ASSERT_EQUAL_HEX8(test_case.code, header->sample_rate_code);
+    TEST_ASSERT_EQUAL_UINT32(test_case.code == 0 ? 0 : test_case.sample_rate_hz,
+                             header->sample_rate_hz);
+  }
+}
+
+void
+test_reference_decoder()
+{
+#if HAVE_LIBFLAC
+  const std::vector<int16_t> signal = MakeTestSignal(k_samples);
+
+  // a rate with a code of its own, one in tens of Hz & one only STREAMINFO holds
+  for (const uint32_t sample_rate_hz : { k_sample_rate_hz, 88'200U, 96'010U, 100'001U }) {
+    const std::vector<uint8_t> stream = EncodeStream(sample_rate_hz, signal);
+    const ReferenceDecoding decoding = DecodeWithReference(stream);
+
+    TEST_ASSERT_FALSE(decoding.has_errors);
+    TEST_ASSERT_EQUAL_size_t(signal.size(), decoding.samples.size());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(signal.data(), decoding.samples.data(), signal.size());
+    TEST_ASSERT_EQUAL_size_t(4, decoding.frame_sample_rates.size());
+    for (const uint32_t frame_sample_rate_hz : decoding.frame_sample_rates) {
+      TEST_ASSERT_EQUAL_UINT32(sample_rate_hz, frame_sample_rate_hz);
+    }
+  }
+#else
+  TEST_IGNORE_MESSAGE("libFLAC is only linked in the native-flac environment");
+#endif
+}
+
+void
+test_reference_decoder_file()
+{
+#if HAVE_LIBFLAC
+  const std::string file_path = std::string(VFS_MOUNT_POINT_PATH) + "/test.flac";
+  const std::vector<int16_t> signal = MakeTestSignal(FLAC_BLOCK_SAMPLES * 2 + 100);
+
+  FlacWriter writer;
+  TEST_ASSERT_TRUE(writer.Open(file_path, CAPTURE_PROFILE.write_buffer_bytes));
+  writer.SetComment("FlacWriter test");
+  writer.WriteSamples(signal);
+  TEST_ASSERT_TRUE(writer.Close());
+  TEST_ASSERT_TRUE(FlacWriter::Recover(file_path));
+
+  const ReferenceDecoding decoding = DecodeWithReference({}, file_path.c_str());
+  std::filesystem::remove(file_path);
+
+  TEST_ASSERT_FALSE(decoding.has_errors);
+  TEST_ASSERT_EQUAL_size_t(signal.size(), decoding.samples.size());
+  TEST_ASSERT_EQUAL_INT16_ARRAY(signal.data(), decoding.samples.data(), signal.size());
+  for (const uint32_t frame_sample_rate_hz : decoding.frame_sample_rates) {
+    TEST_ASSERT_EQUAL_UINT32(MIC_SAMPLE_RATE, frame_sample_rate_hz);
+  }
+#else
+  TEST_IGNORE_MESSAGE("libFLAC is only linked in the native-flac environment");
+#endif
+}
+
+void
+test_benchmark()
+{
+  constexpr std::size_t k_frames = 2'000;
+  const std::vector<int16_t> signal = MakeTestSignal(k_block_size * 16);
+
+  TestEncoder encoder;
+  Frame frame = {};
+  std::size_t encoded_size = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < k_frames; ++i) {
+    const std::size_t offset = i % 16 * k_block_size;
+    encoded_size += encoder.EncodeFrame(
+      k_sample_rate_hz, i, std::span(signal).subspan(offset, k_block_size), frame);
+  }
+  const auto duration = std::chrono::steady_clock::now() - start;
+
+  // the device logs its cycles per sample with every recording, see `FlacWriter`
+  const double seconds = std::chrono::duration<double>(duration).count();
+  const double samples_per_second = k_frames * k_block_size / seconds;
+  std::printf("FLAC encoding: %.2f ns per sample, %.0fx real time at %lu Hz, %.1f%% of PCM\n",
+              1e9 / samples_per_second,
+              samples_per_second / k_sample_rate_hz,
+              static_cast<unsigned long>(k_sample_rate_hz),
+              100.0 * encoded_size / (k_frames * k_block_size * sizeof(int16_t)));
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_checksums);
+  RUN_TEST(test_round_trip);
+  RUN_TEST(test_sample_rate_codes);
+  RUN_TEST(test_reference_decoder);
+  RUN_TEST(test_reference_decoder_file);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
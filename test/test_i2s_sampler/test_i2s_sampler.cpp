@@ -0,0 +1,74 @@
+#include <unity.h>
+
+#include "driver/i2s_std.h"
+
+#include "i2s_sampler.hpp"
+#include "settings.hpp"
+
+void
+setUp()
+{
+  i2s_fake_driver = I2sFakeDriver{};
+}
+
+void
+tearDown()
+{
+}
+
+void
+test_init_and_deinit()
+{
+  I2sSampler sampler;
+  TEST_ASSERT_TRUE(sampler.Init(CAPTURE_PROFILE));
+  TEST_ASSERT_EQUAL_INT(1, i2s_fake_driver.allocated_channels);
+
+  TEST_ASSERT_TRUE(sampler.DeInit());
+  TEST_ASSERT_EQUAL_INT(0, i2s_fake_driver.allocated_channels);
+}
+
+void
+test_failed_channel_creation()
+{
+  i2s_fake_driver.new_channel_result = ESP_ERR_NOT_FOUND;
+
+  I2sSampler sampler;
+  TEST_ASSERT_FALSE(sampler.Init(CAPTURE_PROFILE));
+  TEST_ASSERT_EQUAL_INT(0, i2s_fake_driver.allocated_channels);
+}
+
+void
+test_failed_init_deletes_the_channel()
+{
+  // every step after the channel's creation fails once, & is retried like the pre-roll is
+  esp_err_t* const k_steps[] = {
+    &i2s_fake_driver.init_std_mode_result,
+    &i2s_fake_driver.register_callback_result,
+    &i2s_fake_driver.enable_result,
+  };
+
+  I2sSampler sampler;
+  for (esp_err_t* step : k_steps) {
+    *step = ESP_FAIL;
+    for (int retry = 0; retry < 3; ++retry) {
+      TEST_ASSERT_FALSE(sampler.Init(CAPTURE_PROFILE));
+      TEST_ASSERT_EQUAL_INT(0, i2s_fake_driver.allocated_channels);
+    }
+    *step = ESP_OK;
+  }
+
+  TEST_ASSERT_TRUE(sampler.Init(CAPTURE_PROFILE));
+  TEST_ASSERT_EQUAL_INT(1, i2s_fake_driver.allocated_channels);
+  TEST_ASSERT_TRUE(sampler.DeInit());
+  TEST_ASSERT_EQUAL_INT(0, i2s_fake_driver.allocated_channels);
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_init_and_deinit);
+  RUN_TEST(test_failed_channel_creation);
+  RUN_TEST(test_failed_init_deletes_the_channel);
+  return UNITY_END();
+}
@@ -0,0 +1,163 @@
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include <unity.h>
+
+#include "ima_adpcm_encoder.hpp"
+#include "settings.hpp"
+
+constexpr std::size_t k_block_bytes = 256;
+constexpr std::size_t k_block_samples = ImaAdpcmEncoder::SamplesPerBlock(k_block_bytes);
+
+/// @brief Two tones, 440 Hz & 3 kHz at 16 kHz, generated by fixed-point "magic circle"
+/// oscillators
+std::vector<int16_t>
+MakeTestSignal(const std::size_t size)
+{
+  std::vector<int16_t> signal(size);
+
+  // 2 * sin(pi * f / fs) in Q15
+  constexpr int32_t k_low_coefficient = 5'655;
+  constexpr int32_t k_high_coefficient = 36'409;
+  int32_t low_x = 0;
+  int32_t low_y = 10'000;
+  int32_t high_x = 0;
+  int32_t high_y = 3'000;
+
+  for (int16_t& sample : signal) {
+    low_x += (k_low_coefficient * low_y) >> 15;
+    low_y -= (k_low_coefficient * low_x) >> 15;
+    high_x += (k_high_coefficient * high_y) >> 15;
+    high_y -= (k_high_coefficient * high_x) >> 15;
+    sample = static_cast<int16_t>(low_x + high_x);
+  }
+
+  return signal;
+}
+
+/// @brief Decodes a block the way a WAV player does, from the first sample & the step index
+/// of the block's header
+std::array<int16_t, k_block_samples>
+DecodeBlock(const std::span<const uint8_t, k_block_bytes> block)
+{
+  ImaAdpcmEncoder::State decoder = { .predictor = static_cast<int16_t>(block[0] | block[1] << 8),
+                                     .step_index = block[2] };
+  std::array<int16_t, k_block_samples> decoded = {};
+  decoded[0] = static_cast<int16_t>(decoder.predictor);
+  for (std::size_t i = ImaAdpcmEncoder::BLOCK_HEADER_BYTES; i < block.size(); ++i) {
+    const std::size_t index = 1 + (i - ImaAdpcmEncoder::BLOCK_HEADER_BYTES) * 2;
+    decoded[index] = ImaAdpcmEncoder::DecodeSample(decoder, block[i] & 0x0F);
+    decoded[index + 1] = ImaAdpcmEncoder::DecodeSample(decoder, block[i] >> 4);
+  }
+  return decoded;
+}
+
+void
+setUp()
+{
+}
+
+void
+tearDown()
+{
+}
+
+void
+test_samples_per_block()
+{
+  TEST_ASSERT_EQUAL_size_t(1'017, ImaAdpcmEncoder::SamplesPerBlock(512));
+  TEST_ASSERT_EQUAL_size_t(505, ImaAdpcmEncoder::SamplesPerBlock(256));
+  TEST_ASSERT_EQUAL_size_t(1'017, ImaAdpcmEncoder::SamplesPerBlock(ADPCM_BLOCK_BYTES));
+}
+
+void
+test_block_header()
+{
+  std::vector<int16_t> samples(k_block_samples, 0);
+  samples[0] = -2;
+
+  ImaAdpcmEncoder encoder;
+  std::array<uint8_t, k_block_bytes> block = {};
+  encoder.EncodeBlock(samples, block);
+
+  // the first sample, little endian, the initial step index & a reserved byte
+  TEST_ASSERT_EQUAL_HEX8(0xFE, block[0]);
+  TEST_ASSERT_EQUAL_HEX8(0xFF, block[1]);
+  TEST_ASSERT_EQUAL_UINT8(0, block[2]);
+  TEST_ASSERT_EQUAL_UINT8(0, block[3]);
+
+  // the step index a loud block ends with is carried over to the next block
+  const std::vector<int16_t> signal = MakeTestSignal(k_block_samples * 2);
+  encoder.EncodeBlock(std::span(signal).first(k_block_samples), block);
+  encoder.EncodeBlock(std::span(signal).last(k_block_samples), block);
+  TEST_ASSERT_GREATER_THAN(20, block[2]);
+}
+
+void
+test_signal_to_noise_ratio()
+{
+  constexpr std::size_t k_blocks = 32;
+  const std::vector<int16_t> signal = MakeTestSignal(k_block_samples * k_blocks);
+
+  ImaAdpcmEncoder encoder;
+  std::array<uint8_t, k_block_bytes> block = {};
+  double signal_power = 0;
+  double error_power = 0;
+
+  for (std::size_t start = 0; start < signal.size(); start += k_block_samples) {
+    const std::span<const int16_t> samples = std::span(signal).subspan(start, k_block_samples);
+    encoder.EncodeBlock(samples, block);
+    const std::array<int16_t, k_block_samples> decoded = DecodeBlock(block);
+
+    for (std::size_t i = 0; i < k_block_samples; ++i) {
+      const double error = samples[i] - decoded[i];
+      signal_power += static_cast<double>(samples[i]) * samples[i];
+      error_power += error * error;
+    }
+  }
+
+  const double snr_db = 10 * std::log10(signal_power / error_power);
+  std::printf("IMA-ADPCM SNR: %.1f dB\n", snr_db);
+  // typical IMA-ADPCM quality, the signal measures 27 dB
+  TEST_ASSERT_GREATER_OR_EQUAL(24.0, snr_db);
+}
+
+void
+test_benchmark()
+{
+  constexpr std::size_t k_blocks = 4'000;
+  const std::vector<int16_t> signal = MakeTestSignal(k_block_samples * 16);
+
+  ImaAdpcmEncoder encoder;
+  std::array<uint8_t, k_block_bytes> block = {};
+  uint32_t checksum = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < k_blocks; ++i) {
+    const std::size_t offset = i % 16 * k_block_samples;
+    encoder.EncodeBlock(std::span(signal).subspan(offset, k_block_samples), block);
+    checksum += block[i % block.size()];
+  }
+  const auto duration = std::chrono::steady_clock::now() - start;
+
+  // the device logs its cycles per sample with every recording, see `ImaAdpcmWavWriter`
+  const double ns_per_sample =
+    std::chrono::duration<double, std::nano>(duration).count() / (k_blocks * k_block_samples);
+  std::printf("IMA-ADPCM encoding: %.2f ns per sample (checksum %lu)\n",
+              ns_per_sample,
+              static_cast<unsigned long>(checksum));
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_samples_per_block);
+  RUN_TEST(test_block_header);
+  RUN_TEST(test_signal_to_noise_ratio);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
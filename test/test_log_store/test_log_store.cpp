@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <unity.h>
+
+#include "block_device.hpp"
+#include "log_store.hpp"
+#include "settings.hpp"
+#include "wav_header.hpp"
+
+// The log is kept in a container file of the host, which holds the two superblocks & 100 data
+// sectors, so a few records of 30 sectors fill it
+
+const std::string k_device_path = std::string(VFS_MOUNT_POINT_PATH) + "/log.bin";
+constexpr uint64_t k_superblock_count = 2;
+constexpr uint64_t k_data_sectors = 100;
+// data of a record which takes 30 sectors including its header, the last one partially used
+constexpr uint32_t k_record_bytes = 29 * SD_SECTOR_SIZE - 100;
+
+/// @brief Forwards to `device`, but fails the reads of `failing_sector`, like a card with a
+/// transient error
+class FaultyDevice final : public BlockDevice
+{
+public:
+  FaultyDevice(BlockDevice& device, const uint64_t failing_sector)
+    : m_device(device)
+    , m_failing_sector(failing_sector)
+  {
+  }
+
+  bool Read(const uint64_t sector, const std::span<uint8_t> data) override
+  {
+    const uint64_t end = sector + data.size() / SD_SECTOR_SIZE;
+    return (m_failing_sector < sector || m_failing_sector >= end) && m_device.Read(sector, data);
+  }
+
+  bool Write(const uint64_t sector, const std::span<const uint8_t> data) override
+  {
+    return m_device.Write(sector, data);
+  }
+
+  uint64_t GetSectorCount() const override { return m_device.GetSectorCount(); }
+
+private:
+  BlockDevice& m_device;
+  const uint64_t m_failing_sector;
+};
+
+FileBlockDevice s_device;
+
+/// @brief Returns `size` bytes of record data, which differ between records of other `seed`s
+std::vector<uint8_t>
+MakeData(const std::size_t size, const uint8_t seed)
+{
+  std::vector<uint8_t> data(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<uint8_t>(seed + i * 7 + i / SD_SECTOR_SIZE);
+  }
+  return data;
+}
+
+/// @brief Writes a finished record of `data_bytes` named after `timestamp`
+/// @return the record's position
+uint64_t
+WriteRecord(LogStore& store,
+            const uint32_t data_bytes,
+            const uint8_t seed,
+            const uint32_t timestamp)
+{
+  const std::optional<uint64_t> position = store.BeginRecord();
+  TEST_ASSERT_TRUE(position.has_value());
+
+  const std::size_t sectors = (data_bytes + SD_SECTOR_SIZE - 1) / SD_SECTOR_SIZE;
+  const std::vector<uint8_t> data = MakeData(sectors * SD_SECTOR_SIZE, seed);
+  TEST_ASSERT_TRUE(store.Append(data));
+  TEST_ASSERT_TRUE(store.FinishRecord(data_bytes));
+  TEST_ASSERT_TRUE(store.NameRecord(*position, timestamp, 0));
+
+  return *position;
+}
+
+/// @brief Returns the records waiting to be uploaded, the oldest first
+std::vector<LogRecordHeader>
+GetRecords(LogStore& store)
+{
+  std::vector<LogRecordHeader> records;
+  LogCursor cursor;
+  for (std::optional<LogRecordHeader> record; (record = store.GetNextRecord(cursor));) {
+    records.push_back(*record);
+  }
+  return records;
+}
+
+/// @brief Reads the whole .wav stream of `record`, in reads of up to 8 sectors
+std::vector<uint8_t>
+ReadWav(LogStore& store, const LogRecordHeader& record)
+{
+  std::vector<uint8_t> wav;
+  std::array<uint8_t, 8 * SD_SECTOR_SIZE> buffer;
+  for (std::size_t length; (length = store.ReadWav(record, wav.size(), buffer)) != 0;) {
+    wav.insert(wav.end(), buffer.begin(), buffer.begin() + length);
+  }
+  return wav;
+}
+
+/// @brief Checks that the .wav stream of `record` holds the data written with `seed`
+void
+CheckWav(LogStore& store, const LogRecordHeader& record, const uint8_t seed)
+{
+  const std::vector<uint8_t> wav = ReadWav(store, record);
+  TEST_ASSERT_EQUAL_size_t(sizeof(wav_header_t) + record.data_bytes, wav.size());
+
+  int32_t wav_size;
+  int32_t data_bytes;
+  std::memcpy(&wav_size, wav.data() + offsetof(wav_header_t, wav_size), sizeof(wav_size));
+  std::memcpy(&data_bytes, wav.data() + offsetof(wav_header_t, data_bytes), sizeof(data_bytes));
+  TEST_ASSERT_EQUAL_MEMORY("RIFF", wav.data(), 4);
+  TEST_ASSERT_EQUAL_INT32(wav.size() - 8, wav_size);
+  TEST_ASSERT_EQUAL_INT32(record.data_bytes, data_bytes);
+
+  const std::vector<uint8_t> data = MakeData(record.data_bytes, seed);
+  TEST_ASSERT_EQUAL_MEMORY(data.data(), wav.data() + sizeof(wav_header_t), data.size());
+}
+
+std::array<uint8_t, SD_SECTOR_SIZE>
+ReadSector(const uint64_t sector)
+{
+  std::array<uint8_t, SD_SECTOR_SIZE> data;
+  TEST_ASSERT_TRUE(s_device.Read(sector, data));
+  return data;
+}
+
+void
+setUp()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+
+  TEST_ASSERT_TRUE(s_device.Open(k_device_path, k_superblock_count + k_data_sectors));
+}
+
+void
+tearDown()
+{
+  s_device.Close();
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+}
+
+void
+test_mount_formats_a_blank_device()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+  TEST_ASSERT_TRUE(GetRecords(store).empty());
+  // both copies of the superblock are written
+  for (uint64_t i = 0; i < k_superblock_count; ++i) {
+    TEST_ASSERT_EQUAL_MEMORY("LOGS", ReadSector(i).data(), 4);
+  }
+  WriteRecord(store, k_record_bytes, 1, 1'000);
+  store.Unmount();
+
+  // the log is loaded, not formatted again
+  LogStore remounted_store;
+  TEST_ASSERT_TRUE(remounted_store.Mount(s_device));
+  const std::vector<LogRecordHeader> records = GetRecords(remounted_store);
+  TEST_ASSERT_EQUAL_size_t(1, records.size());
+  TEST_ASSERT_EQUAL_UINT32(1'000, records[0].timestamp);
+  CheckWav(remounted_store, records[0], 1);
+}
+
+void
+test_mount_does_not_format_on_read_errors()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+  WriteRecord(store, k_record_bytes, 1, 1'000);
+  store.Unmount();
+  const std::array<uint8_t, SD_SECTOR_SIZE> superblocks[] = { ReadSector(0), ReadSector(1) };
+
+  // a superblock which can't be read fails the mount, even if the other one is readable
+  for (uint64_t failing_sector = 0; failing_sector < k_superblock_count; ++failing_sector) {
+    FaultyDevice faulty_device(s_device, failing_sector);
+    LogStore faulty_store;
+    TEST_ASSERT_FALSE(faulty_store.Mount(faulty_device));
+    TEST_ASSERT_FALSE(faulty_store.IsMounted());
+  }
+  TEST_ASSERT_EQUAL_MEMORY(superblocks[0].data(), ReadSector(0).data(), SD_SECTOR_SIZE);
+  TEST_ASSERT_EQUAL_MEMORY(superblocks[1].data(), ReadSector(1).data(), SD_SECTOR_SIZE);
+
+  // & the log is still there once the reads succeed again
+  LogStore remounted_store;
+  TEST_ASSERT_TRUE(remounted_store.Mount(s_device));
+  TEST_ASSERT_EQUAL_size_t(1, GetRecords(remounted_store).size());
+}
+
+void
+test_mount_does_not_format_damaged_superblocks()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+  WriteRecord(store, k_record_bytes, 1, 1'000);
+  store.Unmount();
+
+  // both copies keep their magic, but fail their checksums
+  for (uint64_t i = 0; i < k_superblock_count; ++i) {
+    std::array<uint8_t, SD_SECTOR_SIZE> superblock = ReadSector(i);
+    superblock[offsetof(LogSuperblock, head)] ^= 0xFF;
+    TEST_ASSERT_TRUE(s_device.Write(i, superblock));
+  }
+  const std::array<uint8_t, SD_SECTOR_SIZE> superblock = ReadSector(0);
+
+  LogStore damaged_store;
+  TEST_ASSERT_FALSE(damaged_store.Mount(s_device));
+  TEST_ASSERT_EQUAL_MEMORY(superblock.data(), ReadSector(0).data(), SD_SECTOR_SIZE);
+}
+
+void
+test_append_and_commit()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+
+  const std::optional<uint64_t> position = store.BeginRecord();
+  TEST_ASSERT_TRUE(position.has_value());
+  // only one record can be open
+  TEST_ASSERT_FALSE(store.BeginRecord().has_value());
+
+  const std::vector<uint8_t> data = MakeData(12 * SD_SECTOR_SIZE, 3);
+  for (std::size_t i = 0; i < 3; ++i) {
+    TEST_ASSERT_TRUE(
+      store.Append(std::span(data).subspan(i * 4 * SD_SECTOR_SIZE, 4 * SD_SECTOR_SIZE)));
+    TEST_ASSERT_TRUE(store.CommitRecord((i + 1) * 4 * SD_SECTOR_SIZE));
+  }
+  // an open record isn't uploaded
+  TEST_ASSERT_TRUE(GetRecords(store).empty());
+
+  TEST_ASSERT_TRUE(store.FinishRecord(data.size() - 10));
+  TEST_ASSERT_TRUE(store.NameRecord(*position, 2'000, 1));
+  const std::vector<LogRecordHeader> records = GetRecords(store);
+  TEST_ASSERT_EQUAL_size_t(1, records.size());
+  TEST_ASSERT_EQUAL_UINT64(*position, records[0].position);
+  TEST_ASSERT_EQUAL_UINT32(data.size() - 10, records[0].data_bytes);
+  TEST_ASSERT_EQUAL_UINT16(1, records[0].segment);
+  CheckWav(store, records[0], 3);
+
+  // an uploaded record isn't enumerated again, an empty one isn't stored at all
+  TEST_ASSERT_TRUE(store.MarkUploaded(*position));
+  TEST_ASSERT_TRUE(store.BeginRecord().has_value());
+  TEST_ASSERT_TRUE(store.FinishRecord(0));
+  TEST_ASSERT_TRUE(GetRecords(store).empty());
+}
+
+void
+test_adopts_the_open_record_after_a_power_loss()
+{
+  {
+    LogStore store;
+    TEST_ASSERT_TRUE(store.Mount(s_device));
+    WriteRecord(store, k_record_bytes, 1, 1'000);
+
+    // the power is lost after a commit, while more data has been appended
+    TEST_ASSERT_TRUE(store.BeginRecord().has_value());
+    const std::vector<uint8_t> data = MakeData(8 * SD_SECTOR_SIZE, 2);
+    TEST_ASSERT_TRUE(store.Append(data));
+    TEST_ASSERT_TRUE(store.CommitRecord(6 * SD_SECTOR_SIZE));
+  }
+
+  // the committed data is adopted as a finished record
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+  std::vector<LogRecordHeader> records = GetRecords(store);
+  TEST_ASSERT_EQUAL_size_t(2, records.size());
+  TEST_ASSERT_EQUAL_UINT32(6 * SD_SECTOR_SIZE, records[1].data_bytes);
+  TEST_ASSERT_TRUE(records[1].state == LogRecordState::Finished);
+  CheckWav(store, records[1], 2);
+
+  // a record which has never been committed is dropped, & the next one starts in its place
+  const std::optional<uint64_t> position = store.BeginRecord();
+  TEST_ASSERT_TRUE(position.has_value());
+  TEST_ASSERT_TRUE(store.Append(MakeData(4 * SD_SECTOR_SIZE, 4)));
+
+  LogStore remounted_store;
+  TEST_ASSERT_TRUE(remounted_store.Mount(s_device));
+  TEST_ASSERT_EQUAL_size_t(2, GetRecords(remounted_store).size());
+  TEST_ASSERT_EQUAL_UINT64(*position, remounted_store.BeginRecord().value());
+}
+
+void
+test_wrap_around_reclaims_the_oldest_first()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+
+  // 3 records fill 90 of the 100 sectors, every further one reclaims the oldest
+  std::vector<LogRecordHeader> reclaimed_records;
+  for (uint8_t i = 0; i < 7; ++i) {
+    const uint64_t position = WriteRecord(store, k_record_bytes, i, 1'000 + i);
+    TEST_ASSERT_EQUAL_UINT64(i * 30, position);
+
+    const std::vector<LogRecordHeader> records = GetRecords(store);
+    const std::size_t oldest = i < 3 ? 0 : i - 2;
+    TEST_ASSERT_EQUAL_size_t(i + 1 - oldest, records.size());
+    for (std::size_t j = 0; j < records.size(); ++j) {
+      TEST_ASSERT_EQUAL_UINT32(1'000 + oldest + j, records[j].timestamp);
+      CheckWav(store, records[j], oldest + j);
+    }
+    if (i == 0) {
+      reclaimed_records.push_back(records[0]);
+    }
+  }
+
+  // records wrapping around the end of the device are read back whole, across a remount
+  store.Unmount();
+  LogStore remounted_store;
+  TEST_ASSERT_TRUE(remounted_store.Mount(s_device));
+  const std::vector<LogRecordHeader> records = GetRecords(remounted_store);
+  TEST_ASSERT_EQUAL_size_t(3, records.size());
+  for (std::size_t j = 0; j < records.size(); ++j) {
+    CheckWav(remounted_store, records[j], 4 + j);
+  }
+
+  // the reclaimed record's stream is gone
+  std::array<uint8_t, SD_SECTOR_SIZE> buffer;
+  TEST_ASSERT_EQUAL_size_t(0, remounted_store.ReadWav(reclaimed_records[0], 0, buffer));
+}
+
+void
+test_read_wav()
+{
+  LogStore store;
+  TEST_ASSERT_TRUE(store.Mount(s_device));
+  const uint32_t data_bytes = 5 * SD_SECTOR_SIZE + 123;
+  WriteRecord(store, data_bytes, 9, 3'000);
+  const LogRecordHeader record = GetRecords(store).at(0);
+
+  // the stream is read in whole sectors at any sector offset, the last read is partial
+  const std::vector<uint8_t> wav = ReadWav(store, record);
+  std::array<uint8_t, 2 * SD_SECTOR_SIZE> buffer;
+  for (std::size_t offset = 0; offset < wav.size(); offset += SD_SECTOR_SIZE) {
+    const std::size_t length = store.ReadWav(record, offset, buffer);
+    TEST_ASSERT_EQUAL_size_t(std::min(buffer.size(), wav.size() - offset), length);
+    TEST_ASSERT_EQUAL_MEMORY(wav.data() + offset, buffer.data(), length);
+  }
+  TEST_ASSERT_EQUAL_size_t(0, store.ReadWav(record, wav.size(), buffer));
+
+  // it's uploaded under the name of a .wav recording of its time
+  const sd::RecordingName name = LogStore::GetFileName(record);
+  const std::optional<sd::RecordingEntry> entry = sd::RecordingEntry::FromFileName(name.View());
+  TEST_ASSERT_TRUE(entry.has_value());
+  TEST_ASSERT_EQUAL_UINT32(3'000, entry->timestamp);
+  TEST_ASSERT_TRUE(entry->format == RecordingFormat::Wav);
+
+  store.Unmount();
+  TEST_ASSERT_EQUAL_size_t(0, store.ReadWav(record, 0, buffer));
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_mount_formats_a_blank_device);
+  RUN_TEST(test_mount_does_not_format_on_read_errors);
+  RUN_TEST(test_mount_does_not_format_damaged_superblocks);
+  RUN_TEST(test_append_and_commit);
+  RUN_TEST(test_adopts_the_open_record_after_a_power_loss);
+  RUN_TEST(test_wrap_around_reclaims_the_oldest_first);
+  RUN_TEST(test_read_wav);
+  return UNITY_END();
+}
@@ -0,0 +1,191 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#include <unity.h>
+
+#include "esp_timer.h"
+
+#include "audio_writer.hpp"
+#include "i2s_sampler.hpp"
+#include "recorder.hpp"
+#include "settings.hpp"
+#include "wav_writer.hpp"
+
+// The whole capture path runs on the host: the simulated I2S source is paced by the system timer,
+// conditioned by the sampler, buffered by the recorder's tasks & written through the cluster
+// writer into a file, whose flushes stall like the ones of a slow card
+
+const std::string k_file_path = std::string(VFS_MOUNT_POINT_PATH) + "/test.wav";
+
+using PcmWriter = PcmWavWriter<int16_t, 1, MIC_SAMPLE_RATE>;
+
+/// @brief Forwards the samples to `writer` & stalls for `stall_ms` when the write buffer is
+/// flushed, i.e. the file reaches a cluster boundary: at the first flush & every
+/// `stall_interval`th one after it
+class ThrottledWriter final : public AudioWriter
+{
+public:
+  ThrottledWriter(PcmWriter& writer, const std::size_t stall_interval, const std::size_t stall_ms)
+    : m_writer(writer)
+    , m_stall_interval(stall_interval)
+    , m_stall_ms(stall_ms)
+  {
+  }
+
+  void WriteSamples(const std::span<const int16_t> samples) override
+  {
+    m_is_writing = true;
+    const std::size_t flush_count = m_writer.GetStats().file.flush_count;
+    m_writer.WriteSamples(samples);
+    const bool is_flushed = m_writer.GetStats().file.flush_count != flush_count;
+    if (is_flushed && m_flushes++ % m_stall_interval == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(m_stall_ms));
+    }
+    m_is_writing = false;
+  }
+
+  /// @brief Returns `true` while the storage task is inside `WriteSamples()`
+  bool IsWriting() const { return m_is_writing; }
+
+  void SetComment(const std::string_view comment) override { m_writer.SetComment(comment); }
+
+  void SetGainLog(const std::span<const wav_gain_entry_t> gain_log) override
+  {
+    m_writer.SetGainLog(gain_log);
+  }
+
+  bool Close() override { return m_writer.Close(); }
+
+  std::size_t GetFileSize() const override { return m_writer.GetFileSize(); }
+
+private:
+  PcmWriter& m_writer;
+  const std::size_t m_stall_interval;
+  const std::size_t m_stall_ms;
+  std::size_t m_flushes = 0;
+  std::atomic<bool> m_is_writing = false;
+};
+
+I2sSampler s_sampler;
+Recorder s_recorder;
+
+/// @brief Records `duration_ms` of the simulated source through `writer`, after `preroll_ms` of
+/// capturing without a recording
+RecorderStats
+Record(ThrottledWriter& writer, const std::size_t preroll_ms, const std::size_t duration_ms)
+{
+  TEST_ASSERT_TRUE(s_sampler.InitSynthetic(CAPTURE_PROFILE));
+  TEST_ASSERT_TRUE(s_recorder.StartCapture(s_sampler, PREROLL_SAMPLES));
+  std::this_thread::sleep_for(std::chrono::milliseconds(preroll_ms));
+
+  const int64_t start_time_us = esp_timer_get_time();
+  TEST_ASSERT_TRUE(s_recorder.StartRecording(writer));
+  std::this_thread::sleep_for(std::chrono::milliseconds(duration_ms));
+  TEST_ASSERT_TRUE(s_recorder.StopRecording());
+  // the storage task is done with the writer, so it can be closed
+  TEST_ASSERT_FALSE(writer.IsWriting());
+  TEST_ASSERT_TRUE(writer.Close());
+
+  const RecorderStats stats = s_recorder.GetStats();
+  TEST_ASSERT_TRUE(s_recorder.StopCapture());
+  TEST_ASSERT_TRUE(s_sampler.DeInit());
+
+  // the storage task starts writing as soon as the recording has been started
+  TEST_ASSERT_TRUE(stats.first_write_time_us >= start_time_us);
+  std::printf("first write after %lld us, high-water mark %zu/%zu, written %zu, lost %lu (I2S), "
+              "%zu (buffer)\n",
+              static_cast<long long>(stats.first_write_time_us - start_time_us),
+              stats.high_water_mark,
+              CAPTURE_BUFFER_SAMPLES,
+              stats.written_samples,
+              static_cast<unsigned long>(stats.sampler.frames_lost),
+              stats.overrun_samples);
+
+  // every written sample has reached the file's data chunk
+  const std::size_t data_bytes =
+    std::filesystem::file_size(k_file_path) - sizeof(typename PcmWriter::Header);
+  TEST_ASSERT_TRUE(stats.written_samples * sizeof(int16_t) <= data_bytes);
+
+  return stats;
+}
+
+void
+setUp()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+}
+
+void
+tearDown()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+}
+
+void
+test_stalls_within_the_buffer_are_lossless()
+{
+  // every other flush takes most of the stall the capture buffer is sized for
+  PcmWriter file;
+  TEST_ASSERT_TRUE(file.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+  ThrottledWriter writer(file, 2, CAPTURE_BUFFER_STALL_MS * 3 / 4);
+
+  constexpr std::size_t k_duration_ms = 6'000;
+  const RecorderStats stats = Record(writer, PREROLL_MS * 2, k_duration_ms);
+
+  TEST_ASSERT_EQUAL_UINT32(0, stats.sampler.frames_lost);
+  TEST_ASSERT_EQUAL_size_t(0, stats.overrun_samples);
+  TEST_ASSERT_TRUE(stats.high_water_mark < CAPTURE_BUFFER_SAMPLES);
+  // the pre-roll & the recorded duration, give or take the timing of the host
+  const std::size_t expected_samples = PREROLL_SAMPLES + MIC_SAMPLE_RATE * k_duration_ms / 1'000;
+  TEST_ASSERT_TRUE(stats.written_samples >= expected_samples * 9 / 10);
+  TEST_ASSERT_TRUE(stats.written_samples <= expected_samples * 11 / 10);
+}
+
+void
+test_stalls_beyond_the_buffer_overrun()
+{
+  // only the first flush stalls, for twice the duration the capture buffer holds
+  constexpr std::size_t k_buffer_ms = CAPTURE_BUFFER_SAMPLES * 1'000 / MIC_SAMPLE_RATE;
+  PcmWriter file;
+  TEST_ASSERT_TRUE(file.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+  ThrottledWriter writer(file, SIZE_MAX, k_buffer_ms * 2);
+
+  const RecorderStats stats = Record(writer, 0, k_buffer_ms * 3);
+
+  // the capture task keeps reading the source, the samples which don't fit are counted
+  TEST_ASSERT_EQUAL_UINT32(0, stats.sampler.frames_lost);
+  TEST_ASSERT_TRUE(stats.overrun_samples > 0);
+  TEST_ASSERT_TRUE(stats.high_water_mark >= CAPTURE_BUFFER_SAMPLES - MIC_READ_CHUNK_SAMPLES);
+}
+
+void
+test_stop_waits_for_a_stalled_writer()
+{
+  // the first flush stalls for longer than the recorder waits for its tasks to finish, & the
+  // recording is stopped during the stall
+  PcmWriter file;
+  TEST_ASSERT_TRUE(file.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+  ThrottledWriter writer(file, SIZE_MAX, SLEEP_TIMEOUT_MS + 1'000);
+
+  const std::size_t flush_ms = CAPTURE_PROFILE.write_buffer_bytes * 1'000 / sizeof(int16_t) /
+                               MIC_SAMPLE_RATE;
+  const RecorderStats stats = Record(writer, 0, flush_ms + 500);
+
+  TEST_ASSERT_TRUE(stats.written_samples > 0);
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_stalls_within_the_buffer_are_lossless);
+  RUN_TEST(test_stalls_beyond_the_buffer_overrun);
+  RUN_TEST(test_stop_waits_for_a_stalled_writer);
+  return UNITY_END();
+}
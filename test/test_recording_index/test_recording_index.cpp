@@ -0,0 +1,294 @@
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include <unity.h>
+
+#include "recording_index.hpp"
+#include "sd_card.hpp"
+#include "settings.hpp"
+
+// The index is stored in the mount directory, which is a directory of the host
+
+constexpr std::size_t k_recording_count = 5'000;
+// names fetched per call, like the upload does
+constexpr std::size_t k_batch_size = 16;
+constexpr uint32_t k_first_timestamp = 1'700'000'000;
+
+sd::RecordingIndex s_index;
+
+sd::RecordingName
+GetRecordingName(const std::size_t i)
+{
+  // every fourth recording is split into two segments
+  const sd::RecordingEntry entry = { .timestamp = static_cast<uint32_t>(k_first_timestamp + i),
+                                     .size = 0,
+                                     .segment = static_cast<uint16_t>(i % 4 == 0 ? 2 : 0),
+                                     .format = RecordingFormat::Flac,
+                                     .upload_state = sd::UploadState::Pending,
+                                     .checksum = 0 };
+  return entry.GetFileName();
+}
+
+/// @brief Creates an empty file at `file_path`
+void
+CreateFile(const std::string& file_path)
+{
+  std::filesystem::create_directories(std::filesystem::path(file_path).parent_path());
+  FILE* fp = std::fopen(file_path.c_str(), "wb");
+  TEST_ASSERT_NOT_NULL(fp);
+  std::fclose(fp);
+}
+
+/// @brief Returns the time per call of `function` in microseconds, called with each of `count`
+double
+MeasureMicroseconds(const std::size_t count, const auto& function)
+{
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < count; ++i) {
+    function(i);
+  }
+  const auto duration = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::micro>(duration).count() / count;
+}
+
+void
+setUp()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+
+  // an empty card, so the index is rebuilt empty
+  TEST_ASSERT_TRUE(s_index.Load());
+  for (std::size_t i = 0; i < k_recording_count; ++i) {
+    TEST_ASSERT_TRUE(s_index.Add(GetRecordingName(i).View(), 1'000));
+  }
+}
+
+void
+tearDown()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+}
+
+void
+test_get_pending_enumerates_all()
+{
+  // the uploaded ones are skipped
+  for (std::size_t i = 0; i < k_recording_count; i += 10) {
+    TEST_ASSERT_TRUE(
+      s_index.SetUploadState(GetRecordingName(i).View(), sd::UploadState::Uploaded));
+  }
+  const std::size_t pending_count = k_recording_count - k_recording_count / 10;
+
+  sd::RecordingCursor cursor;
+  std::array<sd::RecordingName, k_batch_size> names;
+  std::vector<std::string> enumerated;
+  std::size_t call_count = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t count = 1; count != 0;) {
+    count = s_index.GetPending(cursor, names);
+    ++call_count;
+    for (std::size_t i = 0; i < count; ++i) {
+      enumerated.emplace_back(names[i].View());
+    }
+  }
+  const auto duration = std::chrono::steady_clock::now() - start;
+
+  // full batches, the rest & the empty call which ends the enumeration
+  TEST_ASSERT_EQUAL_size_t(pending_count, enumerated.size());
+  TEST_ASSERT_EQUAL_size_t((pending_count + k_batch_size - 1) / k_batch_size + 1, call_count);
+  TEST_ASSERT_EQUAL_size_t(pending_count, std::set(enumerated.begin(), enumerated.end()).size());
+  TEST_ASSERT_EQUAL_STRING(GetRecordingName(1).View().data(), enumerated.front().c_str());
+
+  const double us_per_call =
+    std::chrono::duration<double, std::micro>(duration).count() / call_count;
+  std::printf("GetPending: %zu calls for %zu recordings, %.2f us per call\n",
+              call_count,
+              k_recording_count,
+              us_per_call);
+  // a call only walks the entries it returns, not the whole index
+  TEST_ASSERT_LESS_THAN(1'000, static_cast<int>(us_per_call));
+}
+
+void
+test_get_pending_with_deletions()
+{
+  sd::RecordingCursor cursor;
+  std::array<sd::RecordingName, k_batch_size> names;
+  std::set<std::string> enumerated;
+  std::set<std::string> deleted;
+  std::size_t call_count = 0;
+  std::chrono::steady_clock::duration duration{};
+
+  for (std::size_t count = 1, next_deletion = 0; count != 0;) {
+    const auto start = std::chrono::steady_clock::now();
+    count = s_index.GetPending(cursor, names);
+    duration += std::chrono::steady_clock::now() - start;
+    ++call_count;
+
+    // every batch is uploaded & deleted, along with a recording which hasn't been enumerated
+    // yet, like the eviction does while the upload runs
+    for (std::size_t i = 0; i < count; ++i) {
+      TEST_ASSERT_TRUE(enumerated.emplace(names[i].View()).second);
+      TEST_ASSERT_FALSE(deleted.contains(std::string(names[i].View())));
+      TEST_ASSERT_TRUE(s_index.Remove(names[i].View()).has_value());
+    }
+    while (next_deletion < k_recording_count &&
+           enumerated.contains(std::string(GetRecordingName(next_deletion).View()))) {
+      next_deletion += 7;
+    }
+    if (next_deletion < k_recording_count) {
+      const std::string name(GetRecordingName(next_deletion).View());
+      TEST_ASSERT_TRUE(s_index.Remove(name).has_value());
+      deleted.insert(name);
+      next_deletion += 7;
+    }
+  }
+
+  // every recording has been either enumerated or deleted ahead of the cursor, but not both
+  TEST_ASSERT_EQUAL_size_t(k_recording_count, enumerated.size() + deleted.size());
+  TEST_ASSERT_EQUAL_size_t((enumerated.size() + k_batch_size - 1) / k_batch_size + 1,
+                           call_count);
+  TEST_ASSERT_EQUAL_size_t(k_recording_count, s_index.GetEntries().size());
+
+  // a new enumeration finds nothing
+  sd::RecordingCursor new_cursor;
+  TEST_ASSERT_EQUAL_size_t(0, s_index.GetPending(new_cursor, names));
+
+  const double us_per_call =
+    std::chrono::duration<double, std::micro>(duration).count() / call_count;
+  std::printf("GetPending with deletions: %zu calls, %zu deleted ahead, %.2f us per call\n",
+              call_count,
+              deleted.size(),
+              us_per_call);
+  TEST_ASSERT_LESS_THAN(1'000, static_cast<int>(us_per_call));
+}
+
+void
+test_reload_restarts_enumeration()
+{
+  sd::RecordingCursor cursor;
+  std::array<sd::RecordingName, k_batch_size> names;
+  TEST_ASSERT_EQUAL_size_t(k_batch_size, s_index.GetPending(cursor, names));
+  TEST_ASSERT_TRUE(s_index.Remove(names[0].View()).has_value());
+
+  // the index is stored clean, & loaded without the deleted entry, which invalidates the cursor
+  TEST_ASSERT_TRUE(s_index.Close(0, 0));
+  TEST_ASSERT_TRUE(s_index.Load());
+  TEST_ASSERT_EQUAL_size_t(k_recording_count - 1, s_index.GetEntries().size());
+  TEST_ASSERT_EQUAL_size_t(k_batch_size, s_index.GetPending(cursor, names));
+  TEST_ASSERT_EQUAL_STRING(GetRecordingName(1).View().data(), names[0].View().data());
+}
+
+void
+test_rebuild_moves_flat_recordings()
+{
+  // recordings of older firmware in the mount directory, one in the day directory of another day
+  // & one in its own, spread over several days
+  constexpr std::size_t k_file_count = 300;
+  std::set<std::string> names;
+  for (std::size_t i = 0; i < k_file_count; ++i) {
+    const sd::RecordingName name = GetRecordingName(i * 997);
+    names.emplace(name.View());
+    std::string file_path = sd::SDCard::GetFilePath(name.View());
+    if (i == k_file_count - 1) {
+      file_path = sd::SDCard::GetFilePath(GetRecordingName(0).View());
+      file_path.replace(file_path.rfind('/') + 1, std::string::npos, name.View());
+    } else if (i != 2) {
+      file_path = std::string(VFS_MOUNT_POINT_PATH).append(1, '/').append(name.View());
+    }
+    CreateFile(file_path);
+  }
+
+  TEST_ASSERT_TRUE(s_index.Rebuild());
+
+  // every recording is indexed once & found in its day directory
+  std::set<std::string> indexed;
+  for (const sd::RecordingEntry& entry : s_index.GetEntries()) {
+    TEST_ASSERT_TRUE(indexed.emplace(entry.GetFileName().View()).second);
+  }
+  TEST_ASSERT_TRUE(names == indexed);
+  for (const std::string& name : names) {
+    TEST_ASSERT_TRUE(std::filesystem::exists(sd::SDCard::GetFilePath(name)));
+    TEST_ASSERT_FALSE(
+      std::filesystem::exists(std::string(VFS_MOUNT_POINT_PATH).append(1, '/').append(name)));
+  }
+
+  // nothing is left to move
+  TEST_ASSERT_TRUE(s_index.Rebuild());
+  TEST_ASSERT_EQUAL_size_t(k_file_count, s_index.GetEntries().size());
+}
+
+void
+test_rename_and_lookup_cost()
+{
+  // the cost of renaming & looking up a recording grows with the directory holding it, which is
+  // what the day directories bound
+  for (const std::size_t file_count : { 100, 1'000, 5'000 }) {
+    std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+    std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+
+    // 10 minutes per recording, so 144 recordings per day directory
+    std::vector<std::string> flat_paths;
+    std::vector<std::string> day_paths;
+    for (std::size_t i = 0; i < file_count; ++i) {
+      const sd::RecordingName name = GetRecordingName(i * 600);
+      flat_paths.emplace_back(VFS_MOUNT_POINT_PATH).append(1, '/').append(name.View());
+      day_paths.push_back(sd::SDCard::GetFilePath(name.View()));
+      CreateFile(flat_paths.back());
+    }
+
+    struct stat file_stats;
+    const double flat_lookup_us = MeasureMicroseconds(file_count, [&](const std::size_t i) {
+      TEST_ASSERT_EQUAL_INT(0, stat(flat_paths[i].c_str(), &file_stats));
+    });
+    const double flat_rename_us = MeasureMicroseconds(file_count, [&](const std::size_t i) {
+      const std::string renamed_path = flat_paths[i] + ".tmp";
+      TEST_ASSERT_EQUAL_INT(0, std::rename(flat_paths[i].c_str(), renamed_path.c_str()));
+      TEST_ASSERT_EQUAL_INT(0, std::rename(renamed_path.c_str(), flat_paths[i].c_str()));
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    TEST_ASSERT_TRUE(s_index.Rebuild());
+    const double migration_us =
+      std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() /
+      file_count;
+    TEST_ASSERT_EQUAL_size_t(file_count, s_index.GetEntries().size());
+
+    const double day_lookup_us = MeasureMicroseconds(file_count, [&](const std::size_t i) {
+      TEST_ASSERT_EQUAL_INT(0, stat(day_paths[i].c_str(), &file_stats));
+    });
+    const double day_rename_us = MeasureMicroseconds(file_count, [&](const std::size_t i) {
+      const std::string renamed_path = day_paths[i] + ".tmp";
+      TEST_ASSERT_EQUAL_INT(0, std::rename(day_paths[i].c_str(), renamed_path.c_str()));
+      TEST_ASSERT_EQUAL_INT(0, std::rename(renamed_path.c_str(), day_paths[i].c_str()));
+    });
+
+    std::printf("%zu recordings: flat lookup %.2f us, rename %.2f us | day directories lookup "
+                "%.2f us, rename %.2f us | migration %.2f us per recording\n",
+                file_count,
+                flat_lookup_us,
+                flat_rename_us / 2,
+                day_lookup_us,
+                day_rename_us / 2,
+                migration_us);
+  }
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_get_pending_enumerates_all);
+  RUN_TEST(test_get_pending_with_deletions);
+  RUN_TEST(test_reload_restarts_enumeration);
+  RUN_TEST(test_rebuild_moves_flat_recordings);
+  RUN_TEST(test_rename_and_lookup_cost);
+  return UNITY_END();
+}
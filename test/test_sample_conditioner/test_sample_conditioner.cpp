@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <unity.h>
+
+#include "sample_conditioner.hpp"
+
+// Golden vectors. Any change of the kernel's output has to be deliberate
+
+constexpr std::array<int32_t, 8> k_golden_input = {
+  0x00000000, 0x01000000, 0x01000000, 0x01000000, -0x01000000, 0x7FFFFF00, -0x7FFFFF00, 0x00001200,
+};
+
+struct GoldenVector
+{
+  uint8_t gain_shift;
+  std::array<int16_t, 8> output;
+};
+
+constexpr std::array<GoldenVector, 3> k_golden_vectors = { {
+  { .gain_shift = 8, .output = { 0, 256, 256, 256, -257, 32'767, -32'768, 0 } },
+  { .gain_shift = 4, .output = { 0, 4'096, 4'092, 4'088, -4'108, 32'767, -32'768, -6 } },
+  { .gain_shift = 0, .output = { 0, 32'767, 32'767, 32'767, -32'768, 32'767, -32'768, -97 } },
+} };
+
+/// @brief Runs the automatic gain over blocks with the given peaks
+/// @return gain shift after the last block
+uint8_t
+RunAgc(const std::span<const uint32_t> peaks)
+{
+  SampleConditioner::AgcState agc;
+  for (const uint32_t peak : peaks) {
+    SampleConditioner::UpdateAgc(agc, peak);
+  }
+  return agc.gain_shift;
+}
+
+/// @brief 24-bit noise with a DC offset, in the upper bits of I2S words
+std::vector<int32_t>
+MakeRawWords(const std::size_t size, const int32_t amplitude)
+{
+  std::vector<int32_t> words(size);
+  uint32_t noise = 1;
+  for (int32_t& word : words) {
+    noise = noise * 1'664'525 + 1'013'904'223;
+    const int32_t sample = static_cast<int32_t>(noise >> 8) % amplitude + 0x1000;
+    word = static_cast<int32_t>(static_cast<uint32_t>(sample) << 8);
+  }
+  return words;
+}
+
+void
+setUp()
+{
+}
+
+void
+tearDown()
+{
+}
+
+void
+test_saturate()
+{
+  TEST_ASSERT_EQUAL_INT16(0, SampleConditioner::Saturate16(0));
+  TEST_ASSERT_EQUAL_INT16(-1, SampleConditioner::Saturate16(-1));
+  TEST_ASSERT_EQUAL_INT16(32'767, SampleConditioner::Saturate16(32'767));
+  TEST_ASSERT_EQUAL_INT16(32'767, SampleConditioner::Saturate16(32'768));
+  TEST_ASSERT_EQUAL_INT16(-32'768, SampleConditioner::Saturate16(-32'768));
+  TEST_ASSERT_EQUAL_INT16(-32'768, SampleConditioner::Saturate16(-32'769));
+  TEST_ASSERT_EQUAL_INT16(32'767, SampleConditioner::Saturate16(INT32_MAX));
+  TEST_ASSERT_EQUAL_INT16(-32'768, SampleConditioner::Saturate16(INT32_MIN));
+}
+
+void
+test_golden_vectors()
+{
+  for (const GoldenVector& golden : k_golden_vectors) {
+    SampleConditioner::State state;
+    for (std::size_t i = 0; i < k_golden_input.size(); ++i) {
+      TEST_ASSERT_EQUAL_INT16(
+        golden.output[i],
+        SampleConditioner::ConditionSample(state, k_golden_input[i], golden.gain_shift));
+    }
+
+    // the unrolled kernel gives the same output
+    SampleConditioner conditioner;
+    conditioner.SetAgcEnabled(false);
+    conditioner.SetGainShift(golden.gain_shift);
+    std::array<int32_t, k_golden_input.size()> buffer = k_golden_input;
+    const std::span<int16_t> output = conditioner.Process(buffer);
+    TEST_ASSERT_EQUAL_size_t(golden.output.size(), output.size());
+    TEST_ASSERT_EQUAL_INT16_ARRAY(golden.output.data(), output.data(), output.size());
+  }
+}
+
+void
+test_process_matches_the_scalar_kernel()
+{
+  // sizes which leave a remainder after the unrolled loops
+  for (const std::size_t size : { 1, 3, 4, 255, 1'024 }) {
+    const std::vector<int32_t> input = MakeRawWords(size, 1 << 20);
+
+    SampleConditioner::State state;
+    std::vector<int16_t> expected(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      expected[i] = SampleConditioner::ConditionSample(state, input[i], CONDITIONER_GAIN_SHIFT);
+    }
+
+    SampleConditioner conditioner;
+    conditioner.SetAgcEnabled(false);
+    std::vector<int32_t> buffer = input;
+    const std::span<int16_t> output = conditioner.Process(buffer);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected.data(), output.data(), size);
+  }
+}
+
+void
+test_adaptive_gain_applies_the_block_gain()
+{
+  const std::vector<int32_t> input = MakeRawWords(1'024, 1 << 12);
+
+  SampleConditioner conditioner;
+  conditioner.SetAgcEnabled(true);
+  // the filter runs alongside, the AGC only picks the shift
+  SampleConditioner::State state;
+  std::vector<int32_t> filtered(input.size());
+
+  // quiet blocks raise the gain step by step
+  for (std::size_t block = 0; block < AGC_RELEASE_BLOCKS * 4; ++block) {
+    for (std::size_t i = 0; i < input.size(); ++i) {
+      filtered[i] = SampleConditioner::FilterSample(state, input[i]);
+    }
+
+    std::vector<int32_t> buffer = input;
+    const std::span<int16_t> output = conditioner.Process(buffer);
+
+    const uint8_t gain_shift = conditioner.GetGainShift();
+    for (std::size_t i = 0; i < input.size(); ++i) {
+      TEST_ASSERT_EQUAL_INT16(SampleConditioner::ShiftSample(filtered[i], gain_shift), output[i]);
+    }
+  }
+
+  TEST_ASSERT_LESS_THAN(CONDITIONER_GAIN_SHIFT, conditioner.GetGainShift());
+}
+
+void
+test_automatic_gain()
+{
+  // a full-scale block keeps the lowest gain, a silent one does not raise it at once
+  const std::array<uint32_t, 1> k_loud = { 0x7FFFFF };
+  const std::array<uint32_t, 1> k_silent = { 0 };
+  TEST_ASSERT_EQUAL_UINT8(CONDITIONER_GAIN_SHIFT, RunAgc(k_loud));
+  TEST_ASSERT_EQUAL_UINT8(CONDITIONER_GAIN_SHIFT, RunAgc(k_silent));
+
+  // the gain rises by a single step after `AGC_RELEASE_BLOCKS` quiet blocks
+  std::vector<uint32_t> peaks(AGC_RELEASE_BLOCKS, 0);
+  TEST_ASSERT_EQUAL_UINT8(CONDITIONER_GAIN_SHIFT - 1, RunAgc(peaks));
+
+  // a loud block after quiet ones lowers the gain immediately
+  peaks.assign(AGC_RELEASE_BLOCKS * 3 + 1, 0);
+  peaks.back() = 0x7FFFFF;
+  TEST_ASSERT_EQUAL_UINT8(CONDITIONER_GAIN_SHIFT, RunAgc(peaks));
+
+  // the gain is never raised above the maximum
+  peaks.assign(AGC_RELEASE_BLOCKS * 16, 0);
+  TEST_ASSERT_EQUAL_UINT8(AGC_MIN_GAIN_SHIFT, RunAgc(peaks));
+
+  // after a long silence, a 21-bit peak needs a shift of 7 to keep one bit of headroom in int16
+  peaks.assign(AGC_RELEASE_BLOCKS * 16 + 1, 0);
+  peaks.back() = 1 << 20;
+  TEST_ASSERT_EQUAL_UINT8(21 - (15 - AGC_HEADROOM_BITS), RunAgc(peaks));
+}
+
+void
+test_benchmark()
+{
+  constexpr std::size_t k_blocks = 2'000;
+  const std::vector<int32_t> input = MakeRawWords(MIC_READ_CHUNK_SAMPLES, 1 << 20);
+  std::vector<int32_t> buffer(input.size());
+
+  for (const bool is_agc_enabled : { false, true }) {
+    SampleConditioner conditioner;
+    conditioner.SetAgcEnabled(is_agc_enabled);
+
+    int64_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t block = 0; block < k_blocks; ++block) {
+      std::copy(input.begin(), input.end(), buffer.begin());
+      const std::span<int16_t> output = conditioner.Process(buffer);
+      checksum += output[block % output.size()];
+    }
+    const auto duration = std::chrono::steady_clock::now() - start;
+
+    const double ns_per_sample =
+      std::chrono::duration<double, std::nano>(duration).count() / (k_blocks * input.size());
+    std::printf("Conditioning, %s gain: %.2f ns per sample (checksum %lld)\n",
+                is_agc_enabled ? "adaptive" : "fixed",
+                ns_per_sample,
+                static_cast<long long>(checksum));
+  }
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_saturate);
+  RUN_TEST(test_golden_vectors);
+  RUN_TEST(test_process_matches_the_scalar_kernel);
+  RUN_TEST(test_adaptive_gain_applies_the_block_gain);
+  RUN_TEST(test_automatic_gain);
+  RUN_TEST(test_benchmark);
+  return UNITY_END();
+}
@@ -0,0 +1,109 @@
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include <SD.h>
+#include <unity.h>
+
+#include "sd_benchmark.hpp"
+#include "sd_card.hpp"
+#include "settings.hpp"
+
+// The card's file system is the mount directory of the host, so the latencies are the host's,
+// but the benchmark runs the same writes, commits, renames & deletes as on the card
+
+void
+setUp()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+
+  SD = SDFS{};
+}
+
+void
+tearDown()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+}
+
+void
+test_benchmark_runs_all_tests()
+{
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+
+  sd::SDBenchmark benchmark(card);
+  TEST_ASSERT_TRUE(benchmark.Run());
+
+  // the appends of each size, the header rewrites, the renames & the deletes
+  const std::vector<sd::BenchmarkResult>& results = benchmark.GetResults();
+  TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_APPEND_SIZES.size() + 3, results.size());
+  for (std::size_t i = 0; i < SD_BENCHMARK_APPEND_SIZES.size(); ++i) {
+    const std::size_t append_size = SD_BENCHMARK_APPEND_SIZES[i];
+    TEST_ASSERT_EQUAL_STRING("append", std::string(results[i].operation).c_str());
+    TEST_ASSERT_EQUAL_size_t(append_size, results[i].operation_size);
+    TEST_ASSERT_EQUAL_size_t((SD_BENCHMARK_APPEND_BYTES + append_size - 1) / append_size,
+                             results[i].operation_count);
+    TEST_ASSERT_TRUE(results[i].written_bytes >= SD_BENCHMARK_APPEND_BYTES);
+
+    // the data reaches the file in whole write buffers only, regardless of the append size
+    TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_APPEND_BYTES / CAPTURE_PROFILE.write_buffer_bytes,
+                             results[i].file.flush_count);
+    TEST_ASSERT_EQUAL_size_t(0, results[i].file.header_commits);
+    TEST_ASSERT_EQUAL_size_t(0, results[i].file.write_errors);
+  }
+
+  const sd::BenchmarkResult& header_rewrite = results[SD_BENCHMARK_APPEND_SIZES.size()];
+  TEST_ASSERT_EQUAL_STRING("header_rewrite", std::string(header_rewrite.operation).c_str());
+  TEST_ASSERT_EQUAL_size_t(SD_SECTOR_SIZE, header_rewrite.operation_size);
+  TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_FILE_OPERATIONS, header_rewrite.operation_count);
+  // a rewrite costs exactly one commit
+  TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_FILE_OPERATIONS, header_rewrite.file.header_commits);
+  TEST_ASSERT_EQUAL_size_t(0, header_rewrite.file.write_errors);
+
+  for (const sd::BenchmarkResult& result : results) {
+    std::printf("%-14.*s %6zu bytes x %5zu: p50 %6u us, p99 %6u us, max %6u us\n",
+                static_cast<int>(result.operation.size()),
+                result.operation.data(),
+                result.operation_size,
+                result.operation_count,
+                result.p50_latency_us,
+                result.p99_latency_us,
+                result.max_latency_us);
+    uint32_t histogram_count = 0;
+    for (const uint32_t count : result.latency_histogram) {
+      histogram_count += count;
+    }
+    TEST_ASSERT_EQUAL_size_t(result.operation_count, histogram_count);
+    TEST_ASSERT_TRUE(result.p50_latency_us <= result.p99_latency_us);
+    TEST_ASSERT_TRUE(result.p99_latency_us <= result.max_latency_us);
+  }
+  TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_FILE_OPERATIONS,
+                           results[results.size() - 2].operation_count);
+  TEST_ASSERT_EQUAL_size_t(SD_BENCHMARK_FILE_OPERATIONS, results.back().operation_count);
+
+  // the scratch file & the renamed recordings are gone, the results are stored
+  TEST_ASSERT_FALSE(std::filesystem::exists(sd::SDCard::GetFilePath(SD_BENCHMARK_FILE_NAME)));
+  for (const auto& file : std::filesystem::recursive_directory_iterator(VFS_MOUNT_POINT_PATH)) {
+    const std::string name = file.path().filename().string();
+    TEST_ASSERT_FALSE_MESSAGE(sd::RecordingEntry::FromFileName(name).has_value(), name.c_str());
+  }
+
+  std::ifstream results_file(sd::SDCard::GetFilePath(SD_BENCHMARK_RESULTS_NAME));
+  std::size_t line_count = 0;
+  for (std::string line; std::getline(results_file, line);) {
+    ++line_count;
+  }
+  TEST_ASSERT_EQUAL_size_t(results.size() + 1, line_count);
+
+  card.DeInit();
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_benchmark_runs_all_tests);
+  return UNITY_END();
+}
@@ -0,0 +1,292 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <SD.h>
+#include <unity.h>
+
+#include "sd_card.hpp"
+#include "settings.hpp"
+
+// The card's file system is the mount directory of the host, its raw sectors hold the volume's
+// boot sector
+
+constexpr uint32_t k_partition_start = 8;
+constexpr uint64_t k_gib = uint64_t{ 1 } << 30;
+
+void
+WriteLittleEndian(const std::size_t offset, const uint32_t value, const std::size_t size)
+{
+  for (std::size_t i = 0; i < size; ++i) {
+    SD.sectors[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+/// @brief Writes a FAT boot sector with clusters of `sectors_per_cluster` at `sector`
+void
+WriteFatBootSector(const uint32_t sector, const uint8_t sectors_per_cluster)
+{
+  const std::size_t offset = sector * SDFS::k_sector_size;
+  SD.sectors[offset] = 0xEB;
+  WriteLittleEndian(offset + 0x0B, SDFS::k_sector_size, 2);
+  SD.sectors[offset + 0x0D] = sectors_per_cluster;
+  WriteLittleEndian(offset + 510, 0xAA55, 2);
+}
+
+/// @brief Writes a master boot record, whose first partition starts at `k_partition_start`
+void
+WriteMasterBootRecord()
+{
+  SD.sectors[0x1BE + 4] = 0x0C;
+  WriteLittleEndian(0x1BE + 8, k_partition_start, 4);
+  WriteLittleEndian(0x1BE + 12, SD.sectors.size() / SDFS::k_sector_size - k_partition_start, 4);
+  WriteLittleEndian(510, 0xAA55, 2);
+}
+
+/// @brief Returns the name of the `i`th oldest recording of the eviction tests, which are a few
+/// hours apart, so they're spread over several day directories
+sd::RecordingName
+GetRecordingName(const std::size_t i)
+{
+  const sd::RecordingEntry entry = { .timestamp = static_cast<uint32_t>(1'700'000'000 + i * 20'000),
+                                     .size = 0,
+                                     .segment = 0,
+                                     .format = RecordingFormat::Wav,
+                                     .upload_state = sd::UploadState::Pending,
+                                     .checksum = 0 };
+  return entry.GetFileName();
+}
+
+/// @brief Returns the size of the `i`th oldest recording, which takes `i + 1` clusters of 4 KiB
+std::size_t
+GetRecordingSize(const std::size_t i)
+{
+  return i * 4'096 + 100;
+}
+
+/// @brief Creates the recordings of the eviction tests in their day directories, the newest
+/// first, so the index has to sort them
+void
+CreateRecordings(const std::size_t count)
+{
+  for (std::size_t i = count; i-- > 0;) {
+    const std::string file_path = sd::SDCard::GetFilePath(GetRecordingName(i).View());
+    std::filesystem::create_directories(std::filesystem::path(file_path).parent_path());
+    FILE* fp = std::fopen(file_path.c_str(), "wb");
+    TEST_ASSERT_NOT_NULL(fp);
+    const std::vector<uint8_t> data(GetRecordingSize(i), 0xA5);
+    TEST_ASSERT_EQUAL_size_t(data.size(), std::fwrite(data.data(), 1, data.size(), fp));
+    std::fclose(fp);
+  }
+}
+
+/// @brief Runs the eviction up to `target` free bytes & waits until it has finished by itself
+void
+Evict(sd::SDCard& card, const uint64_t target)
+{
+  TEST_ASSERT_TRUE(card.StartEviction(target));
+  for (int i = 0; i < 1'000 && card.IsEvicting(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  TEST_ASSERT_FALSE(card.IsEvicting());
+  TEST_ASSERT_TRUE(card.StopEviction());
+}
+
+bool
+IsRecordingStored(const std::size_t i)
+{
+  return std::filesystem::exists(sd::SDCard::GetFilePath(GetRecordingName(i).View()));
+}
+
+void
+setUp()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+
+  SD = SDFS{};
+  SD.total_bytes = 8 * k_gib;
+  SD.used_bytes = 0;
+}
+
+void
+tearDown()
+{
+  std::filesystem::remove_all(VFS_MOUNT_POINT_PATH);
+}
+
+void
+test_cluster_size_of_partition()
+{
+  WriteMasterBootRecord();
+  WriteFatBootSector(k_partition_start, 8);
+
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_EQUAL_UINT64(4'096, card.GetAllocatedSize(1));
+  TEST_ASSERT_EQUAL_UINT64(4'096, card.GetAllocatedSize(4'096));
+  TEST_ASSERT_EQUAL_UINT64(8'192, card.GetAllocatedSize(4'097));
+  card.DeInit();
+}
+
+void
+test_cluster_size_without_partition_table()
+{
+  WriteFatBootSector(0, 128);
+
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_EQUAL_UINT64(64 * 1'024, card.GetAllocatedSize(1));
+  card.DeInit();
+}
+
+void
+test_cluster_size_of_exfat()
+{
+  WriteMasterBootRecord();
+  const std::size_t offset = k_partition_start * SDFS::k_sector_size;
+  SD.sectors[offset] = 0xEB;
+  std::memcpy(SD.sectors.data() + offset + 3, "EXFAT   ", 8);
+  // 512-byte sectors, 256 sectors per cluster
+  SD.sectors[offset + 0x6C] = 9;
+  SD.sectors[offset + 0x6D] = 8;
+  WriteLittleEndian(offset + 510, 0xAA55, 2);
+
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_EQUAL_UINT64(128 * 1'024, card.GetAllocatedSize(1));
+  card.DeInit();
+}
+
+void
+test_cluster_size_fallback()
+{
+  // neither a master boot record nor a boot sector
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_EQUAL_UINT64(SD_CLUSTER_SIZE, card.GetAllocatedSize(1));
+  card.DeInit();
+}
+
+void
+test_free_space_sync_after_mounts()
+{
+  WriteMasterBootRecord();
+  WriteFatBootSector(k_partition_start, 64);
+
+  // the first mount has no index, so the free space is synced
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_EQUAL_UINT64(8 * k_gib, card.GetFreeSpace());
+  card.DeInit();
+
+  // space used by others is only noticed by a sync, which the eviction runs once the mounts
+  // since the last one reach the interval
+  SD.used_bytes = k_gib;
+  for (std::size_t mount = 1; mount <= FREE_SPACE_SYNC_MOUNT_INTERVAL; ++mount) {
+    TEST_ASSERT_TRUE(card.Init());
+    TEST_ASSERT_EQUAL_UINT64(8 * k_gib, card.GetFreeSpace());
+
+    TEST_ASSERT_TRUE(card.StartEviction(0));
+    TEST_ASSERT_TRUE(card.StopEviction());
+    const uint64_t expected_free_space =
+      mount == FREE_SPACE_SYNC_MOUNT_INTERVAL ? 7 * k_gib : 8 * k_gib;
+    TEST_ASSERT_EQUAL_UINT64(expected_free_space, card.GetFreeSpace());
+    card.DeInit();
+  }
+
+  // the count starts over
+  SD.used_bytes = 2 * k_gib;
+  TEST_ASSERT_TRUE(card.Init());
+  TEST_ASSERT_TRUE(card.StartEviction(0));
+  TEST_ASSERT_TRUE(card.StopEviction());
+  TEST_ASSERT_EQUAL_UINT64(7 * k_gib, card.GetFreeSpace());
+  card.DeInit();
+}
+
+void
+test_eviction_deletes_the_oldest_until_the_target()
+{
+  WriteMasterBootRecord();
+  WriteFatBootSector(k_partition_start, 8);
+  constexpr std::size_t k_recording_count = 10;
+  CreateRecordings(k_recording_count);
+
+  // 1 MiB is free, the target needs the clusters of the 3 oldest recordings, minus a byte
+  SD.used_bytes = SD.total_bytes - 1'024 * 1'024;
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  const uint64_t free_space = card.GetFreeSpace();
+  TEST_ASSERT_EQUAL_UINT64(1'024 * 1'024, free_space);
+
+  const uint64_t needed_bytes = (1 + 2 + 3) * 4'096;
+  Evict(card, free_space + needed_bytes - 1);
+
+  for (std::size_t i = 0; i < k_recording_count; ++i) {
+    TEST_ASSERT_EQUAL(i >= 3, IsRecordingStored(i));
+  }
+  const sd::EvictionStats stats = card.GetEvictionStats();
+  TEST_ASSERT_EQUAL_UINT64(needed_bytes, stats.freed_bytes);
+  TEST_ASSERT_EQUAL_size_t(3, stats.removed_files);
+  TEST_ASSERT_EQUAL_size_t(1, stats.run_count);
+  TEST_ASSERT_EQUAL_UINT64(free_space + needed_bytes, card.GetFreeSpace());
+
+  // a run whose target is met deletes nothing
+  Evict(card, free_space);
+  TEST_ASSERT_TRUE(IsRecordingStored(3));
+  TEST_ASSERT_EQUAL_size_t(3, card.GetEvictionStats().removed_files);
+  TEST_ASSERT_EQUAL_size_t(2, card.GetEvictionStats().run_count);
+  card.DeInit();
+}
+
+void
+test_eviction_stops_when_the_index_runs_out()
+{
+  WriteMasterBootRecord();
+  WriteFatBootSector(k_partition_start, 8);
+  constexpr std::size_t k_recording_count = 5;
+  CreateRecordings(k_recording_count);
+
+  SD.used_bytes = SD.total_bytes - 1'024 * 1'024;
+  sd::SDCard card;
+  TEST_ASSERT_TRUE(card.Init());
+  const uint64_t free_space = card.GetFreeSpace();
+
+  // more than all recordings take
+  Evict(card, SD.total_bytes);
+
+  uint64_t freed_bytes = 0;
+  for (std::size_t i = 0; i < k_recording_count; ++i) {
+    TEST_ASSERT_FALSE(IsRecordingStored(i));
+    freed_bytes += (i + 1) * 4'096;
+  }
+  const sd::EvictionStats stats = card.GetEvictionStats();
+  TEST_ASSERT_EQUAL_UINT64(freed_bytes, stats.freed_bytes);
+  TEST_ASSERT_EQUAL_size_t(k_recording_count, stats.removed_files);
+  TEST_ASSERT_EQUAL_size_t(1, stats.run_count);
+  TEST_ASSERT_EQUAL_UINT64(free_space + freed_bytes, card.GetFreeSpace());
+  card.DeInit();
+
+  // the emptied day directories are removed along with the recordings
+  const std::filesystem::path day_path =
+    std::filesystem::path(sd::SDCard::GetFilePath(GetRecordingName(0).View())).parent_path();
+  TEST_ASSERT_FALSE(std::filesystem::exists(day_path.parent_path().parent_path()));
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_cluster_size_of_partition);
+  RUN_TEST(test_cluster_size_without_partition_table);
+  RUN_TEST(test_cluster_size_of_exfat);
+  RUN_TEST(test_cluster_size_fallback);
+  RUN_TEST(test_free_space_sync_after_mounts);
+  RUN_TEST(test_eviction_deletes_the_oldest_until_the_target);
+  RUN_TEST(test_eviction_stops_when_the_index_runs_out);
+  return UNITY_END();
+}
@@ -0,0 +1,402 @@
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <unity.h>
+
+#include "settings.hpp"
+#include "wav_header.hpp"
+#include "wav_writer.hpp"
+
+// Every header instantiation is written into a file through the writers & parsed back by
+// walking the file's RIFF chunks, like a player does
+
+const std::string k_file_path = std::string(VFS_MOUNT_POINT_PATH) + "/test.wav";
+const std::string k_copy_path = std::string(VFS_MOUNT_POINT_PATH) + "/copy.wav";
+
+constexpr std::array<wav_gain_entry_t, 3> k_gain_log = { {
+  { .sample_offset = 0, .gain_shift = 8, .reserved = {} },
+  { .sample_offset = 1'024, .gain_shift = 6, .reserved = {} },
+  { .sample_offset = 4'096, .gain_shift = 10, .reserved = {} },
+} };
+
+struct ParsedWav
+{
+  int16_t audio_format = 0;
+  int16_t channels = 0;
+  int32_t sample_rate = 0;
+  int32_t byte_rate = 0;
+  int16_t block_align = 0;
+  int16_t bits_per_sample = 0;
+  // only in compressed files
+  std::optional<int16_t> samples_per_block;
+  std::optional<int32_t> fact_sample_count;
+
+  std::size_t data_offset = 0;
+  std::vector<uint8_t> data;
+  std::vector<wav_gain_entry_t> gain_log;
+  std::optional<std::string> comment;
+};
+
+std::vector<uint8_t>
+ReadFile(const std::string& file_path)
+{
+  std::ifstream file(file_path, std::ios::binary);
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), {});
+}
+
+template<typename T>
+T
+ReadValue(const std::vector<uint8_t>& bytes, const std::size_t offset)
+{
+  T value;
+  std::memcpy(&value, bytes.data() + offset, sizeof(value));
+  return value;
+}
+
+bool
+HasId(const std::vector<uint8_t>& bytes, const std::size_t offset, const char (&id)[5])
+{
+  return std::memcmp(bytes.data() + offset, id, 4) == 0;
+}
+
+/// @brief Parses a .wav file by walking its chunks & checks that they span the whole file
+ParsedWav
+ParseWav(const std::string& file_path)
+{
+  const std::vector<uint8_t> file = ReadFile(file_path);
+  TEST_ASSERT_GREATER_OR_EQUAL_size_t(12, file.size());
+  TEST_ASSERT_TRUE(HasId(file, 0, "RIFF"));
+  TEST_ASSERT_TRUE(HasId(file, 8, "WAVE"));
+  TEST_ASSERT_EQUAL_size_t(file.size() - 8, ReadValue<int32_t>(file, 4));
+
+  ParsedWav wav;
+  bool has_format = false;
+  bool has_data = false;
+  std::size_t position = 12;
+  while (position < file.size()) {
+    TEST_ASSERT_LESS_OR_EQUAL_size_t(file.size(), position + sizeof(wav_chunk_header_t));
+    const std::size_t size = ReadValue<int32_t>(file, position + 4);
+    const std::size_t body = position + sizeof(wav_chunk_header_t);
+    // chunks start at even offsets
+    const std::size_t next = body + size + size % 2;
+    TEST_ASSERT_LESS_OR_EQUAL_size_t(file.size(), next);
+
+    if (HasId(file, position, "fmt ")) {
+      has_format = true;
+      wav.audio_format = ReadValue<int16_t>(file, body);
+      wav.channels = ReadValue<int16_t>(file, body + 2);
+      wav.sample_rate = ReadValue<int32_t>(file, body + 4);
+      wav.byte_rate = ReadValue<int32_t>(file, body + 8);
+      wav.block_align = ReadValue<int16_t>(file, body + 12);
+      wav.bits_per_sample = ReadValue<int16_t>(file, body + 14);
+      if (size > 16) {
+        TEST_ASSERT_EQUAL_size_t(size, 18 + ReadValue<int16_t>(file, body + 16));
+        wav.samples_per_block = ReadValue<int16_t>(file, body + 18);
+      }
+    } else if (HasId(file, position, "fact")) {
+      wav.fact_sample_count = ReadValue<int32_t>(file, body);
+    } else if (HasId(file, position, "data")) {
+      has_data = true;
+      wav.data_offset = body;
+      wav.data.assign(file.begin() + body, file.begin() + body + size);
+    } else if (HasId(file, position, "gain")) {
+      TEST_ASSERT_EQUAL_size_t(0, size % sizeof(wav_gain_entry_t));
+      wav.gain_log.resize(size / sizeof(wav_gain_entry_t));
+      std::memcpy(wav.gain_log.data(), file.data() + body, size);
+    } else if (HasId(file, position, "LIST")) {
+      TEST_ASSERT_TRUE(HasId(file, body, "INFO"));
+      TEST_ASSERT_TRUE(HasId(file, body + 4, "ICMT"));
+      const std::size_t comment_size = ReadValue<int32_t>(file, body + 8);
+      TEST_ASSERT_EQUAL_size_t(size, 4 + sizeof(wav_chunk_header_t) + comment_size +
+                                       comment_size % 2);
+      // null-terminated
+      const char* comment = reinterpret_cast<const char*>(file.data() + body + 12);
+      TEST_ASSERT_EQUAL_UINT8(0, comment[comment_size - 1]);
+      wav.comment = std::string(comment, comment_size - 1);
+    } else {
+      TEST_ASSERT_TRUE(HasId(file, position, "JUNK"));
+    }
+
+    position = next;
+  }
+
+  TEST_ASSERT_EQUAL_size_t(file.size(), position);
+  TEST_ASSERT_TRUE(has_format);
+  TEST_ASSERT_TRUE(has_data);
+  // the audio data starts at a sector boundary
+  TEST_ASSERT_EQUAL_size_t(SD_SECTOR_SIZE, wav.data_offset);
+
+  return wav;
+}
+
+/// @brief Two tones with noise, of `size` interleaved samples
+std::vector<int16_t>
+MakeTestSignal(const std::size_t size)
+{
+  std::vector<int16_t> signal(size);
+
+  // 2 * sin(pi * f / fs) in Q15
+  constexpr int32_t k_low_coefficient = 5'655;
+  constexpr int32_t k_high_coefficient = 36'409;
+  int32_t low_x = 0;
+  int32_t low_y = 10'000;
+  int32_t high_x = 0;
+  int32_t high_y = 3'000;
+  uint32_t noise = 1;
+
+  for (int16_t& sample : signal) {
+    low_x += (k_low_coefficient * low_y) >> 15;
+    low_y -= (k_low_coefficient * low_x) >> 15;
+    high_x += (k_high_coefficient * high_y) >> 15;
+    high_y -= (k_high_coefficient * high_x) >> 15;
+    noise = noise * 1'664'525 + 1'013'904'223;
+    sample = static_cast<int16_t>(low_x + high_x + (noise >> 26) - 32);
+  }
+
+  return signal;
+}
+
+/// @brief Copies the open file, which is what a power loss leaves on the card. Seeking doesn't
+/// reserve clusters on the host, so they're appended to the copy
+void
+CopyAsAfterPowerLoss()
+{
+  std::filesystem::copy_file(
+    k_file_path, k_copy_path, std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::resize_file(k_copy_path,
+                               std::filesystem::file_size(k_copy_path) + 2 * SD_CLUSTER_SIZE);
+}
+
+template<typename Sample, uint16_t Channels, uint32_t SampleRate>
+std::vector<uint8_t>
+ConvertSignal(const std::span<const int16_t> signal)
+{
+  std::vector<uint8_t> bytes(signal.size() * sizeof(Sample));
+  for (std::size_t i = 0; i < signal.size(); ++i) {
+    const Sample sample = PcmWavWriter<Sample, Channels, SampleRate>::ConvertSample(signal[i]);
+    std::memcpy(bytes.data() + i * sizeof(Sample), &sample, sizeof(Sample));
+  }
+  return bytes;
+}
+
+/// @brief Writes a PCM file with metadata, & a second one which is recovered from a copy taken
+/// while it's still open, as a power loss leaves it
+template<typename Sample, uint16_t Channels, uint32_t SampleRate>
+void
+TestPcmWriter(const std::string_view comment)
+{
+  using Writer = PcmWavWriter<Sample, Channels, SampleRate>;
+  const std::vector<int16_t> signal = MakeTestSignal(Channels * 100'001);
+  const std::vector<uint8_t> expected_data = ConvertSignal<Sample, Channels, SampleRate>(signal);
+
+  {
+    Writer writer;
+    TEST_ASSERT_TRUE(writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+    writer.SetComment(comment);
+    writer.SetGainLog(k_gain_log);
+    writer.WriteSamples(signal);
+    TEST_ASSERT_TRUE(writer.Close());
+    TEST_ASSERT_EQUAL_size_t(std::filesystem::file_size(k_file_path), writer.GetFileSize());
+  }
+
+  const ParsedWav wav = ParseWav(k_file_path);
+  TEST_ASSERT_EQUAL_INT(1, wav.audio_format);
+  TEST_ASSERT_EQUAL_INT(Channels, wav.channels);
+  TEST_ASSERT_EQUAL_INT(SampleRate, wav.sample_rate);
+  TEST_ASSERT_EQUAL_INT(SampleRate * Channels * sizeof(Sample), wav.byte_rate);
+  TEST_ASSERT_EQUAL_INT(Channels * sizeof(Sample), wav.block_align);
+  TEST_ASSERT_EQUAL_INT(8 * sizeof(Sample), wav.bits_per_sample);
+  TEST_ASSERT_FALSE(wav.fact_sample_count.has_value());
+  TEST_ASSERT_EQUAL_size_t(expected_data.size(), wav.data.size());
+  TEST_ASSERT_EQUAL_MEMORY(expected_data.data(), wav.data.data(), expected_data.size());
+  TEST_ASSERT_EQUAL_size_t(k_gain_log.size(), wav.gain_log.size());
+  TEST_ASSERT_EQUAL_MEMORY(k_gain_log.data(), wav.gain_log.data(), sizeof(k_gain_log));
+  TEST_ASSERT_TRUE(wav.comment.has_value());
+  TEST_ASSERT_EQUAL_STRING(std::string(comment).c_str(), wav.comment->c_str());
+
+  {
+    Writer writer;
+    TEST_ASSERT_TRUE(
+      writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes, 0, SD_CLUSTER_SIZE));
+    writer.SetComment(comment);
+    writer.SetGainLog(k_gain_log);
+    writer.WriteSamples(signal);
+    TEST_ASSERT_GREATER_THAN_size_t(0, writer.GetStats().file.header_commits);
+    CopyAsAfterPowerLoss();
+  }
+
+  // the copy holds the audio data up to the last committed header & beyond
+  const int32_t committed_data_bytes =
+    ReadValue<int32_t>(ReadFile(k_copy_path), offsetof(wav_header_t, data_bytes));
+  TEST_ASSERT_GREATER_THAN(0, committed_data_bytes);
+  TEST_ASSERT_TRUE(Writer::Recover(k_copy_path));
+
+  const ParsedWav recovered = ParseWav(k_copy_path);
+  TEST_ASSERT_EQUAL_size_t(committed_data_bytes, recovered.data.size());
+  TEST_ASSERT_EQUAL_size_t(0, recovered.data.size() % (Channels * sizeof(Sample)));
+  TEST_ASSERT_EQUAL_MEMORY(expected_data.data(), recovered.data.data(), recovered.data.size());
+  TEST_ASSERT_TRUE(recovered.gain_log.empty());
+  TEST_ASSERT_FALSE(recovered.comment.has_value());
+}
+
+/// @see TestPcmWriter
+template<uint32_t SampleRate, uint16_t BlockBytes>
+void
+TestAdpcmWriter(const std::string_view comment)
+{
+  using Writer = ImaAdpcmWavWriter<SampleRate, BlockBytes>;
+  constexpr std::size_t k_samples_per_block = ImaAdpcmEncoder::SamplesPerBlock(BlockBytes);
+  // the last block is padded
+  const std::vector<int16_t> signal = MakeTestSignal(k_samples_per_block * 150 + 7);
+  const std::size_t block_count = (signal.size() + k_samples_per_block - 1) / k_samples_per_block;
+
+  {
+    Writer writer;
+    TEST_ASSERT_TRUE(writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+    writer.SetComment(comment);
+    writer.SetGainLog(k_gain_log);
+    writer.WriteSamples(signal);
+    TEST_ASSERT_TRUE(writer.Close());
+  }
+
+  const ParsedWav wav = ParseWav(k_file_path);
+  TEST_ASSERT_EQUAL_INT(0x11, wav.audio_format);
+  TEST_ASSERT_EQUAL_INT(1, wav.channels);
+  TEST_ASSERT_EQUAL_INT(SampleRate, wav.sample_rate);
+  TEST_ASSERT_EQUAL_INT(uint64_t{ SampleRate } * BlockBytes / k_samples_per_block,
+                        wav.byte_rate);
+  TEST_ASSERT_EQUAL_INT(BlockBytes, wav.block_align);
+  TEST_ASSERT_EQUAL_INT(4, wav.bits_per_sample);
+  TEST_ASSERT_TRUE(wav.samples_per_block.has_value());
+  TEST_ASSERT_EQUAL_INT(k_samples_per_block, *wav.samples_per_block);
+  TEST_ASSERT_TRUE(wav.fact_sample_count.has_value());
+  TEST_ASSERT_EQUAL_size_t(signal.size(), *wav.fact_sample_count);
+  TEST_ASSERT_EQUAL_size_t(block_count * BlockBytes, wav.data.size());
+  // every block starts with its first sample
+  for (std::size_t block = 0; block < block_count; ++block) {
+    TEST_ASSERT_EQUAL_INT16(signal[block * k_samples_per_block],
+                            ReadValue<int16_t>(wav.data, block * BlockBytes));
+  }
+  TEST_ASSERT_EQUAL_size_t(k_gain_log.size(), wav.gain_log.size());
+  TEST_ASSERT_TRUE(wav.comment.has_value());
+  TEST_ASSERT_EQUAL_STRING(std::string(comment).c_str(), wav.comment->c_str());
+
+  {
+    Writer writer;
+    TEST_ASSERT_TRUE(
+      writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes, 0, SD_CLUSTER_SIZE));
+    writer.WriteSamples(signal);
+    TEST_ASSERT_GREATER_THAN_size_t(0, writer.GetStats().file.header_commits);
+    CopyAsAfterPowerLoss();
+  }
+
+  TEST_ASSERT_TRUE(Writer::Recover(k_copy_path));
+
+  // only whole blocks are committed, & the fact chunk counts their samples
+  const ParsedWav recovered = ParseWav(k_copy_path);
+  TEST_ASSERT_GREATER_THAN_size_t(0, recovered.data.size());
+  TEST_ASSERT_EQUAL_size_t(0, recovered.data.size() % BlockBytes);
+  TEST_ASSERT_EQUAL_MEMORY(wav.data.data(), recovered.data.data(), recovered.data.size());
+  TEST_ASSERT_TRUE(recovered.fact_sample_count.has_value());
+  TEST_ASSERT_EQUAL_size_t(recovered.data.size() / BlockBytes * k_samples_per_block,
+                           *recovered.fact_sample_count);
+}
+
+void
+setUp()
+{
+  std::filesystem::create_directories(VFS_MOUNT_POINT_PATH);
+}
+
+void
+tearDown()
+{
+  std::filesystem::remove(k_file_path);
+  std::filesystem::remove(k_copy_path);
+}
+
+void
+test_pcm_8_bit()
+{
+  TestPcmWriter<uint8_t, 1, 8'000>("odd");
+}
+
+void
+test_pcm_16_bit()
+{
+  TestPcmWriter<int16_t, 1, MIC_SAMPLE_RATE>("even");
+  TestPcmWriter<int16_t, 2, 44'100>("stereo");
+}
+
+void
+test_pcm_32_bit()
+{
+  TestPcmWriter<int32_t, 2, 48'000>("32-bit stereo");
+}
+
+void
+test_ima_adpcm()
+{
+  TestAdpcmWriter<MIC_SAMPLE_RATE, ADPCM_BLOCK_BYTES>("recorder's format");
+  TestAdpcmWriter<44'100, 1'024>("odd");
+}
+
+void
+test_recover_without_commits()
+{
+  const std::vector<int16_t> signal = MakeTestSignal(10'001);
+  {
+    WavWriter writer;
+    TEST_ASSERT_TRUE(writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+    writer.WriteSamples(signal);
+    TEST_ASSERT_TRUE(writer.Close());
+  }
+
+  // a header which has never been committed holds no size, so the data runs to the end of the
+  // file, cut to whole samples or blocks
+  std::vector<uint8_t> file = ReadFile(k_file_path);
+  const int32_t data_bytes = ReadValue<int32_t>(file, offsetof(wav_header_t, data_bytes));
+  file.resize(sizeof(wav_header_t) + data_bytes + 1);
+  const int32_t no_size = 0;
+  std::memcpy(file.data() + offsetof(wav_header_t, data_bytes), &no_size, sizeof(no_size));
+  std::ofstream(k_copy_path, std::ios::binary)
+    .write(reinterpret_cast<const char*>(file.data()), file.size());
+
+  TEST_ASSERT_TRUE(WavWriter::Recover(k_copy_path));
+  const ParsedWav recovered = ParseWav(k_copy_path);
+  TEST_ASSERT_EQUAL_size_t(data_bytes - data_bytes % recovered.block_align, recovered.data.size());
+}
+
+void
+test_recover_rejects_other_files()
+{
+  std::ofstream(k_copy_path, std::ios::binary) << std::string(SD_SECTOR_SIZE * 2, 'x');
+  TEST_ASSERT_FALSE(WavWriter::Recover(k_copy_path));
+
+  // a header without any audio data
+  {
+    WavWriter writer;
+    TEST_ASSERT_TRUE(writer.Open(k_file_path, CAPTURE_PROFILE.write_buffer_bytes));
+    TEST_ASSERT_TRUE(writer.Close());
+  }
+  TEST_ASSERT_FALSE(WavWriter::Recover(k_file_path));
+}
+
+int
+main(int, char**)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_pcm_8_bit);
+  RUN_TEST(test_pcm_16_bit);
+  RUN_TEST(test_pcm_32_bit);
+  RUN_TEST(test_ima_adpcm);
+  RUN_TEST(test_recover_without_commits);
+  RUN_TEST(test_recover_rejects_other_files);
+  return UNITY_END();
+}